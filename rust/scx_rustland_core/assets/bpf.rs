@@ -13,11 +13,20 @@ use crate::bpf_skel::*;
 use std::ffi::c_int;
 use std::ffi::c_ulong;
 
+use std::cell::Cell;
+use std::cell::RefCell;
 use std::collections::HashMap;
+use std::os::fd::AsFd;
+use std::os::fd::AsRawFd;
+use std::os::unix::thread::JoinHandleExt;
 use std::sync::atomic::AtomicBool;
+use std::sync::atomic::AtomicU64;
 use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::sync::Once;
+use std::thread::JoinHandle;
+use std::time::Duration;
+use std::time::Instant;
 
 use anyhow::Context;
 use anyhow::Result;
@@ -25,6 +34,11 @@ use anyhow::Result;
 use plain::Plain;
 use procfs::process::all_processes;
 
+use libbpf_rs::libbpf_sys;
+use libbpf_rs::MapCore;
+use libbpf_rs::MapFlags;
+use libbpf_rs::MapHandle;
+use libbpf_rs::MapType;
 use libbpf_rs::OpenObject;
 use libbpf_rs::ProgramInput;
 
@@ -53,6 +67,22 @@ const SCHED_EXT: i32 = 7;
 #[allow(dead_code)]
 pub const RL_CPU_ANY: i32 = bpf_intf::RL_CPU_ANY as i32;
 
+// Maximum amount of tasks sent to the BPF dispatcher in a single user ring buffer record.
+const MAX_DISPATCH_BATCH: usize = bpf_intf::MAX_DISPATCH_BATCH as usize;
+
+// Size (in 64-bit words) of the idle CPU bitmap published by the BPF component.
+const IDLE_MAP_WORDS: usize = bpf_intf::MAX_CPUS as usize / 64;
+
+// Maximum amount of user-space scheduler shards.
+const MAX_SCHED_SHARDS: usize = bpf_intf::MAX_SCHED_SHARDS as usize;
+
+// Busy-polling backoff (see BpfShard::enable_busy_poll()): time spent spinning and then
+// consecutive idle rounds spent yielding the CPU, before blocking for at most POLL_SLEEP_MS waiting
+// for new tasks.
+const POLL_SPIN_TIME: Duration = Duration::from_micros(100);
+const POLL_YIELD_ROUNDS: u32 = 100;
+const POLL_SLEEP_MS: i32 = 100;
+
 /// High-level Rust abstraction to interact with a generic sched-ext BPF component.
 ///
 /// Overview
@@ -65,6 +95,14 @@ pub const RL_CPU_ANY: i32 = bpf_intf::RL_CPU_ANY as i32;
 /// objects) and dispatch tasks (in the form of DispatchedTask objects), using respectively the
 /// methods dequeue_task() and dispatch_task().
 ///
+/// Tasks can also be received and dispatched in batches, using dequeue_tasks() and
+/// dispatch_tasks(), that amortize the cost of the ring buffer operations across multiple tasks.
+///
+/// On large systems the user-space scheduler can be split in multiple shards (BpfShard), each one
+/// serving the CPUs of a group of LLCs with its own pair of ring buffers: the first shard is driven
+/// through the BpfScheduler instance, the other shards are run in dedicated threads started by
+/// spawn_shards().
+///
 /// BPF counters and statistics can be accessed using the methods nr_*_mut(), in particular
 /// nr_queued_mut() and nr_scheduled_mut() can be updated to notify the BPF component if the
 /// user-space scheduler has some pending work to do or not.
@@ -151,12 +189,85 @@ impl EnqueuedMessage {
     }
 }
 
-pub struct BpfScheduler<'cb> {
-    pub skel: BpfSkel<'cb>,                // Low-level BPF connector
-    shutdown: Arc<AtomicBool>,             // Determine scheduler shutdown
+// CPU topology used to pick idle CPUs from the idle state published by the BPF component.
+struct IdleTopology {
+    cpu_llc: Vec<usize>,                  // LLC id of each CPU
+    llc_cpus: Vec<[u64; IDLE_MAP_WORDS]>, // Bitmap of the CPUs of each LLC
+}
+
+// State shared by all the user-space scheduler shards.
+#[derive(Clone)]
+struct ShardContext {
+    bss: *mut types::bss,         // Memory-mapped .bss of the BPF component
+    shutdown: Arc<AtomicBool>,    // Determine scheduler shutdown
+    nr_shards: usize,             // Total amount of shards
+    partial: bool,                // Run the shard threads in the SCHED_EXT class
+    idle_topo: Arc<IdleTopology>, // CPU topology used by select_cpu_fast()
+}
+
+// Statistics of a user-space scheduler shard, only updated by the thread running the shard, but
+// readable from any thread.
+#[derive(Default)]
+struct ShardStats {
+    nr_dispatched_tasks: AtomicU64, // Tasks sent to the BPF dispatcher
+    nr_poll_spins: AtomicU64,       // Idle busy-polling rounds spent spinning
+    nr_poll_yields: AtomicU64,      // Idle busy-polling rounds that yielded the CPU
+    nr_poll_sleeps: AtomicU64,      // Times the busy-polling shard blocked waiting for tasks
+    poll_idle_ns: AtomicU64,        // Time spent busy-polling without any task (in ns)
+}
+
+impl ShardStats {
+    // Only the shard thread updates its statistics, so there is no need for an atomic
+    // read-modify-write.
+    fn add(counter: &AtomicU64, val: u64) {
+        counter.store(counter.load(Ordering::Relaxed) + val, Ordering::Relaxed);
+    }
+}
+
+/// User-space scheduler shard.
+///
+/// A shard receives the tasks queued on the CPUs of a group of LLCs and dispatches them, using its
+/// own pair of ring buffers. The first shard is driven by the BpfScheduler from the thread that
+/// initialized it, the other shards (if any) are run in dedicated threads by spawn_shards().
+pub struct BpfShard<'cb> {
+    id: usize,                             // Shard id
+    cpus: Vec<usize>,                      // CPUs served by the shard
+    ctx: ShardContext,                     // State shared by all the shards
     queued: libbpf_rs::RingBuffer<'cb>,    // Ring buffer of queued tasks
     dispatched: libbpf_rs::UserRingBuffer, // User Ring buffer of dispatched tasks
-    struct_ops: Option<libbpf_rs::Link>,   // Low-level BPF methods
+    _maps: Option<(MapHandle, MapHandle)>, // Ring buffer maps created by user-space
+    stats: Arc<ShardStats>,                // Statistics of the shard
+    idle_claimed: [u64; IDLE_MAP_WORDS],   // Idle CPUs picked in the current round
+    idle_hints: Vec<i32>,                  // PID that each idle CPU has been picked for
+    poll: bool,                            // Busy-polling mode enabled
+    poll_active: bool,                     // Tasks received or dispatched in the current round
+    poll_idle_rounds: u32,                 // Consecutive idle rounds spent yielding the CPU
+    poll_idle_since: Option<Instant>,      // Start of the current idle polling period
+    poll_spins: u64,                       // Spinning rounds not reported to the BPF component
+    poll_yields: u64,                      // CPU yields not reported to the BPF component
+}
+
+// SAFETY: the ring buffers of a shard are only used by the thread that owns the shard, and the
+// .bss of the BPF component stays mapped until all the shard threads have been stopped (see
+// BpfScheduler::stop_shards()).
+//
+// The .bss is written concurrently by the BPF component and by all the shards, so it is never
+// accessed through a reference from a shard, only with volatile or atomic accesses through the
+// raw pointer: each shard only writes the slots indexed by its own id (usersched_tids[],
+// usersched_poll[], nr_shard_scheduled[]), nr_scheduled is only written by the first shard and
+// the counters shared by all the shards (nr_queued, nr_poll_*, poll_idle_ns) are only updated
+// atomically.
+unsafe impl Send for BpfShard<'static> {}
+
+pub struct BpfScheduler<'cb> {
+    pub skel: BpfSkel<'cb>,               // Low-level BPF connector
+    shutdown: Arc<AtomicBool>,            // Determine scheduler shutdown
+    struct_ops: Option<libbpf_rs::Link>,  // Low-level BPF methods
+    shard: BpfShard<'cb>,                 // First user-space scheduler shard
+    shards: Vec<BpfShard<'static>>,       // Shards to be run by spawn_shards()
+    threads: Vec<JoinHandle<Result<()>>>, // Threads running the other shards
+    shard_stats: Vec<Arc<ShardStats>>,    // Statistics of the other shards
+    mmap_disabled: bool,                  // Memory mappings are disabled (see disable_mmap())
 }
 
 // Buffer to store a task read from the ring buffer.
@@ -168,12 +279,75 @@ const BUFSIZE: usize = std::mem::size_of::<QueuedTask>();
 #[repr(align(8))]
 struct AlignedBuffer([u8; BUFSIZE]);
 
-static mut BUF: AlignedBuffer = AlignedBuffer([0; BUFSIZE]);
+// Destination of the tasks read from the ring buffer by dequeue_tasks().
+//
+// When `tasks` is null, a single task is copied to BUF instead (see dequeue_task()).
+#[derive(Clone, Copy)]
+struct DequeueBatch {
+    tasks: *mut Vec<QueuedTask>,
+    max: usize,
+}
+
+// The ring buffer of each shard is consumed by the thread running the shard, so the state used by
+// the ring buffer callback is per-thread.
+thread_local! {
+    static BUF: RefCell<AlignedBuffer> = const { RefCell::new(AlignedBuffer([0; BUFSIZE])) };
+    static BATCH: Cell<DequeueBatch> = const {
+        Cell::new(DequeueBatch {
+            tasks: std::ptr::null_mut(),
+            max: 0,
+        })
+    };
+}
 
 // Special negative error code for libbpf to stop after consuming just one item from a BPF
 // ring buffer.
 const LIBBPF_STOP: i32 = -255;
 
+// Copy one item from the ring buffer.
+//
+// # Safety
+//
+// Each invocation of the callback will trigger the copy of exactly one QueuedTask item to BUF.
+// Multiple invocations of the callback never use the same BUF at the same time, since BUF is
+// per-thread and each ring buffer is consumed only by the thread running the corresponding shard.
+//
+// In batch mode (see dequeue_tasks()) the item is appended to the BATCH vector instead, and the
+// callback keeps consuming items until the requested amount is reached.
+//
+// Use of a `str` whose contents are not valid UTF-8 is undefined behavior.
+fn queued_task_callback(data: &[u8]) -> i32 {
+    let batch = BATCH.with(|batch| batch.get());
+
+    // SAFETY: BATCH.tasks is only set by dequeue_tasks() for the duration of the ring buffer
+    // consume operation and it points to a vector owned by the caller.
+    if let Some(tasks) = unsafe { batch.tasks.as_mut() } {
+        tasks.push(EnqueuedMessage::from_bytes(data).to_queued_task());
+        if tasks.len() < batch.max {
+            return 0;
+        }
+        return LIBBPF_STOP;
+    }
+
+    // Copying from the BPF ring buffer to BUF is safe, since the size of BUF is exactly the size
+    // of QueuedTask and the callback operates in chunks of QueuedTask items. It also copies
+    // exactly one QueuedTask at a time, this is guaranteed by the error code returned by this
+    // callback (see below).
+    BUF.with(|buf| buf.borrow_mut().0.copy_from_slice(data));
+
+    // Return an unsupported error to stop early and consume only one item.
+    //
+    // NOTE: this is quite a hack. I wish libbpf would honor stopping after the first item is
+    // consumed, upon returning a non-zero positive value here, but it doesn't seem to be the case:
+    //
+    // https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/tools/lib/bpf/ringbuf.c?h=v6.8-rc5#n260
+    //
+    // Maybe we should fix this to stop processing items from the ring buffer also when a value > 0
+    // is returned.
+    //
+    LIBBPF_STOP
+}
+
 static SET_HANDLER: Once = Once::new();
 
 fn set_ctrlc_handler(shutdown: Arc<AtomicBool>) -> Result<(), anyhow::Error> {
@@ -187,13 +361,78 @@ fn set_ctrlc_handler(shutdown: Arc<AtomicBool>) -> Result<(), anyhow::Error> {
     Ok(())
 }
 
+// Set scheduling class for the calling thread to SCHED_EXT
+fn use_sched_ext() -> i32 {
+    #[cfg(target_env = "gnu")]
+    let param: sched_param = sched_param { sched_priority: 0 };
+    #[cfg(target_env = "musl")]
+    let param: sched_param = sched_param {
+        sched_priority: 0,
+        sched_ss_low_priority: 0,
+        sched_ss_repl_period: timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        },
+        sched_ss_init_budget: timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        },
+        sched_ss_max_repl: 0,
+    };
+
+    unsafe { pthread_setschedparam(pthread_self(), SCHED_EXT, &param as *const sched_param) }
+}
+
+// Bind the calling thread to @cpus.
+fn set_thread_affinity(cpus: &[usize]) -> Result<()> {
+    let mut cpuset: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+    for cpu in cpus.iter() {
+        unsafe { libc::CPU_SET(*cpu, &mut cpuset) };
+    }
+    let size = std::mem::size_of::<libc::cpu_set_t>();
+    if unsafe { libc::sched_setaffinity(0, size, &cpuset) } < 0 {
+        anyhow::bail!("sched_setaffinity error: {}", io::Error::last_os_error());
+    }
+
+    Ok(())
+}
+
+// Return the time of the CPU-time clock @clock (in ns).
+fn cpu_clock_ns(clock: libc::clockid_t) -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    if unsafe { libc::clock_gettime(clock, &mut ts) } < 0 {
+        return 0;
+    }
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+// Atomically add @val to a counter of the BPF .bss that is shared by all the shards.
+unsafe fn bss_counter_add(counter: *mut u64, val: u64) {
+    if val > 0 {
+        (*(counter as *const AtomicU64)).fetch_add(val, Ordering::Relaxed);
+    }
+}
+
 impl<'cb> BpfScheduler<'cb> {
+    // Initialize and attach the BPF component.
+    //
+    // The user-space scheduler is split in @nr_shards shards, each one serving the CPUs of a group
+    // of LLCs with its own pair of ring buffers (0 = one shard per LLC). The first shard is driven
+    // by the caller, the other shards need to be started using spawn_shards().
+    //
+    // WARNING: with multiple shards memory mappings are NOT disabled by init(), because the threads
+    // of the other shards still need to be created. They are disabled by spawn_shards() or, if it's
+    // never called, as soon as the first shard is driven (see notify_complete() and shard_mut()).
     pub fn init(
         open_object: &'cb mut MaybeUninit<OpenObject>,
         exit_dump_len: u32,
         partial: bool,
         debug: bool,
         builtin_idle: bool,
+        nr_shards: usize,
     ) -> Result<Self> {
         let shutdown = Arc::new(AtomicBool::new(false));
         set_ctrlc_handler(shutdown.clone()).context("Error setting Ctrl-C handler")?;
@@ -203,48 +442,47 @@ impl<'cb> BpfScheduler<'cb> {
         skel_builder.obj_builder.debug(debug);
         let mut skel = scx_ops_open!(skel_builder, open_object, rustland)?;
 
-        // Copy one item from the ring buffer.
-        //
-        // # Safety
-        //
-        // Each invocation of the callback will trigger the copy of exactly one QueuedTask item to
-        // BUF. The caller must be synchronize to ensure that multiple invocations of the callback
-        // are not happening at the same time, but this is implicitly guaranteed by the fact that
-        // the caller is a single-thread process (for now).
-        //
-        // Use of a `str` whose contents are not valid UTF-8 is undefined behavior.
-        fn callback(data: &[u8]) -> i32 {
-            #[allow(static_mut_refs)]
-            unsafe {
-                // SAFETY: copying from the BPF ring buffer to BUF is safe, since the size of BUF
-                // is exactly the size of QueuedTask and the callback operates in chunks of
-                // QueuedTask items. It also copies exactly one QueuedTask at a time, this is
-                // guaranteed by the error code returned by this callback (see below). From a
-                // thread-safety perspective this is also correct, assuming the caller is a
-                // single-thread process (as it is for now).
-                BUF.0.copy_from_slice(data);
-            }
-
-            // Return an unsupported error to stop early and consume only one item.
-            //
-            // NOTE: this is quite a hack. I wish libbpf would honor stopping after the first item
-            // is consumed, upon returning a non-zero positive value here, but it doesn't seem to
-            // be the case:
-            //
-            // https://git.kernel.org/pub/scm/linux/kernel/git/torvalds/linux.git/tree/tools/lib/bpf/ringbuf.c?h=v6.8-rc5#n260
-            //
-            // Maybe we should fix this to stop processing items from the ring buffer also when a
-            // value > 0 is returned.
-            //
-            LIBBPF_STOP
-        }
-
         // Check host topology to determine if we need to enable SMT capabilities.
         let topo = Topology::new().unwrap();
         skel.maps.rodata_data.smt_enabled = topo.smt_enabled;
 
+        // Initialize the LLC of each CPU, used to publish the per-LLC idle state.
+        let nr_cpus = topo.all_cpus.keys().max().map_or(0, |cpu| cpu + 1);
+        let mut cpu_llc = vec![0; nr_cpus];
+        let mut llc_cpus = vec![[0u64; IDLE_MAP_WORDS]; topo.all_llcs.len()];
+        for (cpu_id, cpu) in topo.all_cpus.iter() {
+            if *cpu_id >= bpf_intf::MAX_CPUS as usize || cpu.llc_id >= llc_cpus.len() {
+                continue;
+            }
+            cpu_llc[*cpu_id] = cpu.llc_id;
+            llc_cpus[cpu.llc_id][cpu_id / 64] |= 1 << (cpu_id % 64);
+            skel.maps.rodata_data.cpu_llc_id[*cpu_id] = cpu.llc_id as u32;
+        }
+        let idle_topo = Arc::new(IdleTopology { cpu_llc, llc_cpus });
+
+        // Assign the LLCs to the user-space scheduler shards (round-robin).
+        let nr_llcs = topo.all_llcs.len().max(1);
+        let nr_shards = match nr_shards {
+            0 => nr_llcs,
+            n => n.min(nr_llcs),
+        }
+        .min(MAX_SCHED_SHARDS);
+        let mut shard_cpus = vec![Vec::new(); nr_shards];
+        for (i, llc) in topo.all_llcs.values().enumerate() {
+            let shard = i % nr_shards;
+            for cpu in llc.all_cpus.keys() {
+                if *cpu >= bpf_intf::MAX_CPUS as usize {
+                    continue;
+                }
+                shard_cpus[shard].push(*cpu);
+                skel.maps.rodata_data.cpu_shard_id[*cpu] = shard as u32;
+            }
+        }
+        skel.maps.rodata_data.nr_sched_shards = nr_shards as u32;
+
         // Enable scheduler flags.
         skel.struct_ops.rustland_mut().flags = *compat::SCX_OPS_ENQ_LAST
+            | *compat::SCX_OPS_KEEP_BUILTIN_IDLE
             | *compat::SCX_OPS_ENQ_MIGRATION_DISABLED
             | *compat::SCX_OPS_ALLOW_QUEUED_WAKEUP;
         if partial {
@@ -263,28 +501,53 @@ impl<'cb> BpfScheduler<'cb> {
         Self::init_l2_cache_domains(&mut skel, &topo)?;
         Self::init_l3_cache_domains(&mut skel, &topo)?;
 
-        let struct_ops = Some(scx_ops_attach!(skel, rustland)?);
-
-        // Build the ring buffer of queued tasks.
-        let maps = &skel.maps;
-        let queued_ring_buffer = &maps.queued;
-        let mut rbb = libbpf_rs::RingBufferBuilder::new();
-        rbb.add(queued_ring_buffer, callback)
-            .expect("failed to add ringbuf callback");
-        let queued = rbb.build().expect("failed to build ringbuf");
+        // Initialize the user-space scheduler shards: the first shard uses the ring buffers
+        // defined by the BPF component, the ring buffers of the other shards are created here.
+        let ctx = ShardContext {
+            bss: &mut *skel.maps.bss_data as *mut types::bss,
+            shutdown: shutdown.clone(),
+            nr_shards,
+            partial,
+            idle_topo,
+        };
+        let mut shards = Vec::new();
+        for (id, cpus) in shard_cpus.iter().enumerate().skip(1) {
+            let (queued, dispatched) = Self::create_shard_maps(&skel, id)?;
+            let mut shard = BpfShard::new(&ctx, id, cpus.clone(), &queued, &dispatched)?;
+            shard._maps = Some((queued, dispatched));
+            shards.push(shard);
+        }
+        let shard_stats = shards.iter().map(|shard| shard.stats.clone()).collect();
+        let mut shard = BpfShard::new(
+            &ctx,
+            0,
+            shard_cpus[0].clone(),
+            &skel.maps.queued,
+            &skel.maps.dispatched,
+        )?;
+
+        // Bind the calling thread to the CPUs of the first shard, before the BPF component
+        // starts to send tasks to it.
+        if nr_shards > 1 {
+            shard.register()?;
+        }
 
-        // Build the user ring buffer of dispatched tasks.
-        let dispatched = libbpf_rs::UserRingBuffer::new(&maps.dispatched)
-            .expect("failed to create user ringbuf");
+        let struct_ops = Some(scx_ops_attach!(skel, rustland)?);
 
         // Lock all the memory to prevent page faults that could trigger potential deadlocks during
         // scheduling.
+        //
+        // If there are other shards, mmap is disabled only after their threads have been created
+        // (see spawn_shards()).
         ALLOCATOR.lock_memory();
-        ALLOCATOR.disable_mmap().expect("Failed to disable mmap");
+        let mmap_disabled = shards.is_empty();
+        if mmap_disabled {
+            ALLOCATOR.disable_mmap().expect("Failed to disable mmap");
+        }
 
         // Make sure to use the SCHED_EXT class at least for the scheduler itself.
         if partial {
-            let err = Self::use_sched_ext();
+            let err = use_sched_ext();
             if err < 0 {
                 return Err(anyhow::Error::msg(format!(
                     "sched_setscheduler error: {}",
@@ -296,12 +559,151 @@ impl<'cb> BpfScheduler<'cb> {
         Ok(Self {
             skel,
             shutdown,
-            queued,
-            dispatched,
             struct_ops,
+            shard,
+            shards,
+            threads: Vec::new(),
+            shard_stats,
+            mmap_disabled,
         })
     }
 
+    // Create the ring buffers of the user-space scheduler shard @id and install them in the BPF
+    // component.
+    fn create_shard_maps(skel: &BpfSkel<'_>, id: usize) -> Result<(MapHandle, MapHandle)> {
+        let opts = libbpf_sys::bpf_map_create_opts {
+            sz: std::mem::size_of::<libbpf_sys::bpf_map_create_opts>() as _,
+            ..Default::default()
+        };
+        let key = (id as u32).to_ne_bytes();
+
+        let queued = MapHandle::create(
+            MapType::RingBuf,
+            Some(format!("queued_{}", id)),
+            0,
+            0,
+            skel.maps.queued.max_entries(),
+            &opts,
+        )
+        .context("Failed to create queued ring buffer")?;
+        let fd = queued.as_fd().as_raw_fd() as u32;
+        skel.maps
+            .queued_shards
+            .update(&key, &fd.to_ne_bytes(), MapFlags::ANY)
+            .context("Failed to install queued ring buffer")?;
+
+        let dispatched = MapHandle::create(
+            MapType::UserRingBuf,
+            Some(format!("dispatched_{}", id)),
+            0,
+            0,
+            skel.maps.dispatched.max_entries(),
+            &opts,
+        )
+        .context("Failed to create dispatched user ring buffer")?;
+        let fd = dispatched.as_fd().as_raw_fd() as u32;
+        skel.maps
+            .dispatched_shards
+            .update(&key, &fd.to_ne_bytes(), MapFlags::ANY)
+            .context("Failed to install dispatched user ring buffer")?;
+
+        Ok((queued, dispatched))
+    }
+
+    // Run the other user-space scheduler shards (if any), each one in a dedicated thread bound to
+    // the CPUs of its LLCs, calling in a loop, until the scheduler exits, the policy returned by
+    // @new_policy.
+    //
+    // @new_policy is called by each thread, so that the state of its policy (e.g., preallocated
+    // buffers) is created by the thread itself, instead of being cloned.
+    //
+    // This must be called right after init(): memory mappings are disabled once the threads have
+    // been created (see ALLOCATOR.disable_mmap()), so no other thread can be created afterwards.
+    pub fn spawn_shards<F, P>(&mut self, new_policy: F) -> Result<()>
+    where
+        F: Fn() -> P + Clone + Send + 'static,
+        P: FnMut(&mut BpfShard<'static>),
+    {
+        if self.shards.is_empty() {
+            return Ok(());
+        }
+        if self.mmap_disabled {
+            anyhow::bail!("spawn_shards() must be called before driving the first shard");
+        }
+
+        for mut shard in self.shards.drain(..) {
+            let new_policy = new_policy.clone();
+            let thread = std::thread::Builder::new()
+                .name(format!("rustland-{}", shard.id))
+                .spawn(move || {
+                    let res = shard
+                        .register()
+                        .and_then(|_| {
+                            if shard.ctx.partial && use_sched_ext() < 0 {
+                                anyhow::bail!(
+                                    "sched_setscheduler error: {}",
+                                    io::Error::last_os_error()
+                                );
+                            }
+                            Ok(())
+                        })
+                        .and_then(|_| shard.disable_mmap());
+                    if res.is_err() {
+                        shard.ctx.shutdown.store(true, Ordering::Relaxed);
+                        return res;
+                    }
+
+                    let mut policy = new_policy();
+                    while !shard.exited() {
+                        policy(&mut shard);
+                    }
+                    Ok(())
+                })?;
+            self.threads.push(thread);
+        }
+        self.disable_mmap();
+
+        Ok(())
+    }
+
+    // Disable memory mappings in the calling thread, if they are not disabled already.
+    //
+    // With multiple shards this is deferred until their threads have been created, but it must
+    // happen before the scheduler starts to run, even if spawn_shards() is never called: a page
+    // fault in the scheduler could deadlock the tasks waiting to be scheduled. The filter doesn't
+    // apply to the shard threads that already exist, each one of them disables memory mappings
+    // by itself (see BpfShard::disable_mmap()).
+    fn disable_mmap(&mut self) {
+        if !self.mmap_disabled {
+            ALLOCATOR.disable_mmap().expect("Failed to disable mmap");
+            self.mmap_disabled = true;
+        }
+    }
+
+    // Stop the threads running the other user-space scheduler shards.
+    fn stop_shards(&mut self) -> Result<()> {
+        self.shutdown.store(true, Ordering::Relaxed);
+        for thread in self.threads.drain(..) {
+            thread
+                .join()
+                .map_err(|_| anyhow::Error::msg("scheduler shard panicked"))??;
+        }
+        Ok(())
+    }
+
+    // Amount of user-space scheduler shards.
+    #[allow(dead_code)]
+    pub fn nr_shards(&self) -> usize {
+        self.shard.ctx.nr_shards
+    }
+
+    // First user-space scheduler shard, driven by the caller.
+    #[allow(dead_code)]
+    pub fn shard_mut(&mut self) -> &mut BpfShard<'cb> {
+        self.disable_mmap();
+        &mut self.shard
+    }
+
     // Return the PID of khugepaged, if present, otherwise return 0.
     fn khugepaged_pid() -> u32 {
         let procs = match all_processes() {
@@ -424,8 +826,8 @@ impl<'cb> BpfScheduler<'cb> {
     // some point, otherwise the BPF component will keep waking-up the user-space scheduler in a
     // busy loop, causing unnecessary high CPU consumption.
     pub fn notify_complete(&mut self, nr_pending: u64) {
-        self.skel.maps.bss_data.nr_scheduled = nr_pending;
-        std::thread::yield_now();
+        self.disable_mmap();
+        self.shard.notify_complete(nr_pending);
     }
 
     // Counter of the online CPUs.
@@ -488,26 +890,68 @@ impl<'cb> BpfScheduler<'cb> {
         &mut self.skel.maps.bss_data.nr_sched_congested
     }
 
-    // Set scheduling class for the scheduler itself to SCHED_EXT
-    fn use_sched_ext() -> i32 {
-        #[cfg(target_env = "gnu")]
-        let param: sched_param = sched_param { sched_priority: 0 };
-        #[cfg(target_env = "musl")]
-        let param: sched_param = sched_param {
-            sched_priority: 0,
-            sched_ss_low_priority: 0,
-            sched_ss_repl_period: timespec {
-                tv_sec: 0,
-                tv_nsec: 0,
-            },
-            sched_ss_init_budget: timespec {
-                tv_sec: 0,
-                tv_nsec: 0,
-            },
-            sched_ss_max_repl: 0,
-        };
+    // Counter of idle CPUs picked by select_cpu_fast() that were already taken at dispatch time.
+    #[allow(dead_code)]
+    pub fn nr_idle_conflicts_mut(&mut self) -> &mut u64 {
+        &mut self.skel.maps.bss_data.nr_idle_conflicts
+    }
 
-        unsafe { pthread_setschedparam(pthread_self(), SCHED_EXT, &param as *const sched_param) }
+    // Counter of idle busy-polling rounds spent spinning (see BpfShard::enable_busy_poll()).
+    #[allow(dead_code)]
+    pub fn nr_poll_spins_mut(&mut self) -> &mut u64 {
+        &mut self.skel.maps.bss_data.nr_poll_spins
+    }
+
+    // Counter of idle busy-polling rounds that yielded the CPU.
+    #[allow(dead_code)]
+    pub fn nr_poll_yields_mut(&mut self) -> &mut u64 {
+        &mut self.skel.maps.bss_data.nr_poll_yields
+    }
+
+    // Counter of times the busy-polling scheduler blocked waiting for new tasks.
+    #[allow(dead_code)]
+    pub fn nr_poll_sleeps_mut(&mut self) -> &mut u64 {
+        &mut self.skel.maps.bss_data.nr_poll_sleeps
+    }
+
+    // Time spent spinning or yielding without any task to schedule in busy-polling mode (in ns).
+    #[allow(dead_code)]
+    pub fn poll_idle_ns_mut(&mut self) -> &mut u64 {
+        &mut self.skel.maps.bss_data.poll_idle_ns
+    }
+
+    // Amount of tasks sent to the BPF dispatcher by all the user-space scheduler shards.
+    #[allow(dead_code)]
+    pub fn nr_dispatched_tasks(&self) -> u64 {
+        self.shard.nr_dispatched_tasks()
+            + self
+                .shard_stats
+                .iter()
+                .map(|stats| stats.nr_dispatched_tasks.load(Ordering::Relaxed))
+                .sum::<u64>()
+    }
+
+    // CPU time consumed by the calling thread and by the threads running the other user-space
+    // scheduler shards (in ns).
+    //
+    // When called from the thread driving the first shard, this can be used together with
+    // nr_dispatched_tasks() to measure the scheduling throughput (tasks scheduled per second of
+    // CPU time used by the scheduler).
+    #[allow(dead_code)]
+    pub fn sched_cpu_time_ns(&self) -> u64 {
+        self.shard.sched_cpu_time_ns()
+            + self
+                .threads
+                .iter()
+                .map(|thread| {
+                    let mut clock: libc::clockid_t = 0;
+                    match unsafe { libc::pthread_getcpuclockid(thread.as_pthread_t(), &mut clock) }
+                    {
+                        0 => cpu_clock_ns(clock),
+                        _ => 0,
+                    }
+                })
+                .sum::<u64>()
     }
 
     // Pick an idle CPU for the target PID.
@@ -532,19 +976,399 @@ impl<'cb> BpfScheduler<'cb> {
         out.return_value as i32
     }
 
+    // Enable the busy-polling mode for the first user-space scheduler shard, binding the calling
+    // thread to @cpu (see BpfShard::enable_busy_poll()).
+    #[allow(dead_code)]
+    pub fn enable_busy_poll(&mut self, cpu: usize) -> Result<()> {
+        self.shard.enable_busy_poll(cpu)
+    }
+
+    // Pick an idle CPU for the target PID, without any syscall (see BpfShard::select_cpu_fast()).
+    pub fn select_cpu_fast(&mut self, pid: i32, prev_cpu: i32, flags: u64) -> i32 {
+        self.shard.select_cpu_fast(pid, prev_cpu, flags)
+    }
+
+    // Receive a task to be scheduled from the BPF dispatcher.
+    pub fn dequeue_task(&mut self) -> Result<Option<QueuedTask>, i32> {
+        self.shard.dequeue_task()
+    }
+
+    // Receive up to @max tasks to be scheduled from the BPF dispatcher, appending them to @tasks
+    // (see BpfShard::dequeue_tasks()).
+    pub fn dequeue_tasks(&mut self, tasks: &mut Vec<QueuedTask>, max: usize) -> Result<usize, i32> {
+        self.shard.dequeue_tasks(tasks, max)
+    }
+
+    // Send a task to the dispatcher.
+    pub fn dispatch_task(&mut self, task: &DispatchedTask) -> Result<(), libbpf_rs::Error> {
+        self.shard.dispatch_task(task)
+    }
+
+    // Send a batch of tasks to the dispatcher (see BpfShard::dispatch_tasks()).
+    pub fn dispatch_tasks(&mut self, tasks: &[DispatchedTask]) -> Result<usize, libbpf_rs::Error> {
+        self.shard.dispatch_tasks(tasks)
+    }
+
+    // Read exit code from the BPF part.
+    pub fn exited(&mut self) -> bool {
+        if uei_exited!(&self.skel, uei) {
+            self.shutdown.store(true, Ordering::Relaxed);
+        }
+        self.shutdown.load(Ordering::Relaxed)
+    }
+
+    // Called on exit to shutdown and report exit message from the BPF part.
+    pub fn shutdown_and_report(&mut self) -> Result<UserExitInfo> {
+        let _ = self.struct_ops.take();
+        self.stop_shards()?;
+        uei_report!(&self.skel, uei)
+    }
+}
+
+impl<'cb> BpfShard<'cb> {
+    fn new(
+        ctx: &ShardContext,
+        id: usize,
+        cpus: Vec<usize>,
+        queued: &dyn MapCore,
+        dispatched: &dyn MapCore,
+    ) -> Result<Self> {
+        // Build the ring buffer of queued tasks.
+        let mut rbb = libbpf_rs::RingBufferBuilder::new();
+        rbb.add(queued, queued_task_callback)
+            .expect("failed to add ringbuf callback");
+        let queued = rbb.build().expect("failed to build ringbuf");
+
+        // Build the user ring buffer of dispatched tasks.
+        let dispatched =
+            libbpf_rs::UserRingBuffer::new(dispatched).expect("failed to create user ringbuf");
+
+        Ok(Self {
+            id,
+            cpus,
+            ctx: ctx.clone(),
+            queued,
+            dispatched,
+            _maps: None,
+            stats: Arc::new(ShardStats::default()),
+            idle_claimed: [0; IDLE_MAP_WORDS],
+            idle_hints: vec![0; ctx.idle_topo.cpu_llc.len()],
+            poll: false,
+            poll_active: false,
+            poll_idle_rounds: 0,
+            poll_idle_since: None,
+            poll_spins: 0,
+            poll_yields: 0,
+        })
+    }
+
+    // Register the calling thread as the user-space scheduler of the shard and bind it to the CPUs
+    // served by the shard.
+    fn register(&mut self) -> Result<()> {
+        let tid = unsafe { libc::syscall(libc::SYS_gettid) } as u32;
+        unsafe {
+            std::ptr::addr_of_mut!((*self.ctx.bss).usersched_tids[self.id]).write_volatile(tid);
+        }
+
+        set_thread_affinity(&self.cpus)
+    }
+
+    // Disable memory mappings in the calling shard thread, making sure that mmap() actually fails.
+    fn disable_mmap(&self) -> Result<()> {
+        ALLOCATOR
+            .disable_mmap()
+            .map_err(|err| anyhow::anyhow!("Failed to disable mmap: {}", err))?;
+
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                4096,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        if ptr != libc::MAP_FAILED {
+            unsafe { libc::munmap(ptr, 4096) };
+            anyhow::bail!("mmap() is still allowed in shard {}", self.id);
+        }
+
+        Ok(())
+    }
+
+    // Enable the busy-polling mode and bind the calling thread to @cpu.
+    //
+    // In this mode the BPF component doesn't wait for a CPU to go idle to run the user-space
+    // scheduler: the scheduler thread keeps running on @cpu polling the ring buffer of queued
+    // tasks, so that tasks are received (and dispatched) as soon as they are queued.
+    //
+    // When there is nothing to do notify_complete() backs off adaptively: it spins for
+    // POLL_SPIN_TIME, then it yields the CPU for POLL_YIELD_ROUNDS rounds and finally it blocks
+    // until new tasks are queued. The cost of the polling is reported by the counters
+    // nr_poll_*() and poll_idle_ns() of the shard, and by the counters nr_poll_*_mut() and
+    // poll_idle_ns_mut() of the BpfScheduler for all the shards.
+    //
+    // This is meant for systems where @cpu can be dedicated to the user-space scheduler.
+    pub fn enable_busy_poll(&mut self, cpu: usize) -> Result<()> {
+        if cpu >= self.idle_hints.len() {
+            anyhow::bail!("invalid busy-polling CPU {}", cpu);
+        }
+
+        // Set the polling state before changing the affinity, so that the BPF component can
+        // already run the scheduler on the new CPU after the migration.
+        unsafe {
+            std::ptr::addr_of_mut!((*self.ctx.bss).usersched_poll[self.id]).write_volatile(1);
+        }
+        self.poll = true;
+
+        set_thread_affinity(&[cpu])
+    }
+
+    // Shard id.
+    #[allow(dead_code)]
+    pub fn id(&self) -> usize {
+        self.id
+    }
+
+    // CPUs served by the shard.
+    #[allow(dead_code)]
+    pub fn cpus(&self) -> &[usize] {
+        &self.cpus
+    }
+
+    // Return true if the scheduler is exiting.
+    pub fn exited(&self) -> bool {
+        self.ctx.shutdown.load(Ordering::Relaxed)
+    }
+
+    // Notify the BPF component that the shard has completed its scheduling cycle, updating the
+    // amount tasks that are still pending.
+    pub fn notify_complete(&mut self, nr_pending: u64) {
+        let bss = self.ctx.bss;
+        unsafe {
+            if self.id == 0 {
+                std::ptr::addr_of_mut!((*bss).nr_scheduled).write_volatile(nr_pending);
+            } else {
+                std::ptr::addr_of_mut!((*bss).nr_shard_scheduled[self.id])
+                    .write_volatile(nr_pending);
+            }
+        }
+        self.idle_claimed = [0; IDLE_MAP_WORDS];
+
+        if self.poll {
+            let active = self.poll_active || nr_pending > 0;
+            self.poll_active = false;
+            self.busy_poll_wait(active);
+        } else {
+            std::thread::yield_now();
+        }
+    }
+
+    // Wait for more work to do in busy-polling mode.
+    //
+    // After a round that received or dispatched some tasks the CPU is yielded once, to give the
+    // BPF component a chance to consume the dispatched tasks, then each idle round backs off a bit
+    // more: spin, yield the CPU and finally block on the ring buffer of queued tasks.
+    fn busy_poll_wait(&mut self, active: bool) {
+        if active {
+            self.poll_idle_rounds = 0;
+            self.flush_poll_stats();
+            std::thread::yield_now();
+            return;
+        }
+
+        let idle_since = *self.poll_idle_since.get_or_insert_with(Instant::now);
+
+        if idle_since.elapsed() < POLL_SPIN_TIME {
+            self.poll_spins += 1;
+            std::hint::spin_loop();
+        } else if self.poll_idle_rounds < POLL_YIELD_ROUNDS {
+            self.poll_idle_rounds += 1;
+            self.poll_yields += 1;
+            std::thread::yield_now();
+        } else {
+            self.poll_idle_rounds = 0;
+            self.flush_poll_stats();
+            unsafe { bss_counter_add(std::ptr::addr_of_mut!((*self.ctx.bss).nr_poll_sleeps), 1) };
+            ShardStats::add(&self.stats.nr_poll_sleeps, 1);
+
+            // Block until new tasks are queued, with a timeout to periodically check if the
+            // scheduler is exiting. The events are only peeked here, the queued tasks are consumed
+            // by the next dequeue_task(s).
+            let mut event = libc::epoll_event { events: 0, u64: 0 };
+            unsafe { libc::epoll_wait(self.queued.epoll_fd(), &mut event, 1, POLL_SLEEP_MS) };
+        }
+    }
+
+    // Report the busy-polling counters of the current idle period to the BPF component.
+    fn flush_poll_stats(&mut self) {
+        let idle_ns = self
+            .poll_idle_since
+            .take()
+            .map_or(0, |ts| ts.elapsed().as_nanos() as u64);
+        let bss = self.ctx.bss;
+        unsafe {
+            bss_counter_add(
+                std::ptr::addr_of_mut!((*bss).nr_poll_spins),
+                self.poll_spins,
+            );
+            bss_counter_add(
+                std::ptr::addr_of_mut!((*bss).nr_poll_yields),
+                self.poll_yields,
+            );
+            bss_counter_add(std::ptr::addr_of_mut!((*bss).poll_idle_ns), idle_ns);
+        }
+        ShardStats::add(&self.stats.nr_poll_spins, self.poll_spins);
+        ShardStats::add(&self.stats.nr_poll_yields, self.poll_yields);
+        ShardStats::add(&self.stats.poll_idle_ns, idle_ns);
+        self.poll_spins = 0;
+        self.poll_yields = 0;
+    }
+
+    // Counter of tasks queued to all the shards.
+    #[allow(dead_code)]
+    pub fn nr_queued(&self) -> u64 {
+        self.nr_queued_atomic().load(Ordering::Relaxed)
+    }
+
+    // The counter of queued tasks is incremented by the BPF component and decremented by all the
+    // shards, so it must be always updated atomically.
+    fn nr_queued_atomic(&self) -> &AtomicU64 {
+        unsafe { &*(std::ptr::addr_of_mut!((*self.ctx.bss).nr_queued) as *const AtomicU64) }
+    }
+
+    // Update the counter of queued tasks after receiving @nr tasks, @drained means that the ring
+    // buffer of the shard is empty.
+    fn update_nr_queued(&self, nr: u64, drained: bool) {
+        let nr_queued = self.nr_queued_atomic();
+        if drained && self.ctx.nr_shards == 1 {
+            nr_queued.store(0, Ordering::Relaxed);
+        } else {
+            let _ = nr_queued.fetch_update(Ordering::Relaxed, Ordering::Relaxed, |n| {
+                Some(n.saturating_sub(nr))
+            });
+        }
+    }
+
+    // Amount of tasks sent to the BPF dispatcher by the shard.
+    #[allow(dead_code)]
+    pub fn nr_dispatched_tasks(&self) -> u64 {
+        self.stats.nr_dispatched_tasks.load(Ordering::Relaxed)
+    }
+
+    // Account @nr tasks sent to the BPF dispatcher.
+    fn add_dispatched_tasks(&self, nr: u64) {
+        ShardStats::add(&self.stats.nr_dispatched_tasks, nr);
+    }
+
+    // Idle busy-polling rounds of the shard spent spinning (see enable_busy_poll()).
+    #[allow(dead_code)]
+    pub fn nr_poll_spins(&self) -> u64 {
+        self.stats.nr_poll_spins.load(Ordering::Relaxed)
+    }
+
+    // Idle busy-polling rounds of the shard that yielded the CPU.
+    #[allow(dead_code)]
+    pub fn nr_poll_yields(&self) -> u64 {
+        self.stats.nr_poll_yields.load(Ordering::Relaxed)
+    }
+
+    // Times the busy-polling shard blocked waiting for new tasks.
+    #[allow(dead_code)]
+    pub fn nr_poll_sleeps(&self) -> u64 {
+        self.stats.nr_poll_sleeps.load(Ordering::Relaxed)
+    }
+
+    // Time the shard spent busy-polling without any task to schedule (in ns).
+    #[allow(dead_code)]
+    pub fn poll_idle_ns(&self) -> u64 {
+        self.stats.poll_idle_ns.load(Ordering::Relaxed)
+    }
+
+    // CPU time consumed by the calling thread (in ns).
+    #[allow(dead_code)]
+    pub fn sched_cpu_time_ns(&self) -> u64 {
+        cpu_clock_ns(libc::CLOCK_THREAD_CPUTIME_ID)
+    }
+
+    // Pick an idle CPU for the target PID, without any syscall.
+    //
+    // Same as select_cpu(), but the CPU is picked from the idle state that the BPF component
+    // publishes in the memory-mapped .bss: @prev_cpu is preferred if it's idle, then any idle CPU
+    // sharing the same LLC and lastly any other idle CPU in the system.
+    //
+    // The choice is optimistic: the task's affinity is not checked and the CPU may be taken by
+    // another task (or another shard) before the dispatch. In this case the BPF dispatcher picks
+    // another idle CPU for the task, or dispatches it on the first CPU available (see
+    // nr_idle_conflicts_mut()).
+    pub fn select_cpu_fast(&mut self, pid: i32, prev_cpu: i32, _flags: u64) -> i32 {
+        let bss = self.ctx.bss;
+        let topo = &self.ctx.idle_topo;
+
+        // Idle CPUs that haven't been picked yet in the current scheduling round.
+        let mut idle = [0u64; IDLE_MAP_WORDS];
+        for (i, word) in idle.iter_mut().enumerate() {
+            let map = unsafe { std::ptr::addr_of!((*bss).idle_cpus_map[i]).read_volatile() };
+            *word = map & !self.idle_claimed[i];
+        }
+        let is_idle =
+            |map: &[u64; IDLE_MAP_WORDS], cpu: usize| map[cpu / 64] & (1 << (cpu % 64)) != 0;
+        let first_idle = |map: &[u64; IDLE_MAP_WORDS], mask: Option<&[u64; IDLE_MAP_WORDS]>| {
+            map.iter().enumerate().find_map(|(i, word)| {
+                let word = word & mask.map_or(!0, |mask| mask[i]);
+                (word != 0).then(|| i * 64 + word.trailing_zeros() as usize)
+            })
+        };
+
+        let prev = prev_cpu as usize;
+        let cpu = if prev < self.idle_hints.len() && is_idle(&idle, prev) {
+            Some(prev)
+        } else {
+            // Look for an idle CPU in the same LLC first, skipping the scan if the LLC summary
+            // reports that there are no idle CPUs in it.
+            topo.cpu_llc
+                .get(prev)
+                .filter(|llc| unsafe { std::ptr::addr_of!((*bss).llc_nr_idle[**llc]).read_volatile() } > 0)
+                .and_then(|llc| first_idle(&idle, Some(&topo.llc_cpus[*llc])))
+                .or_else(|| first_idle(&idle, None))
+        };
+
+        match cpu {
+            Some(cpu) if cpu < self.idle_hints.len() => {
+                self.idle_claimed[cpu / 64] |= 1 << (cpu % 64);
+                self.idle_hints[cpu] = pid;
+                cpu as i32
+            }
+            _ => -libc::EBUSY,
+        }
+    }
+
+    // Return the dispatch flags of a task that is dispatched on an idle CPU picked by
+    // select_cpu_fast(), consuming the corresponding hint.
+    fn idle_hint_flags(idle_hints: &mut [i32], task: &DispatchedTask) -> u64 {
+        match idle_hints.get_mut(task.cpu as usize) {
+            Some(pid) if *pid == task.pid => {
+                *pid = 0;
+                bpf_intf::RL_CPU_IDLE_HINT as u64
+            }
+            _ => 0,
+        }
+    }
+
     // Receive a task to be scheduled from the BPF dispatcher.
-    #[allow(static_mut_refs)]
     pub fn dequeue_task(&mut self) -> Result<Option<QueuedTask>, i32> {
         match self.queued.consume_raw() {
             0 => {
-                self.skel.maps.bss_data.nr_queued = 0;
+                self.update_nr_queued(0, true);
                 Ok(None)
             }
             LIBBPF_STOP => {
                 // A valid task is received, convert data to a proper task struct.
-                let task = unsafe { EnqueuedMessage::from_bytes(&BUF.0).to_queued_task() };
-                self.skel.maps.bss_data.nr_queued =
-                    self.skel.maps.bss_data.nr_queued.saturating_sub(1);
+                let task =
+                    BUF.with(|buf| EnqueuedMessage::from_bytes(&buf.borrow().0).to_queued_task());
+                self.update_nr_queued(1, false);
+                self.poll_active = true;
 
                 Ok(Some(task))
             }
@@ -556,23 +1380,55 @@ impl<'cb> BpfScheduler<'cb> {
         }
     }
 
-    // Send a task to the dispatcher.
-    pub fn dispatch_task(&mut self, task: &DispatchedTask) -> Result<(), libbpf_rs::Error> {
-        // Reserve a slot in the user ring buffer.
-        let mut urb_sample = self
-            .dispatched
-            .reserve(std::mem::size_of::<bpf_intf::dispatched_task_ctx>())?;
-        let bytes = urb_sample.as_mut();
+    // Receive up to @max tasks to be scheduled from the BPF dispatcher, appending them to @tasks.
+    //
+    // All the tasks are read with a single ring buffer consume operation, so this is much cheaper
+    // than calling dequeue_task() in a loop. Return the amount of tasks received (0 means that
+    // there are no more tasks to be scheduled).
+    pub fn dequeue_tasks(&mut self, tasks: &mut Vec<QueuedTask>, max: usize) -> Result<usize, i32> {
+        if max == 0 {
+            return Ok(0);
+        }
+        let start = tasks.len();
+        tasks.reserve(max);
+
+        BATCH.with(|batch| {
+            batch.set(DequeueBatch {
+                tasks: tasks as *mut _,
+                max: start + max,
+            })
+        });
+        let res = self.queued.consume_raw();
+        BATCH.with(|batch| {
+            batch.set(DequeueBatch {
+                tasks: std::ptr::null_mut(),
+                max: 0,
+            })
+        });
+        if res < 0 && res != LIBBPF_STOP {
+            return Err(res);
+        }
+
+        // If less than @max tasks have been received the ring buffer has been completely drained.
+        let nr_tasks = tasks.len() - start;
+        self.update_nr_queued(nr_tasks as u64, nr_tasks < max);
+        self.poll_active |= nr_tasks > 0;
+
+        Ok(nr_tasks)
+    }
+
+    // Convert a dispatched task into the low-level dispatched task context.
+    fn to_dispatched_task_ctx(bytes: &mut [u8], task: &DispatchedTask, flags_rl: u64) {
         let dispatched_task = plain::from_mut_bytes::<bpf_intf::dispatched_task_ctx>(bytes)
             .expect("failed to convert bytes");
 
-        // Convert the dispatched task into the low-level dispatched task context.
         let bpf_intf::dispatched_task_ctx {
             pid,
             cpu,
             flags,
             slice_ns,
             vtime,
+            rl_flags,
             ..
         } = &mut dispatched_task.as_mut();
 
@@ -581,6 +1437,17 @@ impl<'cb> BpfScheduler<'cb> {
         *flags = task.flags;
         *slice_ns = task.slice_ns;
         *vtime = task.vtime;
+        *rl_flags = flags_rl;
+    }
+
+    // Send a task to the dispatcher.
+    pub fn dispatch_task(&mut self, task: &DispatchedTask) -> Result<(), libbpf_rs::Error> {
+        // Reserve a slot in the user ring buffer.
+        let mut urb_sample = self
+            .dispatched
+            .reserve(std::mem::size_of::<bpf_intf::dispatched_task_ctx>())?;
+        let rl_flags = Self::idle_hint_flags(&mut self.idle_hints, task);
+        Self::to_dispatched_task_ctx(urb_sample.as_mut(), task, rl_flags);
 
         // Store the task in the user ring buffer.
         //
@@ -589,19 +1456,47 @@ impl<'cb> BpfScheduler<'cb> {
         self.dispatched
             .submit(urb_sample)
             .expect("failed to submit task");
+        self.add_dispatched_tasks(1);
+        self.poll_active = true;
 
         Ok(())
     }
 
-    // Read exit code from the BPF part.
-    pub fn exited(&mut self) -> bool {
-        self.shutdown.load(Ordering::Relaxed) || uei_exited!(&self.skel, uei)
-    }
+    // Send a batch of tasks to the dispatcher.
+    //
+    // Tasks are stored in the user ring buffer in records of up to MAX_DISPATCH_BATCH tasks, using
+    // a single reserve/submit operation per record, and the BPF dispatcher dispatches all the
+    // tasks of a record at once.
+    //
+    // Return the amount of tasks dispatched, that can be less than the amount of tasks passed by
+    // the caller if the user ring buffer is full (an error is returned only if none of the tasks
+    // can be dispatched).
+    pub fn dispatch_tasks(&mut self, tasks: &[DispatchedTask]) -> Result<usize, libbpf_rs::Error> {
+        let size = std::mem::size_of::<bpf_intf::dispatched_task_ctx>();
+        let mut nr_tasks = 0;
+
+        for batch in tasks.chunks(MAX_DISPATCH_BATCH) {
+            // Reserve a record for the whole batch in the user ring buffer.
+            let mut urb_sample = match self.dispatched.reserve(batch.len() * size) {
+                Ok(sample) => sample,
+                Err(err) if nr_tasks == 0 => return Err(err),
+                Err(_) => break,
+            };
+            for (task, bytes) in batch.iter().zip(urb_sample.as_mut().chunks_exact_mut(size)) {
+                let rl_flags = Self::idle_hint_flags(&mut self.idle_hints, task);
+                Self::to_dispatched_task_ctx(bytes, task, rl_flags);
+            }
 
-    // Called on exit to shutdown and report exit message from the BPF part.
-    pub fn shutdown_and_report(&mut self) -> Result<UserExitInfo> {
-        let _ = self.struct_ops.take();
-        uei_report!(&self.skel, uei)
+            // Store the batch in the user ring buffer.
+            self.dispatched
+                .submit(urb_sample)
+                .expect("failed to submit task");
+            nr_tasks += batch.len();
+        }
+        self.add_dispatched_tasks(nr_tasks as u64);
+        self.poll_active |= nr_tasks > 0;
+
+        Ok(nr_tasks)
     }
 }
 
@@ -611,6 +1506,7 @@ impl Drop for BpfScheduler<'_> {
         if let Some(struct_ops) = self.struct_ops.take() {
             drop(struct_ops);
         }
+        let _ = self.stop_shards();
         ALLOCATOR.unlock_memory();
     }
 }
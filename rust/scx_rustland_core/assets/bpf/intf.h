@@ -45,6 +45,23 @@ typedef int pid_t;
  */
 #define MAX_CPUS 1024
 
+/*
+ * Maximum amount of tasks that the user-space scheduler can send to the BPF
+ * dispatcher in a single user ring buffer record (see dispatch_tasks()).
+ *
+ * This must be lower than the amount of dispatch slots available in
+ * ops.dispatch(), since all the tasks of a record are dispatched at once.
+ */
+#define MAX_DISPATCH_BATCH 32
+
+/*
+ * Maximum amount of user-space scheduler threads (shards).
+ *
+ * Each shard serves the CPUs of a group of LLCs, using its own pair of
+ * queued / dispatched ring buffers.
+ */
+#define MAX_SCHED_SHARDS 64
+
 /* Special dispatch flags */
 enum {
 	/*
@@ -56,6 +73,17 @@ enum {
 	RL_CPU_ANY = 1 << 20,
 };
 
+/* Flags of a dispatched task (see dispatched_task_ctx->rl_flags) */
+enum {
+	/*
+	 * The target CPU has been picked by the user-space scheduler from
+	 * the published idle CPU state (see idle_cpus_map): the BPF
+	 * dispatcher needs to claim it, picking another idle CPU if it has
+	 * been taken in the meantime.
+	 */
+	RL_CPU_IDLE_HINT = 1 << 0,
+};
+
 /*
  * Specify a target CPU for a specific PID.
  */
@@ -96,6 +124,9 @@ struct queued_task_ctx {
  *
  * This struct can be easily extended to send more information to the
  * dispatcher (i.e., a target CPU, a variable time slice, etc.).
+ *
+ * A user ring buffer record can contain up to MAX_DISPATCH_BATCH
+ * consecutive entries.
  */
 struct dispatched_task_ctx {
 	s32 pid;
@@ -103,6 +134,7 @@ struct dispatched_task_ctx {
 	u64 flags; /* task enqueue flags */
 	u64 slice_ns; /* time slice assigned to the task (0=default) */
 	u64 vtime; /* task deadline / vruntime */
+	u64 rl_flags; /* RL_CPU_* dispatch flags */
 };
 
 #endif /* __INTF_H */
@@ -56,6 +56,8 @@ UEI_DEFINE(uei);
  * This ensures to work in bursts: tasks are queued, then the user-space
  * scheduler runs and dispatches them. Once all these tasks exhaust their
  * time slices, the scheduler is invoked again, repeating the cycle.
+ *
+ * Each user-space scheduler shard uses its own DSQ (SCHED_DSQ + shard id).
  */
 #define SCHED_DSQ (MAX_CPUS + 1)
 
@@ -64,9 +66,27 @@ UEI_DEFINE(uei);
  */
 const volatile u32 usersched_pid; /* User-space scheduler PID */
 const volatile u32 khugepaged_pid; /* khugepaged PID */
-u64 usersched_last_run_at; /* Timestamp of the last user-space scheduler execution */
 static u64 nr_cpu_ids; /* Maximum possible CPU number */
 
+/*
+ * User-space scheduler shards.
+ *
+ * The user-space scheduler can run multiple threads (shards), each one
+ * serving the CPUs of a group of LLCs (@cpu_shard_id): tasks are queued to
+ * the shard of the CPU where they last ran, using the shard's own pair of
+ * ring buffers (see @queued_shards and @dispatched_shards).
+ *
+ * With a single shard the scheduler is the process main thread
+ * (@usersched_pid), otherwise each thread registers itself in
+ * @usersched_tids when it starts.
+ */
+const volatile u32 nr_sched_shards = 1;
+const volatile u32 cpu_shard_id[MAX_CPUS];
+volatile u32 usersched_tids[MAX_SCHED_SHARDS];
+
+/* Timestamp of the last execution of each user-space scheduler shard */
+u64 usersched_last_run_at[MAX_SCHED_SHARDS];
+
 /*
  * Switch all tasks or SCHED_EXT tasks.
  */
@@ -89,6 +109,12 @@ volatile u64 nr_queued;
  */
 volatile u64 nr_scheduled;
 
+/*
+ * Number of tasks that are waiting for scheduling in the shards other than
+ * the first one (that uses @nr_scheduled).
+ */
+volatile u64 nr_shard_scheduled[MAX_SCHED_SHARDS];
+
 /*
  * Amount of currently running tasks.
  */
@@ -101,6 +127,43 @@ volatile u64 nr_user_dispatches, nr_kernel_dispatches,
 /* Failure statistics */
 volatile u64 nr_failed_dispatches, nr_sched_congested;
 
+/*
+ * Busy-polling mode.
+ *
+ * A user-space scheduler shard in busy-polling mode stays on a dedicated
+ * CPU polling its @queued ring buffer, instead of waiting to be dispatched
+ * when a CPU goes idle: the scheduler thread is always inserted directly
+ * into the local DSQ of its CPU when it becomes runnable and it blocks on
+ * the ring buffer when it has nothing to do (set by user-space).
+ */
+volatile u32 usersched_poll[MAX_SCHED_SHARDS];
+
+/*
+ * Busy-polling statistics (updated by user-space): idle polling rounds,
+ * CPU yields, blocking waits and time spent polling without any work.
+ */
+volatile u64 nr_poll_spins, nr_poll_yields, nr_poll_sleeps, poll_idle_ns;
+
+/*
+ * Idle CPUs published to the user-space scheduler.
+ *
+ * @idle_cpus_map is a bitmap of the idle CPUs and @llc_nr_idle the amount
+ * of idle CPUs in each LLC: both are updated on each idle state transition
+ * and read directly by the user-space scheduler from the memory-mapped
+ * .bss, so that it can pick idle CPUs without any syscall.
+ *
+ * The state is only a hint: CPUs that are picked optimistically are claimed
+ * when the task is dispatched (see RL_CPU_IDLE_HINT).
+ */
+volatile u64 idle_cpus_map[MAX_CPUS / 64];
+volatile u32 llc_nr_idle[MAX_CPUS];
+
+/* LLC id of each CPU (initialized by user-space) */
+const volatile u32 cpu_llc_id[MAX_CPUS];
+
+/* Idle CPU hints that were already taken at dispatch time */
+volatile u64 nr_idle_conflicts;
+
  /* Report additional debugging information */
 const volatile bool debug;
 
@@ -155,7 +218,7 @@ static int calloc_cpumask(struct bpf_cpumask **p_cpumask)
  *
  * This map is drained by the user space scheduler.
  */
-struct {
+struct queued_ring {
 	__uint(type, BPF_MAP_TYPE_RINGBUF);
 	__uint(max_entries, MAX_ENQUEUED_TASKS *
 				sizeof(struct queued_task_ctx));
@@ -167,12 +230,36 @@ struct {
  *
  * Drained by the kernel in .dispatch().
  */
-struct {
+struct dispatched_ring {
         __uint(type, BPF_MAP_TYPE_USER_RINGBUF);
 	__uint(max_entries, MAX_ENQUEUED_TASKS *
 				sizeof(struct dispatched_task_ctx));
 } dispatched SEC(".maps");
 
+/*
+ * Ring buffers of the user-space scheduler shards.
+ *
+ * The first shard uses @queued and @dispatched, the ring buffers of the
+ * other shards are created and installed by user-space.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, MAX_SCHED_SHARDS);
+	__type(key, u32);
+	__array(values, struct queued_ring);
+} queued_shards SEC(".maps") = {
+	.values = { [0] = &queued },
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, MAX_SCHED_SHARDS);
+	__type(key, u32);
+	__array(values, struct dispatched_ring);
+} dispatched_shards SEC(".maps") = {
+	.values = { [0] = &dispatched },
+};
+
 /*
  * Per-CPU context.
  */
@@ -223,6 +310,13 @@ struct task_ctx {
 	 * Execution time (in nanoseconds) since the last sleep event.
 	 */
 	u64 exec_runtime;
+
+	/*
+	 * User-space scheduler shard served by the task plus one, or 0 if
+	 * the task is not known to be a user-space scheduler thread (see
+	 * usersched_shard()).
+	 */
+	u32 usersched_shard;
 };
 
 /* Map that contains task-local storage. */
@@ -271,12 +365,104 @@ struct {
  */
 #define USERSCHED_TIMER_NS (NSEC_PER_SEC / 10)
 
+/*
+ * Return the thread ID of the user-space scheduler @shard, or 0 if the
+ * shard is not running yet.
+ */
+static u32 shard_tid(u32 shard)
+{
+	volatile u32 *tid;
+
+	if (nr_sched_shards <= 1)
+		return shard ? 0 : usersched_pid;
+
+	tid = MEMBER_VPTR(usersched_tids, [shard]);
+	return tid ? *tid : 0;
+}
+
+/*
+ * Return the user-space scheduler shard served by the target task @p, or
+ * a negative value if @p is not a user-space scheduler thread.
+ */
+static s32 usersched_shard(const struct task_struct *p)
+{
+	struct task_ctx *tctx;
+	u32 shard;
+
+	if (p->tgid != usersched_pid)
+		return -ENOENT;
+
+	/*
+	 * The shard of a thread never changes once it's registered, so
+	 * cache it in the task storage, to avoid scanning the shards every
+	 * time the thread is enqueued or starts running.
+	 */
+	tctx = try_lookup_task_ctx(p);
+	if (tctx && tctx->usersched_shard)
+		return tctx->usersched_shard - 1;
+
+	bpf_for(shard, 0, MIN(nr_sched_shards, MAX_SCHED_SHARDS)) {
+		if (p->pid != shard_tid(shard))
+			continue;
+		if (tctx)
+			tctx->usersched_shard = shard + 1;
+		return shard;
+	}
+
+	return -ENOENT;
+}
+
 /*
  * Return true if the target task @p is the user-space scheduler.
  */
 static inline bool is_usersched_task(const struct task_struct *p)
 {
-	return p->pid == usersched_pid;
+	return usersched_shard(p) >= 0;
+}
+
+/*
+ * Return true if the user-space scheduler @shard is in busy-polling mode.
+ */
+static bool is_usersched_polling(u32 shard)
+{
+	volatile u32 *poll = MEMBER_VPTR(usersched_poll, [shard]);
+
+	return poll && *poll;
+}
+
+/*
+ * Return the user-space scheduler shard that serves @cpu.
+ *
+ * CPUs served by a shard that hasn't started yet are temporarily served by
+ * the first shard.
+ */
+static u32 cpu_to_shard(s32 cpu)
+{
+	const volatile u32 *shard;
+
+	shard = MEMBER_VPTR(cpu_shard_id, [cpu]);
+	if (!shard || *shard >= nr_sched_shards || !shard_tid(*shard))
+		return 0;
+
+	return *shard;
+}
+
+/*
+ * Return the ring buffer used to queue tasks to the user-space scheduler
+ * @shard.
+ */
+static void *shard_queued_ring(u32 shard)
+{
+	return bpf_map_lookup_elem(&queued_shards, &shard);
+}
+
+/*
+ * Return the user ring buffer of the tasks dispatched by the user-space
+ * scheduler @shard.
+ */
+static void *shard_dispatched_ring(u32 shard)
+{
+	return bpf_map_lookup_elem(&dispatched_shards, &shard);
 }
 
 /*
@@ -312,26 +498,28 @@ static bool is_queued(const struct task_struct *p)
 }
 
 /*
- * Flag used to wake-up the user-space scheduler.
+ * Flags used to wake-up the user-space scheduler (one bit per shard).
  */
-static volatile u32 usersched_needed;
+static volatile u64 usersched_needed;
 
 /*
- * Set user-space scheduler wake-up flag (equivalent to an atomic release
- * operation).
+ * Set user-space scheduler wake-up flag of @shard (equivalent to an atomic
+ * release operation).
  */
-static void set_usersched_needed(void)
+static void set_usersched_needed(u32 shard)
 {
-	__sync_fetch_and_or(&usersched_needed, 1);
+	__sync_fetch_and_or(&usersched_needed, 1ULL << (shard & 63));
 }
 
 /*
- * Check and clear user-space scheduler wake-up flag (equivalent to an atomic
- * acquire operation).
+ * Check and clear user-space scheduler wake-up flag of @shard (equivalent
+ * to an atomic acquire operation).
  */
-static bool test_and_clear_usersched_needed(void)
+static bool test_and_clear_usersched_needed(u32 shard)
 {
-	return __sync_fetch_and_and(&usersched_needed, 0) == 1;
+	u64 bit = 1ULL << (shard & 63);
+
+	return __sync_fetch_and_and(&usersched_needed, ~bit) & bit;
 }
 
 /*
@@ -354,15 +542,24 @@ static bool test_and_clear_usersched_needed(void)
  * (even if a CPU becomes idle), because there is nothing to do.
  *
  * Also keep in mind that we don't need any protection here since this code
- * doesn't run concurrently with the user-space scheduler (that is single
- * threaded), therefore this check is also safe from a concurrency perspective.
+ * doesn't run concurrently with the user-space scheduler @shard (each shard
+ * is single threaded), therefore this check is also safe from a concurrency
+ * perspective.
  */
-static bool usersched_has_pending_tasks(void)
+static bool usersched_has_pending_tasks(u32 shard)
 {
-	if (nr_scheduled)
+	volatile u64 *nr_pending = shard ? MEMBER_VPTR(nr_shard_scheduled, [shard]) :
+					   &nr_scheduled;
+	void *ring;
+
+	if (nr_pending && *nr_pending)
 		return true;
 
-	return bpf_ringbuf_query(&queued, BPF_RB_AVAIL_DATA) > 0;
+	ring = shard_queued_ring(shard);
+	if (!ring)
+		return false;
+
+	return bpf_ringbuf_query(ring, BPF_RB_AVAIL_DATA) > 0;
 }
 
 /*
@@ -574,6 +771,27 @@ static void kick_task_cpu(const struct task_struct *p, s32 cpu)
 	scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
 }
 
+/*
+ * Claim the idle CPU picked by the user-space scheduler from the published
+ * idle state for @p.
+ *
+ * If the CPU is not idle anymore (or if it can't be used by the task), try
+ * to pick another idle CPU. Return the CPU to use, or RL_CPU_ANY if there
+ * are no idle CPUs.
+ */
+static s32 claim_idle_hint(const struct task_struct *p, s32 cpu)
+{
+	if (bpf_cpumask_test_cpu(cpu, p->cpus_ptr) &&
+	    scx_bpf_test_and_clear_cpu_idle(cpu))
+		return cpu;
+
+	__sync_fetch_and_add(&nr_idle_conflicts, 1);
+
+	cpu = pick_idle_cpu(p, cpu);
+
+	return cpu >= 0 ? cpu : RL_CPU_ANY;
+}
+
 /*
  * Dispatch a task to a target per-CPU DSQ, waking up the corresponding CPU, if
  * needed.
@@ -581,7 +799,7 @@ static void kick_task_cpu(const struct task_struct *p, s32 cpu)
 static void dispatch_task(const struct dispatched_task_ctx *task)
 {
 	struct task_struct *p;
-	s32 prev_cpu;
+	s32 prev_cpu, cpu = task->cpu;
 
 	/* Ignore entry if the task doesn't exist anymore */
 	p = bpf_task_from_pid(task->pid);
@@ -589,11 +807,18 @@ static void dispatch_task(const struct dispatched_task_ctx *task)
 		return;
 	prev_cpu = scx_bpf_task_cpu(p);
 
+	/*
+	 * Resolve the idle CPU picked optimistically by the user-space
+	 * scheduler.
+	 */
+	if ((task->rl_flags & RL_CPU_IDLE_HINT) && cpu != RL_CPU_ANY)
+		cpu = claim_idle_hint(p, cpu);
+
 	/*
 	 * Dispatch task to the shared DSQ if the user-space scheduler
 	 * didn't select any specific target CPU.
 	 */
-	if (task->cpu == RL_CPU_ANY) {
+	if (cpu == RL_CPU_ANY) {
 		scx_bpf_dsq_insert_vtime(p, SHARED_DSQ,
 					 task->slice_ns, task->vtime, task->flags);
 		kick_task_cpu(p, prev_cpu);
@@ -606,7 +831,7 @@ static void dispatch_task(const struct dispatched_task_ctx *task)
 	 * valid, dispatch it to the SHARED_DSQ, independently on what the
 	 * user-space scheduler has decided.
 	 */
-	if (!bpf_cpumask_test_cpu(task->cpu, p->cpus_ptr)) {
+	if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr)) {
 		scx_bpf_dsq_insert_vtime(p, SHARED_DSQ,
 					 task->slice_ns, task->vtime, task->flags);
 		__sync_fetch_and_add(&nr_bounce_dispatches, 1);
@@ -619,7 +844,7 @@ static void dispatch_task(const struct dispatched_task_ctx *task)
 	 * Dispatch a task to a target CPU selected by the user-space
 	 * scheduler.
 	 */
-	scx_bpf_dsq_insert_vtime(p, cpu_to_dsq(task->cpu),
+	scx_bpf_dsq_insert_vtime(p, cpu_to_dsq(cpu),
 				 task->slice_ns, task->vtime, task->flags);
 	__sync_fetch_and_add(&nr_user_dispatches, 1);
 
@@ -632,14 +857,14 @@ static void dispatch_task(const struct dispatched_task_ctx *task)
 	 * since the task will be re-enqueued by the core sched-ext code,
 	 * potentially selecting a different CPU.
 	 */
-	if (!bpf_cpumask_test_cpu(task->cpu, p->cpus_ptr)) {
+	if (!bpf_cpumask_test_cpu(cpu, p->cpus_ptr)) {
 		scx_bpf_dispatch_cancel();
 		__sync_fetch_and_add(&nr_cancel_dispatches, 1);
 
 		goto out_release;
 	}
 
-	scx_bpf_kick_cpu(task->cpu, SCX_KICK_IDLE);
+	scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
 
 out_release:
 	bpf_task_release(p);
@@ -815,14 +1040,26 @@ static bool is_queued_wakeup(const struct task_struct *p, u64 enq_flags)
 void BPF_STRUCT_OPS(rustland_enqueue, struct task_struct *p, u64 enq_flags)
 {
 	struct queued_task_ctx *task;
-	s32 cpu = -EBUSY;
+	s32 cpu = -EBUSY, shard;
+	void *ring;
 
 	/*
 	 * Scheduler is dispatched directly in .dispatch() when needed, so
 	 * we can skip it here.
+	 *
+	 * In busy-polling mode the scheduler owns its CPU instead, so run
+	 * it again as soon as possible. Use a finite time slice, so that
+	 * the other tasks dispatched to the same CPU (e.g., per-CPU
+	 * kthreads) still get to run when its slice expires.
 	 */
-	if (is_usersched_task(p))
+	shard = usersched_shard(p);
+	if (shard >= 0) {
+		if (is_usersched_polling(shard)) {
+			scx_bpf_dsq_insert(p, SCX_DSQ_LOCAL, SCX_SLICE_DFL, enq_flags);
+			scx_bpf_kick_cpu(scx_bpf_task_cpu(p), SCX_KICK_IDLE);
+		}
 		return;
+	}
 
 	/*
 	 * Always dispatch per-CPU kthreads directly on their target CPU.
@@ -854,14 +1091,16 @@ void BPF_STRUCT_OPS(rustland_enqueue, struct task_struct *p, u64 enq_flags)
 	}
 
 	/*
-	 * Add tasks to the @queued list, they will be processed by the
+	 * Add tasks to the @queued list of the shard that serves the CPU
+	 * where the task last ran, they will be processed by the
 	 * user-space scheduler.
 	 *
 	 * If @queued list is full (user-space scheduler is congested) tasks
 	 * will be dispatched directly from the kernel (using the first CPU
 	 * available in this case).
 	 */
-	task = bpf_ringbuf_reserve(&queued, sizeof(*task), 0);
+	ring = shard_queued_ring(cpu_to_shard(scx_bpf_task_cpu(p)));
+	task = ring ? bpf_ringbuf_reserve(ring, sizeof(*task), 0) : NULL;
 	if (!task) {
 		sched_congested(p);
 		scx_bpf_dsq_insert_vtime(p, SHARED_DSQ, SCX_SLICE_DFL, p->scx.dsq_vtime, enq_flags);
@@ -881,15 +1120,20 @@ out_kick:
 }
 
 /*
- * Dispatch the user-space scheduler.
+ * Dispatch the user-space scheduler @shard.
  */
-static void dispatch_user_scheduler(void)
+static void dispatch_user_scheduler(u32 shard)
 {
 	struct task_struct *p;
+	u32 tid = shard_tid(shard);
 
-	p = bpf_task_from_pid(usersched_pid);
+	/* Ignore shards that haven't registered yet */
+	if (!tid)
+		return;
+
+	p = bpf_task_from_pid(tid);
 	if (!p) {
-		scx_bpf_error("Failed to find usersched task %d", usersched_pid);
+		scx_bpf_error("Failed to find usersched task %d", tid);
 		return;
 	}
 
@@ -900,26 +1144,38 @@ static void dispatch_user_scheduler(void)
 	 * The user-space scheduler will voluntarily yield the CPU upon
 	 * completion through BpfScheduler->notify_complete().
 	 */
-	scx_bpf_dsq_insert(p, SCHED_DSQ, SCX_SLICE_INF, 0);
+	scx_bpf_dsq_insert(p, SCHED_DSQ + shard, SCX_SLICE_INF, 0);
 
 	bpf_task_release(p);
 }
 
 /*
- * Handle a task dispatched from user-space, performing the actual low-level
- * BPF dispatch.
+ * Handle a batch of tasks dispatched from user-space, performing the actual
+ * low-level BPF dispatch.
+ *
+ * Each record of the @dispatched user ring buffer contains up to
+ * MAX_DISPATCH_BATCH tasks.
  */
 static long handle_dispatched_task(struct bpf_dynptr *dynptr, void *context)
 {
 	const struct dispatched_task_ctx *task;
+	u32 nr_tasks, i;
 
-	task = bpf_dynptr_data(dynptr, 0, sizeof(*task));
-	if (!task)
-		return 0;
+	nr_tasks = bpf_dynptr_size(dynptr) / sizeof(*task);
+	bpf_for(i, 0, MIN(nr_tasks, MAX_DISPATCH_BATCH)) {
+		task = bpf_dynptr_data(dynptr, i * sizeof(*task), sizeof(*task));
+		if (!task)
+			break;
 
-	dispatch_task(task);
+		dispatch_task(task);
+	}
 
-	return !!scx_bpf_dispatch_nr_slots();
+	/*
+	 * Stop draining if the dispatch buffer can't hold another full
+	 * record, the remaining records will be consumed by the next
+	 * ops.dispatch().
+	 */
+	return scx_bpf_dispatch_nr_slots() >= MAX_DISPATCH_BATCH;
 }
 
 /*
@@ -934,19 +1190,27 @@ static long handle_dispatched_task(struct bpf_dynptr *dynptr, void *context)
  */
 void BPF_STRUCT_OPS(rustland_dispatch, s32 cpu, struct task_struct *prev)
 {
+	u32 shard = cpu_to_shard(cpu);
+	void *ring;
+
 	/*
-	 * Fire up the user-space scheduler: it will run only if no other
-	 * task needs to run.
+	 * Fire up the user-space scheduler shard that serves this CPU: it
+	 * will run only if no other task needs to run.
+	 *
+	 * A shard in busy-polling mode doesn't need to be dispatched: it is
+	 * always runnable on its own CPU, or waiting for new tasks.
 	 */
-	if (test_and_clear_usersched_needed())
-		dispatch_user_scheduler();
+	if (test_and_clear_usersched_needed(shard) && !is_usersched_polling(shard))
+		dispatch_user_scheduler(shard);
 
 	/*
-	 * Consume all tasks from the @dispatched list and immediately
-	 * dispatch them on the target CPU decided by the user-space
-	 * scheduler.
+	 * Consume all tasks from the @dispatched list of the shard and
+	 * immediately dispatch them on the target CPU decided by the
+	 * user-space scheduler.
 	 */
-	bpf_user_ringbuf_drain(&dispatched, handle_dispatched_task, NULL, BPF_RB_NO_WAKEUP);
+	ring = shard_dispatched_ring(shard);
+	if (ring)
+		bpf_user_ringbuf_drain(ring, handle_dispatched_task, NULL, BPF_RB_NO_WAKEUP);
 
 	/*
 	 * Consume a task from the per-CPU DSQ.
@@ -963,15 +1227,15 @@ void BPF_STRUCT_OPS(rustland_dispatch, s32 cpu, struct task_struct *prev)
 	/*
 	 * Lastly, consume and dispatch the user-space scheduler.
 	 */
-	if (scx_bpf_dsq_move_to_local(SCHED_DSQ))
+	if (scx_bpf_dsq_move_to_local(SCHED_DSQ + shard))
 		return;
 
 	/*
 	 * If there are still pending task, notify the user-space scheduler
 	 * and prevent the CPU from going idle.
 	 */
-	if (usersched_has_pending_tasks()) {
-		set_usersched_needed();
+	if (usersched_has_pending_tasks(shard)) {
+		set_usersched_needed(shard);
 		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
 		return;
 	}
@@ -1004,11 +1268,15 @@ void BPF_STRUCT_OPS(rustland_runnable, struct task_struct *p, u64 enq_flags)
  */
 void BPF_STRUCT_OPS(rustland_running, struct task_struct *p)
 {
-	s32 cpu = scx_bpf_task_cpu(p);
+	s32 cpu = scx_bpf_task_cpu(p), shard;
 	struct task_ctx *tctx;
+	u64 *last_run_at;
 
-	if (is_usersched_task(p)) {
-		usersched_last_run_at = scx_bpf_now();
+	shard = usersched_shard(p);
+	if (shard >= 0) {
+		last_run_at = MEMBER_VPTR(usersched_last_run_at, [shard]);
+		if (last_run_at)
+			*last_run_at = scx_bpf_now();
 		return;
 	}
 
@@ -1061,13 +1329,15 @@ void BPF_STRUCT_OPS(rustland_cpu_release, s32 cpu,
 				struct scx_cpu_release_args *args)
 {
 	struct task_struct *p = args->task;
+	s32 shard;
 	/*
 	 * If the interrupted task is the user-space scheduler make sure to
 	 * re-schedule it immediately.
 	 */
 	dbg_msg("cpu preemption: pid=%d (%s)", p->pid, p->comm);
-	if (is_usersched_task(p))
-		set_usersched_needed();
+	shard = usersched_shard(p);
+	if (shard >= 0)
+		set_usersched_needed(shard);
 }
 
 /*
@@ -1131,19 +1401,28 @@ s32 BPF_STRUCT_OPS(rustland_init_task, struct task_struct *p,
 static int usersched_timer_fn(void *map, int *key, struct bpf_timer *timer)
 {
 	struct task_struct *p;
+	u64 now = scx_bpf_now(), *last_run_at;
+	u32 shard, tid;
 	int err = 0;
 
 	/*
-	 * Trigger the user-space scheduler if it has been inactive for
-	 * more than USERSCHED_TIMER_NS.
+	 * Trigger the user-space scheduler shards that have been inactive
+	 * for more than USERSCHED_TIMER_NS.
 	 */
-	if (time_delta(scx_bpf_now(), usersched_last_run_at) >= USERSCHED_TIMER_NS) {
+	bpf_for(shard, 0, MIN(nr_sched_shards, MAX_SCHED_SHARDS)) {
+		last_run_at = MEMBER_VPTR(usersched_last_run_at, [shard]);
+		if (!last_run_at || time_delta(now, *last_run_at) < USERSCHED_TIMER_NS)
+			continue;
+		tid = shard_tid(shard);
+		if (!tid)
+			continue;
+
 		bpf_rcu_read_lock();
-		p = bpf_task_from_pid(usersched_pid);
+		p = bpf_task_from_pid(tid);
 		if (p) {
 			s32 cpu;
 
-			set_usersched_needed();
+			set_usersched_needed(shard);
 			cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
 			if (cpu >= 0)
 				scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
@@ -1215,6 +1494,7 @@ static s32 get_nr_online_cpus(void)
  */
 static int dsq_init(void)
 {
+	u32 shard;
 	int err;
 	s32 cpu;
 
@@ -1238,11 +1518,14 @@ static int dsq_init(void)
 		return err;
 	}
 
-	/* Create the scheduler's DSQ */
-	err = scx_bpf_create_dsq(SCHED_DSQ, -1);
-	if (err) {
-		scx_bpf_error("failed to create scheduler DSQ: %d", err);
-		return err;
+	/* Create the DSQs of the scheduler's shards */
+	bpf_for(shard, 0, MIN(nr_sched_shards, MAX_SCHED_SHARDS)) {
+		err = scx_bpf_create_dsq(SCHED_DSQ + shard, -1);
+		if (err) {
+			scx_bpf_error("failed to create scheduler DSQ %d: %d",
+				      shard, err);
+			return err;
+		}
 	}
 
 	return 0;
@@ -1306,6 +1589,56 @@ int enable_sibling_cpu(struct domain_arg *input)
 	return err;
 }
 
+/*
+ * Publish the idle state of @cpu to the user-space scheduler.
+ */
+static void publish_cpu_idle(s32 cpu, bool idle)
+{
+	u64 bit, old;
+	u32 llc;
+
+	if (cpu < 0 || cpu >= MAX_CPUS)
+		return;
+	llc = cpu_llc_id[cpu];
+	if (llc >= MAX_CPUS)
+		return;
+	bit = 1ULL << (cpu & 63);
+
+	/*
+	 * Update the LLC summary only if the state of the CPU has actually
+	 * changed, so that it's always consistent with the idle bitmap.
+	 */
+	if (idle) {
+		old = __sync_fetch_and_or(&idle_cpus_map[cpu / 64], bit);
+		if (!(old & bit))
+			__sync_fetch_and_add(&llc_nr_idle[llc], 1);
+	} else {
+		old = __sync_fetch_and_and(&idle_cpus_map[cpu / 64], ~bit);
+		if (old & bit)
+			__sync_fetch_and_sub(&llc_nr_idle[llc], 1);
+	}
+}
+
+void BPF_STRUCT_OPS(rustland_update_idle, s32 cpu, bool idle)
+{
+	publish_cpu_idle(cpu, idle);
+}
+
+/*
+ * Publish the CPUs that are already idle when the scheduler is loaded.
+ */
+static void idle_state_init(void)
+{
+	const struct cpumask *idle_cpumask;
+	s32 cpu;
+
+	idle_cpumask = scx_bpf_get_idle_cpumask();
+	bpf_for(cpu, 0, nr_cpu_ids)
+		if (bpf_cpumask_test_cpu(cpu, idle_cpumask))
+			publish_cpu_idle(cpu, true);
+	scx_bpf_put_cpumask(idle_cpumask);
+}
+
 /*
  * Initialize the scheduling class.
  */
@@ -1315,6 +1648,8 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rustland_init)
 
 	/* Compile-time checks */
 	BUILD_BUG_ON((MAX_CPUS % 2));
+	BUILD_BUG_ON((MAX_DISPATCH_BATCH >= MAX_DISPATCH_SLOT));
+	BUILD_BUG_ON((MAX_SCHED_SHARDS > 64));
 
 	/* Initialize maximum possible CPU number */
 	nr_cpu_ids = scx_bpf_nr_cpu_ids();
@@ -1326,6 +1661,7 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rustland_init)
 	err = usersched_timer_init();
 	if (err)
 		return err;
+	idle_state_init();
 
 	return 0;
 }
@@ -1349,6 +1685,7 @@ SCX_OPS_DEFINE(rustland,
 	       .running			= (void *)rustland_running,
 	       .stopping		= (void *)rustland_stopping,
 	       .cpu_release		= (void *)rustland_cpu_release,
+	       .update_idle		= (void *)rustland_update_idle,
 	       .enable			= (void *)rustland_enable,
 	       .init_task		= (void *)rustland_init_task,
 	       .init			= (void *)rustland_init,
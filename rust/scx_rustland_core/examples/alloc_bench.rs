@@ -0,0 +1,108 @@
+// Copyright (c) Andrea Righi <andrea.righi@linux.dev>
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+// Allocation microbenchmark for the scx_rustland_core memory allocator.
+//
+// Measure the average cost of the allocation patterns of a typical user-space scheduler (small
+// fixed-size allocations, B-tree churn and vector growth) using the scx_rustland_core allocator,
+// comparing it with the system allocator where possible.
+//
+// Usage: alloc_bench [ITERATIONS] [THREADS]
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::collections::BTreeSet;
+use std::hint::black_box;
+use std::thread;
+use std::time::Instant;
+
+use scx_rustland_core::ALLOCATOR;
+
+// Allocate and free @nr objects of @size bytes at a time, @iters times, with @alloc.
+fn alloc_free<A: GlobalAlloc>(alloc: &A, size: usize, nr: usize, iters: usize) -> f64 {
+    let layout = Layout::from_size_align(size, 8).unwrap();
+    let mut ptrs = Vec::with_capacity(nr);
+
+    let start = Instant::now();
+    for _ in 0..iters {
+        for _ in 0..nr {
+            ptrs.push(black_box(unsafe { alloc.alloc(layout) }));
+        }
+        for p in ptrs.drain(..) {
+            unsafe { alloc.dealloc(p, layout) };
+        }
+    }
+    start.elapsed().as_nanos() as f64 / (iters * nr) as f64
+}
+
+// Keep @nr tasks in a B-tree ordered by deadline, re-inserting the first one with a later deadline
+// @iters times (similar to the task queue of scx_rustland).
+fn btree_churn(nr: usize, iters: usize) -> f64 {
+    let mut tasks: BTreeSet<(u64, i32)> = (0..nr).map(|i| (i as u64, i as i32)).collect();
+
+    let start = Instant::now();
+    for i in 0..iters {
+        let (deadline, pid) = tasks.pop_first().unwrap();
+        tasks.insert((deadline + nr as u64 + (i % 7) as u64, pid));
+    }
+    black_box(&tasks);
+    start.elapsed().as_nanos() as f64 / iters as f64
+}
+
+// Grow a vector up to @nr elements, one element at a time, @iters times.
+fn vec_growth(nr: usize, iters: usize) -> f64 {
+    let start = Instant::now();
+    for _ in 0..iters {
+        let mut v = Vec::new();
+        for i in 0..nr {
+            v.push(i as u64);
+        }
+        black_box(&v);
+    }
+    start.elapsed().as_nanos() as f64 / (iters * nr) as f64
+}
+
+fn main() {
+    let args: Vec<String> = std::env::args().collect();
+    let iters: usize = args.get(1).and_then(|s| s.parse().ok()).unwrap_or(100_000);
+    let nr_threads: usize = args.get(2).and_then(|s| s.parse().ok()).unwrap_or(4);
+
+    println!(
+        "{:<32} {:>12} {:>12}",
+        "benchmark", "rustland ns", "system ns"
+    );
+    for size in [16, 64, 256, 1024, 4096] {
+        println!(
+            "{:<32} {:>12.1} {:>12.1}",
+            format!("alloc_free/{}B", size),
+            alloc_free(&ALLOCATOR, size, 64, iters / 64),
+            alloc_free(&System, size, 64, iters / 64),
+        );
+    }
+    println!(
+        "{:<32} {:>12.1} {:>12}",
+        "btree_churn/1024",
+        btree_churn(1024, iters),
+        "-"
+    );
+    println!(
+        "{:<32} {:>12.1} {:>12}",
+        "vec_growth/256",
+        vec_growth(256, iters / 256),
+        "-"
+    );
+
+    // Same allocation pattern from multiple threads, to measure the lock contention.
+    let start = Instant::now();
+    let handles: Vec<_> = (0..nr_threads)
+        .map(|_| thread::spawn(move || alloc_free(&ALLOCATOR, 64, 64, iters / 64)))
+        .collect();
+    let avg: f64 = handles.into_iter().map(|h| h.join().unwrap()).sum::<f64>() / nr_threads as f64;
+    println!(
+        "{:<32} {:>12.1} {:>12}",
+        format!("alloc_free/64B/{}threads", nr_threads),
+        avg,
+        "-"
+    );
+    println!("wall time ({} threads): {:?}", nr_threads, start.elapsed());
+}
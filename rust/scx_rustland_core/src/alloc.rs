@@ -28,6 +28,7 @@
 
 use seccomp::*;
 use std::alloc::{GlobalAlloc, Layout};
+use std::cell::UnsafeCell;
 use std::fs::File;
 use std::io::{BufRead, BufReader, Write};
 use std::sync::Mutex;
@@ -434,10 +435,154 @@ impl BuddyAlloc {
     }
 }
 
+/// Slab allocator
+///
+/// Small allocations are served from power-of-two size classes, carved out of slabs allocated from
+/// the buddy allocator. Each thread keeps a cache of free objects for each size class, so that the
+/// fast path doesn't take any lock and doesn't pay the buddy allocator's split/merge cost. Objects
+/// are moved in batches between the thread caches and a central free list per size class, that is
+/// refilled from the buddy allocator one slab at a time.
+///
+/// Slabs are never returned to the buddy allocator, and the objects cached by a thread are not
+/// reclaimed when the thread exits (the amount of memory cached by each thread is bounded by
+/// SLAB_CACHE_MAX).
+
+// Size classes served by the slab allocator: 16 bytes .. 2K (larger allocations and allocations
+// that require an alignment bigger than the buddy allocator's leaf size use the buddy allocator).
+const SLAB_MIN_SHIFT: usize = 4;
+const SLAB_MAX_SHIFT: usize = 11;
+const SLAB_CLASSES: usize = SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1;
+
+// Size of the slabs allocated from the buddy allocator (multiple of all the size classes).
+const SLAB_SIZE: usize = 64 * 1024;
+
+// Objects moved at once between a thread cache and a central free list, and maximum amount of
+// objects of each size class cached by a thread.
+const SLAB_BATCH: usize = 32;
+const SLAB_CACHE_MAX: usize = 2 * SLAB_BATCH;
+
+// Free object, linked in a thread cache or in a central free list.
+struct FreeObj {
+    next: *mut FreeObj,
+}
+
+// Singly-linked list of free objects.
+#[derive(Clone, Copy)]
+struct FreeList {
+    head: *mut FreeObj,
+    len: usize,
+}
+
+impl FreeList {
+    const fn new() -> Self {
+        FreeList {
+            head: core::ptr::null_mut(),
+            len: 0,
+        }
+    }
+
+    fn push(&mut self, p: *mut u8) {
+        let obj = p.cast::<FreeObj>();
+        unsafe { (*obj).next = self.head };
+        self.head = obj;
+        self.len += 1;
+    }
+
+    fn pop(&mut self) -> *mut u8 {
+        let obj = self.head;
+        if !obj.is_null() {
+            self.head = unsafe { (*obj).next };
+            self.len -= 1;
+        }
+        obj.cast::<u8>()
+    }
+
+    // Detach the first @n objects of the list (n must be <= len).
+    fn split_off(&mut self, n: usize) -> FreeList {
+        debug_assert!(n > 0 && n <= self.len);
+        let head = self.head;
+        let mut tail = head;
+        for _ in 1..n {
+            tail = unsafe { (*tail).next };
+        }
+        unsafe {
+            self.head = (*tail).next;
+            (*tail).next = core::ptr::null_mut();
+        }
+        self.len -= n;
+        FreeList { head, len: n }
+    }
+
+    // Prepend all the objects of @other to the list.
+    fn append(&mut self, other: FreeList) {
+        if other.len == 0 {
+            return;
+        }
+        let mut tail = other.head;
+        unsafe {
+            while !(*tail).next.is_null() {
+                tail = (*tail).next;
+            }
+            (*tail).next = self.head;
+        }
+        self.head = other.head;
+        self.len += other.len;
+    }
+}
+
+// Central state of a size class.
+struct SlabClass {
+    free: FreeList, // Objects flushed by the thread caches
+    next: usize,    // Next never-used object of the current slab
+    end: usize,     // End of the current slab
+}
+
+impl SlabClass {
+    const fn new() -> Self {
+        SlabClass {
+            free: FreeList::new(),
+            next: 0,
+            end: 0,
+        }
+    }
+}
+
+// Per-thread cache of free objects, one list per size class.
+struct SlabCache {
+    lists: [FreeList; SLAB_CLASSES],
+    nr_allocs: u64, // Allocations performed by the thread
+}
+
+thread_local! {
+    // The cache doesn't implement Drop, so accessing it never allocates (no TLS destructor needs to
+    // be registered) and it remains valid until the thread exits.
+    static SLAB_CACHE: UnsafeCell<SlabCache> = const {
+        UnsafeCell::new(SlabCache {
+            lists: [FreeList::new(); SLAB_CLASSES],
+            nr_allocs: 0,
+        })
+    };
+}
+
+// Return the slab size class of @layout, or None if it must be served by the buddy allocator.
+fn slab_class(layout: &Layout) -> Option<usize> {
+    if layout.align() > LEAF_SIZE {
+        return None;
+    }
+    let size = layout.size().max(layout.align());
+    if size > 1 << SLAB_MAX_SHIFT {
+        return None;
+    }
+    let shift = size.next_power_of_two().trailing_zeros() as usize;
+
+    Some(shift.max(SLAB_MIN_SHIFT) - SLAB_MIN_SHIFT)
+}
+
 // Main allocator class.
 pub struct UserAllocator {
     buddy_alloc_param: BuddyAllocParam,
     inner_buddy_alloc: Mutex<Option<BuddyAlloc>>,
+    slabs: [Mutex<SlabClass>; SLAB_CLASSES],
 }
 
 impl UserAllocator {
@@ -445,6 +590,7 @@ impl UserAllocator {
         UserAllocator {
             inner_buddy_alloc: Mutex::new(None),
             buddy_alloc_param,
+            slabs: [const { Mutex::new(SlabClass::new()) }; SLAB_CLASSES],
         }
     }
 
@@ -456,7 +602,69 @@ impl UserAllocator {
         }
     }
 
-    // Enable a seccomp filter that sends a SIGSYS when mmap() is called.
+    // Return the amount of memory allocations performed by the calling thread.
+    //
+    // This can be used to verify that the hot paths of the scheduler don't allocate any memory.
+    pub fn thread_allocs(&self) -> u64 {
+        SLAB_CACHE.with(|cache| unsafe { (*cache.get()).nr_allocs })
+    }
+
+    // Allocate an object of size class @class from the cache of the current thread.
+    fn slab_alloc(&self, class: usize) -> *mut u8 {
+        SLAB_CACHE.with(|cache| {
+            let cache = unsafe { &mut *cache.get() };
+            cache.nr_allocs += 1;
+            let list = &mut cache.lists[class];
+            if list.len == 0 {
+                self.slab_refill(list, class);
+            }
+            list.pop()
+        })
+    }
+
+    // Return an object of size class @class to the cache of the current thread.
+    fn slab_free(&self, p: *mut u8, class: usize) {
+        SLAB_CACHE.with(|cache| {
+            let list = unsafe { &mut (*cache.get()).lists[class] };
+            list.push(p);
+            if list.len > SLAB_CACHE_MAX {
+                let batch = list.split_off(SLAB_BATCH);
+                self.slabs[class].lock().unwrap().free.append(batch);
+            }
+        })
+    }
+
+    // Move a batch of free objects of size class @class to the thread cache @list, taking them from
+    // the central free list first, then from the current slab, allocating a new slab from the buddy
+    // allocator if needed.
+    fn slab_refill(&self, list: &mut FreeList, class: usize) {
+        let size = 1 << (class + SLAB_MIN_SHIFT);
+        let mut slab = self.slabs[class].lock().unwrap();
+
+        let n = slab.free.len.min(SLAB_BATCH);
+        if n > 0 {
+            list.append(slab.free.split_off(n));
+            return;
+        }
+
+        if slab.next >= slab.end {
+            let p = unsafe { self.fetch_buddy_alloc(|alloc| alloc.malloc(SLAB_SIZE)) };
+            if p.is_null() {
+                return;
+            }
+            slab.next = p as usize;
+            slab.end = slab.next + SLAB_SIZE;
+        }
+        while list.len < SLAB_BATCH && slab.next < slab.end {
+            list.push(slab.next as *mut u8);
+            slab.next += size;
+        }
+    }
+
+    // Enable a seccomp filter that makes mmap() fail with EPERM.
+    //
+    // The filter is applied to the calling thread and inherited by the threads it creates
+    // afterwards, the threads that already exist are not affected.
     #[allow(static_mut_refs)]
     pub fn disable_mmap(&self) -> Result<(), Box<dyn std::error::Error>> {
         let mut ctx = seccomp::Context::default(Action::Allow)?;
@@ -512,17 +720,42 @@ impl UserAllocator {
 // Override global allocator methods.
 unsafe impl GlobalAlloc for UserAllocator {
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        if let Some(class) = slab_class(&layout) {
+            return self.slab_alloc(class);
+        }
+        SLAB_CACHE.with(|cache| unsafe { (*cache.get()).nr_allocs += 1 });
         unsafe {
             let bytes = layout.size();
             self.fetch_buddy_alloc(|alloc| alloc.malloc(bytes))
         }
     }
 
-    unsafe fn dealloc(&self, ptr: *mut u8, _layout: Layout) {
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        if let Some(class) = slab_class(&layout) {
+            return self.slab_free(ptr, class);
+        }
         unsafe {
             self.fetch_buddy_alloc(|alloc| alloc.free(ptr));
         }
     }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        unsafe {
+            // Nothing to do if the object already fits in the same size class.
+            let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+            let class = slab_class(&layout);
+            if class.is_some() && class == slab_class(&new_layout) {
+                return ptr;
+            }
+
+            let new_ptr = self.alloc(new_layout);
+            if !new_ptr.is_null() {
+                core::ptr::copy_nonoverlapping(ptr, new_ptr, layout.size().min(new_size));
+                self.dealloc(ptr, layout);
+            }
+            new_ptr
+        }
+    }
 }
 
 unsafe impl Sync for UserAllocator {}
@@ -625,3 +858,52 @@ impl VmSettings {
 static mut VM: VmSettings = VmSettings {
     compact_unevictable_allowed: 0,
 };
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_slab_class() {
+        let class = |size, align| slab_class(&Layout::from_size_align(size, align).unwrap());
+
+        assert_eq!(class(1, 1), Some(0));
+        assert_eq!(class(16, 8), Some(0));
+        assert_eq!(class(17, 8), Some(1));
+        assert_eq!(class(8, 64), Some(2));
+        assert_eq!(class(2048, 8), Some(SLAB_CLASSES - 1));
+        assert_eq!(class(2049, 8), None);
+        assert_eq!(class(64, 128), None);
+    }
+
+    #[test]
+    fn test_slab_alloc() {
+        let mut objs = vec![];
+        for i in 0..4 * SLAB_CACHE_MAX {
+            let size = 8 << (i % 9);
+            let layout = Layout::from_size_align(size, 8.min(size)).unwrap();
+            let p = unsafe { ALLOCATOR.alloc(layout) };
+            assert!(!p.is_null());
+            assert_eq!(p as usize % layout.align(), 0);
+            unsafe { p.write_bytes(i as u8, size) };
+            objs.push((p, layout, i as u8));
+        }
+        for (p, layout, val) in objs.into_iter() {
+            let data = unsafe { std::slice::from_raw_parts(p, layout.size()) };
+            assert!(data.iter().all(|b| *b == val));
+            unsafe { ALLOCATOR.dealloc(p, layout) };
+        }
+    }
+
+    #[test]
+    fn test_thread_allocs() {
+        let layout = Layout::from_size_align(64, 8).unwrap();
+        let nr_allocs = ALLOCATOR.thread_allocs();
+        unsafe {
+            let p = ALLOCATOR.alloc(layout);
+            let p = ALLOCATOR.realloc(p, layout, 48);
+            ALLOCATOR.dealloc(p, Layout::from_size_align(48, 8).unwrap());
+        }
+        assert_eq!(ALLOCATOR.thread_allocs(), nr_allocs + 1);
+    }
+}
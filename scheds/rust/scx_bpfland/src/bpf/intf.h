@@ -20,6 +20,12 @@ enum consts {
 	NSEC_PER_MSEC = (1000ULL * NSEC_PER_USEC),
 	NSEC_PER_SEC = (1000ULL * NSEC_PER_MSEC),
 
+	/* Maximum amount of CPUs supported by the staggered throttling */
+	MAX_CPUS		= 1024,
+
+	/* Maximum amount of CPUs per core supported by the staggered throttling */
+	MAX_CORE_CPUS		= 8,
+
 	/* Kernel definitions */
 	CLOCK_BOOTTIME		= 7,
 };
@@ -38,6 +44,15 @@ typedef signed long s64;
 typedef int pid_t;
 #endif /* __VMLINUX_H__ */
 
+/*
+ * Per-CPU ops.select_cpu() cost statistics.
+ */
+enum select_stat_idx {
+	SELECT_STAT_CALLS,
+	SELECT_STAT_NS,
+	NR_SELECT_STATS,
+};
+
 struct cpu_arg {
 	s32 cpu_id;
 };
@@ -68,6 +68,18 @@ const volatile bool local_kthreads;
  */
 const volatile bool local_pcpu;
 
+/*
+ * Use a separate shared DSQ for each LLC, instead of one per node.
+ *
+ * This reduces the contention on the DSQ locks on systems with many CPUs per
+ * node. CPUs consume tasks from their own LLC and steal from the sibling
+ * LLCs of the same node only when their LLC is empty, or when a sibling LLC
+ * is more loaded and its head is lagging behind the local head by more than
+ * @llc_steal_lag in vruntime.
+ */
+const volatile bool per_llc_dsq;
+const volatile u64 llc_steal_lag = 20ULL * NSEC_PER_MSEC;
+
 /*
  * The CPU frequency performance level: a negative value will not affect the
  * performance level and will be ignored.
@@ -78,6 +90,25 @@ volatile s64 cpufreq_perf_lvl;
  * Scheduling statistics.
  */
 volatile u64 nr_kthread_dispatches, nr_direct_dispatches, nr_shared_dispatches;
+volatile u64 nr_llc_steals;
+
+/*
+ * Cost of ops.select_cpu(), accounted per-CPU to avoid contention.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(u64));
+	__uint(max_entries, NR_SELECT_STATS);
+} select_stats SEC(".maps");
+
+static void select_stat_add(u32 idx, u64 value)
+{
+	u64 *cnt_p = bpf_map_lookup_elem(&select_stats, &idx);
+
+	if (cnt_p)
+		(*cnt_p) += value;
+}
 
 /*
  * Amount of currently running tasks.
@@ -98,8 +129,16 @@ static u64 nr_cpu_ids;
  * Runtime throttling.
  *
  * Throttle the CPUs by injecting @throttle_ns idle time every @slice_max.
+ *
+ * If @throttle_stagger is enabled, each core runs its own idle injection
+ * phase, with the phases of the cores evenly spread across the period,
+ * instead of throttling all the CPUs at the same time: the total amount of
+ * injected idle time is the same, but the IPIs and the power draw are
+ * spread over time.
  */
 const volatile u64 throttle_ns;
+const volatile bool throttle_stagger;
+static u32 nr_throttle_cores;
 static volatile bool cpus_throttled;
 
 static inline bool is_throttled(void)
@@ -166,6 +205,17 @@ struct {
 	__type(value, struct throttle_timer);
 } throttle_timer SEC(".maps");
 
+/*
+ * Per-core timers used to inject idle cycles when @throttle_stagger is
+ * enabled, indexed by the first CPU of each core.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_CPUS);
+	__type(key, u32);
+	__type(value, struct throttle_timer);
+} throttle_core_timer SEC(".maps");
+
 /*
  * Per-node context.
  */
@@ -195,6 +245,17 @@ struct node_ctx *try_lookup_node_ctx(int node)
 	return bpf_map_lookup_elem(&node_ctx_stor, &node);
 }
 
+/*
+ * Per-LLC DSQs (when @per_llc_dsq is enabled), identified by
+ * LLC_DSQ_BASE + the first CPU of the LLC, and their NUMA node.
+ */
+#define MAX_LLCS	1024
+#define LLC_DSQ_BASE	MAX_NUMA_NODES
+
+static u64 llc_dsqs[MAX_LLCS];
+static int llc_nodes[MAX_LLCS];
+static u32 nr_llcs;
+
 /*
  * Return true if @node needs a rebalance, false otherwise.
  */
@@ -212,6 +273,21 @@ static bool node_rebalance(int node)
 	return nctx->need_rebalance;
 }
 
+/*
+ * Idle CPU search plan flags.
+ */
+enum idle_plan_flags {
+	/* The primary CPUs sharing the L2/L3 cache are not empty */
+	IDLE_PLAN_L2		= 1 << 0,
+	IDLE_PLAN_L3		= 1 << 1,
+	/*
+	 * The L2 level contains the same CPUs as the L3 level. The L3 level
+	 * is always searched: the primary domain search that follows it uses
+	 * different flags (it can cross the node).
+	 */
+	IDLE_PLAN_L2_DUP	= 1 << 2,
+};
+
 /*
  * Per-CPU context.
  */
@@ -220,9 +296,33 @@ struct cpu_ctx {
 	u64 prev_runtime;
 	u64 last_running;
 	u64 perf_lvl;
+	u64 dsq_id;
 	struct bpf_cpumask __kptr *smt_cpumask;
 	struct bpf_cpumask __kptr *l2_cpumask;
 	struct bpf_cpumask __kptr *l3_cpumask;
+
+	/*
+	 * Idle CPU search plan, built once at init: the primary CPUs that
+	 * share the L2 and L3 cache with this CPU and the levels that are
+	 * worth searching (see enum idle_plan_flags).
+	 */
+	struct bpf_cpumask __kptr *l2_plan_cpumask;
+	struct bpf_cpumask __kptr *l3_plan_cpumask;
+	u32 idle_plan;
+
+	/*
+	 * The CPU is in its idle injection phase (only with
+	 * @throttle_stagger).
+	 */
+	bool throttled;
+
+	/*
+	 * CPUs of the core and index of the core, set only in the first
+	 * CPU of each core (only with @throttle_stagger).
+	 */
+	s32 core_cpus[MAX_CORE_CPUS];
+	u32 nr_core_cpus;
+	u32 core_idx;
 };
 
 struct {
@@ -241,6 +341,21 @@ struct cpu_ctx *try_lookup_cpu_ctx(s32 cpu)
 	return bpf_map_lookup_percpu_elem(&cpu_ctx_stor, &idx, cpu);
 }
 
+/*
+ * Return true if @cpu is forced to stay idle, false otherwise.
+ */
+static bool is_cpu_throttled(s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!throttle_stagger)
+		return is_throttled();
+
+	cctx = try_lookup_cpu_ctx(cpu);
+
+	return cctx && READ_ONCE(cctx->throttled);
+}
+
 /*
  * Per-task local storage.
  *
@@ -287,6 +402,13 @@ struct task_ctx {
 	 * refresh the task's cpumasks.
 	 */
 	s32 recent_used_cpu;
+
+	/*
+	 * The task can run on all the primary CPUs, so its cache domains
+	 * are the same as the idle search plan of the CPU it's running on
+	 * and don't need to be computed (refreshed on affinity changes).
+	 */
+	bool use_plan;
 };
 
 /* Map that contains task-local storage. */
@@ -392,11 +514,27 @@ static int calloc_cpumask(struct bpf_cpumask **p_cpumask)
 }
 
 /*
- * Return the total amount of tasks that are currently waiting to be scheduled.
+ * Return the shared DSQ used by @cpu: the DSQ of its node, or of its LLC if
+ * @per_llc_dsq is enabled.
+ */
+static u64 cpu_dsq(s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return __COMPAT_scx_bpf_cpu_node(cpu);
+
+	return cctx->dsq_id;
+}
+
+/*
+ * Return the total amount of tasks that are currently waiting to be scheduled
+ * in @dsq_id.
  */
-static u64 nr_tasks_waiting(int node)
+static u64 nr_tasks_waiting(u64 dsq_id)
 {
-	return scx_bpf_dsq_nr_queued(node) + 1;
+	return scx_bpf_dsq_nr_queued(dsq_id) + 1;
 }
 
 /*
@@ -522,6 +660,75 @@ static void task_update_domain(struct task_struct *p, struct task_ctx *tctx,
 		bpf_cpumask_and(l3_mask, cast_mask(p_mask), cast_mask(l3_domain));
 }
 
+/*
+ * Refresh the task's domain after its affinity has changed to @cpumask.
+ */
+static void task_update_affinity(struct task_struct *p, struct task_ctx *tctx,
+				 s32 cpu, const struct cpumask *cpumask)
+{
+	const struct cpumask *primary = cast_mask(primary_cpumask);
+
+	tctx->use_plan = primary && !bpf_cpumask_empty(primary) &&
+			 bpf_cpumask_subset(primary, cpumask);
+
+	task_update_domain(p, tctx, cpu, cpumask);
+}
+
+/*
+ * Return the primary CPUs sharing the L2 cache with @cpu that are usable by
+ * the task, or NULL if there are none.
+ */
+static const struct cpumask *task_l2_mask(const struct task_ctx *tctx, s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!tctx->use_plan)
+		return cast_mask(tctx->l2_cpumask);
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx || !(cctx->idle_plan & IDLE_PLAN_L2))
+		return NULL;
+
+	return cast_mask(cctx->l2_plan_cpumask);
+}
+
+/*
+ * Return the primary CPUs sharing the L3 cache with @cpu that are usable by
+ * the task, or NULL if there are none.
+ */
+static const struct cpumask *task_l3_mask(const struct task_ctx *tctx, s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!tctx->use_plan)
+		return cast_mask(tctx->l3_cpumask);
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx || !(cctx->idle_plan & IDLE_PLAN_L3))
+		return NULL;
+
+	return cast_mask(cctx->l3_plan_cpumask);
+}
+
+/*
+ * Return the cache levels that can be skipped when searching an idle CPU
+ * for the task around @cpu, because they contain the same CPUs as the L3
+ * level.
+ */
+static u32 task_plan_skip(const struct task_ctx *tctx, s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!tctx->use_plan)
+		return 0;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return 0;
+
+	return cctx->idle_plan & IDLE_PLAN_L2_DUP;
+}
+
 /*
  * Return true if all the CPUs in the LLC of @cpu are busy, false
  * otherwise.
@@ -620,6 +827,7 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	int node;
 	s32 this_cpu = bpf_get_smp_processor_id(), cpu;
 	bool share_llc;
+	u32 skip;
 
 	primary = cast_mask(primary_cpumask);
 	if (!primary)
@@ -641,22 +849,32 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	}
 
 	/*
-	 * Refresh task domain based on the previously used cpu. If we keep
-	 * selecting the same CPU, the task's domain doesn't need to be
-	 * updated and we can save some cpumask ops.
+	 * Tasks that can run on all the primary CPUs simply follow the idle
+	 * search plan of @prev_cpu, that doesn't require any cpumask
+	 * operation.
+	 *
+	 * Otherwise, refresh task domain based on the previously used cpu.
+	 * If we keep selecting the same CPU, the task's domain doesn't need
+	 * to be updated and we can save some cpumask ops.
 	 */
-	if (tctx->recent_used_cpu != prev_cpu)
-		task_update_domain(p, tctx, prev_cpu, p->cpus_ptr);
-
 	p_mask = cast_mask(tctx->cpumask);
-	if (p_mask && bpf_cpumask_empty(p_mask))
-		p_mask = NULL;
-	l2_mask = cast_mask(tctx->l2_cpumask);
-	if (l2_mask && bpf_cpumask_empty(l2_mask))
-		l2_mask = NULL;
-	l3_mask = cast_mask(tctx->l3_cpumask);
-	if (l3_mask && bpf_cpumask_empty(l3_mask))
-		l3_mask = NULL;
+	if (tctx->use_plan) {
+		l2_mask = task_l2_mask(tctx, prev_cpu);
+		l3_mask = task_l3_mask(tctx, prev_cpu);
+	} else {
+		if (tctx->recent_used_cpu != prev_cpu)
+			task_update_domain(p, tctx, prev_cpu, p->cpus_ptr);
+
+		if (p_mask && bpf_cpumask_empty(p_mask))
+			p_mask = NULL;
+		l2_mask = cast_mask(tctx->l2_cpumask);
+		if (l2_mask && bpf_cpumask_empty(l2_mask))
+			l2_mask = NULL;
+		l3_mask = cast_mask(tctx->l3_cpumask);
+		if (l3_mask && bpf_cpumask_empty(l3_mask))
+			l3_mask = NULL;
+	}
+	skip = task_plan_skip(tctx, prev_cpu);
 
 	/*
 	 * Acquire the CPU masks to determine the idle CPUs in the system.
@@ -704,7 +922,7 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 		 * Search for any full-idle CPU in the primary domain that
 		 * shares the same L2 cache.
 		 */
-		if (l2_mask) {
+		if (l2_mask && !(skip & IDLE_PLAN_L2_DUP)) {
 			cpu = pick_idle_cpu_node(l2_mask, node, SCX_PICK_IDLE_CORE | __COMPAT_SCX_PICK_IDLE_IN_NODE);
 			if (cpu >= 0) {
 				*is_idle = true;
@@ -758,7 +976,7 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	 * Search for any idle CPU in the primary domain that shares the same
 	 * L2 cache.
 	 */
-	if (l2_mask && !node_rebalance(node)) {
+	if (l2_mask && !(skip & IDLE_PLAN_L2_DUP) && !node_rebalance(node)) {
 		cpu = pick_idle_cpu_node(l2_mask, node, __COMPAT_SCX_PICK_IDLE_IN_NODE);
 		if (cpu >= 0) {
 			*is_idle = true;
@@ -813,10 +1031,10 @@ out_put_cpumask:
 }
 
 /*
- * Return true if we can perform a direct dispatch on @node, false
- * otherwise.
+ * Return true if we can perform a direct dispatch on a CPU that uses the
+ * shared DSQ @dsq_id, false otherwise.
  */
-static bool can_direct_dispatch(int node)
+static bool can_direct_dispatch(u64 dsq_id)
 {
 	/*
 	 * Never allow direct dispatch if preemption is disabled.
@@ -826,9 +1044,9 @@ static bool can_direct_dispatch(int node)
 
 	/*
 	 * Allow direct dispatch when @local_pcpu is enabled, or when there
-	 * are no tasks queued in the node DSQ.
+	 * are no tasks queued in the shared DSQ.
 	 */
-	return local_pcpu || !scx_bpf_dsq_nr_queued(node);
+	return local_pcpu || !scx_bpf_dsq_nr_queued(dsq_id);
 }
 
 /*
@@ -840,6 +1058,7 @@ static bool can_direct_dispatch(int node)
 s32 BPF_STRUCT_OPS(bpfland_select_cpu, struct task_struct *p,
 			s32 prev_cpu, u64 wake_flags)
 {
+	u64 start = bpf_ktime_get_ns();
 	bool is_idle = false;
 	s32 cpu;
 
@@ -847,15 +1066,22 @@ s32 BPF_STRUCT_OPS(bpfland_select_cpu, struct task_struct *p,
 		return prev_cpu;
 
 	cpu = pick_idle_cpu(p, prev_cpu, wake_flags, &is_idle);
-	if (is_idle) {
-		int node = __COMPAT_scx_bpf_cpu_node(cpu);
-
-		if (can_direct_dispatch(node)) {
-			scx_bpf_dsq_insert(p, SCX_DSQ_LOCAL, slice_max, 0);
-			__sync_fetch_and_add(&nr_direct_dispatches, 1);
-		}
+	if (is_idle && is_cpu_throttled(cpu)) {
+		/*
+		 * The idle CPU is forced to stay idle: kick it to restore
+		 * its idle state and keep the task on its previous CPU,
+		 * ops.enqueue() will look for another idle CPU.
+		 */
+		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+		cpu = prev_cpu;
+	} else if (is_idle && can_direct_dispatch(cpu_dsq(cpu))) {
+		scx_bpf_dsq_insert(p, SCX_DSQ_LOCAL, slice_max, 0);
+		__sync_fetch_and_add(&nr_direct_dispatches, 1);
 	}
 
+	select_stat_add(SELECT_STAT_CALLS, 1);
+	select_stat_add(SELECT_STAT_NS, bpf_ktime_get_ns() - start);
+
 	return cpu;
 }
 
@@ -884,7 +1110,7 @@ static bool kick_idle_cpu(const struct task_struct *p, const struct task_ctx *tc
 	/*
 	 * Try to reuse the same CPU if idle.
 	 */
-	if (!idle_smt || is_fully_idle(prev_cpu)) {
+	if (!is_cpu_throttled(prev_cpu) && (!idle_smt || is_fully_idle(prev_cpu))) {
 		if (scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
 			scx_bpf_kick_cpu(prev_cpu, SCX_KICK_IDLE);
 			return true;
@@ -895,20 +1121,30 @@ static bool kick_idle_cpu(const struct task_struct *p, const struct task_ctx *tc
 	 * Look for any idle CPU usable by the task that can immediately
 	 * execute the task, prioritizing SMT isolation and cache locality.
 	 */
-	mask = cast_mask(tctx->l2_cpumask);
+	mask = task_l2_mask(tctx, prev_cpu);
 	if (mask) {
 		cpu = pick_idle_cpu_node(mask, node, flags | __COMPAT_SCX_PICK_IDLE_IN_NODE);
 		if (cpu >= 0) {
+			/*
+			 * Kick the CPU even if it's throttled, so that it
+			 * can restore its idle state, but keep looking.
+			 */
 			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
-			return true;
+			if (!is_cpu_throttled(cpu))
+				return true;
 		}
 	}
-	mask = cast_mask(tctx->l3_cpumask);
+	mask = task_l3_mask(tctx, prev_cpu);
 	if (mask) {
 		cpu = pick_idle_cpu_node(mask, node, flags | __COMPAT_SCX_PICK_IDLE_IN_NODE);
 		if (cpu >= 0) {
+			/*
+			 * Kick the CPU even if it's throttled, so that it
+			 * can restore its idle state, but keep looking.
+			 */
 			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
-			return true;
+			if (!is_cpu_throttled(cpu))
+				return true;
 		}
 	}
 
@@ -944,22 +1180,20 @@ static bool try_direct_dispatch(struct task_struct *p, struct task_ctx *tctx,
 	}
 
 	/*
-	 * Skip direct dispatch if the CPUs are forced to stay idle.
+	 * Skip direct dispatch if the CPU is forced to stay idle.
 	 */
-	if (is_throttled())
+	if (is_cpu_throttled(prev_cpu))
 		return false;
 
 	/*
 	 * If ops.select_cpu() has been skipped, try direct dispatch.
 	 */
 	if (!__COMPAT_is_enq_cpu_selected(enq_flags)) {
-		int node = __COMPAT_scx_bpf_cpu_node(prev_cpu);
-
 		/*
 		 * Stop here if direct dispatch is not allowed in the
-		 * target node.
+		 * target DSQ.
 		 */
-		if (!can_direct_dispatch(node))
+		if (!can_direct_dispatch(cpu_dsq(prev_cpu)))
 			return false;
 
 		/*
@@ -1018,7 +1252,7 @@ static bool try_direct_dispatch(struct task_struct *p, struct task_ctx *tctx,
 			s32 cpu;
 
 			cpu = pick_idle_cpu(p, prev_cpu, 0, &is_idle);
-			if (is_idle) {
+			if (is_idle && !is_cpu_throttled(cpu)) {
 				scx_bpf_dsq_insert(p, SCX_DSQ_LOCAL_ON | cpu, slice_max, 0);
 				__sync_fetch_and_add(&nr_direct_dispatches, 1);
 
@@ -1043,8 +1277,10 @@ void BPF_STRUCT_OPS(bpfland_enqueue, struct task_struct *p, u64 enq_flags)
 	const struct cpumask *idle_cpumask;
 	struct task_ctx *tctx;
 	u64 slice, deadline;
-	s32 prev_cpu = scx_bpf_task_cpu(p);
+	s32 prev_cpu = scx_bpf_task_cpu(p), cpu;
 	int node = __COMPAT_scx_bpf_cpu_node(prev_cpu);
+	u64 dsq_id = cpu_dsq(prev_cpu);
+	bool kicked;
 
 	/*
 	 * Dispatch regular tasks to the shared DSQ.
@@ -1053,7 +1289,7 @@ void BPF_STRUCT_OPS(bpfland_enqueue, struct task_struct *p, u64 enq_flags)
 	if (!tctx)
 		return;
 	deadline = task_deadline(p, tctx);
-	slice = CLAMP(slice_max / nr_tasks_waiting(node), slice_min, slice_max);
+	slice = CLAMP(slice_max / nr_tasks_waiting(dsq_id), slice_min, slice_max);
 
 	/*
 	 * Try to dispatch the task directly, if possible.
@@ -1061,7 +1297,7 @@ void BPF_STRUCT_OPS(bpfland_enqueue, struct task_struct *p, u64 enq_flags)
 	if (try_direct_dispatch(p, tctx, prev_cpu, slice, enq_flags))
 		return;
 
-	scx_bpf_dsq_insert_vtime(p, node, slice, deadline, enq_flags);
+	scx_bpf_dsq_insert_vtime(p, dsq_id, slice, deadline, enq_flags);
 	__sync_fetch_and_add(&nr_shared_dispatches, 1);
 
 	/*
@@ -1072,7 +1308,7 @@ void BPF_STRUCT_OPS(bpfland_enqueue, struct task_struct *p, u64 enq_flags)
 	 * near the one the task was most recently running on, preventing
 	 * expensive cross-LLC or cross-node migrations.
 	 */
-	if (tctx->recent_used_cpu != prev_cpu)
+	if (!tctx->use_plan && tctx->recent_used_cpu != prev_cpu)
 		task_update_domain(p, tctx, prev_cpu, p->cpus_ptr);
 
 	/*
@@ -1082,9 +1318,21 @@ void BPF_STRUCT_OPS(bpfland_enqueue, struct task_struct *p, u64 enq_flags)
 	 * first, if present).
 	 */
 	idle_cpumask = get_idle_cpumask_node(node);
-	if (!bpf_cpumask_empty(idle_cpumask))
-		if (!kick_idle_cpu(p, tctx, prev_cpu, true))
-			kick_idle_cpu(p, tctx, prev_cpu, false);
+	if (!bpf_cpumask_empty(idle_cpumask)) {
+		kicked = kick_idle_cpu(p, tctx, prev_cpu, true) ||
+			 kick_idle_cpu(p, tctx, prev_cpu, false);
+
+		/*
+		 * With per-LLC DSQs the CPUs outside of the task's LLC can
+		 * only get the task by stealing it, so wake up any idle CPU
+		 * in the node to keep the scheduler work-conserving.
+		 */
+		if (!kicked && per_llc_dsq && !is_throttled()) {
+			cpu = pick_idle_cpu_node(p->cpus_ptr, node, __COMPAT_SCX_PICK_IDLE_IN_NODE);
+			if (cpu >= 0)
+				scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+		}
+	}
 	scx_bpf_put_cpumask(idle_cpumask);
 }
 
@@ -1145,22 +1393,107 @@ static bool keep_running(const struct task_struct *p, s32 cpu)
 	return ret;
 }
 
+/*
+ * Return the vruntime of the first task queued in @dsq_id in @vtime.
+ *
+ * Return false if @dsq_id is empty, true otherwise.
+ */
+static bool dsq_head_vtime(u64 dsq_id, u64 *vtime)
+{
+	struct task_struct *p;
+	bool found = false;
+
+	bpf_for_each(scx_dsq, p, dsq_id, 0) {
+		*vtime = p->scx.dsq_vtime;
+		found = true;
+		break;
+	}
+
+	return found;
+}
+
+/*
+ * Return the DSQ of the most loaded LLC in @node, excluding @dsq_id, and
+ * its amount of queued tasks in @nr_queued.
+ *
+ * Return @dsq_id if all the other LLCs are empty.
+ */
+static u64 busiest_llc_dsq(u64 dsq_id, int node, u64 *nr_queued)
+{
+	u64 busiest = dsq_id, nr;
+	u32 i;
+
+	*nr_queued = 0;
+	bpf_for(i, 0, nr_llcs) {
+		if (i >= MAX_LLCS)
+			break;
+		if (llc_dsqs[i] == dsq_id || llc_nodes[i] != node)
+			continue;
+
+		nr = scx_bpf_dsq_nr_queued(llc_dsqs[i]);
+		if (nr > *nr_queued) {
+			*nr_queued = nr;
+			busiest = llc_dsqs[i];
+		}
+	}
+
+	return busiest;
+}
+
+/*
+ * Consume a task from the LLC DSQ of @cpu, stealing from a sibling LLC in
+ * the same @node if the local one is empty, or if the sibling is more
+ * loaded and its head is lagging behind the local head by more than
+ * @llc_steal_lag.
+ *
+ * The queue lengths are checked first without locking, so the heads of the
+ * DSQs are inspected only when there is an imbalance.
+ *
+ * Return true if a task was consumed, false otherwise.
+ */
+static bool consume_llc_dsq(s32 cpu, int node)
+{
+	u64 dsq_id = cpu_dsq(cpu), victim;
+	u64 nr_local, nr_victim, local_vtime, victim_vtime;
+
+	nr_local = scx_bpf_dsq_nr_queued(dsq_id);
+	victim = busiest_llc_dsq(dsq_id, node, &nr_victim);
+
+	if (victim != dsq_id &&
+	    (!nr_local ||
+	     (nr_victim > nr_local &&
+	      dsq_head_vtime(dsq_id, &local_vtime) &&
+	      dsq_head_vtime(victim, &victim_vtime) &&
+	      time_before(victim_vtime + llc_steal_lag, local_vtime)))) {
+		if (scx_bpf_dsq_move_to_local(victim)) {
+			__sync_fetch_and_add(&nr_llc_steals, 1);
+			return true;
+		}
+	}
+
+	return scx_bpf_dsq_move_to_local(dsq_id);
+}
+
 void BPF_STRUCT_OPS(bpfland_dispatch, s32 cpu, struct task_struct *prev)
 {
 	int node = __COMPAT_scx_bpf_cpu_node(cpu);
 
 	/*
-	 * Let the CPU go idle if the system is throttled.
+	 * Let the CPU go idle if it's throttled.
 	 */
-	if (is_throttled())
+	if (is_cpu_throttled(cpu))
 		return;
 
 	/*
 	 * Consume regular tasks from the shared DSQ, transferring them to the
 	 * local CPU DSQ.
 	 */
-	if (scx_bpf_dsq_move_to_local(node))
+	if (per_llc_dsq) {
+		if (consume_llc_dsq(cpu, node))
+			return;
+	} else if (scx_bpf_dsq_move_to_local(node)) {
 		return;
+	}
 
 	/*
 	 * If the current task expired its time slice and no other task wants
@@ -1318,7 +1651,7 @@ void BPF_STRUCT_OPS(bpfland_set_cpumask, struct task_struct *p,
 	if (!tctx)
 		return;
 
-	task_update_domain(p, tctx, cpu, cpumask);
+	task_update_affinity(p, tctx, cpu, cpumask);
 }
 
 void BPF_STRUCT_OPS(bpfland_enable, struct task_struct *p)
@@ -1360,7 +1693,7 @@ s32 BPF_STRUCT_OPS(bpfland_init_task, struct task_struct *p,
 	if (err)
 		return err;
 
-	task_update_domain(p, tctx, cpu, p->cpus_ptr);
+	task_update_affinity(p, tctx, cpu, p->cpus_ptr);
 
 	return 0;
 }
@@ -1471,6 +1804,121 @@ int enable_primary_cpu(struct cpu_arg *input)
 	return err;
 }
 
+/*
+ * Assign the shared DSQ to each CPU, creating the per-LLC DSQs if
+ * @per_llc_dsq is enabled.
+ *
+ * The LLCs are determined by the L3 cache domains, so this needs to run
+ * after user-space has initialized them.
+ */
+static int init_cpu_dsqs(void)
+{
+	const struct cpumask *l3_mask;
+	struct cpu_ctx *cctx;
+	s32 cpu, first;
+	u32 idx;
+	int node, err;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		cctx = try_lookup_cpu_ctx(cpu);
+		if (!cctx)
+			continue;
+
+		node = __COMPAT_scx_bpf_cpu_node(cpu);
+		cctx->dsq_id = node;
+		if (!per_llc_dsq)
+			continue;
+
+		/*
+		 * Identify the LLC by its first CPU (CPUs without an L3
+		 * cache domain get their own DSQ).
+		 */
+		bpf_rcu_read_lock();
+		l3_mask = cast_mask(cctx->l3_cpumask);
+		first = l3_mask ? bpf_cpumask_first(l3_mask) : cpu;
+		bpf_rcu_read_unlock();
+		if (first >= nr_cpu_ids)
+			first = cpu;
+
+		cctx->dsq_id = LLC_DSQ_BASE + first;
+		if (first != cpu)
+			continue;
+
+		idx = nr_llcs;
+		if (idx >= MAX_LLCS) {
+			scx_bpf_error("too many LLCs");
+			return -E2BIG;
+		}
+
+		err = scx_bpf_create_dsq(cctx->dsq_id, node);
+		if (err) {
+			scx_bpf_error("failed to create LLC DSQ %llu: %d", cctx->dsq_id, err);
+			return err;
+		}
+		llc_dsqs[idx] = cctx->dsq_id;
+		llc_nodes[idx] = node;
+		nr_llcs = idx + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Build the idle CPU search plan of each CPU.
+ *
+ * The primary domain and the cache domains are initialized by user-space
+ * before the scheduler is attached and never change while it's running, so
+ * their intersections can be computed once here, instead of for each task
+ * migration.
+ */
+static int init_idle_plans(void)
+{
+	struct bpf_cpumask *l2_plan, *l3_plan;
+	const struct cpumask *primary, *l2_mask, *l3_mask;
+	struct cpu_ctx *cctx;
+	u32 plan;
+	s32 cpu;
+	int err;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		cctx = try_lookup_cpu_ctx(cpu);
+		if (!cctx)
+			continue;
+
+		err = init_cpumask(&cctx->l2_plan_cpumask);
+		if (err)
+			return err;
+		err = init_cpumask(&cctx->l3_plan_cpumask);
+		if (err)
+			return err;
+
+		bpf_rcu_read_lock();
+		primary = cast_mask(primary_cpumask);
+		l2_plan = cctx->l2_plan_cpumask;
+		l3_plan = cctx->l3_plan_cpumask;
+		if (!primary || !l2_plan || !l3_plan) {
+			bpf_rcu_read_unlock();
+			continue;
+		}
+		l2_mask = cast_mask(cctx->l2_cpumask);
+		l3_mask = cast_mask(cctx->l3_cpumask);
+
+		plan = 0;
+		if (l3_mask && bpf_cpumask_and(l3_plan, l3_mask, primary))
+			plan |= IDLE_PLAN_L3;
+		if (l2_mask && bpf_cpumask_and(l2_plan, l2_mask, primary)) {
+			plan |= IDLE_PLAN_L2;
+			if ((plan & IDLE_PLAN_L3) &&
+			    bpf_cpumask_equal(cast_mask(l2_plan), cast_mask(l3_plan)))
+				plan |= IDLE_PLAN_L2_DUP;
+		}
+		cctx->idle_plan = plan;
+		bpf_rcu_read_unlock();
+	}
+
+	return 0;
+}
+
 /*
  * Initialize cpufreq performance level on all the online CPUs.
  */
@@ -1547,6 +1995,171 @@ static int throttle_timerfn(void *map, int *key, struct bpf_timer *timer)
 	return 0;
 }
 
+/*
+ * Return the first CPU of the core of @cpu.
+ */
+static s32 core_leader(s32 cpu)
+{
+	const struct cpumask *smt;
+	struct cpu_ctx *cctx;
+	s32 leader = cpu;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return cpu;
+
+	bpf_rcu_read_lock();
+	smt = cast_mask(cctx->smt_cpumask);
+	if (smt)
+		leader = bpf_cpumask_first(smt);
+	bpf_rcu_read_unlock();
+
+	return leader < nr_cpu_ids ? leader : cpu;
+}
+
+/*
+ * Set the throttled state of all the CPUs in the core of @leader and kick
+ * them with @flags.
+ */
+static void throttle_core(s32 leader, bool state, u64 flags)
+{
+	struct cpu_ctx *lctx, *cctx;
+	u32 i;
+	s32 cpu;
+
+	lctx = try_lookup_cpu_ctx(leader);
+	if (!lctx)
+		return;
+
+	bpf_for(i, 0, lctx->nr_core_cpus) {
+		if (i >= MAX_CORE_CPUS)
+			break;
+		cpu = lctx->core_cpus[i];
+
+		cctx = try_lookup_cpu_ctx(cpu);
+		if (cctx)
+			WRITE_ONCE(cctx->throttled, state);
+		scx_bpf_kick_cpu(cpu, flags);
+	}
+}
+
+/*
+ * Per-core throttle timer, used to inject idle time in a single core.
+ */
+static int throttle_core_timerfn(void *map, int *key, struct bpf_timer *timer)
+{
+	s32 leader = *key;
+	struct cpu_ctx *cctx;
+	bool throttled;
+	u64 flags, duration;
+	int err;
+
+	cctx = try_lookup_cpu_ctx(leader);
+	if (!cctx)
+		return 0;
+	throttled = READ_ONCE(cctx->throttled);
+
+	/*
+	 * Same duty cycle as the global throttle timer, limited to the
+	 * CPUs of the core.
+	 */
+	if (throttled) {
+		flags = SCX_KICK_IDLE;
+		duration = slice_max;
+	} else {
+		flags = SCX_KICK_PREEMPT;
+		duration = throttle_ns;
+	}
+	throttle_core(leader, !throttled, flags);
+
+	err = bpf_timer_start(timer, duration, 0);
+	if (err)
+		scx_bpf_error("Failed to re-arm core %d duty cycle timer", leader);
+
+	return 0;
+}
+
+/*
+ * Store the list of CPUs of each core in the first CPU of the core, so
+ * that the per-core throttle timers don't need to scan all the CPUs.
+ */
+static int init_throttle_cores(void)
+{
+	struct cpu_ctx *cctx;
+	s32 cpu, leader;
+	u32 nr;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		leader = core_leader(cpu);
+		cctx = try_lookup_cpu_ctx(leader);
+		if (!cctx)
+			return -ENOENT;
+
+		nr = cctx->nr_core_cpus;
+		if (nr >= MAX_CORE_CPUS) {
+			scx_bpf_error("Too many CPUs in core %d", leader);
+			return -E2BIG;
+		}
+		if (!nr)
+			cctx->core_idx = nr_throttle_cores++;
+		cctx->core_cpus[nr] = cpu;
+		cctx->nr_core_cpus = nr + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the throttle timer of the core of the current CPU.
+ *
+ * A timer keeps firing on the CPU it was started on, so user-space runs
+ * this from each CPU, to spread the timers across the cores, instead of
+ * arming all of them on the CPU that initializes the scheduler. The first
+ * idle injection phase of each core is offset by its core index, to
+ * spread the phases of the cores evenly across the duty cycle period.
+ */
+SEC("syscall")
+int start_core_timer(struct cpu_arg *input)
+{
+	u64 period = slice_max + throttle_ns;
+	s32 cpu = bpf_get_smp_processor_id();
+	struct bpf_timer *timer;
+	struct cpu_ctx *cctx;
+	u32 key = cpu;
+	int err;
+
+	if (cpu != input->cpu_id)
+		return -EINVAL;
+	if (!throttle_ns || !throttle_stagger)
+		return 0;
+
+	/*
+	 * Only the first CPU of each core owns a timer.
+	 */
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return -ENOENT;
+	if (!cctx->nr_core_cpus)
+		return 0;
+
+	timer = bpf_map_lookup_elem(&throttle_core_timer, &key);
+	if (!timer) {
+		scx_bpf_error("Failed to lookup core %d throttle timer", cpu);
+		return -ESRCH;
+	}
+
+	bpf_timer_init(timer, &throttle_core_timer, CLOCK_BOOTTIME);
+	bpf_timer_set_callback(timer, throttle_core_timerfn);
+	err = bpf_timer_start(timer,
+			      slice_max + period * cctx->core_idx / nr_throttle_cores, 0);
+	if (err) {
+		scx_bpf_error("Failed to arm core %d throttle timer", cpu);
+		return err;
+	}
+
+	return 0;
+}
+
 /*
  * Refresh NUMA statistics.
  */
@@ -1658,11 +2271,21 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(bpfland_init)
 		}
 	}
 
+	/* Assign the shared DSQs to the CPUs */
+	err = init_cpu_dsqs();
+	if (err)
+		return err;
+
 	/* Initialize the primary scheduling domain */
 	err = init_cpumask(&primary_cpumask);
 	if (err)
 		return err;
 
+	/* Build the idle CPU search plans */
+	err = init_idle_plans();
+	if (err)
+		return err;
+
 	timer = bpf_map_lookup_elem(&throttle_timer, &key);
 	if (!timer) {
 		scx_bpf_error("Failed to lookup throttle timer");
@@ -1672,7 +2295,15 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(bpfland_init)
 	/*
 	 * Fire the throttle timer if CPU throttling is enabled.
 	 */
-	if (throttle_ns) {
+	if (throttle_ns && throttle_stagger) {
+		/*
+		 * The per-core timers are started by user-space, once the
+		 * scheduler is attached.
+		 */
+		err = init_throttle_cores();
+		if (err)
+			return err;
+	} else if (throttle_ns) {
 		bpf_timer_init(timer, &throttle_timer, CLOCK_BOOTTIME);
 		bpf_timer_set_callback(timer, throttle_timerfn);
 		err = bpf_timer_start(timer, slice_max, 0);
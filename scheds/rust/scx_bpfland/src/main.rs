@@ -20,10 +20,13 @@ use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::time::Duration;
 
+use affinity::set_thread_affinity;
+use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
 use clap::Parser;
 use crossbeam::channel::RecvTimeoutError;
+use libbpf_rs::MapCore as _;
 use libbpf_rs::OpenObject;
 use libbpf_rs::ProgramInput;
 use log::warn;
@@ -142,6 +145,15 @@ struct Opts {
     #[clap(short = 't', long, default_value = "0")]
     throttle_us: u64,
 
+    /// Stagger the idle injection of the CPU throttling (see --throttle-us) across the cores.
+    ///
+    /// Instead of throttling all the CPUs at the same time, each core runs its own idle injection
+    /// phase, with the phases evenly spread over time. The total amount of injected idle time is
+    /// the same, but the aggregate power draw is smoother and the IPIs are spread out, which can
+    /// help to prevent frequency dips on thermally constrained systems.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    throttle_stagger: bool,
+
     /// Set CPU idle QoS resume latency in microseconds (-1 = disabled).
     ///
     /// Setting a lower latency value makes CPUs less likely to enter deeper idle states, enhancing
@@ -211,6 +223,20 @@ struct Opts {
     #[clap(long, action = clap::ArgAction::SetTrue)]
     disable_smt: bool,
 
+    /// Use a separate shared queue for each LLC, instead of one per NUMA node.
+    ///
+    /// This can reduce the contention on the shared queues on systems with many CPUs per node.
+    /// CPUs prefer tasks queued in their own LLC and steal from the other LLCs of the same node
+    /// only when their LLC is empty, or when the other LLC is more loaded and lagging behind by
+    /// more than --llc-steal-lag-us. Ignored if L3 cache awareness is disabled.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    per_llc_dsq: bool,
+
+    /// Maximum vruntime lag in microseconds between the head of a sibling LLC queue and the head
+    /// of the local LLC queue before stealing from the sibling (only with --per-llc-dsq).
+    #[clap(long, default_value = "20000")]
+    llc_steal_lag_us: u64,
+
     /// Disable NUMA rebalancing.
     #[clap(long, action = clap::ArgAction::SetTrue)]
     disable_numa: bool,
@@ -330,6 +356,22 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.slice_min = opts.slice_us_min * 1000;
         skel.maps.rodata_data.slice_lag = opts.slice_us_lag * 1000;
         skel.maps.rodata_data.throttle_ns = opts.throttle_us * 1000;
+        if opts.throttle_stagger && *NR_CPU_IDS > consts_MAX_CPUS as usize {
+            warn!(
+                "staggered throttling supports up to {} CPUs, disabling it",
+                consts_MAX_CPUS
+            );
+        } else {
+            skel.maps.rodata_data.throttle_stagger = opts.throttle_stagger;
+        }
+
+        // Per-LLC DSQs rely on the L3 cache domains.
+        let per_llc_dsq = opts.per_llc_dsq && !opts.disable_l3;
+        if opts.per_llc_dsq && !per_llc_dsq {
+            warn!("per-LLC DSQs require L3 cache awareness, using per-node DSQs");
+        }
+        skel.maps.rodata_data.per_llc_dsq = per_llc_dsq;
+        skel.maps.rodata_data.llc_steal_lag = opts.llc_steal_lag_us * 1000;
 
         // Implicitly enable direct dispatch of per-CPU kthreads if CPU throttling is enabled
         // (it's never a good idea to throttle per-CPU kthreads).
@@ -384,6 +426,12 @@ impl<'a> Scheduler<'a> {
 
         // Attach the scheduler.
         let struct_ops = Some(scx_ops_attach!(skel, bpfland_ops)?);
+
+        // Start the per-core throttle timers.
+        if opts.throttle_us > 0 && opts.throttle_stagger {
+            Self::init_throttle_core_timers(&mut skel, &topo)?;
+        }
+
         let stats_server = StatsServer::new(stats::server_data()).launch()?;
 
         Ok(Self {
@@ -419,6 +467,52 @@ impl<'a> Scheduler<'a> {
         Ok(())
     }
 
+    fn start_core_timer(skel: &mut BpfSkel<'_>, cpu: i32) -> Result<(), u32> {
+        let prog = &mut skel.progs.start_core_timer;
+        let mut args = cpu_arg {
+            cpu_id: cpu as c_int,
+        };
+        let input = ProgramInput {
+            context_in: Some(unsafe {
+                std::slice::from_raw_parts_mut(
+                    &mut args as *mut _ as *mut u8,
+                    std::mem::size_of_val(&args),
+                )
+            }),
+            ..Default::default()
+        };
+        let out = prog.test_run(input).unwrap();
+        if out.return_value != 0 {
+            return Err(out.return_value);
+        }
+
+        Ok(())
+    }
+
+    // Start the throttle timer of each core from a CPU of the core itself (a timer keeps firing
+    // on the CPU it was started on), so that the timers are spread across the cores.
+    fn init_throttle_core_timers(skel: &mut BpfSkel<'_>, topo: &Topology) -> Result<()> {
+        for &cpu in topo.all_cpus.keys() {
+            if let Err(e) = set_thread_affinity(&[cpu]) {
+                bail!("cannot set CPU {} affinity: {}", cpu, e);
+            }
+            if let Err(err) = Self::start_core_timer(skel, cpu as i32) {
+                bail!(
+                    "failed to start throttle timer on CPU {}: error {}",
+                    cpu,
+                    err
+                );
+            }
+        }
+
+        // Reset task affinity.
+        if let Err(e) = set_thread_affinity((0..*NR_CPU_IDS).collect::<Vec<usize>>()) {
+            bail!("cannot reset CPU affinity: {}", e);
+        }
+
+        Ok(())
+    }
+
     fn epp_to_cpumask(profile: Powermode) -> Result<Cpumask> {
         let mut cpus = get_primary_cpus(profile).unwrap_or_default();
         if cpus.is_empty() {
@@ -648,13 +742,39 @@ impl<'a> Scheduler<'a> {
         })
     }
 
+    fn read_select_stats(&self) -> Vec<u64> {
+        let stats_map = &self.skel.maps.select_stats;
+
+        (0..select_stat_idx_NR_SELECT_STATS)
+            .map(|stat| {
+                stats_map
+                    .lookup_percpu(&stat.to_ne_bytes(), libbpf_rs::MapFlags::ANY)
+                    .ok()
+                    .flatten()
+                    .map(|vals| {
+                        vals.iter()
+                            .map(|val| {
+                                u64::from_ne_bytes(val.as_slice().try_into().unwrap_or([0; 8]))
+                            })
+                            .sum()
+                    })
+                    .unwrap_or(0)
+            })
+            .collect()
+    }
+
     fn get_metrics(&self) -> Metrics {
+        let select_stats = self.read_select_stats();
+
         Metrics {
             nr_running: self.skel.maps.bss_data.nr_running,
             nr_cpus: self.skel.maps.bss_data.nr_online_cpus,
             nr_kthread_dispatches: self.skel.maps.bss_data.nr_kthread_dispatches,
             nr_direct_dispatches: self.skel.maps.bss_data.nr_direct_dispatches,
             nr_shared_dispatches: self.skel.maps.bss_data.nr_shared_dispatches,
+            nr_llc_steals: self.skel.maps.bss_data.nr_llc_steals,
+            nr_select_cpu: select_stats[select_stat_idx_SELECT_STAT_CALLS as usize],
+            select_cpu_ns: select_stats[select_stat_idx_SELECT_STAT_NS as usize],
         }
     }
 
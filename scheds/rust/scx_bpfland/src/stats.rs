@@ -25,19 +25,27 @@ pub struct Metrics {
     pub nr_direct_dispatches: u64,
     #[stat(desc = "Number of regular task dispatches")]
     pub nr_shared_dispatches: u64,
+    #[stat(desc = "Number of tasks stolen from a sibling LLC")]
+    pub nr_llc_steals: u64,
+    #[stat(desc = "Number of ops.select_cpu() calls")]
+    pub nr_select_cpu: u64,
+    #[stat(desc = "Time spent in ops.select_cpu() (ns)")]
+    pub select_cpu_ns: u64,
 }
 
 impl Metrics {
     fn format<W: Write>(&self, w: &mut W) -> Result<()> {
         writeln!(
             w,
-            "[{}] tasks -> r: {:>2}/{:<2} | dispatch -> k: {:<5} d: {:<5} s: {:<5}",
+            "[{}] tasks -> r: {:>2}/{:<2} | dispatch -> k: {:<5} d: {:<5} s: {:<5} l: {:<5} | select -> {:>5}ns",
             crate::SCHEDULER_NAME,
             self.nr_running,
             self.nr_cpus,
             self.nr_kthread_dispatches,
             self.nr_direct_dispatches,
-            self.nr_shared_dispatches
+            self.nr_shared_dispatches,
+            self.nr_llc_steals,
+            self.select_cpu_ns.checked_div(self.nr_select_cpu).unwrap_or(0)
         )?;
         Ok(())
     }
@@ -47,6 +55,9 @@ impl Metrics {
             nr_kthread_dispatches: self.nr_kthread_dispatches - rhs.nr_kthread_dispatches,
             nr_direct_dispatches: self.nr_direct_dispatches - rhs.nr_direct_dispatches,
             nr_shared_dispatches: self.nr_shared_dispatches - rhs.nr_shared_dispatches,
+            nr_llc_steals: self.nr_llc_steals - rhs.nr_llc_steals,
+            nr_select_cpu: self.nr_select_cpu - rhs.nr_select_cpu,
+            select_cpu_ns: self.select_cpu_ns - rhs.select_cpu_ns,
             ..self.clone()
         }
     }
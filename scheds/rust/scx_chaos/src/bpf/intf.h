@@ -6,6 +6,7 @@
 #define __CHAOS_INTF_H
 
 #ifndef __KERNEL__
+typedef unsigned int u32;
 typedef unsigned long long u64;
 #endif
 
@@ -14,6 +15,8 @@ enum chaos_consts {
 	CHAOS_DSQ_BASE		= 1 << CHAOS_DSQ_BASE_SHIFT,
 
 	CHAOS_NUM_PPIDS_CHECK	= 1 << 20,
+
+	CHAOS_EVENT_LOG_SIZE	= 1 << 22,
 };
 
 enum chaos_match {
@@ -30,6 +33,7 @@ enum chaos_trait_kind {
 	CHAOS_TRAIT_RANDOM_DELAYS,
 	CHAOS_TRAIT_CPU_FREQ,
 	CHAOS_TRAIT_DEGRADATION,
+	CHAOS_TRAIT_CRITICAL_DELAYS,
 	CHAOS_TRAIT_MAX,
 };
 
@@ -41,15 +45,39 @@ struct chaos_task_ctx {
 	enum chaos_trait_kind	pending_trait;
 	u64			enq_flags;
 	u64			p2dq_vtime;
+
+	// number of random draws the task made, see chaos_rand64()
+	u64			rand_ctr;
+
+	// when the task last acquired a futex, 0 once released
+	u64			futex_acquired_at;
+};
+
+/*
+ * One injected perturbation as exported through the chaos_events ring
+ * buffer. arg depends on the kind: the delay for RANDOM_DELAYS and
+ * CRITICAL_DELAYS, the degraded slice for DEGRADATION and the cpuperf target
+ * for CPU_FREQ.
+ */
+struct chaos_event {
+	u64			ts;
+	u64			arg;
+	u64			rand_ctr;
+	u32			pid;
+	u32			tgid;
+	u32			cpu;
+	enum chaos_trait_kind	kind;
 };
 
 enum chaos_stat_idx {
 	CHAOS_STAT_TRAIT_RANDOM_DELAYS,
 	CHAOS_STAT_TRAIT_CPU_FREQ,
 	CHAOS_STAT_TRAIT_DEGRADATION,
+	CHAOS_STAT_TRAIT_CRITICAL_DELAYS,
 	CHAOS_STAT_CHAOS_EXCLUDED,
 	CHAOS_STAT_CHAOS_SKIPPED,
 	CHAOS_STAT_TIMER_KICKS,
+	CHAOS_STAT_EVENTS_DROPPED,
 	CHAOS_NR_STATS,
 };
 
@@ -52,6 +52,17 @@ const volatile u64 degradation_frac7 = 0;
 
 const volatile u32 kprobe_delays_freq_frac32 = 1;
 
+const volatile u32 critical_delays_freq_frac32 = 1;
+const volatile u64 critical_delays_min_ns = 1; /* for veristat */
+const volatile u64 critical_delays_max_ns = 2; /* for veristat */
+const volatile bool critical_delays_wake_chain = false;
+const volatile bool critical_delays_futex = false;
+/* a futex not released within this long is assumed to be released, see below */
+const volatile u64 critical_futex_hold_ns = 1000000;
+
+const volatile u64 chaos_seed = 0;
+const volatile bool event_log_enabled = false;
+
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
@@ -81,6 +92,11 @@ struct {
 	__type(value, u64);
 } chaos_stats SEC(".maps");
 
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, CHAOS_EVENT_LOG_SIZE);
+} chaos_events SEC(".maps");
+
 struct chaos_task_ctx *lookup_create_chaos_task_ctx(struct task_struct *p)
 {
 	return bpf_task_storage_get(&chaos_task_ctxs, p, NULL, BPF_LOCAL_STORAGE_GET_F_CREATE);
@@ -93,14 +109,67 @@ static __always_inline void chaos_stat_inc(enum chaos_stat_idx stat)
 		(*cnt_p)++;
 }
 
-static __always_inline enum chaos_trait_kind choose_chaos(struct chaos_task_ctx *taskc)
+/*
+ * Counter based PRNG. Each draw is a pure function of chaos_seed, the task's
+ * tgid and tid and the number of draws the task made so far, so the same
+ * workload run with the same seed (and the same pids, e.g. in a fresh pid
+ * namespace) sees the same chaos decisions. The mixing is splitmix64's.
+ */
+static __always_inline u64 chaos_rand64(struct task_struct *p,
+					struct chaos_task_ctx *taskc)
+{
+	u64 x;
+
+	x = chaos_seed ^ ((u64)p->tgid * 0xd1b54a32d192ed03ULL);
+	x ^= (u64)(p->pid - p->tgid) << 40;
+	x += ++taskc->rand_ctr * 0x9e3779b97f4a7c15ULL;
+
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static __always_inline u32 chaos_rand32(struct task_struct *p,
+					struct chaos_task_ctx *taskc)
+{
+	return chaos_rand64(p, taskc) >> 32;
+}
+
+static __always_inline void chaos_log_event(struct task_struct *p,
+					    struct chaos_task_ctx *taskc,
+					    enum chaos_trait_kind kind, u64 arg)
+{
+	struct chaos_event *ev;
+
+	if (!event_log_enabled)
+		return;
+
+	if (!(ev = bpf_ringbuf_reserve(&chaos_events, sizeof(*ev), 0))) {
+		chaos_stat_inc(CHAOS_STAT_EVENTS_DROPPED);
+		return;
+	}
+
+	ev->ts = bpf_ktime_get_ns();
+	ev->arg = arg;
+	ev->rand_ctr = taskc->rand_ctr;
+	ev->pid = p->pid;
+	ev->tgid = p->tgid;
+	ev->cpu = bpf_get_smp_processor_id();
+	ev->kind = kind;
+
+	// userspace polls, don't kick it from the scheduling paths
+	bpf_ringbuf_submit(ev, BPF_RB_NO_WAKEUP);
+}
+
+static __always_inline enum chaos_trait_kind choose_chaos(struct task_struct *p,
+							  struct chaos_task_ctx *taskc)
 {
 	if (taskc->match & CHAOS_MATCH_EXCLUDED) {
 		chaos_stat_inc(CHAOS_STAT_CHAOS_EXCLUDED);
 		return CHAOS_TRAIT_NONE;
 	}
 
-	u32 roll = bpf_get_prandom_u32();
+	u32 roll = chaos_rand32(p, taskc);
 
 	#pragma unroll
 	for (int i = 0; i < CHAOS_TRAIT_MAX; ++i) {
@@ -114,7 +183,38 @@ static __always_inline enum chaos_trait_kind choose_chaos(struct chaos_task_ctx
 
 static __always_inline bool chaos_trait_skips_select_cpu(struct chaos_task_ctx *taskc)
 {
-	return taskc->next_trait == CHAOS_TRAIT_RANDOM_DELAYS;
+	return taskc->next_trait == CHAOS_TRAIT_RANDOM_DELAYS ||
+	       taskc->next_trait == CHAOS_TRAIT_CRITICAL_DELAYS;
+}
+
+static __always_inline bool chaos_holds_futex(struct chaos_task_ctx *taskc)
+{
+	u64 at = taskc->futex_acquired_at;
+
+	return at && bpf_ktime_get_ns() - at < critical_futex_hold_ns;
+}
+
+/*
+ * Whether the wakeup of @p being processed continues a wakeup chain, i.e. @p
+ * is being woken by another thread of the same process, as happens when a
+ * thread pool hands work over. Remote wakeups may run on an unrelated task,
+ * requiring the same tgid filters those out.
+ */
+static __always_inline bool chaos_on_wake_chain(struct task_struct *p,
+						struct chaos_task_ctx *taskc)
+{
+	struct chaos_task_ctx *wakerc;
+	struct task_struct *waker;
+
+	if (!critical_delays_wake_chain || (taskc->match & CHAOS_MATCH_EXCLUDED))
+		return false;
+
+	waker = bpf_get_current_task_btf();
+	if (waker->pid == p->pid || waker->tgid != p->tgid)
+		return false;
+
+	wakerc = bpf_task_storage_get(&chaos_task_ctxs, waker, NULL, 0);
+	return wakerc && !(wakerc->match & CHAOS_MATCH_EXCLUDED);
 }
 
 static __always_inline u64 get_cpu_delay_dsq(int cpu_idx)
@@ -250,18 +350,47 @@ out:
 	return ret;
 }
 
-__weak s32 enqueue_random_delay(struct task_struct *p __arg_trusted, u64 enq_flags,
-				struct chaos_task_ctx *taskc __arg_nonnull)
+/*
+ * Park @p in this CPU's delay DSQ for a random time in [min_ns, max_ns) and
+ * return that time.
+ */
+static __always_inline u64 enqueue_delayed(struct task_struct *p, u64 enq_flags,
+					   struct chaos_task_ctx *taskc,
+					   u64 min_ns, u64 max_ns)
 {
-	u64 rand64 = ((u64)bpf_get_prandom_u32() << 32) | bpf_get_prandom_u32();
+	u64 rand64 = chaos_rand64(p, taskc);
 
-	u64 vtime = bpf_ktime_get_ns() + random_delays_min_ns;
-	if (random_delays_min_ns != random_delays_max_ns) {
-		vtime += rand64 % (random_delays_max_ns - random_delays_min_ns);
+	u64 delay = min_ns;
+	if (min_ns != max_ns) {
+		delay += rand64 % (max_ns - min_ns);
 	}
+	u64 vtime = bpf_ktime_get_ns() + delay;
 
 	scx_bpf_dsq_insert_vtime(p, get_cpu_delay_dsq(-1), 0, vtime, enq_flags);
+	return delay;
+}
+
+__weak s32 enqueue_random_delay(struct task_struct *p __arg_trusted, u64 enq_flags,
+				struct chaos_task_ctx *taskc __arg_nonnull)
+{
+	u64 delay = enqueue_delayed(p, enq_flags, taskc, random_delays_min_ns,
+				    random_delays_max_ns);
+
 	chaos_stat_inc(CHAOS_STAT_TRAIT_RANDOM_DELAYS);
+	chaos_log_event(p, taskc, CHAOS_TRAIT_RANDOM_DELAYS, delay);
+
+	return true;
+}
+
+__weak s32 enqueue_critical_delay(struct task_struct *p __arg_trusted, u64 enq_flags,
+				  struct chaos_task_ctx *taskc __arg_nonnull)
+{
+	u64 delay = enqueue_delayed(p, enq_flags, taskc, critical_delays_min_ns,
+				    critical_delays_max_ns);
+
+	dbg("CHAOS[critical][%d] delay: %llu", p->pid, delay);
+	chaos_stat_inc(CHAOS_STAT_TRAIT_CRITICAL_DELAYS);
+	chaos_log_event(p, taskc, CHAOS_TRAIT_CRITICAL_DELAYS, delay);
 
 	return true;
 }
@@ -275,6 +404,9 @@ __weak s32 enqueue_chaotic(struct task_struct *p __arg_trusted, u64 enq_flags,
 	case CHAOS_TRAIT_RANDOM_DELAYS:
 		out = enqueue_random_delay(p, enq_flags, taskc);
 		break;
+	case CHAOS_TRAIT_CRITICAL_DELAYS:
+		out = enqueue_critical_delay(p, enq_flags, taskc);
+		break;
 
 	case CHAOS_TRAIT_NONE:
 		chaos_stat_inc(CHAOS_STAT_CHAOS_SKIPPED);
@@ -477,7 +609,8 @@ void BPF_STRUCT_OPS(chaos_enqueue, struct task_struct *p __arg_trusted, u64 enq_
 	if (promise.kind == P2DQ_ENQUEUE_PROMISE_COMPLETE)
 		return;
 
-	if (taskc->next_trait == CHAOS_TRAIT_RANDOM_DELAYS &&
+	if ((taskc->next_trait == CHAOS_TRAIT_RANDOM_DELAYS ||
+	     taskc->next_trait == CHAOS_TRAIT_CRITICAL_DELAYS) &&
 	    enqueue_chaotic(p, enq_flags, taskc))
 		return;
 
@@ -488,6 +621,8 @@ void BPF_STRUCT_OPS(chaos_enqueue, struct task_struct *p __arg_trusted, u64 enq_
 			promise.fifo.slice_ns = ((degradation_frac7 << 7) * promise.fifo.slice_ns) >> 7;
 			dbg("CHAOS[degradation][%d] slice_ns: %llu", p, promise.fifo.slice_ns);
 			chaos_stat_inc(CHAOS_STAT_TRAIT_DEGRADATION);
+			chaos_log_event(p, taskc, CHAOS_TRAIT_DEGRADATION,
+					promise.fifo.slice_ns);
 		}
 		if (promise.kind == P2DQ_ENQUEUE_PROMISE_VTIME) {
 			promise.vtime.vtime += ((degradation_frac7 << 7) * promise.vtime.slice_ns) >> 7;
@@ -495,6 +630,8 @@ void BPF_STRUCT_OPS(chaos_enqueue, struct task_struct *p __arg_trusted, u64 enq_
 			dbg("CHAOS[degradation][%d] vtime: %llu slice_ns: %llu",
 			    p, promise.vtime.vtime, promise.vtime.slice_ns);
 			chaos_stat_inc(CHAOS_STAT_TRAIT_DEGRADATION);
+			chaos_log_event(p, taskc, CHAOS_TRAIT_DEGRADATION,
+					promise.vtime.slice_ns);
 		}
 	}
 
@@ -507,13 +644,23 @@ void BPF_STRUCT_OPS(chaos_runnable, struct task_struct *p, u64 enq_flags)
 	if (!(wakee_ctx = lookup_create_chaos_task_ctx(p)))
 		return;
 
+	// a futex holder blocking with the futex held is delayed on wakeup
+	if (wakee_ctx->pending_trait == CHAOS_TRAIT_CRITICAL_DELAYS &&
+	    !chaos_holds_futex(wakee_ctx))
+		wakee_ctx->pending_trait = 0;
+
 	if (wakee_ctx->pending_trait) {
 		wakee_ctx->next_trait = wakee_ctx->pending_trait;
 		wakee_ctx->pending_trait = 0;
 		return;
 	}
 
-	wakee_ctx->next_trait = choose_chaos(wakee_ctx);
+	wakee_ctx->next_trait = choose_chaos(p, wakee_ctx);
+
+	if (wakee_ctx->next_trait == CHAOS_TRAIT_NONE &&
+	    (enq_flags & SCX_ENQ_WAKEUP) && chaos_on_wake_chain(p, wakee_ctx) &&
+	    chaos_rand32(p, wakee_ctx) <= critical_delays_freq_frac32)
+		wakee_ctx->next_trait = CHAOS_TRAIT_CRITICAL_DELAYS;
 }
 
 void BPF_STRUCT_OPS(chaos_running, struct task_struct *p)
@@ -535,6 +682,7 @@ void BPF_STRUCT_OPS(chaos_running, struct task_struct *p)
 			dbg("CHAOS[freq][%d] freq: %d", p->pid, cpu_freq_min);
 			scx_bpf_cpuperf_set(task_cpu, cpu_freq_min);
 			chaos_stat_inc(CHAOS_STAT_TRAIT_CPU_FREQ);
+			chaos_log_event(p, taskc, CHAOS_TRAIT_CPU_FREQ, cpu_freq_min);
 		}
 	} else {
 		if (cpu_freq_max > 0)
@@ -564,6 +712,15 @@ void BPF_STRUCT_OPS(chaos_tick, struct task_struct *p)
 
 	if (taskc->pending_trait == CHAOS_TRAIT_RANDOM_DELAYS)
 		p->scx.slice = 0;
+
+	// preempt a running futex holder so that enqueue can delay it
+	if (taskc->pending_trait == CHAOS_TRAIT_CRITICAL_DELAYS) {
+		if (chaos_holds_futex(taskc)) {
+			taskc->next_trait = CHAOS_TRAIT_CRITICAL_DELAYS;
+			p->scx.slice = 0;
+		}
+		taskc->pending_trait = 0;
+	}
 }
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(chaos_init_task, struct task_struct *p,
@@ -611,7 +768,7 @@ int generic(struct pt_regs *ctx)
 	if (!(taskc = lookup_create_chaos_task_ctx(p)))
 		return -EINVAL;
 
-	u32 roll = bpf_get_prandom_u32();
+	u32 roll = chaos_rand32(p, taskc);
 	if (roll <= kprobe_delays_freq_frac32) {
 		taskc->pending_trait = CHAOS_TRAIT_RANDOM_DELAYS;
 		dbg("GENERIC: setting pending_trait to RANDOM_DELAYS - task[%d]", p->pid);
@@ -619,3 +776,105 @@ int generic(struct pt_regs *ctx)
 
 	return 0;
 }
+
+/*
+ * Futex tracking for CHAOS_TRAIT_CRITICAL_DELAYS, following scx_lavd's
+ * lock.bpf.c: a successful futex wait or PI lock is taken as acquiring a
+ * lock and a futex wake or PI unlock as releasing it. Userspace locks only
+ * enter the kernel when contended, which are exactly the critical sections
+ * worth delaying. A missed release is covered by critical_futex_hold_ns.
+ */
+static __always_inline void chaos_futex_acquired(void)
+{
+	struct task_struct *p = bpf_get_current_task_btf();
+	struct chaos_task_ctx *taskc;
+
+	if (!critical_delays_futex ||
+	    !(taskc = bpf_task_storage_get(&chaos_task_ctxs, p, NULL, 0)) ||
+	    (taskc->match & CHAOS_MATCH_EXCLUDED))
+		return;
+
+	taskc->futex_acquired_at = bpf_ktime_get_ns();
+	if (!taskc->pending_trait &&
+	    chaos_rand32(p, taskc) <= critical_delays_freq_frac32)
+		taskc->pending_trait = CHAOS_TRAIT_CRITICAL_DELAYS;
+}
+
+static __always_inline void chaos_futex_released(void)
+{
+	struct task_struct *p = bpf_get_current_task_btf();
+	struct chaos_task_ctx *taskc;
+
+	if (!critical_delays_futex ||
+	    !(taskc = bpf_task_storage_get(&chaos_task_ctxs, p, NULL, 0)))
+		return;
+
+	taskc->futex_acquired_at = 0;
+	if (taskc->pending_trait == CHAOS_TRAIT_CRITICAL_DELAYS)
+		taskc->pending_trait = 0;
+}
+
+struct futex_vector;
+struct hrtimer_sleeper;
+
+SEC("?fexit/__futex_wait")
+int BPF_PROG(chaos_fexit___futex_wait, u32 *uaddr, unsigned int flags, u32 val,
+	     struct hrtimer_sleeper *to, u32 bitset, int ret)
+{
+	if (ret == 0)
+		chaos_futex_acquired();
+	return 0;
+}
+
+SEC("?fexit/futex_wait_multiple")
+int BPF_PROG(chaos_fexit_futex_wait_multiple, struct futex_vector *vs,
+	     unsigned int count, struct hrtimer_sleeper *to, int ret)
+{
+	if (ret == 0)
+		chaos_futex_acquired();
+	return 0;
+}
+
+SEC("?fexit/futex_wait_requeue_pi")
+int BPF_PROG(chaos_fexit_futex_wait_requeue_pi, u32 *uaddr, unsigned int flags,
+	     u32 val, ktime_t *abs_time, u32 bitset, u32 *uaddr2, int ret)
+{
+	if (ret == 0)
+		chaos_futex_acquired();
+	return 0;
+}
+
+SEC("?fexit/futex_lock_pi")
+int BPF_PROG(chaos_fexit_futex_lock_pi, u32 *uaddr, unsigned int flags,
+	     ktime_t *time, int trylock, int ret)
+{
+	if (ret == 0)
+		chaos_futex_acquired();
+	return 0;
+}
+
+SEC("?fexit/futex_wake")
+int BPF_PROG(chaos_fexit_futex_wake, u32 *uaddr, unsigned int flags,
+	     int nr_wake, u32 bitset, int ret)
+{
+	if (ret >= 0)
+		chaos_futex_released();
+	return 0;
+}
+
+SEC("?fexit/futex_wake_op")
+int BPF_PROG(chaos_fexit_futex_wake_op, u32 *uaddr1, unsigned int flags,
+	     u32 *uaddr2, int nr_wake, int nr_wake2, int op, int ret)
+{
+	if (ret >= 0)
+		chaos_futex_released();
+	return 0;
+}
+
+SEC("?fexit/futex_unlock_pi")
+int BPF_PROG(chaos_fexit_futex_unlock_pi, u32 *uaddr, unsigned int flags, int ret)
+{
+	if (ret == 0)
+		chaos_futex_released();
+	return 0;
+}
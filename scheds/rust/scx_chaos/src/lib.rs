@@ -13,6 +13,7 @@ use scx_p2dq::SchedulerOpts as P2dqOpts;
 use scx_userspace_arena::alloc::Allocator;
 use scx_userspace_arena::alloc::HeapAllocator;
 use scx_utils::build_id;
+use scx_utils::compat;
 use scx_utils::compat::tracefs_mount;
 use scx_utils::init_libbpf_logging;
 use scx_utils::scx_ops_attach;
@@ -43,16 +44,22 @@ use libbpf_rs::OpenObject;
 use libbpf_rs::ProgramInput;
 use log::debug;
 use log::info;
+use log::warn;
 use nix::unistd::Pid;
 use scx_stats::prelude::*;
 
 use std::alloc::Layout;
+use std::cell::RefCell;
 use std::collections::HashSet;
 use std::fs::File;
+use std::io::BufWriter;
+use std::io::Write;
 use std::io::{BufRead, BufReader};
 use std::marker::PhantomPinned;
 use std::mem::MaybeUninit;
 use std::panic;
+use std::path::Path;
+use std::path::PathBuf;
 use std::pin::Pin;
 use std::process::Command;
 use std::ptr::NonNull;
@@ -64,6 +71,7 @@ use std::sync::RwLock;
 use std::thread;
 use std::time::Duration;
 use std::time::Instant;
+use std::time::SystemTime;
 
 struct ArenaAllocator(Pin<Rc<SkelWithObject>>);
 
@@ -110,6 +118,13 @@ pub enum Trait {
         frequency: f64,
         degradation_frac7: u64,
     },
+    CriticalDelays {
+        frequency: f64,
+        min_us: u64,
+        max_us: u64,
+        wake_chain: bool,
+        futex: bool,
+    },
 }
 
 impl Trait {
@@ -118,6 +133,7 @@ impl Trait {
             Self::RandomDelays { .. } => bpf_intf::chaos_trait_kind_CHAOS_TRAIT_RANDOM_DELAYS,
             Self::CpuFreq { .. } => bpf_intf::chaos_trait_kind_CHAOS_TRAIT_CPU_FREQ,
             Self::PerfDegradation { .. } => bpf_intf::chaos_trait_kind_CHAOS_TRAIT_DEGRADATION,
+            Self::CriticalDelays { .. } => bpf_intf::chaos_trait_kind_CHAOS_TRAIT_CRITICAL_DELAYS,
         }
     }
 
@@ -126,6 +142,7 @@ impl Trait {
             Self::RandomDelays { frequency, .. } => *frequency,
             Self::CpuFreq { frequency, .. } => *frequency,
             Self::PerfDegradation { frequency, .. } => *frequency,
+            Self::CriticalDelays { frequency, .. } => *frequency,
         }
     }
 }
@@ -150,6 +167,8 @@ pub struct Builder<'a> {
     pub kprobe_random_delays: Option<KprobeRandomDelays>,
     pub p2dq_opts: &'a P2dqOpts,
     pub requires_ppid: Option<RequiresPpid>,
+    pub seed: u64,
+    pub event_log: Option<PathBuf>,
 }
 
 pub struct SkelWithObject {
@@ -165,6 +184,7 @@ pub struct Scheduler {
     _struct_ops: libbpf_rs::Link,
     _links: Vec<Link>,
     stats_server: StatsServer<(), Metrics>,
+    event_log: Option<EventLog>,
 
     // Fields are dropped in declaration order, this must be last as arena holds a reference to the
     // skel
@@ -194,9 +214,12 @@ impl Scheduler {
             trait_cpu_freq: stats[bpf_intf::chaos_stat_idx_CHAOS_STAT_TRAIT_CPU_FREQ as usize],
             trait_degradation: stats
                 [bpf_intf::chaos_stat_idx_CHAOS_STAT_TRAIT_DEGRADATION as usize],
+            trait_critical_delays: stats
+                [bpf_intf::chaos_stat_idx_CHAOS_STAT_TRAIT_CRITICAL_DELAYS as usize],
             chaos_excluded: stats[bpf_intf::chaos_stat_idx_CHAOS_STAT_CHAOS_EXCLUDED as usize],
             chaos_skipped: stats[bpf_intf::chaos_stat_idx_CHAOS_STAT_CHAOS_SKIPPED as usize],
             timer_kicks: stats[bpf_intf::chaos_stat_idx_CHAOS_STAT_TIMER_KICKS as usize],
+            events_dropped: stats[bpf_intf::chaos_stat_idx_CHAOS_STAT_EVENTS_DROPPED as usize],
         }
     }
 
@@ -214,6 +237,10 @@ impl Scheduler {
         while !*guard {
             let skel = &self.skel.skel.read().unwrap();
 
+            if let Some(event_log) = &self.event_log {
+                event_log.drain()?;
+            }
+
             if uei_exited!(&skel, uei) {
                 return uei_report!(&skel, uei)
                     .and_then(|_| Err(anyhow::anyhow!("scheduler exited unexpectedly")));
@@ -237,10 +264,92 @@ impl Scheduler {
                 .0;
         }
 
+        if let Some(event_log) = &self.event_log {
+            event_log.drain()?;
+        }
+
         Ok(())
     }
 }
 
+fn trait_name(kind: u32) -> &'static str {
+    match kind {
+        bpf_intf::chaos_trait_kind_CHAOS_TRAIT_RANDOM_DELAYS => "random_delays",
+        bpf_intf::chaos_trait_kind_CHAOS_TRAIT_CPU_FREQ => "cpu_freq",
+        bpf_intf::chaos_trait_kind_CHAOS_TRAIT_DEGRADATION => "degradation",
+        bpf_intf::chaos_trait_kind_CHAOS_TRAIT_CRITICAL_DELAYS => "critical_delays",
+        _ => "unknown",
+    }
+}
+
+/// Writes every injected perturbation to a CSV file. Timestamps are
+/// CLOCK_MONOTONIC so they can be lined up with the application's own logs.
+struct EventLog {
+    ringbuf: libbpf_rs::RingBuffer<'static>,
+    out: Rc<RefCell<BufWriter<File>>>,
+}
+
+impl EventLog {
+    fn new(skel: &BpfSkel, path: &Path) -> Result<Self> {
+        let file = File::create(path)
+            .with_context(|| format!("Failed to create event log {}", path.display()))?;
+        let out = Rc::new(RefCell::new(BufWriter::new(file)));
+        writeln!(out.borrow_mut(), "ts_ns,cpu,pid,tgid,trait,arg,rand_ctr")?;
+
+        let cb_out = out.clone();
+        let mut rbb = libbpf_rs::RingBufferBuilder::new();
+        rbb.add(&skel.maps.chaos_events, move |data: &[u8]| {
+            if data.len() < std::mem::size_of::<bpf_intf::chaos_event>() {
+                return 0;
+            }
+            let ev = unsafe {
+                // SAFETY: the record is a chaos_event written by BPF, checked for size above.
+                std::ptr::read_unaligned(data.as_ptr() as *const bpf_intf::chaos_event)
+            };
+            match writeln!(
+                cb_out.borrow_mut(),
+                "{},{},{},{},{},{},{}",
+                ev.ts,
+                ev.cpu,
+                ev.pid,
+                ev.tgid,
+                trait_name(ev.kind),
+                ev.arg,
+                ev.rand_ctr
+            ) {
+                Ok(()) => 0,
+                Err(_) => -1,
+            }
+        })?;
+
+        Ok(Self {
+            ringbuf: rbb.build()?,
+            out,
+        })
+    }
+
+    /// Write the pending events and flush them to the file, so the log is
+    /// complete up to now even if the scheduler is killed.
+    fn drain(&self) -> Result<()> {
+        self.ringbuf
+            .consume()
+            .context("Failed to write the event log")?;
+        self.out
+            .borrow_mut()
+            .flush()
+            .context("Failed to flush the event log")
+    }
+}
+
+/// Seed used when none is given on the command line.
+pub fn random_seed() -> u64 {
+    let nanos = SystemTime::now()
+        .duration_since(SystemTime::UNIX_EPOCH)
+        .map(|d| d.as_nanos() as u64)
+        .unwrap_or(0);
+    nanos ^ ((std::process::id() as u64) << 32)
+}
+
 impl Builder<'_> {
     fn setup_arenas(&self, skel: &mut BpfSkel) -> Result<()> {
         // Allocate the arena memory from the BPF side so userspace initializes it before starting
@@ -387,6 +496,27 @@ impl Builder<'_> {
         Ok(links)
     }
 
+    /// Load the futex hooks used to find lock holders. Returns false if the kernel lacks any of
+    /// the traced functions.
+    fn enable_futex_tracking(open_skel: &mut bpf_skel::OpenBpfSkel) -> Result<bool> {
+        let progs = &open_skel.progs;
+        compat::cond_kprobes_enable(vec![
+            ("__futex_wait", &progs.chaos_fexit___futex_wait),
+            (
+                "futex_wait_multiple",
+                &progs.chaos_fexit_futex_wait_multiple,
+            ),
+            (
+                "futex_wait_requeue_pi",
+                &progs.chaos_fexit_futex_wait_requeue_pi,
+            ),
+            ("futex_lock_pi", &progs.chaos_fexit_futex_lock_pi),
+            ("futex_wake", &progs.chaos_fexit_futex_wake),
+            ("futex_wake_op", &progs.chaos_fexit_futex_wake_op),
+            ("futex_unlock_pi", &progs.chaos_fexit_futex_unlock_pi),
+        ])
+    }
+
     fn load_skel(&self) -> Result<Pin<Rc<SkelWithObject>>> {
         let mut out: Rc<MaybeUninit<SkelWithObject>> = Rc::new_uninit();
         let uninit_skel = Rc::get_mut(&mut out).expect("brand new rc should be unique");
@@ -433,6 +563,22 @@ impl Builder<'_> {
             }
         };
 
+        info!(
+            "chaos seed: {} (pass --seed {} to replay)",
+            self.seed, self.seed
+        );
+        open_skel.maps.rodata_data.chaos_seed = self.seed;
+        open_skel.maps.rodata_data.event_log_enabled = self.event_log.is_some();
+        if self.event_log.is_none() {
+            // The ring buffer can't be left out, shrink it to a single page.
+            let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u32;
+            open_skel
+                .maps
+                .chaos_events
+                .set_max_entries(page_size)
+                .context("Failed to resize the event log ring buffer")?;
+        }
+
         if let Some(kprobe_random_delays) = &self.kprobe_random_delays {
             open_skel.maps.rodata_data.kprobe_delays_freq_frac32 =
                 (kprobe_random_delays.freq * 2_f64.powf(32_f64)) as u32;
@@ -443,6 +589,10 @@ impl Builder<'_> {
         let freq_array = &mut open_skel.maps.rodata_data.trait_delay_freq_frac32;
         freq_array.fill(0);
         for tr in &self.traits {
+            // Critical delays only roll at critical moments, not on every wakeup.
+            if let Trait::CriticalDelays { .. } = tr {
+                continue;
+            }
             let kind = tr.kind();
             if freq_array[kind as usize] != 0 {
                 bail!("trait of kind {} specified multiple times!", kind);
@@ -498,6 +648,25 @@ impl Builder<'_> {
                         (frequency * 2_f64.powf(32_f64)) as u32;
                     open_skel.maps.rodata_data.degradation_frac7 = *degradation_frac7;
                 }
+                Trait::CriticalDelays {
+                    frequency,
+                    min_us,
+                    max_us,
+                    wake_chain,
+                    futex,
+                } => {
+                    open_skel.maps.rodata_data.critical_delays_freq_frac32 =
+                        (frequency * 2_f64.powf(32_f64)) as u32;
+                    open_skel.maps.rodata_data.critical_delays_min_ns = min_us * 1000;
+                    open_skel.maps.rodata_data.critical_delays_max_ns = max_us * 1000;
+                    open_skel.maps.rodata_data.critical_delays_wake_chain = *wake_chain;
+
+                    let futex_enabled = *futex && Self::enable_futex_tracking(&mut open_skel)?;
+                    if *futex && !futex_enabled {
+                        warn!("futex tracing unavailable, futex holders won't be delayed");
+                    }
+                    open_skel.maps.rodata_data.critical_delays_futex = futex_enabled;
+                }
             }
         }
 
@@ -536,11 +705,15 @@ impl<'a> TryFrom<Builder<'a>> for Scheduler {
 
         let arena = HeapAllocator::new(ArenaAllocator(skel.clone()));
         let stats_server = StatsServer::new(stats::server_data()).launch()?;
-        let (links, struct_ops) = {
+        let (links, struct_ops, event_log) = {
             let mut skel_guard = skel.skel.write().unwrap();
+            let event_log = match &b.event_log {
+                Some(path) => Some(EventLog::new(&skel_guard, path)?),
+                None => None,
+            };
             let struct_ops = scx_ops_attach!(skel_guard, chaos)?;
             let links = b.attach_kprobes(&mut skel_guard)?;
-            (links, struct_ops)
+            (links, struct_ops, event_log)
         };
         debug!("scx_chaos scheduler started");
 
@@ -549,6 +722,7 @@ impl<'a> TryFrom<Builder<'a>> for Scheduler {
             _struct_ops: struct_ops,
             _links: links,
             stats_server,
+            event_log,
             skel,
         })
     }
@@ -598,6 +772,31 @@ pub struct PerfDegradationArgs {
     pub degradation_frac7: u64,
 }
 
+/// Delay a process at the moments that matter for tail latency: right after another thread of
+/// its process woke it up, or while it holds a contended futex.
+#[derive(Debug, Parser)]
+pub struct CriticalDelayArgs {
+    /// Chance of delaying a process at a critical moment.
+    #[clap(long, requires = "critical_delay_min_us")]
+    pub critical_delay_frequency: Option<f64>,
+
+    /// Minimum time to add for critical delays.
+    #[clap(long, requires = "critical_delay_max_us")]
+    pub critical_delay_min_us: Option<u64>,
+
+    /// Maximum time to add for critical delays.
+    #[clap(long, requires = "critical_delay_frequency")]
+    pub critical_delay_max_us: Option<u64>,
+
+    /// Don't delay threads woken by another thread of the same process.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    pub critical_delay_no_wake_chain: bool,
+
+    /// Don't delay futex holders.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    pub critical_delay_no_futex: bool,
+}
+
 /// Delay a process when a kprobe is hit.
 #[derive(Debug, Parser)]
 pub struct KprobeArgs {
@@ -653,6 +852,17 @@ pub struct Args {
     #[clap(long)]
     pub stats: Option<f64>,
 
+    /// Seed for the chaos decisions. Runs of the same workload with the same seed make the same
+    /// decisions, as long as the tasks get the same pids. A random seed is picked and logged if
+    /// not given.
+    #[clap(long)]
+    pub seed: Option<u64>,
+
+    /// Write every injected delay, degradation and frequency change to this file as CSV, with
+    /// CLOCK_MONOTONIC timestamps.
+    #[clap(long)]
+    pub event_log: Option<PathBuf>,
+
     /// Run in stats monitoring mode with the specified interval. Scheduler
     /// is not launched.
     #[clap(long)]
@@ -667,6 +877,9 @@ pub struct Args {
     #[command(flatten, next_help_heading = "CPU Frequency")]
     pub cpu_freq: CpuFreqArgs,
 
+    #[command(flatten, next_help_heading = "Critical Delays")]
+    pub critical_delay: CriticalDelayArgs,
+
     #[command(flatten, next_help_heading = "Kprobe Random Delays")]
     pub kprobe_random_delays: KprobeArgs,
 
@@ -697,11 +910,16 @@ pub struct Args {
 struct BuilderIterator<'a> {
     args: &'a Args,
     idx: u32,
+    seed: u64,
 }
 
 impl<'a> From<&'a Args> for BuilderIterator<'a> {
     fn from(args: &'a Args) -> BuilderIterator<'a> {
-        BuilderIterator { args, idx: 0 }
+        BuilderIterator {
+            args,
+            idx: 0,
+            seed: args.seed.unwrap_or_else(random_seed),
+        }
     }
 }
 
@@ -741,6 +959,23 @@ impl<'a> Iterator for BuilderIterator<'a> {
                 });
             };
 
+            if let CriticalDelayArgs {
+                critical_delay_frequency: Some(frequency),
+                critical_delay_min_us: Some(min_us),
+                critical_delay_max_us: Some(max_us),
+                critical_delay_no_wake_chain,
+                critical_delay_no_futex,
+            } = self.args.critical_delay
+            {
+                traits.push(Trait::CriticalDelays {
+                    frequency,
+                    min_us,
+                    max_us,
+                    wake_chain: !critical_delay_no_wake_chain,
+                    futex: !critical_delay_no_futex,
+                });
+            };
+
             let requires_ppid = if self.args.ppid_targeting {
                 if let Some(p) = self.args.pid {
                     Some(RequiresPpid::IncludeParent(Pid::from_raw(p)))
@@ -770,6 +1005,8 @@ impl<'a> Iterator for BuilderIterator<'a> {
                 kprobe_random_delays,
                 p2dq_opts: &self.args.p2dq,
                 requires_ppid,
+                seed: self.seed,
+                event_log: self.args.event_log.clone(),
             })
         }
     }
@@ -21,25 +21,31 @@ pub struct Metrics {
     pub trait_cpu_freq: u64,
     #[stat(desc = "Number of times performance degradation chaos trait was applied")]
     pub trait_degradation: u64,
+    #[stat(desc = "Number of times critical delay chaos trait was applied")]
+    pub trait_critical_delays: u64,
     #[stat(desc = "Number of times chaos was excluded due to task matching")]
     pub chaos_excluded: u64,
     #[stat(desc = "Number of times chaos was skipped (TRAIT_NONE selected)")]
     pub chaos_skipped: u64,
     #[stat(desc = "Number of timer-based CPU kicks for delayed tasks")]
     pub timer_kicks: u64,
+    #[stat(desc = "Number of chaos events dropped because the event log was full")]
+    pub events_dropped: u64,
 }
 
 impl Metrics {
     fn format<W: Write>(&self, w: &mut W) -> Result<()> {
         writeln!(
             w,
-            "chaos traits: random_delays/cpu_freq/degradation {}/{}/{}\n\tchaos excluded/skipped {}/{}\n\ttimer kicks: {}",
+            "chaos traits: random_delays/cpu_freq/degradation/critical_delays {}/{}/{}/{}\n\tchaos excluded/skipped {}/{}\n\ttimer kicks: {}\n\tevents dropped: {}",
             self.trait_random_delays,
             self.trait_cpu_freq,
             self.trait_degradation,
+            self.trait_critical_delays,
             self.chaos_excluded,
             self.chaos_skipped,
             self.timer_kicks,
+            self.events_dropped,
         )?;
         Ok(())
     }
@@ -49,9 +55,11 @@ impl Metrics {
             trait_random_delays: self.trait_random_delays - rhs.trait_random_delays,
             trait_cpu_freq: self.trait_cpu_freq - rhs.trait_cpu_freq,
             trait_degradation: self.trait_degradation - rhs.trait_degradation,
+            trait_critical_delays: self.trait_critical_delays - rhs.trait_critical_delays,
             chaos_excluded: self.chaos_excluded - rhs.chaos_excluded,
             chaos_skipped: self.chaos_skipped - rhs.chaos_skipped,
             timer_kicks: self.timer_kicks - rhs.timer_kicks,
+            events_dropped: self.events_dropped - rhs.events_dropped,
         }
     }
 }
@@ -20,6 +20,16 @@ enum consts {
 	NSEC_PER_MSEC = (1000ULL * NSEC_PER_USEC),
 	NSEC_PER_SEC = (1000ULL * NSEC_PER_MSEC),
 
+	/* Maximum amount of CPUs supported by the staggered throttling */
+	MAX_CPUS		= 1024,
+
+	/* Maximum amount of CPUs per core supported by the staggered throttling */
+	MAX_CORE_CPUS		= 8,
+
+	/* Energy model limits */
+	MAX_PERF_DOMS		= 64,
+	MAX_PERF_STATES		= 32,
+
 	/* Kernel definitions */
 	CLOCK_BOOTTIME		= 7,
 };
@@ -38,6 +48,15 @@ typedef signed long s64;
 typedef int pid_t;
 #endif /* __VMLINUX_H__ */
 
+/*
+ * Per-CPU ops.select_cpu() cost statistics.
+ */
+enum select_stat_idx {
+	SELECT_STAT_CALLS,
+	SELECT_STAT_NS,
+	NR_SELECT_STATS,
+};
+
 struct cpu_arg {
 	s32 cpu_id;
 };
@@ -48,4 +67,27 @@ struct domain_arg {
 	s32 sibling_cpu_id;
 };
 
+/*
+ * Performance state of the energy model: @perf is the capacity provided
+ * by the state and @cost its energy cost, as reported by the kernel.
+ */
+struct perf_state {
+	u64 perf;
+	u64 cost;
+};
+
+/*
+ * Performance states of a performance domain, sorted by increasing @perf.
+ */
+struct perf_dom_arg {
+	s32 pd_id;
+	u32 nr_states;
+	struct perf_state states[MAX_PERF_STATES];
+};
+
+struct perf_dom_cpu_arg {
+	s32 pd_id;
+	s32 cpu_id;
+};
+
 #endif /* __INTF_H */
@@ -126,6 +126,20 @@ const volatile bool native_priority;
  */
 const volatile bool tickless_sched;
 
+/*
+ * Energy-aware task placement.
+ *
+ * Pick the idle CPU where running the task is expected to increase the
+ * energy consumption the least, based on the energy model provided by
+ * user-space.
+ */
+const volatile bool energy_aware;
+
+/*
+ * Estimated energy consumption (energy model power units x ms).
+ */
+volatile u64 energy_estimate;
+
 /*
  * The CPU frequency performance level: a negative value will not affect the
  * performance level and will be ignored.
@@ -137,6 +151,24 @@ volatile s64 cpufreq_perf_lvl;
  */
 volatile u64 nr_kthread_dispatches, nr_direct_dispatches, nr_shared_dispatches;
 
+/*
+ * Cost of ops.select_cpu(), accounted per-CPU to avoid contention.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(key_size, sizeof(u32));
+	__uint(value_size, sizeof(u64));
+	__uint(max_entries, NR_SELECT_STATS);
+} select_stats SEC(".maps");
+
+static void select_stat_add(u32 idx, u64 value)
+{
+	u64 *cnt_p = bpf_map_lookup_elem(&select_stats, &idx);
+
+	if (cnt_p)
+		(*cnt_p) += value;
+}
+
 /*
  * Amount of currently running tasks.
  */
@@ -156,8 +188,16 @@ static u64 nr_cpu_ids;
  * Runtime throttling.
  *
  * Throttle the CPUs by injecting @throttle_ns idle time every @slice_max.
+ *
+ * If @throttle_stagger is enabled, each core runs its own idle injection
+ * phase, with the phases of the cores evenly spread across the period,
+ * instead of throttling all the CPUs at the same time: the total amount of
+ * injected idle time is the same, but the IPIs and the power draw are
+ * spread over time.
  */
 const volatile u64 throttle_ns;
+const volatile bool throttle_stagger;
+static u32 nr_throttle_cores;
 static volatile bool cpus_throttled;
 
 static inline bool is_throttled(void)
@@ -224,6 +264,17 @@ struct {
 	__type(value, struct throttle_timer);
 } throttle_timer SEC(".maps");
 
+/*
+ * Per-core timers used to inject idle cycles when @throttle_stagger is
+ * enabled, indexed by the first CPU of each core.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_CPUS);
+	__type(key, u32);
+	__type(value, struct throttle_timer);
+} throttle_core_timer SEC(".maps");
+
 /*
  * Per-node context.
  */
@@ -270,6 +321,21 @@ static bool node_rebalance(int node)
 	return nctx->need_rebalance;
 }
 
+/*
+ * Idle CPU search plan flags.
+ */
+enum idle_plan_flags {
+	/* The primary CPUs sharing the L2/L3 cache are not empty */
+	IDLE_PLAN_L2		= 1 << 0,
+	IDLE_PLAN_L3		= 1 << 1,
+	/*
+	 * The L2 level contains the same CPUs as the L3 level. The L3 level
+	 * is always searched: the primary domain search that follows it uses
+	 * different flags (it can cross the node).
+	 */
+	IDLE_PLAN_L2_DUP	= 1 << 2,
+};
+
 /*
  * Per-CPU context.
  */
@@ -281,6 +347,38 @@ struct cpu_ctx {
 	struct bpf_cpumask __kptr *smt_cpumask;
 	struct bpf_cpumask __kptr *l2_cpumask;
 	struct bpf_cpumask __kptr *l3_cpumask;
+
+	/*
+	 * Idle CPU search plan, built once at init: the primary CPUs that
+	 * share the L2 and L3 cache with this CPU and the levels that are
+	 * worth searching (see enum idle_plan_flags).
+	 */
+	struct bpf_cpumask __kptr *l2_plan_cpumask;
+	struct bpf_cpumask __kptr *l3_plan_cpumask;
+	u32 idle_plan;
+
+	/*
+	 * The CPU is in its idle injection phase (only with
+	 * @throttle_stagger).
+	 */
+	bool throttled;
+
+	/*
+	 * CPUs of the core and index of the core, set only in the first
+	 * CPU of each core (only with @throttle_stagger).
+	 */
+	s32 core_cpus[MAX_CORE_CPUS];
+	u32 nr_core_cpus;
+	u32 core_idx;
+
+	/*
+	 * Energy model: performance domain of the CPU (negative if the CPU
+	 * doesn't belong to any domain) and its average utilization, in
+	 * capacity units (only with @energy_aware).
+	 */
+	s32 perf_dom;
+	u64 util;
+	u64 energy_prev_runtime;
 };
 
 struct {
@@ -299,6 +397,114 @@ struct cpu_ctx *try_lookup_cpu_ctx(s32 cpu)
 	return bpf_map_lookup_percpu_elem(&cpu_ctx_stor, &idx, cpu);
 }
 
+/*
+ * Interval used to refresh the utilization of the performance domains.
+ */
+#define ENERGY_TIMER_NS	(10ULL * NSEC_PER_MSEC)
+
+/*
+ * Timer used to refresh the utilization of the performance domains.
+ */
+struct energy_timer {
+	struct bpf_timer timer;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct energy_timer);
+} energy_timer SEC(".maps");
+
+/*
+ * Per performance domain context.
+ *
+ * Utilization values are expressed in capacity units, the same scale used
+ * by the @perf values of the performance states.
+ */
+struct perf_dom_ctx {
+	struct bpf_cpumask __kptr *span;
+	u64 capacity;
+	u64 util_sum;
+	u64 util_max;
+	u64 tot_util;
+	u64 tot_util_max;
+	u32 nr_states;
+	struct perf_state states[MAX_PERF_STATES];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct perf_dom_ctx);
+	__uint(max_entries, MAX_PERF_DOMS);
+} perf_dom_stor SEC(".maps");
+
+/*
+ * Amount of performance domains initialized by user-space.
+ */
+static u32 nr_perf_doms;
+
+/*
+ * Last time the utilization of the performance domains was refreshed.
+ */
+static u64 energy_updated_at;
+
+/*
+ * Return a performance domain context.
+ */
+static struct perf_dom_ctx *try_lookup_perf_dom_ctx(s32 pd_id)
+{
+	u32 key = pd_id;
+
+	return bpf_map_lookup_elem(&perf_dom_stor, &key);
+}
+
+/*
+ * Estimate the power drawn by a performance domain, given the utilization
+ * of its busiest CPU (@util_max) and the aggregate utilization of all its
+ * CPUs (@util_sum).
+ *
+ * Like the kernel energy model, assume that the domain runs at the lowest
+ * performance state that can sustain its busiest CPU and that each CPU
+ * contributes to the power proportionally to its utilization.
+ */
+static u64 perf_dom_power(struct perf_dom_ctx *pdctx, u64 util_max, u64 util_sum)
+{
+	struct perf_state *ps;
+	u64 cost = 0;
+	u32 i;
+
+	if (!pdctx->capacity)
+		return 0;
+
+	bpf_for(i, 0, pdctx->nr_states) {
+		ps = MEMBER_VPTR(*pdctx, .states[i]);
+		if (!ps)
+			break;
+		cost = ps->cost;
+		if (ps->perf >= util_max)
+			break;
+	}
+
+	return cost * util_sum / pdctx->capacity;
+}
+
+/*
+ * Return true if @cpu is forced to stay idle, false otherwise.
+ */
+static bool is_cpu_throttled(s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!throttle_stagger)
+		return is_throttled();
+
+	cctx = try_lookup_cpu_ctx(cpu);
+
+	return cctx && READ_ONCE(cctx->throttled);
+}
+
 /*
  * Per-task local storage.
  *
@@ -334,6 +540,20 @@ struct task_ctx {
 	 * Keep track of the last waker.
 	 */
 	u32 waker_pid;
+
+	/*
+	 * The task can run on all the primary CPUs, so its cache domains
+	 * are the same as the idle search plan of the CPU it's running on
+	 * and don't need to be computed (refreshed on affinity changes).
+	 */
+	bool use_plan;
+
+	/*
+	 * Average task utilization, in capacity units (only with
+	 * @energy_aware).
+	 */
+	u64 util;
+	u64 last_stop_at;
 };
 
 /* Map that contains task-local storage. */
@@ -646,6 +866,75 @@ static void task_update_domain(struct task_struct *p, struct task_ctx *tctx,
 		bpf_cpumask_and(l3_mask, p_mask, cast_mask(l3_domain));
 }
 
+/*
+ * Refresh the task's domain after its affinity has changed to @cpumask.
+ */
+static void task_update_affinity(struct task_struct *p, struct task_ctx *tctx,
+				 s32 cpu, const struct cpumask *cpumask)
+{
+	const struct cpumask *primary = cast_mask(primary_cpumask);
+
+	tctx->use_plan = primary && !bpf_cpumask_empty(primary) &&
+			 bpf_cpumask_subset(primary, cpumask);
+
+	task_update_domain(p, tctx, cpu, cpumask);
+}
+
+/*
+ * Return the primary CPUs sharing the L2 cache with @cpu that are usable by
+ * the task, or NULL if there are none.
+ */
+static const struct cpumask *task_l2_mask(const struct task_ctx *tctx, s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!tctx->use_plan)
+		return cast_mask(tctx->l2_cpumask);
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx || !(cctx->idle_plan & IDLE_PLAN_L2))
+		return NULL;
+
+	return cast_mask(cctx->l2_plan_cpumask);
+}
+
+/*
+ * Return the primary CPUs sharing the L3 cache with @cpu that are usable by
+ * the task, or NULL if there are none.
+ */
+static const struct cpumask *task_l3_mask(const struct task_ctx *tctx, s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!tctx->use_plan)
+		return cast_mask(tctx->l3_cpumask);
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx || !(cctx->idle_plan & IDLE_PLAN_L3))
+		return NULL;
+
+	return cast_mask(cctx->l3_plan_cpumask);
+}
+
+/*
+ * Return the cache levels that can be skipped when searching an idle CPU
+ * for the task around @cpu, because they contain the same CPUs as the L3
+ * level.
+ */
+static u32 task_plan_skip(const struct task_ctx *tctx, s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	if (!tctx->use_plan)
+		return 0;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return 0;
+
+	return cctx->idle_plan & IDLE_PLAN_L2_DUP;
+}
+
 /*
  * Return true if all the CPUs in the LLC of @cpu are busy, false
  * otherwise.
@@ -724,6 +1013,88 @@ static bool cpus_share_llc(s32 this_cpu, s32 that_cpu)
 	return bpf_cpumask_test_cpu(this_cpu, llc_mask);
 }
 
+/*
+ * Return true if a CPU of @capacity can sustain @util with a 20% margin,
+ * false otherwise.
+ */
+static inline bool util_fits_capacity(u64 util, u64 capacity)
+{
+	return util * 1280 < capacity * 1024;
+}
+
+/*
+ * Pick the idle CPU in @cpus_allowed where running @p is expected to
+ * increase the energy consumption the least.
+ *
+ * Only one candidate per performance domain is evaluated: @prev_cpu, if
+ * it's idle, or any other idle CPU of the domain.
+ *
+ * Return the claimed idle CPU or a negative value if none of the idle CPUs
+ * can fit the task.
+ */
+static s32 pick_energy_cpu(const struct task_struct *p, const struct task_ctx *tctx,
+			   s32 prev_cpu, const struct cpumask *cpus_allowed,
+			   const struct cpumask *idle_cpumask)
+{
+	u64 task_util = tctx->util, best_delta = -1ULL;
+	s32 best_cpu = -EBUSY;
+	u32 pd_id;
+
+	bpf_for(pd_id, 0, nr_perf_doms) {
+		struct perf_dom_ctx *pdctx;
+		const struct cpumask *span;
+		struct cpu_ctx *cctx;
+		u64 util_max, util_sum, power, delta;
+		s32 cpu;
+
+		pdctx = try_lookup_perf_dom_ctx(pd_id);
+		if (!pdctx)
+			break;
+
+		span = cast_mask(pdctx->span);
+		if (!span)
+			continue;
+
+		if (bpf_cpumask_test_cpu(prev_cpu, span) &&
+		    bpf_cpumask_test_cpu(prev_cpu, idle_cpumask))
+			cpu = prev_cpu;
+		else
+			cpu = bpf_cpumask_any_and_distribute(span, idle_cpumask);
+		if (cpu >= nr_cpu_ids || !bpf_cpumask_test_cpu(cpu, cpus_allowed))
+			continue;
+
+		cctx = try_lookup_cpu_ctx(cpu);
+		if (!cctx)
+			continue;
+
+		/*
+		 * Skip the domain if the task would saturate the CPU.
+		 */
+		if (!util_fits_capacity(cctx->util + task_util, pdctx->capacity))
+			continue;
+		util_max = MAX(pdctx->util_max, cctx->util + task_util);
+		util_sum = pdctx->util_sum + task_util;
+
+		/*
+		 * Evaluate the additional power required to run the task in
+		 * this domain, preferring @prev_cpu in case of a tie.
+		 */
+		power = perf_dom_power(pdctx, pdctx->util_max, pdctx->util_sum);
+		delta = perf_dom_power(pdctx, util_max, util_sum);
+		delta = delta > power ? delta - power : 0;
+
+		if (delta < best_delta || (delta == best_delta && cpu == prev_cpu)) {
+			best_delta = delta;
+			best_cpu = cpu;
+		}
+	}
+
+	if (best_cpu >= 0 && !scx_bpf_test_and_clear_cpu_idle(best_cpu))
+		return -EBUSY;
+
+	return best_cpu;
+}
+
 /*
  * Find an idle CPU in the system.
  *
@@ -742,6 +1113,7 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	int node;
 	s32 this_cpu = bpf_get_smp_processor_id(), cpu;
 	bool is_prev_allowed;
+	u32 skip;
 
 	primary = cast_mask(primary_cpumask);
 	if (!primary)
@@ -823,15 +1195,33 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	}
 
 	/*
-	 * Refresh task domain based on the previously used cpu. If we keep
-	 * selecting the same CPU, the task's domain doesn't need to be
-	 * updated and we can save some cpumask ops.
+	 * With energy-aware placement pick the most energy-efficient idle
+	 * CPU, falling back to the regular idle CPU search if none of the
+	 * idle CPUs can fit the task.
+	 */
+	if (energy_aware && p_mask) {
+		cpu = pick_energy_cpu(p, tctx, prev_cpu, p_mask, idle_cpumask);
+		if (cpu >= 0) {
+			*is_idle = true;
+			goto out_put_cpumask;
+		}
+	}
+
+	/*
+	 * Tasks that can run on all the primary CPUs simply follow the idle
+	 * search plan of @prev_cpu, that doesn't require any cpumask
+	 * operation.
+	 *
+	 * Otherwise, refresh task domain based on the previously used cpu.
+	 * If we keep selecting the same CPU, the task's domain doesn't need
+	 * to be updated and we can save some cpumask ops.
 	 */
-	if (tctx->recent_used_cpu != prev_cpu)
+	if (!tctx->use_plan && tctx->recent_used_cpu != prev_cpu)
 		task_update_domain(p, tctx, prev_cpu, p->cpus_ptr);
 
-	l2_mask = cast_mask(tctx->l2_cpumask);
-	l3_mask = cast_mask(tctx->l3_cpumask);
+	l2_mask = task_l2_mask(tctx, prev_cpu);
+	l3_mask = task_l3_mask(tctx, prev_cpu);
+	skip = task_plan_skip(tctx, prev_cpu);
 
 	/*
 	 * Find the best idle CPU, prioritizing full idle cores in SMT systems.
@@ -853,7 +1243,7 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 		 * Search for any full-idle CPU in the primary domain that
 		 * shares the same L2 cache.
 		 */
-		if (l2_mask) {
+		if (l2_mask && !(skip & IDLE_PLAN_L2_DUP)) {
 			cpu = pick_idle_cpu_node(l2_mask, node, SCX_PICK_IDLE_CORE | __COMPAT_SCX_PICK_IDLE_IN_NODE);
 			if (cpu >= 0) {
 				*is_idle = true;
@@ -920,7 +1310,7 @@ static s32 pick_idle_cpu(struct task_struct *p, s32 prev_cpu, u64 wake_flags, bo
 	 * Search for any idle CPU in the primary domain that shares the same
 	 * L2 cache.
 	 */
-	if (l2_mask && !node_rebalance(node)) {
+	if (l2_mask && !(skip & IDLE_PLAN_L2_DUP) && !node_rebalance(node)) {
 		cpu = pick_idle_cpu_node(l2_mask, node, __COMPAT_SCX_PICK_IDLE_IN_NODE);
 		if (cpu >= 0) {
 			*is_idle = true;
@@ -982,6 +1372,12 @@ out_put_cpumask:
  */
 static inline bool can_direct_dispatch(s32 cpu)
 {
+	/*
+	 * Never dispatch to a CPU that is forced to stay idle.
+	 */
+	if (is_cpu_throttled(cpu))
+		return false;
+
 	/*
 	 * If @local_pcpu is enabled allow direct dispatch only if there
 	 * are no other tasks queued to the CPU DSQ. This prevents
@@ -1002,6 +1398,7 @@ static inline bool can_direct_dispatch(s32 cpu)
 s32 BPF_STRUCT_OPS(flash_select_cpu, struct task_struct *p,
 			s32 prev_cpu, u64 wake_flags)
 {
+	u64 start = bpf_ktime_get_ns();
 	bool is_idle = false;
 	s32 cpu;
 
@@ -1009,11 +1406,22 @@ s32 BPF_STRUCT_OPS(flash_select_cpu, struct task_struct *p,
 		return prev_cpu;
 
 	cpu = pick_idle_cpu(p, prev_cpu, wake_flags, &is_idle);
-	if (is_idle && can_direct_dispatch(cpu)) {
+	if (is_idle && is_cpu_throttled(cpu)) {
+		/*
+		 * The idle CPU is forced to stay idle: kick it to restore
+		 * its idle state and keep the task on its previous CPU,
+		 * ops.enqueue() will look for another idle CPU.
+		 */
+		scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
+		cpu = prev_cpu;
+	} else if (is_idle && can_direct_dispatch(cpu)) {
 		scx_bpf_dsq_insert(p, SCX_DSQ_LOCAL, task_slice_max(), 0);
 		__sync_fetch_and_add(&nr_direct_dispatches, 1);
 	}
 
+	select_stat_add(SELECT_STAT_CALLS, 1);
+	select_stat_add(SELECT_STAT_NS, bpf_ktime_get_ns() - start);
+
 	return cpu;
 }
 
@@ -1042,7 +1450,7 @@ static bool kick_idle_cpu(const struct task_struct *p, const struct task_ctx *tc
 	/*
 	 * Try to reuse the same CPU if idle.
 	 */
-	if (!idle_smt || is_fully_idle(prev_cpu)) {
+	if (!is_cpu_throttled(prev_cpu) && (!idle_smt || is_fully_idle(prev_cpu))) {
 		if (scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
 			scx_bpf_kick_cpu(prev_cpu, SCX_KICK_IDLE);
 			return true;
@@ -1053,20 +1461,30 @@ static bool kick_idle_cpu(const struct task_struct *p, const struct task_ctx *tc
 	 * Look for any idle CPU usable by the task that can immediately
 	 * execute the task, prioritizing SMT isolation and cache locality.
 	 */
-	mask = cast_mask(tctx->l2_cpumask);
+	mask = task_l2_mask(tctx, prev_cpu);
 	if (mask) {
 		cpu = pick_idle_cpu_node(mask, node, flags | __COMPAT_SCX_PICK_IDLE_IN_NODE);
 		if (cpu >= 0) {
+			/*
+			 * Kick the CPU even if it's throttled, so that it
+			 * can restore its idle state, but keep looking.
+			 */
 			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
-			return true;
+			if (!is_cpu_throttled(cpu))
+				return true;
 		}
 	}
-	mask = cast_mask(tctx->l3_cpumask);
+	mask = task_l3_mask(tctx, prev_cpu);
 	if (mask) {
 		cpu = pick_idle_cpu_node(mask, node, flags | __COMPAT_SCX_PICK_IDLE_IN_NODE);
 		if (cpu >= 0) {
+			/*
+			 * Kick the CPU even if it's throttled, so that it
+			 * can restore its idle state, but keep looking.
+			 */
 			scx_bpf_kick_cpu(cpu, SCX_KICK_IDLE);
-			return true;
+			if (!is_cpu_throttled(cpu))
+				return true;
 		}
 	}
 
@@ -1101,9 +1519,9 @@ static bool try_direct_dispatch(struct task_struct *p, struct task_ctx *tctx,
 	}
 
 	/*
-	 * Skip direct dispatch if the CPUs are forced to stay idle.
+	 * Skip direct dispatch if the CPU is forced to stay idle.
 	 */
-	if (is_throttled())
+	if (is_cpu_throttled(prev_cpu))
 		return false;
 
 	/*
@@ -1312,7 +1730,7 @@ void BPF_STRUCT_OPS(flash_enqueue, struct task_struct *p, u64 enq_flags)
 	 * This ensures the proactive wakeup (see below) will target a CPU
 	 * near the one the task was most recently running on.
 	 */
-	if (tctx->recent_used_cpu != prev_cpu)
+	if (!tctx->use_plan && tctx->recent_used_cpu != prev_cpu)
 		task_update_domain(p, tctx, prev_cpu, p->cpus_ptr);
 
 out_kick:
@@ -1397,9 +1815,9 @@ void BPF_STRUCT_OPS(flash_dispatch, s32 cpu, struct task_struct *prev)
 	int node = __COMPAT_scx_bpf_cpu_node(cpu);
 
 	/*
-	 * Let the CPU go idle if the system is throttled.
+	 * Let the CPU go idle if it's throttled.
 	 */
-	if (is_throttled())
+	if (is_cpu_throttled(cpu))
 		return;
 
 	/*
@@ -1508,6 +1926,33 @@ static void update_cpu_load(struct task_struct *p, struct task_ctx *tctx)
 	cctx->prev_runtime = cctx->tot_runtime;
 }
 
+/*
+ * Update the average utilization of a task that is releasing @cpu, in
+ * capacity units of the CPU's performance domain.
+ */
+static void update_task_util(struct task_ctx *tctx, s32 cpu, u64 now)
+{
+	struct perf_dom_ctx *pdctx;
+	struct cpu_ctx *cctx;
+	u64 delta_t, runtime;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx || cctx->perf_dom < 0)
+		return;
+
+	pdctx = try_lookup_perf_dom_ctx(cctx->perf_dom);
+	if (!pdctx)
+		return;
+
+	delta_t = now - tctx->last_stop_at;
+	if (!delta_t)
+		return;
+
+	runtime = MIN(now - tctx->last_run_at, delta_t);
+	tctx->util = calc_avg(tctx->util, runtime * pdctx->capacity / delta_t);
+	tctx->last_stop_at = now;
+}
+
 void BPF_STRUCT_OPS(flash_running, struct task_struct *p)
 {
 	struct task_ctx *tctx;
@@ -1569,6 +2014,15 @@ void BPF_STRUCT_OPS(flash_stopping, struct task_struct *p, bool runnable)
 		p->scx.dsq_vtime += scale_by_task_normalized_weight_inverse(p, slice);
 	}
 
+	/*
+	 * Update task utilization.
+	 */
+	if (energy_aware) {
+		tctx = try_lookup_task_ctx(p);
+		if (tctx)
+			update_task_util(tctx, cpu, now);
+	}
+
 	/*
 	 * Update CPU runtime.
 	 */
@@ -1644,7 +2098,7 @@ void BPF_STRUCT_OPS(flash_set_cpumask, struct task_struct *p,
 	if (!tctx)
 		return;
 
-	task_update_domain(p, tctx, cpu, cpumask);
+	task_update_affinity(p, tctx, cpu, cpumask);
 }
 
 void BPF_STRUCT_OPS(flash_enable, struct task_struct *p)
@@ -1710,7 +2164,7 @@ s32 BPF_STRUCT_OPS(flash_init_task, struct task_struct *p,
 	if (err)
 		return err;
 
-	task_update_domain(p, tctx, cpu, p->cpus_ptr);
+	task_update_affinity(p, tctx, cpu, p->cpus_ptr);
 
 	return 0;
 }
@@ -1798,6 +2252,133 @@ int enable_primary_cpu(struct cpu_arg *input)
 	return err;
 }
 
+SEC("syscall")
+int init_perf_dom(struct perf_dom_arg *input)
+{
+	struct perf_dom_ctx *pdctx;
+	struct perf_state *ps;
+	u32 nr_states = input->nr_states;
+	s32 pd_id = input->pd_id;
+	int err;
+
+	if (pd_id < 0 || !nr_states || nr_states > MAX_PERF_STATES)
+		return -EINVAL;
+
+	pdctx = try_lookup_perf_dom_ctx(pd_id);
+	if (!pdctx)
+		return -ENOENT;
+
+	/* Make sure the domain CPU mask is initialized */
+	err = init_cpumask(&pdctx->span);
+	if (err)
+		return err;
+
+	__builtin_memcpy(pdctx->states, input->states, sizeof(pdctx->states));
+	pdctx->nr_states = nr_states;
+
+	/*
+	 * The capacity of the domain is provided by its highest performance
+	 * state.
+	 */
+	ps = MEMBER_VPTR(*pdctx, .states[nr_states - 1]);
+	if (!ps)
+		return -EINVAL;
+	pdctx->capacity = ps->perf;
+
+	if (pd_id >= nr_perf_doms)
+		nr_perf_doms = pd_id + 1;
+
+	return 0;
+}
+
+SEC("syscall")
+int set_cpu_perf_dom(struct perf_dom_cpu_arg *input)
+{
+	struct perf_dom_ctx *pdctx;
+	struct bpf_cpumask *mask;
+	struct cpu_ctx *cctx;
+	s32 cpu = input->cpu_id;
+	int err = -EINVAL;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return -ENOENT;
+
+	cctx->perf_dom = input->pd_id;
+	if (input->pd_id < 0)
+		return 0;
+
+	pdctx = try_lookup_perf_dom_ctx(input->pd_id);
+	if (!pdctx)
+		return -ENOENT;
+
+	bpf_rcu_read_lock();
+	mask = pdctx->span;
+	if (mask) {
+		bpf_cpumask_set_cpu(cpu, mask);
+		err = 0;
+	}
+	bpf_rcu_read_unlock();
+
+	return err;
+}
+
+/*
+ * Build the idle CPU search plan of each CPU.
+ *
+ * The primary domain and the cache domains are initialized by user-space
+ * before the scheduler is attached and never change while it's running, so
+ * their intersections can be computed once here, instead of for each task
+ * migration.
+ */
+static int init_idle_plans(void)
+{
+	struct bpf_cpumask *l2_plan, *l3_plan;
+	const struct cpumask *primary, *l2_mask, *l3_mask;
+	struct cpu_ctx *cctx;
+	u32 plan;
+	s32 cpu;
+	int err;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		cctx = try_lookup_cpu_ctx(cpu);
+		if (!cctx)
+			continue;
+
+		err = init_cpumask(&cctx->l2_plan_cpumask);
+		if (err)
+			return err;
+		err = init_cpumask(&cctx->l3_plan_cpumask);
+		if (err)
+			return err;
+
+		bpf_rcu_read_lock();
+		primary = cast_mask(primary_cpumask);
+		l2_plan = cctx->l2_plan_cpumask;
+		l3_plan = cctx->l3_plan_cpumask;
+		if (!primary || !l2_plan || !l3_plan) {
+			bpf_rcu_read_unlock();
+			continue;
+		}
+		l2_mask = cast_mask(cctx->l2_cpumask);
+		l3_mask = cast_mask(cctx->l3_cpumask);
+
+		plan = 0;
+		if (l3_mask && bpf_cpumask_and(l3_plan, l3_mask, primary))
+			plan |= IDLE_PLAN_L3;
+		if (l2_mask && bpf_cpumask_and(l2_plan, l2_mask, primary)) {
+			plan |= IDLE_PLAN_L2;
+			if ((plan & IDLE_PLAN_L3) &&
+			    bpf_cpumask_equal(cast_mask(l2_plan), cast_mask(l3_plan)))
+				plan |= IDLE_PLAN_L2_DUP;
+		}
+		cctx->idle_plan = plan;
+		bpf_rcu_read_unlock();
+	}
+
+	return 0;
+}
+
 /*
  * Initialize cpufreq performance level on all the online CPUs.
  */
@@ -1874,6 +2455,234 @@ static int throttle_timerfn(void *map, int *key, struct bpf_timer *timer)
 	return 0;
 }
 
+/*
+ * Return the first CPU of the core of @cpu.
+ */
+static s32 core_leader(s32 cpu)
+{
+	const struct cpumask *smt;
+	struct cpu_ctx *cctx;
+	s32 leader = cpu;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return cpu;
+
+	bpf_rcu_read_lock();
+	smt = cast_mask(cctx->smt_cpumask);
+	if (smt)
+		leader = bpf_cpumask_first(smt);
+	bpf_rcu_read_unlock();
+
+	return leader < nr_cpu_ids ? leader : cpu;
+}
+
+/*
+ * Set the throttled state of all the CPUs in the core of @leader and kick
+ * them with @flags.
+ */
+static void throttle_core(s32 leader, bool state, u64 flags)
+{
+	struct cpu_ctx *lctx, *cctx;
+	u32 i;
+	s32 cpu;
+
+	lctx = try_lookup_cpu_ctx(leader);
+	if (!lctx)
+		return;
+
+	bpf_for(i, 0, lctx->nr_core_cpus) {
+		if (i >= MAX_CORE_CPUS)
+			break;
+		cpu = lctx->core_cpus[i];
+
+		cctx = try_lookup_cpu_ctx(cpu);
+		if (cctx)
+			WRITE_ONCE(cctx->throttled, state);
+		scx_bpf_kick_cpu(cpu, flags);
+	}
+}
+
+/*
+ * Per-core throttle timer, used to inject idle time in a single core.
+ */
+static int throttle_core_timerfn(void *map, int *key, struct bpf_timer *timer)
+{
+	s32 leader = *key;
+	struct cpu_ctx *cctx;
+	bool throttled;
+	u64 flags, duration;
+	int err;
+
+	cctx = try_lookup_cpu_ctx(leader);
+	if (!cctx)
+		return 0;
+	throttled = READ_ONCE(cctx->throttled);
+
+	/*
+	 * Same duty cycle as the global throttle timer, limited to the
+	 * CPUs of the core.
+	 */
+	if (throttled) {
+		flags = SCX_KICK_IDLE;
+		duration = slice_max;
+	} else {
+		flags = SCX_KICK_PREEMPT;
+		duration = throttle_ns;
+	}
+	throttle_core(leader, !throttled, flags);
+
+	err = bpf_timer_start(timer, duration, 0);
+	if (err)
+		scx_bpf_error("Failed to re-arm core %d duty cycle timer", leader);
+
+	return 0;
+}
+
+/*
+ * Store the list of CPUs of each core in the first CPU of the core, so
+ * that the per-core throttle timers don't need to scan all the CPUs.
+ */
+static int init_throttle_cores(void)
+{
+	struct cpu_ctx *cctx;
+	s32 cpu, leader;
+	u32 nr;
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		leader = core_leader(cpu);
+		cctx = try_lookup_cpu_ctx(leader);
+		if (!cctx)
+			return -ENOENT;
+
+		nr = cctx->nr_core_cpus;
+		if (nr >= MAX_CORE_CPUS) {
+			scx_bpf_error("Too many CPUs in core %d", leader);
+			return -E2BIG;
+		}
+		if (!nr)
+			cctx->core_idx = nr_throttle_cores++;
+		cctx->core_cpus[nr] = cpu;
+		cctx->nr_core_cpus = nr + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the throttle timer of the core of the current CPU.
+ *
+ * A timer keeps firing on the CPU it was started on, so user-space runs
+ * this from each CPU, to spread the timers across the cores, instead of
+ * arming all of them on the CPU that initializes the scheduler. The first
+ * idle injection phase of each core is offset by its core index, to
+ * spread the phases of the cores evenly across the duty cycle period.
+ */
+SEC("syscall")
+int start_core_timer(struct cpu_arg *input)
+{
+	u64 period = slice_max + throttle_ns;
+	s32 cpu = bpf_get_smp_processor_id();
+	struct bpf_timer *timer;
+	struct cpu_ctx *cctx;
+	u32 key = cpu;
+	int err;
+
+	if (cpu != input->cpu_id)
+		return -EINVAL;
+	if (!throttle_ns || !throttle_stagger)
+		return 0;
+
+	/*
+	 * Only the first CPU of each core owns a timer.
+	 */
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return -ENOENT;
+	if (!cctx->nr_core_cpus)
+		return 0;
+
+	timer = bpf_map_lookup_elem(&throttle_core_timer, &key);
+	if (!timer) {
+		scx_bpf_error("Failed to lookup core %d throttle timer", cpu);
+		return -ESRCH;
+	}
+
+	bpf_timer_init(timer, &throttle_core_timer, CLOCK_BOOTTIME);
+	bpf_timer_set_callback(timer, throttle_core_timerfn);
+	err = bpf_timer_start(timer,
+			      slice_max + period * cctx->core_idx / nr_throttle_cores, 0);
+	if (err) {
+		scx_bpf_error("Failed to arm core %d throttle timer", cpu);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Refresh the utilization of the performance domains and account the
+ * energy consumed since the last update.
+ */
+static int energy_timerfn(void *map, int *key, struct bpf_timer *timer)
+{
+	u64 now = scx_bpf_now(), delta_t = now - energy_updated_at;
+	struct perf_dom_ctx *pdctx;
+	u32 pd_id;
+	s32 cpu;
+	int err;
+
+	if (!delta_t)
+		goto out;
+
+	/*
+	 * Evaluate the utilization of each CPU since the last update.
+	 */
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		struct cpu_ctx *cctx;
+		u64 runtime;
+
+		cctx = try_lookup_cpu_ctx(cpu);
+		if (!cctx || cctx->perf_dom < 0)
+			continue;
+
+		pdctx = try_lookup_perf_dom_ctx(cctx->perf_dom);
+		if (!pdctx)
+			continue;
+
+		runtime = MIN(cctx->tot_runtime - cctx->energy_prev_runtime, delta_t);
+		cctx->energy_prev_runtime = cctx->tot_runtime;
+		cctx->util = calc_avg(cctx->util, runtime * pdctx->capacity / delta_t);
+
+		pdctx->tot_util += cctx->util;
+		pdctx->tot_util_max = MAX(pdctx->tot_util_max, cctx->util);
+	}
+
+	/*
+	 * Publish the utilization of each domain and account its energy.
+	 */
+	bpf_for(pd_id, 0, nr_perf_doms) {
+		pdctx = try_lookup_perf_dom_ctx(pd_id);
+		if (!pdctx)
+			break;
+
+		pdctx->util_sum = pdctx->tot_util;
+		pdctx->util_max = pdctx->tot_util_max;
+		pdctx->tot_util = 0;
+		pdctx->tot_util_max = 0;
+
+		energy_estimate += perf_dom_power(pdctx, pdctx->util_max, pdctx->util_sum) *
+				   delta_t / NSEC_PER_MSEC;
+	}
+	energy_updated_at = now;
+out:
+	err = bpf_timer_start(timer, ENERGY_TIMER_NS, 0);
+	if (err)
+		scx_bpf_error("Failed to start energy timer");
+
+	return 0;
+}
+
 /*
  * Refresh NUMA statistics.
  */
@@ -1998,6 +2807,11 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(flash_init)
 	if (err)
 		return err;
 
+	/* Build the idle CPU search plans */
+	err = init_idle_plans();
+	if (err)
+		return err;
+
 	timer = bpf_map_lookup_elem(&throttle_timer, &key);
 	if (!timer) {
 		scx_bpf_error("Failed to lookup throttle timer");
@@ -2007,7 +2821,15 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(flash_init)
 	/*
 	 * Fire the throttle timer if CPU throttling is enabled.
 	 */
-	if (throttle_ns) {
+	if (throttle_ns && throttle_stagger) {
+		/*
+		 * The per-core timers are started by user-space, once the
+		 * scheduler is attached.
+		 */
+		err = init_throttle_cores();
+		if (err)
+			return err;
+	} else if (throttle_ns) {
 		bpf_timer_init(timer, &throttle_timer, CLOCK_BOOTTIME);
 		bpf_timer_set_callback(timer, throttle_timerfn);
 		err = bpf_timer_start(timer, slice_max, 0);
@@ -2017,6 +2839,27 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(flash_init)
 		}
 	}
 
+	/*
+	 * Periodically refresh the utilization of the performance domains
+	 * if energy-aware placement is enabled.
+	 */
+	if (energy_aware) {
+		timer = bpf_map_lookup_elem(&energy_timer, &key);
+		if (!timer) {
+			scx_bpf_error("Failed to lookup energy timer");
+			return -ESRCH;
+		}
+
+		energy_updated_at = scx_bpf_now();
+		bpf_timer_init(timer, &energy_timer, CLOCK_BOOTTIME);
+		bpf_timer_set_callback(timer, energy_timerfn);
+		err = bpf_timer_start(timer, ENERGY_TIMER_NS, 0);
+		if (err) {
+			scx_bpf_error("Failed to start energy timer");
+			return err;
+		}
+	}
+
 	/* Do not update NUMA statistics if there's only one node */
 	if (numa_disabled || __COMPAT_scx_bpf_nr_node_ids() <= 1)
 		return 0;
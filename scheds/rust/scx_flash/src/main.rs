@@ -22,12 +22,14 @@ use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::time::Duration;
 
+use affinity::set_thread_affinity;
 use anyhow::anyhow;
 use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
 use clap::Parser;
 use crossbeam::channel::RecvTimeoutError;
+use libbpf_rs::MapCore as _;
 use libbpf_rs::OpenObject;
 use libbpf_rs::ProgramInput;
 use log::{debug, info, warn};
@@ -44,6 +46,8 @@ use scx_utils::uei_exited;
 use scx_utils::uei_report;
 use scx_utils::CoreType;
 use scx_utils::Cpumask;
+use scx_utils::EnergyModel;
+use scx_utils::PerfDomain;
 use scx_utils::Topology;
 use scx_utils::UserExitInfo;
 use scx_utils::NR_CPU_IDS;
@@ -197,6 +201,24 @@ struct Opts {
     #[clap(short = 't', long, default_value = "0")]
     throttle_us: u64,
 
+    /// Stagger the idle injection of the CPU throttling (see --throttle-us) across the cores.
+    ///
+    /// Instead of throttling all the CPUs at the same time, each core runs its own idle injection
+    /// phase, with the phases evenly spread over time. The total amount of injected idle time is
+    /// the same, but the aggregate power draw is smoother and the IPIs are spread out, which can
+    /// help to prevent frequency dips on thermally constrained systems.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    throttle_stagger: bool,
+
+    /// Enable energy-aware task placement.
+    ///
+    /// Use the energy model of the system to pick, among the idle CPUs, the one where running the
+    /// task is expected to increase the energy consumption the least. This requires the kernel
+    /// energy model (exposed via debugfs) and it's mostly effective on heterogeneous systems, where
+    /// the performance domains have different performance/power trade-offs.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    energy_aware: bool,
+
     /// Set CPU idle QoS resume latency in microseconds (-1 = disabled).
     ///
     /// Setting a lower latency value makes CPUs less likely to enter deeper idle states, enhancing
@@ -431,7 +453,23 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.slice_lag = opts.slice_us_lag * 1000;
         skel.maps.rodata_data.run_lag = opts.run_us_lag * 1000;
         skel.maps.rodata_data.throttle_ns = opts.throttle_us * 1000;
+        if opts.throttle_stagger && *NR_CPU_IDS > consts_MAX_CPUS as usize {
+            warn!(
+                "staggered throttling supports up to {} CPUs, disabling it",
+                consts_MAX_CPUS
+            );
+        } else {
+            skel.maps.rodata_data.throttle_stagger = opts.throttle_stagger;
+        }
         skel.maps.rodata_data.max_avg_nvcsw = opts.max_avg_nvcsw;
+
+        // Load the energy model, if energy-aware placement is enabled.
+        let energy_model = if opts.energy_aware {
+            Self::energy_model()
+        } else {
+            None
+        };
+        skel.maps.rodata_data.energy_aware = energy_model.is_some();
         skel.maps.rodata_data.cpu_busy_thresh = opts.cpu_busy_thresh;
         skel.maps.rodata_data.primary_all = domain.weight() == *NR_CPU_IDS;
 
@@ -476,6 +514,12 @@ impl<'a> Scheduler<'a> {
             );
         }
 
+        // Initialize the performance domains of the energy model.
+        if let Some(em) = &energy_model {
+            Self::init_energy_model(&mut skel, em)
+                .map_err(|err| anyhow!("failed to initialize energy model: error {}", err))?;
+        }
+
         // Initialize SMT domains.
         if smt_enabled {
             Self::init_smt_domains(&mut skel, &topo)?;
@@ -492,6 +536,12 @@ impl<'a> Scheduler<'a> {
 
         // Attach the scheduler.
         let struct_ops = Some(scx_ops_attach!(skel, flash_ops)?);
+
+        // Start the per-core throttle timers.
+        if opts.throttle_us > 0 && opts.throttle_stagger {
+            Self::init_throttle_core_timers(&mut skel, &topo)?;
+        }
+
         let stats_server = StatsServer::new(stats::server_data()).launch()?;
 
         Ok(Self {
@@ -527,6 +577,176 @@ impl<'a> Scheduler<'a> {
         Ok(())
     }
 
+    fn start_core_timer(skel: &mut BpfSkel<'_>, cpu: i32) -> Result<(), u32> {
+        let prog = &mut skel.progs.start_core_timer;
+        let mut args = cpu_arg {
+            cpu_id: cpu as c_int,
+        };
+        let input = ProgramInput {
+            context_in: Some(unsafe {
+                std::slice::from_raw_parts_mut(
+                    &mut args as *mut _ as *mut u8,
+                    std::mem::size_of_val(&args),
+                )
+            }),
+            ..Default::default()
+        };
+        let out = prog.test_run(input).unwrap();
+        if out.return_value != 0 {
+            return Err(out.return_value);
+        }
+
+        Ok(())
+    }
+
+    // Start the throttle timer of each core from a CPU of the core itself (a timer keeps firing
+    // on the CPU it was started on), so that the timers are spread across the cores.
+    fn init_throttle_core_timers(skel: &mut BpfSkel<'_>, topo: &Topology) -> Result<()> {
+        for &cpu in topo.all_cpus.keys() {
+            if let Err(e) = set_thread_affinity(&[cpu]) {
+                bail!("cannot set CPU {} affinity: {}", cpu, e);
+            }
+            if let Err(err) = Self::start_core_timer(skel, cpu as i32) {
+                bail!(
+                    "failed to start throttle timer on CPU {}: error {}",
+                    cpu,
+                    err
+                );
+            }
+        }
+
+        // Reset task affinity.
+        if let Err(e) = set_thread_affinity((0..*NR_CPU_IDS).collect::<Vec<usize>>()) {
+            bail!("cannot reset CPU affinity: {}", e);
+        }
+
+        Ok(())
+    }
+
+    fn energy_model() -> Option<EnergyModel> {
+        let em = match EnergyModel::new() {
+            Ok(em) => em,
+            Err(err) => {
+                warn!(
+                    "energy model not available, disabling energy-aware placement: {}",
+                    err
+                );
+                return None;
+            }
+        };
+        if em.perf_doms.len() > consts_MAX_PERF_DOMS as usize {
+            warn!(
+                "energy-aware placement supports up to {} performance domains, disabling it",
+                consts_MAX_PERF_DOMS
+            );
+            return None;
+        }
+
+        Some(em)
+    }
+
+    // Return the performance states of a domain in the format expected by the BPF code.
+    //
+    // Inefficient states are skipped, like the kernel does, and if the remaining states don't fit
+    // in the BPF table they are evenly sub-sampled, always keeping the highest one.
+    fn perf_dom_states(pd: &PerfDomain) -> Vec<perf_state> {
+        let states: Vec<_> = pd
+            .perf_table
+            .values()
+            .filter(|ps| ps.inefficient == 0)
+            .collect();
+        let step = states
+            .len()
+            .div_ceil(consts_MAX_PERF_STATES as usize)
+            .max(1);
+        let mut states: Vec<_> = states
+            .iter()
+            .rev()
+            .step_by(step)
+            .map(|ps| perf_state {
+                perf: ps.performance as u64,
+                cost: ps.cost as u64,
+            })
+            .collect();
+        states.reverse();
+
+        states
+    }
+
+    fn init_perf_dom(skel: &mut BpfSkel<'_>, pd: &PerfDomain) -> Result<(), u32> {
+        let prog = &mut skel.progs.init_perf_dom;
+        let states = Self::perf_dom_states(pd);
+        let mut args = perf_dom_arg {
+            pd_id: pd.id as c_int,
+            nr_states: states.len() as u32,
+            states: [perf_state { perf: 0, cost: 0 }; consts_MAX_PERF_STATES as usize],
+        };
+        args.states[..states.len()].copy_from_slice(&states);
+
+        let input = ProgramInput {
+            context_in: Some(unsafe {
+                std::slice::from_raw_parts_mut(
+                    &mut args as *mut _ as *mut u8,
+                    std::mem::size_of_val(&args),
+                )
+            }),
+            ..Default::default()
+        };
+        let out = prog.test_run(input).unwrap();
+        if out.return_value != 0 {
+            return Err(out.return_value);
+        }
+
+        Ok(())
+    }
+
+    fn set_cpu_perf_dom(skel: &mut BpfSkel<'_>, cpu: usize, pd_id: i32) -> Result<(), u32> {
+        let prog = &mut skel.progs.set_cpu_perf_dom;
+        let mut args = perf_dom_cpu_arg {
+            pd_id: pd_id as c_int,
+            cpu_id: cpu as c_int,
+        };
+        let input = ProgramInput {
+            context_in: Some(unsafe {
+                std::slice::from_raw_parts_mut(
+                    &mut args as *mut _ as *mut u8,
+                    std::mem::size_of_val(&args),
+                )
+            }),
+            ..Default::default()
+        };
+        let out = prog.test_run(input).unwrap();
+        if out.return_value != 0 {
+            return Err(out.return_value);
+        }
+
+        Ok(())
+    }
+
+    fn init_energy_model(skel: &mut BpfSkel<'_>, em: &EnergyModel) -> Result<(), u32> {
+        for pd in em.perf_doms.values() {
+            info!(
+                "perf domain {}: cpus {}, {} perf states",
+                pd.id,
+                pd.span,
+                pd.perf_table.len()
+            );
+            Self::init_perf_dom(skel, pd)?;
+        }
+
+        // CPUs that don't belong to any performance domain are never considered by the
+        // energy-aware placement.
+        for cpu in 0..*NR_CPU_IDS {
+            let pd_id = em
+                .get_pd_by_cpu_id(cpu)
+                .map(|pd| pd.id as i32)
+                .unwrap_or(-1);
+            Self::set_cpu_perf_dom(skel, cpu, pd_id)?;
+        }
+
+        Ok(())
+    }
+
     fn epp_to_cpumask(profile: Powermode) -> Result<Cpumask> {
         let mut cpus = get_primary_cpus(profile).unwrap_or_default();
         if cpus.is_empty() {
@@ -758,13 +978,39 @@ impl<'a> Scheduler<'a> {
         })
     }
 
+    fn read_select_stats(&self) -> Vec<u64> {
+        let stats_map = &self.skel.maps.select_stats;
+
+        (0..select_stat_idx_NR_SELECT_STATS)
+            .map(|stat| {
+                stats_map
+                    .lookup_percpu(&stat.to_ne_bytes(), libbpf_rs::MapFlags::ANY)
+                    .ok()
+                    .flatten()
+                    .map(|vals| {
+                        vals.iter()
+                            .map(|val| {
+                                u64::from_ne_bytes(val.as_slice().try_into().unwrap_or([0; 8]))
+                            })
+                            .sum()
+                    })
+                    .unwrap_or(0)
+            })
+            .collect()
+    }
+
     fn get_metrics(&self) -> Metrics {
+        let select_stats = self.read_select_stats();
+
         Metrics {
             nr_running: self.skel.maps.bss_data.nr_running,
             nr_cpus: self.skel.maps.bss_data.nr_online_cpus,
             nr_kthread_dispatches: self.skel.maps.bss_data.nr_kthread_dispatches,
             nr_direct_dispatches: self.skel.maps.bss_data.nr_direct_dispatches,
             nr_shared_dispatches: self.skel.maps.bss_data.nr_shared_dispatches,
+            nr_select_cpu: select_stats[select_stat_idx_SELECT_STAT_CALLS as usize],
+            select_cpu_ns: select_stats[select_stat_idx_SELECT_STAT_NS as usize],
+            energy: self.skel.maps.bss_data.energy_estimate,
         }
     }
 
@@ -54,6 +54,9 @@ enum {
 	LAVD_CPDOM_MAX_DIST		= 3,  /* maximum distance from one compute domain to another */
 
 	LAVD_PCO_STATE_MAX		= 11, /* maximum number of performance vs. CPU order states */
+	LAVD_PCO_LUT_NR			= 128, /* number of entries of the PCO lookup table */
+
+	LAVD_WCHAIN_MAX_EDGES		= 4,  /* maximum number of wakees tracked per task */
 
 	LAVD_STATUS_STR_LEN		= 4,  /* {LR: Latency-critical, Regular}
 						 {HI: performance-Hungry, performance-Insensitive}
@@ -97,6 +100,14 @@ struct sys_stat {
 	u64	nr_lc_on_big;	/* latency-critical tasks scheduled on big core */
 };
 
+/*
+ * Wake-up dependency from a waker to its wakee
+ */
+struct wake_edge {
+	pid_t	pid;			/* wakee's pid */
+	u32	cnt;			/* how many times the waker woke up the wakee recently */
+};
+
 /*
  * Task context
  */
@@ -125,6 +136,7 @@ struct task_ctx {
 	 */
 	u32	lat_cri;		/* final context-aware latency criticality */
 	u32	lat_cri_waker;		/* waker's latency criticality */
+	u32	lat_cri_wakee;		/* latency criticality inherited from wakees blocked on this task */
 	u32	perf_cri;		/* performance criticality of a task */
 	u32	slice_ns;		/* time slice */
 	s8	futex_boost;		/* futex acquired or not */
@@ -135,6 +147,11 @@ struct task_ctx {
 	u8	on_big;			/* executable on a big core */
 	u8	on_little;		/* executable on a little core */
 	u8	is_affinitized;		/* is this task pinned to a subset of all CPUs? */
+
+	/*
+	 * Recent wakees depending on this task
+	 */
+	struct wake_edge wakees[LAVD_WCHAIN_MAX_EDGES];
 };
 
 /*
@@ -159,27 +176,30 @@ struct task_ctx_x {
  * introspection
  */
 enum {
-       LAVD_CMD_NOP		= 0x0,
-       LAVD_CMD_SCHED_N		= 0x1,
+	LAVD_INTROSPEC_RING_SZ	= 32, /* number of samples per CPU (power of two) */
 };
 
-enum {
-       LAVD_MSG_TASKC		= 0x1
-};
-
-struct introspec {
-	volatile u64	arg;
-	volatile u32	cmd;
-};
-
-struct msg_hdr {
-	u32		kind;
+struct introspec_sample {
+	volatile u64		seq;	/* 1-based sequence number; 0 while being written */
+	struct task_ctx_x	taskc_x;
+	u64			run_freq;
+	u64			avg_runtime;
+	u64			wait_freq;
+	u64			wake_freq;
+	u32			slice_ns;
+	u32			lat_cri;
+	u32			perf_cri;
 };
 
-struct msg_task_ctx {
-	struct msg_hdr		hdr;
-	struct task_ctx		taskc;
-	struct task_ctx_x	taskc_x;
+/*
+ * Per-CPU fixed-size sample ring. Only the owner CPU writes the ring,
+ * overwriting the oldest sample circularly, and userspace polls it in bulk
+ * through the memory-mapped introspec_rings map.
+ */
+struct introspec_ring {
+	volatile u64		head;		/* number of samples written so far */
+	u32			countdown;	/* schedules remaining until the next sample */
+	struct introspec_sample	samples[LAVD_INTROSPEC_RING_SZ];
 };
 
 
@@ -9,103 +9,100 @@
  */
 
 /*
- * Introspection commands
+ * Sample one out of @introspec_sample_rate schedules on each CPU.
+ * Sampling is off when it is zero.
  */
-struct introspec intrspc;
+volatile u32		introspec_sample_rate;
 
+/*
+ * Per-CPU sample rings, indexed by CPU id
+ *
+ * The map is resized to nr_cpu_ids by userspace before loading, so only
+ * the rings of the possible CPUs are allocated, and userspace polls them
+ * in bulk by memory-mapping the map.
+ */
 struct {
-	__uint(type, BPF_MAP_TYPE_RINGBUF);
-	__uint(max_entries, 16 * 1024 /* 16 KB */);
-} introspec_msg SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__type(key, u32);
+	__type(value, struct introspec_ring);
+	__uint(max_entries, LAVD_CPU_ID_MAX);
+} introspec_rings SEC(".maps");
 
 static __always_inline
-int submit_task_ctx(struct task_struct *p, struct task_ctx *taskc, u32 cpu_id)
+void write_sample(struct introspec_sample *s, struct task_struct *p,
+		  struct task_ctx *taskc, struct cpu_ctx *cpuc, u32 cpu_id)
 {
-	struct cpu_ctx *cpuc;
-	struct msg_task_ctx *m;
-
-	cpuc = get_cpu_ctx_id(cpu_id);
-	if (!cpuc)
-		return -EINVAL;
-
-	m = bpf_ringbuf_reserve(&introspec_msg, sizeof(*m), 0);
-	if (!m)
-		return -ENOMEM;
-
-	m->hdr.kind = LAVD_MSG_TASKC;
-	m->taskc_x.pid = p->pid;
-	__builtin_memcpy_inline(m->taskc_x.comm, p->comm, TASK_COMM_LEN);
-	m->taskc_x.static_prio = get_nice_prio(p);
-	m->taskc_x.cpu_util = s2p(cpuc->avg_util);
-	m->taskc_x.cpu_sutil = s2p(cpuc->avg_sc_util);
-	m->taskc_x.cpu_id = cpu_id;
-	m->taskc_x.avg_lat_cri = sys_stat.avg_lat_cri;
-	m->taskc_x.thr_perf_cri = sys_stat.thr_perf_cri;
-	m->taskc_x.nr_active = sys_stat.nr_active;
-	m->taskc_x.cpuperf_cur = cpuc->cpuperf_cur;
-
-	m->taskc_x.stat[0] = is_lat_cri(taskc) ? 'L' : 'R';
-	m->taskc_x.stat[1] = is_perf_cri(taskc) ? 'H' : 'I';
-	m->taskc_x.stat[2] = cpuc->big_core ? 'B' : 'T';
-	m->taskc_x.stat[3] = is_greedy(taskc) ? 'G' : 'E';
-	m->taskc_x.stat[4] = '\0';
-
-	__builtin_memcpy_inline(&m->taskc, taskc, sizeof(m->taskc));
-
-	bpf_ringbuf_submit(m, 0);
-
-	return 0;
+	s->taskc_x.pid = p->pid;
+	__builtin_memcpy_inline(s->taskc_x.comm, p->comm, TASK_COMM_LEN);
+	s->taskc_x.static_prio = get_nice_prio(p);
+	s->taskc_x.cpu_util = s2p(cpuc->avg_util);
+	s->taskc_x.cpu_sutil = s2p(cpuc->avg_sc_util);
+	s->taskc_x.cpu_id = cpu_id;
+	s->taskc_x.avg_lat_cri = sys_stat.avg_lat_cri;
+	s->taskc_x.thr_perf_cri = sys_stat.thr_perf_cri;
+	s->taskc_x.nr_active = sys_stat.nr_active;
+	s->taskc_x.cpuperf_cur = cpuc->cpuperf_cur;
+
+	s->taskc_x.stat[0] = is_lat_cri(taskc) ? 'L' : 'R';
+	s->taskc_x.stat[1] = is_perf_cri(taskc) ? 'H' : 'I';
+	s->taskc_x.stat[2] = cpuc->big_core ? 'B' : 'T';
+	s->taskc_x.stat[3] = is_greedy(taskc) ? 'G' : 'E';
+	s->taskc_x.stat[4] = '\0';
+
+	s->run_freq = taskc->run_freq;
+	s->avg_runtime = taskc->avg_runtime;
+	s->wait_freq = taskc->wait_freq;
+	s->wake_freq = taskc->wake_freq;
+	s->slice_ns = taskc->slice_ns;
+	s->lat_cri = taskc->lat_cri;
+	s->perf_cri = taskc->perf_cri;
 }
 
-static void proc_introspec_sched_n(struct task_struct *p,
-				   struct task_ctx *taskc)
+static void try_sample_task_ctx(struct task_struct *p, struct task_ctx *taskc,
+				struct cpu_ctx *cpuc)
 {
-	u64 cur_nr, prev_nr;
-	u32 cpu_id;
-	int i;
+	struct introspec_ring *ring;
+	struct introspec_sample *s;
+	u32 rate, cpu_id;
+	u64 head;
 
-	/* do not introspect itself */
-	if (bpf_strncmp(p->comm, 8, "scx_lavd") == 0)
+	rate = READ_ONCE(introspec_sample_rate);
+	if (!rate)
 		return;
 
-	/* introspec_arg is the number of schedules remaining */
 	cpu_id = bpf_get_smp_processor_id();
-	cur_nr = intrspc.arg;
+	ring = bpf_map_lookup_elem(&introspec_rings, &cpu_id);
+	if (!ring)
+		return;
 
 	/*
-	 * Note that the bounded retry (@LAVD_MAX_RETRY) does *not *guarantee*
-	 * to decrement introspec_arg. However, it is unlikely to happen. Even
-	 * if it happens, it is nothing but a matter of delaying a message
-	 * delivery. That's because other threads will try and succeed the CAS
-	 * operation eventually. So this is good enough. ;-)
+	 * Count down the schedules on this CPU instead of using a random
+	 * number, which is cheaper and gives a steady sampling rate.
 	 */
-	for (i = 0; cur_nr > 0 && i < LAVD_MAX_RETRY; i++) {
-		prev_nr = __sync_val_compare_and_swap(
-				&intrspc.arg, cur_nr, cur_nr - 1);
-		/* CAS success: submit a message and done */
-		if (prev_nr == cur_nr) {
-			submit_task_ctx(p, taskc, cpu_id);
-			break;
-		}
-		/* CAS failure: retry */
-		cur_nr = prev_nr;
+	if (ring->countdown > 1) {
+		ring->countdown--;
+		return;
 	}
-}
+	ring->countdown = rate;
 
-static void try_proc_introspec_cmd(struct task_struct *p,
-				   struct task_ctx *taskc)
-{
-	switch(intrspc.cmd) {
-	case LAVD_CMD_SCHED_N:
-		proc_introspec_sched_n(p, taskc);
-		break;
-	case LAVD_CMD_NOP:
-		/* do nothing */
-		break;
-	default:
-		scx_bpf_error("Unknown introspec command: %d", intrspc.cmd);
-		break;
-	}
-}
+	/* do not introspect itself */
+	if (bpf_strncmp(p->comm, 8, "scx_lavd") == 0)
+		return;
+
+	/*
+	 * Since only this CPU writes its ring, no reservation is necessary.
+	 * Overwrite the oldest sample, invalidating its sequence number while
+	 * writing, so userspace can detect a torn read. The sample is published
+	 * with release stores, which pair with the acquire loads of userspace.
+	 */
+	head = ring->head;
+	s = &ring->samples[head & (LAVD_INTROSPEC_RING_SZ - 1)];
+	WRITE_ONCE(s->seq, 0);
+	smp_wmb();
 
+	write_sample(s, p, taskc, cpuc, cpu_id);
 
+	smp_store_release(&s->seq, head + 1);
+	smp_store_release(&ring->head, head + 1);
+}
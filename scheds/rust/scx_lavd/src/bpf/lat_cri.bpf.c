@@ -168,9 +168,72 @@ static void calc_lat_cri(struct task_struct *p, struct task_ctx *taskc)
 	/*
 	 * Determine latency criticality of a task in a context-aware manner by
 	 * considering which task wakes up this task. If its waker is more
-	 * latency-critcial, inherit waker's latency criticality.
+	 * latency-critcial, inherit waker's latency criticality. Also, if more
+	 * latency-critical tasks are blocked on this task (i.e., this task is
+	 * on their critical path), inherit their latency criticality.
 	 */
-	taskc->lat_cri = max(lat_cri, taskc->lat_cri_waker);
+	lat_cri = max(lat_cri, taskc->lat_cri_waker);
+	taskc->lat_cri = max(lat_cri, taskc->lat_cri_wakee);
+}
+
+static void update_wake_chain(struct task_ctx *waker_taskc,
+			      struct task_struct *wakee,
+			      struct task_ctx *wakee_taskc)
+{
+	struct wake_edge *e, *edge = NULL, *victim = NULL;
+	u32 min_cnt = U32_MAX, lat_cri;
+	pid_t pid = wakee->pid;
+	int i;
+
+	/*
+	 * Find the waker-wakee edge among the recent wakees of the waker.
+	 */
+	for (i = 0; i < LAVD_WCHAIN_MAX_EDGES; i++) {
+		e = &waker_taskc->wakees[i];
+		if (e->pid == pid) {
+			edge = e;
+			break;
+		}
+		if (e->cnt < min_cnt) {
+			min_cnt = e->cnt;
+			victim = e;
+		}
+	}
+
+	/*
+	 * If this is a new edge, replace the least frequent one. Age all the
+	 * other edges so that stale dependencies fade out over time.
+	 */
+	if (!edge) {
+		if (!victim)
+			return;
+
+		for (i = 0; i < LAVD_WCHAIN_MAX_EDGES; i++)
+			waker_taskc->wakees[i].cnt >>= 1;
+		victim->pid = pid;
+		victim->cnt = 1;
+		return;
+	}
+
+	if (edge->cnt < LAVD_WCHAIN_CNT_MAX)
+		edge->cnt++;
+
+	/*
+	 * A wakee that is repeatedly woken up by the waker blocks on the
+	 * waker -- e.g., waiting for a futex release, a pipe/socket write,
+	 * or a completion signaled by the waker. So, the waker is on the
+	 * critical path of the wakee. Propagate the wakee's latency
+	 * criticality, including what the wakee inherited from its own
+	 * wakees, to the waker with a per-hop decay. This way, the latency
+	 * criticality flows backward along the blocking chain.
+	 */
+	if (edge->cnt < LAVD_WCHAIN_MIN_CNT)
+		return;
+
+	lat_cri = max(wakee_taskc->lat_cri, wakee_taskc->lat_cri_wakee);
+	lat_cri -= lat_cri >> LAVD_WCHAIN_DECAY_SHIFT;
+	if (waker_taskc->lat_cri_wakee < lat_cri)
+		waker_taskc->lat_cri_wakee = lat_cri;
 }
 
 static u64 calc_adjusted_runtime(struct task_ctx *taskc)
@@ -46,6 +46,8 @@ enum consts_internal  {
 
 	LAVD_SYS_STAT_INTERVAL_NS	= LAVD_TARGETED_LATENCY_NS,
 	LAVD_SYS_STAT_DECAY_TIMES	= ((2ULL * LAVD_TIME_ONE_SEC) / LAVD_SYS_STAT_INTERVAL_NS),
+	LAVD_SYS_STAT_FOLD_NS		= (LAVD_SYS_STAT_INTERVAL_NS >> 3), /* minimum interval to fold per-CPU
+									       statistics into a compute domain */
 
 	LAVD_CC_PER_CORE_SHIFT		= 1,  /* 50%: maximum per-core CPU utilization */
 	LAVD_CC_UTIL_SPIKE		= p2s(90), /* When the CPU utilization is almost full (90%),
@@ -54,6 +56,8 @@ enum consts_internal  {
 	LAVD_CC_CPU_PIN_INTERVAL	= (250ULL * NSEC_PER_MSEC),
 	LAVD_CC_CPU_PIN_INTERVAL_DIV	= (LAVD_CC_CPU_PIN_INTERVAL / LAVD_SYS_STAT_INTERVAL_NS),
 
+	LAVD_PCO_HYST_SHIFT		= 3, /* 12.5%: headroom required to move to a lower PCO state */
+
 	LAVD_AP_HIGH_UTIL_DFL_SMT_RT	= p2s(25),
 	LAVD_AP_HIGH_UTIL_DFL_NO_SMT_RT	= p2s(50), /* 50%: balanced mode when 10% < cpu util <= 50%,
 							  performance mode when cpu util > 50% */
@@ -63,9 +67,40 @@ enum consts_internal  {
 	LAVD_CPDOM_MIG_SHIFT_OL		= 4, /* when over-loaded:   1/2**4 = [-6.25%, +6.25%] */
 	LAVD_CPDOM_MIG_PROB_FT		= (LAVD_SYS_STAT_INTERVAL_NS / (2 * LAVD_SLICE_MAX_NS_DFL)), /* roughly twice per interval */
 
+	LAVD_WCHAIN_MIN_CNT		= 2,  /* wake-ups to consider a waker-wakee edge as a dependency */
+	LAVD_WCHAIN_CNT_MAX		= 255,
+	LAVD_WCHAIN_DECAY_SHIFT		= 3,  /* 12.5%: decay of latency criticality per hop */
+
 	LAVD_FUTEX_OP_INVALID		= -1,
 };
 
+/*
+ * Per-compute-domain statistics accumulator
+ *
+ * Each CPU folds its per-CPU counters into the accumulator of its compute
+ * domain when it stops a task or goes idle. Then, the update timer reduces
+ * only nr_cpdoms accumulators instead of sweeping all CPUs' cpu_ctx.
+ */
+struct cpdom_stat {
+	volatile u64	busy_total;	/* total non-idle time of the CPUs */
+	volatile u64	tot_svc_time;	/* total service time scaled by tasks' weights */
+	volatile u64	tot_sc_time;	/* total scaled CPU time */
+	volatile u64	tsct_spike;	/* scaled CPU time when the CPU utilization spikes */
+	volatile u64	sum_lat_cri;	/* sum of latency criticality */
+	volatile u64	sum_perf_cri;	/* sum of performance criticality */
+	volatile u32	max_lat_cri;	/* maximum latency criticality */
+	volatile u32	min_perf_cri;	/* mininum performance criticality */
+	volatile u32	max_perf_cri;	/* maximum performance criticality */
+	volatile u32	nr_sched;
+	volatile u32	nr_preempt;
+	volatile u32	nr_perf_cri;
+	volatile u32	nr_lat_cri;
+	volatile u32	nr_x_migration;
+	volatile u32	nr_big;
+	volatile u32	nr_pc_on_big;
+	volatile u32	nr_lc_on_big;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
 /*
  * Compute domain context
  * - system > numa node > llc domain > compute domain per core type (P or E)
@@ -89,6 +124,7 @@ struct cpdom_ctx {
 	u8	nr_neighbors[LAVD_CPDOM_MAX_DIST];  /* number of neighbors per distance */
 	u64	neighbor_bits[LAVD_CPDOM_MAX_DIST]; /* bitmask of neighbor bitmask per distance */
 	u64	__cpumask[LAVD_CPU_ID_MAX/64];	    /* cpumasks belongs to this compute domain */
+	struct cpdom_stat stat;			    /* statistics folded from the CPUs in this domain */
 } __attribute__((aligned(CACHELINE_SIZE)));
 
 /*
@@ -102,8 +138,12 @@ struct cpu_ctx {
 	volatile u32	cur_util;	/* CPU utilization of the current interval */
 	volatile u32	avg_sc_util;	/* average of the scaled CPU utilization, which is capacity and frequency invariant. */
 	volatile u32	cur_sc_util;	/* the scaled CPU utilization of the current interval, which is capacity and frequency invariant. */
-	volatile u64	idle_total;	/* total idle time so far */
+	volatile u64	idle_total;	/* total idle time since the last fold */
 	volatile u64	idle_start_clk;	/* when the CPU becomes idle */
+	volatile u64	fold_clk;	/* when the statistics are folded to the compute domain */
+	volatile u64	util_clk;	/* when the current utilization interval starts */
+	volatile u64	util_busy;	/* non-idle time in the current utilization interval */
+	volatile u64	util_sc_time;	/* scaled CPU time in the current utilization interval */
 
 	/*
 	 * Information used to keep track of load
@@ -181,6 +181,7 @@
  * Author: Changwoo Min <changwoo@igalia.com>
  */
 #include <scx/common.bpf.h>
+#include <scx/bpf_atomic.h>
 #include "intf.h"
 #include "lavd.bpf.h"
 #include <errno.h>
@@ -402,6 +403,12 @@ static void update_stat_for_stopping(struct task_struct *p,
 	 */
 	taskc->lat_cri_waker = 0;
 
+	/*
+	 * Decay the latency criticality inherited from the wakees, so it is
+	 * kept only while the wakees keep depending on this task.
+	 */
+	taskc->lat_cri_wakee >>= 1;
+
 	/*
 	 * Increase total service time of this CPU.
 	 */
@@ -425,6 +432,11 @@ static void update_stat_for_stopping(struct task_struct *p,
 	 */
 	reset_lock_futex_boost(taskc, cpuc);
 	taskc->lock_holder_xted = false;
+
+	/*
+	 * Fold the per-CPU statistics into the compute domain if needed.
+	 */
+	try_fold_cpu_stat(cpuc, now);
 }
 
 static u64 calc_when_to_run(struct task_struct *p, struct task_ctx *taskc)
@@ -803,7 +815,7 @@ void BPF_STRUCT_OPS(lavd_runnable, struct task_struct *p, u64 enq_flags)
 		return;
 
 	waker = bpf_get_current_task_btf();
-	if ((p->real_parent != waker->real_parent) || is_kernel_task(waker))
+	if (is_kernel_task(waker))
 		return;
 
 	waker_taskc = get_task_ctx(waker);
@@ -815,6 +827,16 @@ void BPF_STRUCT_OPS(lavd_runnable, struct task_struct *p, u64 enq_flags)
 		return;
 	}
 
+	/*
+	 * Keep track of the blocking chain across processes since a critical
+	 * path (e.g., an RPC served over a socket) can span processes.
+	 */
+	if (!no_wake_chain)
+		update_wake_chain(waker_taskc, p, p_taskc);
+
+	if (p->real_parent != waker->real_parent)
+		return;
+
 	/*
 	 * Update wake frequency.
 	 */
@@ -868,9 +890,9 @@ void BPF_STRUCT_OPS(lavd_running, struct task_struct *p)
 	cpuc->stopping_tm_est_ns = get_est_stopping_time(taskc, now);
 
 	/*
-	 * If there is a relevant introspection command with @p, process it.
+	 * Sample @p for introspection if sampling is on.
 	 */
-	try_proc_introspec_cmd(p, taskc);
+	try_sample_task_ctx(p, taskc, cpuc);
 }
 
 void BPF_STRUCT_OPS(lavd_stopping, struct task_struct *p, bool runnable)
@@ -937,6 +959,7 @@ unlock_out:
 	bpf_rcu_read_unlock();
 
 	cpuc->idle_start_clk = 0;
+	reset_cpu_stat_clk(cpuc, now);
 	cpuc->lat_cri = 0;
 	cpuc->stopping_tm_est_ns = SCX_SLICE_INF;
 	WRITE_ONCE(cpuc->online_clk, now);
@@ -1035,6 +1058,12 @@ void BPF_STRUCT_OPS(lavd_update_idle, s32 cpu, bool idle)
 	 * The CPU is entering into the idle state.
 	 */
 	if (idle) {
+		/*
+		 * Publish the statistics of the busy period before going
+		 * idle, so the update timer can see them while this CPU
+		 * stays idle.
+		 */
+		try_fold_cpu_stat(cpuc, now);
 		cpuc->idle_start_clk = now;
 
 		/*
@@ -1051,21 +1080,22 @@ void BPF_STRUCT_OPS(lavd_update_idle, s32 cpu, bool idle)
 		 * If idle_start_clk is zero, that means entering into the idle
 		 * is not captured by the scx (i.e., the scx scheduler is
 		 * loaded when this CPU is in an idle state).
+		 *
+		 * Only this CPU updates its idle_start_clk and idle_total, so
+		 * there is no need to synchronize with the update timer.
 		 */
 		u64 old_clk = cpuc->idle_start_clk;
 		if (old_clk != 0) {
-			/*
-			 * The CAS failure happens when idle_start_clk is
-			 * updated by the update timer. That means the update
-			 * timer already took the idle_time duration. Hence the
-			 * idle duration should not be accumulated.
-			 */
-			u64 duration = time_delta(now, old_clk);
-			bool ret = __sync_bool_compare_and_swap(
-					&cpuc->idle_start_clk, old_clk, 0);
-			if (ret)
-				cpuc->idle_total += duration;
+			cpuc->idle_total += time_delta(now, old_clk);
+			cpuc->idle_start_clk = 0;
 		}
+
+		/*
+		 * Fold the idle period before running a task, so that the
+		 * utilization of a CPU that stayed idle for a while decays
+		 * before it decides the performance target in running.
+		 */
+		try_fold_cpu_stat(cpuc, now);
 	}
 }
 
@@ -1380,6 +1410,7 @@ static s32 init_per_cpu_ctx(u64 now)
 
 		cpuc->cpu_id = cpu;
 		cpuc->idle_start_clk = 0;
+		reset_cpu_stat_clk(cpuc, now);
 		cpuc->lat_cri = 0;
 		cpuc->stopping_tm_est_ns = SCX_SLICE_INF;
 		cpuc->online_clk = now;
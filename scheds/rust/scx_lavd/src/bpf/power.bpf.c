@@ -60,6 +60,12 @@ const volatile u16	pco_nr_primary[LAVD_PCO_STATE_MAX];
 /* The PCO table */
 const volatile u16	pco_table[LAVD_PCO_STATE_MAX][LAVD_CPU_ID_MAX];
 
+/* The capacity covered by the PCO lookup table (i.e., the highest bound). */
+const volatile u32	pco_lut_cap;
+
+/* Utilization-indexed lookup table from the required capacity to PCO state. */
+const volatile u8	pco_lut[LAVD_PCO_LUT_NR];
+
 /* The index for current PCO state */
 volatile static int	pco_idx;
 
@@ -155,6 +161,40 @@ static u64 get_human_readable_avg_sc_util(u64 avg_sc_util)
 	return (avg_sc_util * nr_cpus_onln * 1000) / total_capacity;
 }
 
+static int lookup_pco_state(u64 req_cap)
+{
+	u64 b;
+
+	b = (req_cap * LAVD_PCO_LUT_NR) / max(pco_lut_cap, 1);
+	if (b >= LAVD_PCO_LUT_NR)
+		b = LAVD_PCO_LUT_NR - 1;
+	return pco_lut[b];
+}
+
+static int calc_pco_idx(u64 req_cap)
+{
+	int cur = READ_ONCE(pco_idx);
+	int next;
+
+	/*
+	 * Move up to a higher PCO state immediately to meet the demand.
+	 * However, move down to a lower PCO state only when the required
+	 * capacity with some headroom (LAVD_PCO_HYST_SHIFT) still fits in the
+	 * lower state. This prevents flip-flopping between two PCO states
+	 * when the load hovers around their boundary.
+	 */
+	next = lookup_pco_state(req_cap);
+	if (next < cur) {
+		next = lookup_pco_state(req_cap + (req_cap >> LAVD_PCO_HYST_SHIFT));
+		if (next > cur)
+			next = cur;
+	}
+
+	if (next < 0 || next >= nr_pco_states || next >= LAVD_PCO_STATE_MAX)
+		next = nr_pco_states - 1;
+	return next;
+}
+
 static int calc_nr_active_cpus(void)
 {
 	u64 req_cap;
@@ -203,17 +243,22 @@ static int calc_nr_active_cpus(void)
 		/*
 		 * When the energy model is available, all primary CPUs should
 		 * be active. First, update pco_idx to meet the required
-		 * capacity. Then, choose the number of primary CPUs for the
-		 * PCO state.
+		 * capacity using the lookup table precomputed from the energy
+		 * model. Then, choose the number of primary CPUs for the PCO
+		 * state.
+		 *
+		 * The lookup table clamps the required capacity to the highest
+		 * PCO state, so check first that it can meet the demand. If it
+		 * can't, keep all the CPUs active.
 		 */
-		bpf_for(i, 0, nr_pco_states) {
-			if (i >= LAVD_PCO_STATE_MAX)
-				break;
-
-			if (pco_bounds[i] >= req_cap) {
-				WRITE_ONCE(pco_idx, i);
-				return pco_nr_primary[i];
-			}
+		i = nr_pco_states - 1;
+		if (i < 0 || i >= LAVD_PCO_STATE_MAX || req_cap > pco_bounds[i])
+			return nr_cpu_ids;
+
+		i = calc_pco_idx(req_cap);
+		if (i >= 0 && i < LAVD_PCO_STATE_MAX) {
+			WRITE_ONCE(pco_idx, i);
+			return pco_nr_primary[i];
 		}
 	}
 
@@ -26,7 +26,6 @@ struct sys_stat_ctx {
 	u64		now;
 	u64		duration;
 	u64		duration_total;
-	u64		idle_total;
 	u64		compute_total;
 	u64		tot_svc_time;
 	u64		tot_sc_time;
@@ -62,149 +61,253 @@ static void init_sys_stat_ctx(struct sys_stat_ctx *c)
 	sys_stat.last_update_clk = c->now;
 }
 
-static void collect_sys_stat(struct sys_stat_ctx *c)
+static u64 take_u64(volatile u64 *v)
 {
-	struct cpdom_ctx *cpdomc;
-	u64 dsq_id, cpuc_tot_sc_time, compute;
-	int cpu;
+	u64 val = READ_ONCE(*v);
 
 	/*
-	 * Collect statistics for each compute domain.
+	 * Subtract exactly what we read, so concurrent additions from other
+	 * CPUs are carried over to the next interval instead of being lost.
 	 */
-	bpf_for(dsq_id, 0, nr_cpdoms) {
-		if (dsq_id >= LAVD_CPDOM_MAX_NR)
+	if (val)
+		__sync_fetch_and_sub(v, val);
+	return val;
+}
+
+static u32 take_u32(volatile u32 *v)
+{
+	u32 val = READ_ONCE(*v);
+
+	if (val)
+		__sync_fetch_and_sub(v, val);
+	return val;
+}
+
+static u32 swap_u32(volatile u32 *v, u32 new_val)
+{
+	u32 old_val = READ_ONCE(*v);
+
+	for (int i = 0; i < LAVD_MAX_RETRY; i++) {
+		u32 ret = __sync_val_compare_and_swap(v, old_val, new_val);
+		if (ret == old_val)
 			break;
+		old_val = ret;
+	}
+	return old_val;
+}
 
-		cpdomc = MEMBER_VPTR(cpdom_ctxs, [dsq_id]);
-		cpdomc->cur_util_sum = 0;
-		cpdomc->nr_queued_task = scx_bpf_dsq_nr_queued(dsq_id);
-		c->nr_queued_task += cpdomc->nr_queued_task;
+static void fold_max_u32(volatile u32 *v, u32 val)
+{
+	for (int i = 0; i < LAVD_MAX_RETRY; i++) {
+		u32 old_val = READ_ONCE(*v);
+		if (old_val >= val ||
+		    __sync_bool_compare_and_swap(v, old_val, val))
+			break;
 	}
+}
+
+static void fold_min_u32(volatile u32 *v, u32 val)
+{
+	for (int i = 0; i < LAVD_MAX_RETRY; i++) {
+		u32 old_val = READ_ONCE(*v);
+		if (old_val <= val ||
+		    __sync_bool_compare_and_swap(v, old_val, val))
+			break;
+	}
+}
+
+static void update_cpu_util(struct cpu_ctx *cpuc, u64 now)
+{
+	u64 util_dur;
 
 	/*
-	 * Collect statistics for each CPU.
+	 * Update per-CPU utilization, which is capacity and frequency
+	 * invariant for the scaled one, once per update interval.
 	 */
-	bpf_for(cpu, 0, nr_cpu_ids) {
-		struct cpu_ctx *cpuc = get_cpu_ctx_id(cpu);
-		if (!cpuc) {
-			c->compute_total = 0;
-			break;
-		}
+	util_dur = time_delta(now, cpuc->util_clk);
+	if (util_dur < LAVD_SYS_STAT_INTERVAL_NS)
+		return;
+
+	cpuc->cur_util = min((cpuc->util_busy << LAVD_SHIFT) / util_dur,
+			     LAVD_SCALE);
+	cpuc->avg_util = calc_asym_avg(cpuc->avg_util, cpuc->cur_util);
+	cpuc->cur_sc_util = (cpuc->util_sc_time << LAVD_SHIFT) / util_dur;
+	cpuc->avg_sc_util = calc_avg(cpuc->avg_sc_util, cpuc->cur_sc_util);
+	cpuc->util_busy = 0;
+	cpuc->util_sc_time = 0;
+	cpuc->util_clk = now;
+}
 
-		/*
-		 * Accumulate cpus' loads.
-		 */
-		c->tot_svc_time += cpuc->tot_svc_time;
-		cpuc->tot_svc_time = 0;
+static void fold_cpu_stat(struct cpu_ctx *cpuc, u64 now)
+{
+	struct cpdom_ctx *cpdomc;
+	struct cpdom_stat *st;
+	u64 busy, sc_time;
+	u32 nr_sched;
 
-		/*
-		 * Update scaled CPU utilization,
-		 * which is capacity and frequency invariant.
-		 */
-		cpuc_tot_sc_time = cpuc->tot_sc_time;
-		cpuc->tot_sc_time = 0;
-		cpuc->cur_sc_util = (cpuc_tot_sc_time << LAVD_SHIFT) / c->duration;
-		cpuc->avg_sc_util = calc_avg(cpuc->avg_sc_util, cpuc->cur_sc_util);
+	/*
+	 * Only the owner CPU updates its counters, so reading and resetting
+	 * them here is race-free. The compute domain's accumulator is shared
+	 * by the CPUs in the domain, so it is updated atomically.
+	 */
+	busy = time_delta(time_delta(now, cpuc->fold_clk), cpuc->idle_total);
+	cpuc->idle_total = 0;
+	cpuc->fold_clk = now;
 
-		/*
-		 * Accumulate cpus' scaled loads,
-		 * whcih is capacity and frequency invariant.
-		 */
-		c->tot_sc_time += cpuc_tot_sc_time;
+	sc_time = cpuc->tot_sc_time;
+	cpuc->tot_sc_time = 0;
 
-		/*
-		 * Accumulate statistics.
-		 */
-		if (cpuc->big_core) {
-			c->nr_big += cpuc->nr_sched;
-			c->nr_pc_on_big += cpuc->nr_perf_cri;
-			c->nr_lc_on_big += cpuc->nr_lat_cri;
-		}
-		c->nr_perf_cri += cpuc->nr_perf_cri;
-		cpuc->nr_perf_cri = 0;
+	cpuc->util_busy += busy;
+	cpuc->util_sc_time += sc_time;
+	update_cpu_util(cpuc, now);
 
-		c->nr_lat_cri += cpuc->nr_lat_cri;
-		cpuc->nr_lat_cri = 0;
+	cpdomc = MEMBER_VPTR(cpdom_ctxs, [cpuc->cpdom_id]);
+	if (!cpdomc)
+		return;
+	st = &cpdomc->stat;
 
-		c->nr_x_migration += cpuc->nr_x_migration;
-		cpuc->nr_x_migration = 0;
+	__sync_fetch_and_add(&st->busy_total, busy);
+	__sync_fetch_and_add(&st->tot_sc_time, sc_time);
 
-		/*
-		 * Accumulate task's latency criticlity information.
-		 *
-		 * While updating cpu->* is racy, the resulting impact on
-		 * accuracy should be small and very rare and thus should be
-		 * fine.
-		 */
-		c->sum_lat_cri += cpuc->sum_lat_cri;
-		cpuc->sum_lat_cri = 0;
+	/*
+	 * Track the scaled time when the utilization spikes happened.
+	 */
+	if (cpuc->cur_util > LAVD_CC_UTIL_SPIKE)
+		__sync_fetch_and_add(&st->tsct_spike, sc_time);
 
-		c->nr_sched += cpuc->nr_sched;
-		cpuc->nr_sched = 0;
+	nr_sched = cpuc->nr_sched;
+	if (!nr_sched && !cpuc->nr_preempt)
+		return;
 
-		c->nr_preempt += cpuc->nr_preempt;
-		cpuc->nr_preempt = 0;
+	__sync_fetch_and_add(&st->tot_svc_time, cpuc->tot_svc_time);
+	cpuc->tot_svc_time = 0;
 
-		if (cpuc->max_lat_cri > c->max_lat_cri)
-			c->max_lat_cri = cpuc->max_lat_cri;
-		cpuc->max_lat_cri = 0;
+	/*
+	 * Accumulate statistics.
+	 */
+	if (cpuc->big_core) {
+		__sync_fetch_and_add(&st->nr_big, nr_sched);
+		__sync_fetch_and_add(&st->nr_pc_on_big, cpuc->nr_perf_cri);
+		__sync_fetch_and_add(&st->nr_lc_on_big, cpuc->nr_lat_cri);
+	}
+	__sync_fetch_and_add(&st->nr_sched, nr_sched);
+	cpuc->nr_sched = 0;
 
-		/*
-		 * Accumulate task's performance criticlity information.
-		 */
-		if (have_little_core) {
-			if (cpuc->min_perf_cri < c->min_perf_cri)
-				c->min_perf_cri = cpuc->min_perf_cri;
-			cpuc->min_perf_cri = LAVD_SCALE;
+	__sync_fetch_and_add(&st->nr_perf_cri, cpuc->nr_perf_cri);
+	cpuc->nr_perf_cri = 0;
 
-			if (cpuc->max_perf_cri > c->max_perf_cri)
-				c->max_perf_cri = cpuc->max_perf_cri;
-			cpuc->max_perf_cri = 0;
+	__sync_fetch_and_add(&st->nr_lat_cri, cpuc->nr_lat_cri);
+	cpuc->nr_lat_cri = 0;
 
-			c->sum_perf_cri += cpuc->sum_perf_cri;
-			cpuc->sum_perf_cri = 0;
-		}
+	__sync_fetch_and_add(&st->nr_x_migration, cpuc->nr_x_migration);
+	cpuc->nr_x_migration = 0;
 
-		/*
-		 * If the CPU is in an idle state (i.e., idle_start_clk is
-		 * non-zero), accumulate the current idle peirod so far.
-		 */
-		for (int i = 0; i < LAVD_MAX_RETRY; i++) {
-			u64 old_clk = cpuc->idle_start_clk;
-			if (old_clk == 0 || time_after(old_clk, c->now))
-				break;
-
-			bool ret = __sync_bool_compare_and_swap(
-					&cpuc->idle_start_clk, old_clk, c->now);
-			if (ret) {
-				cpuc->idle_total += time_delta(c->now, old_clk);
-				break;
-			}
-		}
+	__sync_fetch_and_add(&st->nr_preempt, cpuc->nr_preempt);
+	cpuc->nr_preempt = 0;
 
-		/*
-		 * Calculcate per-CPU utilization.
-		 */
-		compute = time_delta(c->duration, cpuc->idle_total);
+	/*
+	 * Accumulate task's latency criticlity information.
+	 */
+	__sync_fetch_and_add(&st->sum_lat_cri, cpuc->sum_lat_cri);
+	cpuc->sum_lat_cri = 0;
 
-		cpuc->cur_util = (compute << LAVD_SHIFT) / c->duration;
-		cpuc->avg_util = calc_asym_avg(cpuc->avg_util, cpuc->cur_util);
+	fold_max_u32(&st->max_lat_cri, cpuc->max_lat_cri);
+	cpuc->max_lat_cri = 0;
 
-		cpdomc = MEMBER_VPTR(cpdom_ctxs, [cpuc->cpdom_id]);
-		if (cpdomc)
-			cpdomc->cur_util_sum += cpuc->cur_util;
+	/*
+	 * Accumulate task's performance criticlity information.
+	 */
+	if (have_little_core) {
+		fold_min_u32(&st->min_perf_cri, cpuc->min_perf_cri);
+		cpuc->min_perf_cri = LAVD_SCALE;
 
-		/*
-		 * Accmulate system-wide idle time.
-		 */
-		c->idle_total += cpuc->idle_total;
-		cpuc->idle_total = 0;
+		fold_max_u32(&st->max_perf_cri, cpuc->max_perf_cri);
+		cpuc->max_perf_cri = 0;
+
+		__sync_fetch_and_add(&st->sum_perf_cri, cpuc->sum_perf_cri);
+		cpuc->sum_perf_cri = 0;
+	}
+}
+
+static void try_fold_cpu_stat(struct cpu_ctx *cpuc, u64 now)
+{
+	/*
+	 * Fold the per-CPU statistics into the compute domain at most once
+	 * per LAVD_SYS_STAT_FOLD_NS to amortize the atomic operations on the
+	 * shared compute domain cache line.
+	 */
+	if (time_delta(now, cpuc->fold_clk) >= LAVD_SYS_STAT_FOLD_NS)
+		fold_cpu_stat(cpuc, now);
+}
+
+static void reset_cpu_stat_clk(struct cpu_ctx *cpuc, u64 now)
+{
+	cpuc->idle_total = 0;
+	cpuc->fold_clk = now;
+	cpuc->util_busy = 0;
+	cpuc->util_sc_time = 0;
+	cpuc->util_clk = now;
+}
+
+static void collect_sys_stat(struct sys_stat_ctx *c)
+{
+	struct cpdom_ctx *cpdomc;
+	struct cpdom_stat *st;
+	u64 dsq_id, busy;
+	u32 v;
+
+	/*
+	 * Reduce the statistics folded into each compute domain. Each CPU
+	 * folds its own statistics into its compute domain (fold_cpu_stat()),
+	 * so there is no need to touch every CPU's cpu_ctx here.
+	 */
+	bpf_for(dsq_id, 0, nr_cpdoms) {
+		if (dsq_id >= LAVD_CPDOM_MAX_NR)
+			break;
+
+		cpdomc = MEMBER_VPTR(cpdom_ctxs, [dsq_id]);
+		st = &cpdomc->stat;
+
+		cpdomc->nr_queued_task = scx_bpf_dsq_nr_queued(dsq_id);
+		c->nr_queued_task += cpdomc->nr_queued_task;
 
 		/*
-		 * Track the scaled time when the utilization spikes happened.
+		 * Calculate the sum of CPU utilization of the compute domain.
 		 */
-		if (cpuc->cur_util > LAVD_CC_UTIL_SPIKE)
-			c->tsct_spike += cpuc_tot_sc_time;
+		busy = take_u64(&st->busy_total);
+		cpdomc->cur_util_sum = c->duration ?
+				(busy << LAVD_SHIFT) / c->duration : 0;
+		c->compute_total += busy;
+
+		c->tot_svc_time += take_u64(&st->tot_svc_time);
+		c->tot_sc_time += take_u64(&st->tot_sc_time);
+		c->tsct_spike += take_u64(&st->tsct_spike);
+
+		c->nr_sched += take_u32(&st->nr_sched);
+		c->nr_preempt += take_u32(&st->nr_preempt);
+		c->nr_perf_cri += take_u32(&st->nr_perf_cri);
+		c->nr_lat_cri += take_u32(&st->nr_lat_cri);
+		c->nr_x_migration += take_u32(&st->nr_x_migration);
+		c->nr_big += take_u32(&st->nr_big);
+		c->nr_pc_on_big += take_u32(&st->nr_pc_on_big);
+		c->nr_lc_on_big += take_u32(&st->nr_lc_on_big);
+
+		c->sum_lat_cri += take_u64(&st->sum_lat_cri);
+		v = swap_u32(&st->max_lat_cri, 0);
+		if (v > c->max_lat_cri)
+			c->max_lat_cri = v;
+
+		if (have_little_core) {
+			c->sum_perf_cri += take_u64(&st->sum_perf_cri);
+
+			v = swap_u32(&st->min_perf_cri, LAVD_SCALE);
+			if (v < c->min_perf_cri)
+				c->min_perf_cri = v;
+
+			v = swap_u32(&st->max_perf_cri, 0);
+			if (v > c->max_perf_cri)
+				c->max_perf_cri = v;
+		}
 	}
 }
 
@@ -226,7 +329,8 @@ static void calc_sys_stat(struct sys_stat_ctx *c)
 	 * Calculate the CPU utilization.
 	 */
 	c->duration_total = c->duration * nr_cpus_onln;
-	c->compute_total = time_delta(c->duration_total, c->idle_total);
+	if (c->compute_total > c->duration_total)
+		c->compute_total = c->duration_total;
 	c->cur_util = (c->compute_total << LAVD_SHIFT) / c->duration_total;
 
 	cur_sc_util = (c->tot_sc_time << LAVD_SHIFT) / c->duration_total;
@@ -431,6 +535,7 @@ static s32 init_sys_stat(u64 now)
 			break;
 
 		cpdomc = MEMBER_VPTR(cpdom_ctxs, [dsq_id]);
+		cpdomc->stat.min_perf_cri = LAVD_SCALE;
 		if (cpdomc->nr_active_cpus)
 			sys_stat.nr_active_cpdoms++;
 	}
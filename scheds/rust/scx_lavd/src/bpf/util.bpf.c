@@ -28,6 +28,7 @@ struct sys_stat	sys_stat;
  */
 volatile bool		no_preemption;
 volatile bool		no_wake_sync;
+volatile bool		no_wake_chain;
 volatile bool		no_core_compaction;
 volatile bool		no_freq_scaling;
 volatile bool		is_powersave_mode;
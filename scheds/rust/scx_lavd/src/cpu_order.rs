@@ -108,6 +108,42 @@ impl CpuOrder {
             has_energy_model: ctx.has_energy_model,
         })
     }
+
+    /// Build a dense, utilization-indexed lookup table of the PCO states.
+    /// See gen_pco_lut() for details.
+    pub fn gen_pco_lut(&self, nr_entries: usize) -> Vec<u8> {
+        gen_pco_lut(&self.perf_cpu_order, nr_entries)
+    }
+}
+
+/// Build a dense lookup table from the required compute capacity to the
+/// index of a PCO state (i.e., an index of @perf_cpu_order in ascending
+/// order of perf_cap).
+///
+/// The capacity range [0, max perf_cap] is evenly split into @nr_entries
+/// buckets. Each bucket holds the lowest PCO state whose capacity bound
+/// covers the upper edge of the bucket. Since the performance domain sets
+/// of lower PCO states consume less power, this is the most power-efficient
+/// state that meets any required capacity falling into the bucket. The BPF
+/// side can then find the PCO state with a single array lookup.
+pub fn gen_pco_lut(perf_cpu_order: &BTreeMap<usize, PerfCpuOrder>, nr_entries: usize) -> Vec<u8> {
+    let perf_caps: Vec<usize> = perf_cpu_order.keys().cloned().collect();
+    let max_cap = *perf_caps.last().unwrap();
+    let mut lut = Vec::with_capacity(nr_entries);
+    let mut state = 0;
+
+    for b in 0..nr_entries {
+        let upper = ((b + 1) * max_cap).div_ceil(nr_entries);
+        while state < perf_caps.len() - 1 && perf_caps[state] < upper {
+            state += 1;
+        }
+        lut.push(state as u8);
+    }
+
+    debug!("## gen_pco_lut");
+    debug!("{:?}", lut);
+
+    lut
 }
 
 /// CpuOrderCtx is a helper struct used to build a CpuOrder
@@ -1050,8 +1086,8 @@ impl<'a> PDSetInfo<'_> {
         let nr_cpus = self.pdcpu_set.len();
 
         ((nr_pds - nr_pds_overlap) * PD_UNIT) +         // # non-overlapping PDs
-        ((*NR_CPU_IDS - nr_cpus) * CPU_UNIT) +          // # of CPUs
-        (*NR_CPU_IDS - self.pd_id_set.first().unwrap()) // PD ID as a tiebreaker
+        (NR_CPU_IDS.saturating_sub(nr_cpus) * CPU_UNIT) + // # of CPUs
+        NR_CPU_IDS.saturating_sub(*self.pd_id_set.first().unwrap()) // PD ID as a tiebreaker
     }
 }
 
@@ -1090,3 +1126,129 @@ impl fmt::Display for PerfCpuOrder {
         Ok(())
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::Arc;
+
+    fn perf_state(performance: usize, power: usize) -> Arc<PerfState> {
+        Arc::new(PerfState {
+            cost: power,
+            frequency: performance * 1000,
+            inefficient: 0,
+            performance,
+            power,
+        })
+    }
+
+    fn perf_domain(id: usize, mask: u64, states: &[(usize, usize)]) -> Arc<PerfDomain> {
+        let perf_table = states
+            .iter()
+            .map(|&(perf, power)| (perf, perf_state(perf, power)))
+            .collect();
+        Arc::new(PerfDomain {
+            id,
+            span: Cpumask::from_vec(vec![mask]),
+            perf_table,
+        })
+    }
+
+    fn cpu_id(cpu_adx: usize, pd_adx: usize, cpu_cap: usize, big_core: bool) -> CpuId {
+        CpuId {
+            node_adx: 0,
+            pd_adx,
+            llc_rdx: 0,
+            core_rdx: cpu_adx,
+            cpu_rdx: 0,
+            cpu_adx,
+            smt_level: 1,
+            cache_size: 0,
+            cpu_cap,
+            big_core,
+            turbo_core: false,
+        }
+    }
+
+    /// A hybrid system with two LITTLE CPUs (pd 0) and two big CPUs (pd 1).
+    fn hybrid_em() -> (EnergyModel, Vec<CpuId>) {
+        let mut perf_doms = BTreeMap::new();
+        perf_doms.insert(
+            0,
+            perf_domain(0, 0b0011, &[(100, 40), (200, 110), (300, 250)]),
+        );
+        perf_doms.insert(
+            1,
+            perf_domain(1, 0b1100, &[(400, 300), (700, 800), (1024, 1800)]),
+        );
+        let cpus = vec![
+            cpu_id(2, 1, 1024, true),
+            cpu_id(3, 1, 1024, true),
+            cpu_id(0, 0, 300, false),
+            cpu_id(1, 0, 300, false),
+        ];
+        (EnergyModel { perf_doms }, cpus)
+    }
+
+    #[test]
+    fn test_pco_lut_matches_energy_model() {
+        let (em, cpus) = hybrid_em();
+        let pco = EnergyModelOptimizer::get_perf_cpu_order_table(&em, &cpus);
+        assert!(!pco.is_empty());
+
+        let nr_entries = 128;
+        let lut = gen_pco_lut(&pco, nr_entries);
+        assert_eq!(lut.len(), nr_entries);
+
+        let perf_caps: Vec<usize> = pco.keys().cloned().collect();
+        let max_cap = *perf_caps.last().unwrap();
+        for (b, &state) in lut.iter().enumerate() {
+            let state = state as usize;
+            let upper = ((b + 1) * max_cap).div_ceil(nr_entries);
+
+            // The table is monotonic in the required capacity.
+            if b > 0 {
+                assert!(lut[b - 1] as usize <= state);
+            }
+
+            // The chosen state covers the demand of the bucket, and it is
+            // the lowest (i.e., the most power-efficient) one doing so.
+            assert!(perf_caps[state] >= upper);
+            if state > 0 {
+                assert!(perf_caps[state - 1] < upper);
+            }
+        }
+
+        // The primary CPUs of each PCO state can deliver its capacity bound
+        // according to the energy model.
+        for (&perf_cap, order) in pco.iter() {
+            let max_perf: usize = order
+                .cpus_perf
+                .borrow()
+                .iter()
+                .map(|&cpu| {
+                    let pd = em.get_pd_by_cpu_id(cpu).unwrap();
+                    let (&perf, _) = pd.perf_table.last_key_value().unwrap();
+                    perf
+                })
+                .sum();
+            assert!(max_perf >= perf_cap);
+        }
+    }
+
+    #[test]
+    fn test_pco_lut_single_state() {
+        let mut pco = BTreeMap::new();
+        pco.insert(
+            4096,
+            PerfCpuOrder {
+                perf_cap: 4096,
+                perf_util: 1.0,
+                cpus_perf: vec![0, 1, 2, 3].into(),
+                cpus_ovflw: vec![].into(),
+            },
+        );
+        let lut = gen_pco_lut(&pco, 16);
+        assert!(lut.iter().all(|&s| s == 0));
+    }
+}
@@ -15,10 +15,14 @@ mod cpu_order;
 mod stats;
 use std::ffi::c_int;
 use std::ffi::CStr;
-use std::mem;
 use std::mem::MaybeUninit;
+use std::os::fd::AsFd;
+use std::os::fd::AsRawFd;
+use std::ptr;
 use std::str;
+use std::sync::atomic::fence;
 use std::sync::atomic::AtomicBool;
+use std::sync::atomic::AtomicU64;
 use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::thread::ThreadId;
@@ -30,17 +34,12 @@ use clap::Parser;
 use clap_num::number_range;
 use cpu_order::CpuOrder;
 use cpu_order::PerfCpuOrder;
-use crossbeam::channel;
-use crossbeam::channel::Receiver;
 use crossbeam::channel::RecvTimeoutError;
-use crossbeam::channel::Sender;
-use crossbeam::channel::TrySendError;
 use libbpf_rs::OpenObject;
 use libbpf_rs::ProgramInput;
 use libc::c_char;
 use log::debug;
 use log::info;
-use plain::Plain;
 use scx_stats::prelude::*;
 use scx_utils::autopower::{fetch_power_profile, PowerProfile};
 use scx_utils::build_id;
@@ -145,6 +144,13 @@ struct Opts {
     #[clap(long = "no-wake-sync", action = clap::ArgAction::SetTrue)]
     no_wake_sync: bool,
 
+    /// Do not propagate latency criticality along wake-up chains. When
+    /// enabled, a task that repeatedly wakes up a latency-critical task
+    /// (e.g., releasing a futex or writing to a pipe or socket) inherits
+    /// the wakee's latency criticality.
+    #[clap(long = "no-wake-chain", action = clap::ArgAction::SetTrue)]
+    no_wake_chain: bool,
+
     /// Disable core compaction so the scheduler uses all the online CPUs.
     /// The core compaction attempts to minimize the number of actively used
     /// CPUs for unaffinitized tasks, respecting the CPU preference order.
@@ -173,6 +179,13 @@ struct Opts {
     #[clap(long)]
     monitor_sched_samples: Option<u64>,
 
+    /// Keep sampling one out of every N schedules on each CPU into the
+    /// per-CPU introspection rings, so the scheduling samples can be
+    /// monitored at any time with little overhead. When 0 (default),
+    /// sampling is enabled only while a monitor requests samples.
+    #[clap(long = "introspec-sample-rate", default_value = "0")]
+    introspec_sample_rate: u32,
+
     /// Enable verbose output, including libbpf details. Specify multiple
     /// times to increase verbosity.
     #[clap(short = 'v', long, action = clap::ArgAction::Count)]
@@ -288,27 +301,64 @@ impl Opts {
     }
 }
 
-unsafe impl Plain for msg_task_ctx {}
+/// Read-only mapping of the per-CPU introspection rings, which stays valid
+/// until it is dropped.
+struct IntrospecRings {
+    ptr: *const introspec_ring,
+}
+
+impl IntrospecRings {
+    fn map(skel: &BpfSkel) -> Result<Self> {
+        let fd = skel.maps.introspec_rings.as_fd().as_raw_fd();
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                Self::size(),
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                fd,
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error())
+                .context("Failed to mmap the introspection rings");
+        }
+        Ok(Self {
+            ptr: ptr as *const introspec_ring,
+        })
+    }
+
+    fn size() -> usize {
+        *NR_CPU_IDS * std::mem::size_of::<introspec_ring>()
+    }
 
-impl msg_task_ctx {
-    fn from_bytes(buf: &[u8]) -> &msg_task_ctx {
-        plain::from_bytes(buf).expect("The buffer is either too short or not aligned!")
+    fn as_slice(&self) -> &[introspec_ring] {
+        unsafe { std::slice::from_raw_parts(self.ptr, *NR_CPU_IDS) }
     }
 }
 
-impl introspec {
-    fn new() -> Self {
-        let intrspc = unsafe { mem::MaybeUninit::<introspec>::zeroed().assume_init() };
-        intrspc
+impl Drop for IntrospecRings {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.ptr as *mut libc::c_void, Self::size());
+        }
     }
 }
 
+/// Load @val, which BPF publishes with smp_store_release(), with acquire
+/// ordering.
+fn load_acquire(val: &u64) -> u64 {
+    unsafe { (*(val as *const u64 as *const AtomicU64)).load(Ordering::Acquire) }
+}
+
 struct Scheduler<'a> {
     skel: BpfSkel<'a>,
     struct_ops: Option<libbpf_rs::Link>,
-    rb_mgr: libbpf_rs::RingBuffer<'static>,
-    intrspc: introspec,
-    intrspc_rx: Receiver<SchedSample>,
+    intrspc_rate: u32,
+    intrspc_rings: IntrospecRings,
+    intrspc_tails: Vec<u64>,
+    intrspc_next_cpu: usize,
     monitor_tid: Option<ThreadId>,
     stats_server: StatsServer<StatsReq, StatsRes>,
     mseq_id: u64,
@@ -351,28 +401,25 @@ impl<'a> Scheduler<'a> {
         // Initialize skel according to @opts.
         Self::init_globals(&mut skel, &opts, &order);
 
+        // Allocate an introspection ring only for the possible CPUs.
+        skel.maps
+            .introspec_rings
+            .set_max_entries(*NR_CPU_IDS as u32)
+            .context("Failed to resize the introspection rings")?;
+
         // Attach.
         let mut skel = scx_ops_load!(skel, lavd_ops, uei)?;
+        let intrspc_rings = IntrospecRings::map(&skel)?;
         let struct_ops = Some(scx_ops_attach!(skel, lavd_ops)?);
         let stats_server = StatsServer::new(stats::server_data(*NR_CPU_IDS as u64)).launch()?;
 
-        // Build a ring buffer for instrumentation
-        let (intrspc_tx, intrspc_rx) = channel::bounded(65536);
-        let rb_map = &mut skel.maps.introspec_msg;
-        let mut builder = libbpf_rs::RingBufferBuilder::new();
-        builder
-            .add(rb_map, move |data| {
-                Scheduler::relay_introspec(data, &intrspc_tx)
-            })
-            .unwrap();
-        let rb_mgr = builder.build().unwrap();
-
         Ok(Self {
             skel,
             struct_ops,
-            rb_mgr,
-            intrspc: introspec::new(),
-            intrspc_rx,
+            intrspc_rate: opts.introspec_sample_rate,
+            intrspc_rings,
+            intrspc_tails: vec![0; *NR_CPU_IDS],
+            intrspc_next_cpu: 0,
             monitor_tid: None,
             stats_server,
             mseq_id: 0,
@@ -443,6 +490,17 @@ impl<'a> Scheduler<'a> {
         for i in nr_pco_states..LAVD_PCO_STATE_MAX as u8 {
             Self::init_pco_tuple(skel, i as usize, &last_pco);
         }
+
+        // Initialize the utilization-indexed lookup table of PCO states.
+        let (&pco_lut_cap, _) = order.perf_cpu_order.last_key_value().unwrap();
+        skel.maps.rodata_data.pco_lut_cap = pco_lut_cap as u32;
+        for (i, &state) in order
+            .gen_pco_lut(LAVD_PCO_LUT_NR as usize)
+            .iter()
+            .enumerate()
+        {
+            skel.maps.rodata_data.pco_lut[i] = state;
+        }
     }
 
     fn init_pco_tuple(skel: &mut OpenBpfSkel, i: usize, pco: &PerfCpuOrder) {
@@ -497,6 +555,7 @@ impl<'a> Scheduler<'a> {
     fn init_globals(skel: &mut OpenBpfSkel, opts: &Opts, order: &CpuOrder) {
         skel.maps.bss_data.no_preemption = opts.no_preemption;
         skel.maps.bss_data.no_wake_sync = opts.no_wake_sync;
+        skel.maps.bss_data.no_wake_chain = opts.no_wake_chain;
         skel.maps.bss_data.no_core_compaction = opts.no_core_compaction;
         skel.maps.bss_data.no_freq_scaling = opts.no_freq_scaling;
         skel.maps.bss_data.is_powersave_mode = opts.powersave;
@@ -508,6 +567,7 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.slice_min_ns = opts.slice_min_us * 1000;
         skel.maps.rodata_data.preempt_shift = opts.preempt_shift;
         skel.maps.rodata_data.no_use_em = opts.no_use_em as u8;
+        skel.maps.bss_data.introspec_sample_rate = opts.introspec_sample_rate;
 
         skel.struct_ops.lavd_ops_mut().flags = *compat::SCX_OPS_ENQ_EXITING
             | *compat::SCX_OPS_ENQ_LAST
@@ -523,16 +583,8 @@ impl<'a> Scheduler<'a> {
         }
     }
 
-    fn relay_introspec(data: &[u8], intrspc_tx: &Sender<SchedSample>) -> i32 {
-        let mt = msg_task_ctx::from_bytes(data);
-        let tx = mt.taskc_x;
-        let tc = mt.taskc;
-
-        // No idea how to print other types than LAVD_MSG_TASKC
-        if mt.hdr.kind != LAVD_MSG_TASKC {
-            return 0;
-        }
-
+    fn to_sched_sample(sm: &introspec_sample) -> SchedSample {
+        let tx = &sm.taskc_x;
         let mseq = Scheduler::get_msg_seq_id();
 
         let c_tx_cm: *const c_char = (&tx.comm as *const [c_char; 17]) as *const c_char;
@@ -543,39 +595,105 @@ impl<'a> Scheduler<'a> {
         let c_tx_st_str: &CStr = unsafe { CStr::from_ptr(c_tx_st) };
         let tx_stat: &str = c_tx_st_str.to_str().unwrap();
 
-        match intrspc_tx.try_send(SchedSample {
+        SchedSample {
             mseq,
             pid: tx.pid,
             comm: tx_comm.into(),
             stat: tx_stat.into(),
             cpu_id: tx.cpu_id,
-            slice_ns: tc.slice_ns,
-            lat_cri: tc.lat_cri,
+            slice_ns: sm.slice_ns,
+            lat_cri: sm.lat_cri,
             avg_lat_cri: tx.avg_lat_cri,
             static_prio: tx.static_prio,
-            run_freq: tc.run_freq,
-            avg_runtime: tc.avg_runtime,
-            wait_freq: tc.wait_freq,
-            wake_freq: tc.wake_freq,
-            perf_cri: tc.perf_cri,
+            run_freq: sm.run_freq,
+            avg_runtime: sm.avg_runtime,
+            wait_freq: sm.wait_freq,
+            wake_freq: sm.wake_freq,
+            perf_cri: sm.perf_cri,
             thr_perf_cri: tx.thr_perf_cri,
             cpuperf_cur: tx.cpuperf_cur,
             cpu_util: tx.cpu_util,
             cpu_sutil: tx.cpu_sutil,
             nr_active: tx.nr_active,
-        }) {
-            Ok(()) | Err(TrySendError::Full(_)) => 0,
-            Err(e) => panic!("failed to send on intrspc_tx ({})", e),
         }
     }
 
+    /// Read the sample @seq of @ring. Return None if the sample has been
+    /// overwritten by BPF before being read, or while reading it.
+    fn read_introspec_sample(ring: &introspec_ring, seq: u64) -> Option<SchedSample> {
+        let ring_sz = LAVD_INTROSPEC_RING_SZ as u64;
+        let slot = &ring.samples[(seq % ring_sz) as usize];
+
+        let seq_before = load_acquire(&slot.seq);
+        let sm = unsafe { ptr::read_volatile(slot) };
+        fence(Ordering::Acquire);
+        let seq_after = load_acquire(&slot.seq);
+
+        if seq_before == seq + 1 && seq_after == seq + 1 {
+            Some(Self::to_sched_sample(&sm))
+        } else {
+            None
+        }
+    }
+
+    /// Skip all the samples currently in the per-CPU introspection rings.
+    fn skip_introspec(&mut self) {
+        let rings = self.intrspc_rings.as_slice();
+
+        for (ring, tail) in rings.iter().zip(self.intrspc_tails.iter_mut()) {
+            *tail = load_acquire(&ring.head);
+        }
+    }
+
+    /// Drain up to @max samples from the per-CPU introspection rings in
+    /// bulk. The rings are drained round-robin, one sample per CPU at a
+    /// time starting from where the last drain stopped, so the samples are
+    /// not biased toward the CPUs with the lowest ids. The samples left over
+    /// are skipped.
+    fn drain_introspec(&mut self, max: usize) -> Vec<SchedSample> {
+        let rings = self.intrspc_rings.as_slice();
+        let ring_sz = LAVD_INTROSPEC_RING_SZ as u64;
+        let nr_cpus = rings.len();
+        let mut samples = Vec::with_capacity(max);
+
+        // Snapshot the heads first, so that the CPUs producing samples
+        // while draining don't get more samples than the others.
+        let heads: Vec<u64> = rings.iter().map(|ring| load_acquire(&ring.head)).collect();
+
+        // Skip the samples already overwritten by BPF.
+        for (tail, &head) in self.intrspc_tails.iter_mut().zip(heads.iter()) {
+            *tail = (*tail).max(head.saturating_sub(ring_sz));
+        }
+
+        let mut cpu = self.intrspc_next_cpu % nr_cpus;
+        let mut nr_idle = 0;
+        while samples.len() < max && nr_idle < nr_cpus {
+            let tail = &mut self.intrspc_tails[cpu];
+            if *tail < heads[cpu] {
+                if let Some(sm) = Self::read_introspec_sample(&rings[cpu], *tail) {
+                    samples.push(sm);
+                }
+                *tail += 1;
+                nr_idle = 0;
+            } else {
+                nr_idle += 1;
+            }
+            cpu = (cpu + 1) % nr_cpus;
+        }
+        self.intrspc_next_cpu = cpu;
+
+        self.intrspc_tails.copy_from_slice(&heads);
+        samples
+    }
+
     fn prep_introspec(&mut self) {
-        self.skel.maps.bss_data.intrspc.cmd = self.intrspc.cmd;
-        self.skel.maps.bss_data.intrspc.arg = self.intrspc.arg;
+        if self.intrspc_rate == 0 {
+            self.skel.maps.bss_data.introspec_sample_rate = 1;
+        }
     }
 
     fn cleanup_introspec(&mut self) {
-        self.skel.maps.bss_data.intrspc.cmd = LAVD_CMD_NOP;
+        self.skel.maps.bss_data.introspec_sample_rate = self.intrspc_rate;
     }
 
     fn get_pc(x: u64, y: u64) -> f64 {
@@ -594,7 +712,7 @@ impl<'a> Scheduler<'a> {
     fn stats_req_to_res(&mut self, req: &StatsReq) -> Result<StatsRes> {
         Ok(match req {
             StatsReq::NewSampler(tid) => {
-                self.rb_mgr.consume().unwrap();
+                self.skip_introspec();
                 self.monitor_tid = Some(*tid);
                 StatsRes::Ack
             }
@@ -656,17 +774,15 @@ impl<'a> Scheduler<'a> {
                     return Ok(StatsRes::Bye);
                 }
 
-                self.intrspc.cmd = LAVD_CMD_SCHED_N;
-                self.intrspc.arg = *nr_samples;
+                // Skip the stale samples of the last interval unless the
+                // sampling is permanently on.
+                if self.intrspc_rate == 0 {
+                    self.skip_introspec();
+                }
                 self.prep_introspec();
                 std::thread::sleep(Duration::from_millis(*interval_ms));
-                self.rb_mgr.poll(Duration::from_millis(100)).unwrap();
-
-                let mut samples = vec![];
-                while let Ok(ts) = self.intrspc_rx.try_recv() {
-                    samples.push(ts);
-                }
 
+                let samples = self.drain_introspec(*nr_samples as usize);
                 self.cleanup_introspec();
 
                 StatsRes::SchedSamples(SchedSamples { samples })
@@ -750,7 +866,6 @@ impl<'a> Scheduler<'a> {
             }
             self.cleanup_introspec();
         }
-        self.rb_mgr.consume().unwrap();
 
         let _ = self.struct_ops.take();
         uei_report!(&self.skel, uei)
@@ -23,9 +23,21 @@ enum consts {
 	MAX_CPUS_SHIFT = 9,
 	MAX_CPUS = 1 << MAX_CPUS_SHIFT,
 	MAX_CPUS_U8 = MAX_CPUS / 8,
-	MAX_CELLS = 16,
+	MAX_CELLS = 4096,
+	CELL_WORDS = MAX_CELLS / 64,
 	USAGE_HALF_LIFE = 100000000, /* 100ms */
 
+	/*
+	 * Cells live in the arena in chunks of CELLS_PER_CHUNK, allocated the
+	 * first time one of their ids is handed out.
+	 */
+	CELL_CHUNK_SHIFT = 6,
+	CELLS_PER_CHUNK = 1 << CELL_CHUNK_SHIFT,
+	MAX_CELL_CHUNKS = MAX_CELLS / CELLS_PER_CHUNK,
+
+	/* Number of distinct cells each CPU keeps local stats for */
+	CPU_CELL_STAT_SLOTS = 8,
+
 	HI_FALLBACK_DSQ = MAX_CELLS,
 	LO_FALLBACK_DSQ = MAX_CELLS + 1,
 };
@@ -41,10 +53,22 @@ enum cell_stat_idx {
 	NR_CSTATS,
 };
 
+/*
+ * Stats a CPU accumulated for one cell. Slots are recycled when a CPU runs
+ * more distinct cells than it has slots, in which case the evicted counts are
+ * folded into the cell's totals.
+ */
+struct cpu_cell_stats {
+	/* cell + 1, 0 if the slot is unused */
+	u32 key;
+	u64 cstats[NR_CSTATS];
+	u64 cycles;
+};
+
 struct cpu_ctx {
-	u64 cstats[MAX_CELLS][NR_CSTATS];
-	u64 cell_cycles[MAX_CELLS];
+	struct cpu_cell_stats cell_stats[CPU_CELL_STAT_SLOTS];
 	u32 cell;
+	u32 cell_stats_rr;
 };
 
 struct cgrp_ctx {
@@ -58,10 +82,14 @@ struct cgrp_ctx {
 struct cell {
 	// current vtime of the cell
 	u64 vtime_now;
-	// which dsq the cell uses
-	u32 dsq;
-	// Whether or not the cell is used or not
-	u32 in_use;
-};
+	// stats flushed from per-CPU slots, see struct cpu_cell_stats
+	u64 cstats[NR_CSTATS];
+	u64 cycles;
+	// cpus of the cpuset the cell was created from, the cell may be shrunk
+	// below it but never grown beyond it
+	u64 home_cpus[MAX_CPUS / 64];
+	// DSQ depth as of the last sample_cells() run
+	u32 nr_queued;
+} __attribute__((aligned(CACHELINE_SIZE)));
 
 #endif /* __INTF_H */
@@ -9,7 +9,9 @@
  * assignment (all are determined by userspace).
  *
  * Each cell has an associated DSQ which it uses for vtime scheduling of the
- * cgroups belonging to the cell.
+ * cgroups belonging to the cell. Cells are identified by a compact id which is
+ * also their DSQ id, and their book-keeping lives in the arena so that the
+ * number of cells isn't bounded by the size of any per-CPU structure.
  */
 
 #include "intf.h"
@@ -18,9 +20,11 @@
 #define __bpf__
 #include "../../../../include/scx/common.bpf.h"
 #include "../../../../include/scx/ravg_impl.bpf.h"
+#include "../../../../include/scx/bpf_arena_common.bpf.h"
 #else
 #include <scx/common.bpf.h>
 #include <scx/ravg_impl.bpf.h>
+#include <scx/bpf_arena_common.bpf.h>
 #endif
 
 char _license[] SEC("license") = "GPL";
@@ -42,8 +46,34 @@ const volatile u64 slice_ns;
 u32 configuration_seq;
 u32 applied_configuration_seq;
 
+/*
+ * With dynamic_cells, userspace resizes cells by writing the cell of every
+ * CPU into cpu_cell_assignment and then bumping assignment_seq. The
+ * assignment is only applied if configuration_seq still equals
+ * assignment_base_seq, i.e. if no cell was created since userspace read the
+ * state it based the assignment on. Stale assignments are dropped and
+ * userspace retries with fresh state.
+ */
+const volatile bool dynamic_cells = false;
+u32 cpu_cell_assignment[MAX_CPUS];
+u32 assignment_base_seq;
+u32 assignment_seq;
+u32 applied_assignment_seq;
+u64 nr_stale_assignments;
+
 private(all_cpumask) struct bpf_cpumask __kptr *all_cpumask;
 
+struct {
+	__uint(type, BPF_MAP_TYPE_ARENA);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(max_entries, 1 << 12); /* number of pages */
+#if defined(__TARGET_ARCH_arm64) || defined(__aarch64__)
+	__ulong(map_extra, (1ull << 32)); /* start of mmap() region */
+#else
+	__ulong(map_extra, (1ull << 44)); /* start of mmap() region */
+#endif
+} arena SEC(".maps");
+
 UEI_DEFINE(uei);
 
 static inline struct cgroup *lookup_cgrp_ancestor(struct cgroup *cgrp,
@@ -151,53 +181,130 @@ static inline struct cpu_ctx *lookup_cpu_ctx(int cpu)
 	return cctx;
 }
 
-struct cell cells[MAX_CELLS];
+/*
+ * Arena pointers to the cell chunks, see CELL_CHUNK_SHIFT. Chunks are never
+ * freed, so a stale cell id always resolves to valid memory.
+ */
+u64 cell_chunks[MAX_CELL_CHUNKS];
+
+/* Bitmap of the cell ids currently in use */
+u64 cells_in_use[CELL_WORDS];
 
-static inline struct cell *lookup_cell(int idx)
+static inline struct cell __arena *lookup_cell(int idx)
 {
-	struct cell *cell;
+	struct cell __arena *chunk;
+	u64 *chunkp;
 
-	cell = MEMBER_VPTR(cells, [idx]);
-	if (!cell) {
+	chunkp = MEMBER_VPTR(cell_chunks, [(u32)idx >> CELL_CHUNK_SHIFT]);
+	if (!chunkp || !(chunk = (struct cell __arena *)*chunkp)) {
 		scx_bpf_error("Invalid cell %d", idx);
 		return NULL;
 	}
-	return cell;
+
+	return &chunk[idx & (CELLS_PER_CHUNK - 1)];
+}
+
+/*
+ * Back the chunk holding @cell_idx with arena memory. Cgroups may be
+ * initialized concurrently, the loser of a race frees its pages.
+ */
+static int alloc_cell_chunk(u32 cell_idx)
+{
+	u32 nr_pages = (sizeof(struct cell) * CELLS_PER_CHUNK + PAGE_SIZE - 1) / PAGE_SIZE;
+	void __arena *chunk;
+	u64 *chunkp;
+
+	if (!(chunkp = MEMBER_VPTR(cell_chunks, [cell_idx >> CELL_CHUNK_SHIFT])))
+		return -EINVAL;
+
+	if (READ_ONCE(*chunkp))
+		return 0;
+
+	chunk = bpf_arena_alloc_pages(&arena, NULL, nr_pages, NUMA_NO_NODE, 0);
+	if (!chunk)
+		return -ENOMEM;
+
+	if (!__sync_bool_compare_and_swap(chunkp, 0, (u64)chunk))
+		bpf_arena_free_pages(&arena, chunk, nr_pages);
+
+	return 0;
 }
 
+static int alloc_cell_cpumasks(u32 cell_idx);
+
 /*
  * Cells are allocated concurrently in some cases (e.g. cgroup_init).
- * allocate_cell and free_cell enable these allocations to be done safely
+ * allocate_cell and free_cell enable these allocations to be done safely.
+ * Backing memory, the DSQ and cpumasks of a cell id are set up by setup_cell()
+ * the first time the id is used and kept around for later reuse.
 */
-static inline int allocate_cell()
+static int allocate_cell(void)
 {
-	int cell_idx;
-	bpf_for(cell_idx, 0, MAX_CELLS)
+	u64 *word, old;
+	int w, b;
+
+	bpf_for(w, 0, CELL_WORDS)
 	{
-		struct cell *c;
-		if (!(c = lookup_cell(cell_idx)))
+		if (!(word = MEMBER_VPTR(cells_in_use, [w])))
 			return -1;
 
-		if (__sync_bool_compare_and_swap(&c->in_use, 0, 1))
-			return cell_idx;
+		bpf_for(b, 0, 64)
+		{
+			old = READ_ONCE(*word);
+			if (old == -1LLU)
+				break;
+			if (old & (1LLU << b))
+				continue;
+			if (!__sync_bool_compare_and_swap(word, old, old | (1LLU << b)))
+				continue;
+
+			return w * 64 + b;
+		}
 	}
 	scx_bpf_error("No available cells to allocate");
 	return -1;
 }
 
+static int setup_cell(u32 cell_idx)
+{
+	struct cell __arena *cell;
+	s32 ret;
+	int i;
+
+	if ((ret = alloc_cell_chunk(cell_idx)))
+		return ret;
+
+	ret = scx_bpf_create_dsq(cell_idx, -1);
+	if (ret < 0 && ret != -EEXIST)
+		return ret;
+
+	if ((ret = alloc_cell_cpumasks(cell_idx)))
+		return ret;
+
+	if (!(cell = lookup_cell(cell_idx)))
+		return -ENOENT;
+
+	/* A reused id may carry a stale vtime, start over as a new cell */
+	cell->vtime_now = 0;
+	bpf_for(i, 0, MAX_CPUS / 64)
+		cell->home_cpus[i] = 0;
+
+	return 0;
+}
+
 static inline int free_cell(int cell_idx)
 {
-	struct cell *c;
+	u64 *word;
 
 	if (cell_idx < 0 || cell_idx >= MAX_CELLS) {
 		scx_bpf_error("Invalid cell %d", cell_idx);
 		return -1;
 	}
 
-	if (!(c = lookup_cell(cell_idx)))
+	if (!(word = MEMBER_VPTR(cells_in_use, [cell_idx / 64])))
 		return -1;
 
-	c->in_use = 0;
+	__sync_fetch_and_and(word, ~(1LLU << (cell_idx % 64)));
 	return 0;
 }
 
@@ -232,6 +339,42 @@ static inline const struct cpumask *lookup_cell_cpumask(int idx)
 	return (const struct cpumask *)cpumaskw->cpumask;
 }
 
+static int alloc_cell_cpumasks(u32 cell_idx)
+{
+	struct cell_cpumask_wrapper *cpumaskw;
+	struct bpf_cpumask *cpumask;
+
+	if (!(cpumaskw = bpf_map_lookup_elem(&cell_cpumasks, &cell_idx)))
+		return -ENOENT;
+
+	if (!cpumaskw->cpumask) {
+		cpumask = bpf_cpumask_create();
+		if (!cpumask)
+			return -ENOMEM;
+
+		/*
+		 * Start with a full cpumask. It'll get setup in cgroup_init
+		 */
+		bpf_cpumask_setall(cpumask);
+
+		cpumask = bpf_kptr_xchg(&cpumaskw->cpumask, cpumask);
+		if (cpumask)
+			bpf_cpumask_release(cpumask);
+	}
+
+	if (!cpumaskw->tmp_cpumask) {
+		cpumask = bpf_cpumask_create();
+		if (!cpumask)
+			return -ENOMEM;
+
+		cpumask = bpf_kptr_xchg(&cpumaskw->tmp_cpumask, cpumask);
+		if (cpumask)
+			bpf_cpumask_release(cpumask);
+	}
+
+	return 0;
+}
+
 /*
  * This is an RCU-like implementation to keep track of scheduling events so we
  * can establish when cell assignments have propagated completely.
@@ -317,15 +460,82 @@ static __always_inline __maybe_unused int critical_section_poll()
 	return 0;
 }
 
+/*
+ * Fold @slot's counts into its cell's totals so that the slot can be reused.
+ */
+static void cell_stats_flush(struct cpu_cell_stats *slot)
+{
+	struct cell __arena *cell;
+	int i;
+
+	if (!slot->key)
+		return;
+
+	if ((cell = lookup_cell(slot->key - 1))) {
+		bpf_for(i, 0, NR_CSTATS)
+		{
+			if (i >= NR_CSTATS)
+				break;
+			if (slot->cstats[i])
+				__sync_fetch_and_add(&cell->cstats[i], slot->cstats[i]);
+			slot->cstats[i] = 0;
+		}
+		if (slot->cycles)
+			__sync_fetch_and_add(&cell->cycles, slot->cycles);
+	}
+
+	slot->cycles = 0;
+	slot->key = 0;
+}
+
+/*
+ * Find the slot holding this CPU's stats for @cell. Slots are claimed in
+ * order and only recycled once all are taken, so the first unused slot ends
+ * the search.
+ */
+static struct cpu_cell_stats *lookup_cell_stats(struct cpu_ctx *cctx, u32 cell)
+{
+	struct cpu_cell_stats *slot;
+	u32 i;
+
+	bpf_for(i, 0, CPU_CELL_STAT_SLOTS)
+	{
+		if (!(slot = MEMBER_VPTR(cctx->cell_stats, [i])))
+			break;
+
+		if (slot->key == cell + 1)
+			return slot;
+
+		if (!slot->key) {
+			slot->key = cell + 1;
+			return slot;
+		}
+	}
+
+	i = cctx->cell_stats_rr++ % CPU_CELL_STAT_SLOTS;
+	if (!(slot = MEMBER_VPTR(cctx->cell_stats, [i]))) {
+		scx_bpf_error("invalid cell stats slot %u", i);
+		return NULL;
+	}
+
+	cell_stats_flush(slot);
+	slot->key = cell + 1;
+	return slot;
+}
+
 /*
  * Helper functions for bumping per-cell stats
  */
 static void cstat_add(enum cell_stat_idx idx, u32 cell, struct cpu_ctx *cctx,
 		      s64 delta)
 {
+	struct cpu_cell_stats *slot;
 	u64 *vptr;
 
-	if ((vptr = MEMBER_VPTR(*cctx, .cstats[cell][idx])))
+	if (!(slot = lookup_cell_stats(cctx, cell)))
+		return;
+
+	if ((vptr = MEMBER_VPTR(*slot, .cstats[idx])))
 		(*vptr) += delta;
 	else
 		scx_bpf_error("invalid cell or stat idxs: %d, %d", idx, cell);
@@ -359,7 +569,7 @@ static inline int update_task_cpumask(struct task_struct *p,
 static inline int update_task_cell(struct task_struct *p, struct task_ctx *tctx,
 				   struct cgroup *cg)
 {
-	struct cell *cell;
+	struct cell __arena *cell;
 	struct cgrp_ctx *cgc;
 
 	if (!(cgc = lookup_cgrp_ctx(cg)))
@@ -550,7 +760,7 @@ void BPF_STRUCT_OPS(mitosis_enqueue, struct task_struct *p, u64 enq_flags)
 {
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
-	struct cell *cell;
+	struct cell __arena *cell;
 	s32 task_cpu = scx_bpf_task_cpu(p);
 	u64 vtime = p->scx.dsq_vtime;
 
@@ -621,6 +831,111 @@ void BPF_STRUCT_OPS(mitosis_dispatch, s32 cpu, struct task_struct *prev)
 	scx_bpf_dsq_move_to_local(LO_FALLBACK_DSQ);
 }
 
+/*
+ * Rebuild the cpumasks of all cells but the root one from
+ * cpu_cell_assignment. The root cell is recomputed by the caller as whatever
+ * is left.
+ *
+ * A cell being set up concurrently by cgroup_init has its tmp_cpumask taken,
+ * such cells are left alone and the configuration_seq bump that follows
+ * their setup makes userspace recompute the assignment. The cells whose
+ * tmp_cpumask got cleared are remembered in assignment_cells so that only
+ * those are swapped at the end.
+ */
+u64 assignment_cells[CELL_WORDS];
+
+static int apply_cell_assignment(void)
+{
+	struct cell_cpumask_wrapper *cpumaskw;
+	struct bpf_cpumask *cpumask;
+	struct cpu_ctx *cctx;
+	int word_idx, bit, cpu_idx;
+	u32 cell_idx;
+	u64 word;
+
+	bpf_for(word_idx, 0, CELL_WORDS)
+	{
+		if (word_idx >= CELL_WORDS)
+			break;
+
+		word = READ_ONCE(cells_in_use[word_idx]);
+		if (!word_idx)
+			word &= ~1LLU;
+
+		bpf_for(bit, 0, 64)
+		{
+			if (!(word & (1LLU << bit)))
+				continue;
+
+			cell_idx = word_idx * 64 + bit;
+			if (!(cpumaskw = bpf_map_lookup_elem(&cell_cpumasks, &cell_idx)))
+				return -ENOENT;
+			if ((cpumask = cpumaskw->tmp_cpumask))
+				bpf_cpumask_clear(cpumask);
+			else
+				word &= ~(1LLU << bit);
+		}
+		assignment_cells[word_idx] = word;
+	}
+
+	bpf_for(cpu_idx, 0, nr_possible_cpus)
+	{
+		if (cpu_idx >= MAX_CPUS)
+			break;
+
+		cell_idx = READ_ONCE(cpu_cell_assignment[cpu_idx]);
+		if (!cell_idx || cell_idx >= MAX_CELLS ||
+		    !(assignment_cells[cell_idx / 64] & (1LLU << (cell_idx % 64))))
+			continue;
+
+		if (!(cpumaskw = bpf_map_lookup_elem(&cell_cpumasks, &cell_idx)) ||
+		    !(cpumask = cpumaskw->tmp_cpumask))
+			return -ENOENT;
+		bpf_cpumask_set_cpu(cpu_idx, cpumask);
+
+		if (!(cctx = lookup_cpu_ctx(cpu_idx)))
+			return -ENOENT;
+		WRITE_ONCE(cctx->cell, cell_idx);
+	}
+
+	bpf_for(word_idx, 0, CELL_WORDS)
+	{
+		if (word_idx >= CELL_WORDS)
+			break;
+
+		word = assignment_cells[word_idx];
+
+		bpf_for(bit, 0, 64)
+		{
+			if (!(word & (1LLU << bit)))
+				continue;
+
+			cell_idx = word_idx * 64 + bit;
+			if (!(cpumaskw = bpf_map_lookup_elem(&cell_cpumasks, &cell_idx)))
+				return -ENOENT;
+
+			cpumask = bpf_kptr_xchg(&cpumaskw->tmp_cpumask, NULL);
+			if (!cpumask) {
+				scx_bpf_error("tmp_cpumask should never be null");
+				return -ENOENT;
+			}
+			cpumask = bpf_kptr_xchg(&cpumaskw->cpumask, cpumask);
+			if (!cpumask) {
+				scx_bpf_error("cpumask should never be null");
+				return -ENOENT;
+			}
+			cpumask = bpf_kptr_xchg(&cpumaskw->tmp_cpumask, cpumask);
+			if (cpumask) {
+				scx_bpf_error("tmp_cpumask should be null");
+				bpf_cpumask_release(cpumask);
+				return -ENOENT;
+			}
+		}
+	}
+
+	return 0;
+}
+
 /*
  * On tick, we apply CPU assignment
 */
@@ -629,6 +944,23 @@ void BPF_STRUCT_OPS(mitosis_tick, struct task_struct *p_run)
 	if (bpf_get_smp_processor_id())
 		return;
 
+	u32 local_assignment_seq = READ_ONCE(assignment_seq);
+	if (dynamic_cells && local_assignment_seq != applied_assignment_seq) {
+		if (READ_ONCE(assignment_base_seq) != READ_ONCE(configuration_seq)) {
+			nr_stale_assignments++;
+		} else {
+			/*
+			 * Only commit the assignment once it has been fully
+			 * applied, apply_cell_assignment() starts over from
+			 * the tmp_cpumasks on the next tick otherwise.
+			 */
+			if (apply_cell_assignment())
+				return;
+			__atomic_add_fetch(&configuration_seq, 1, __ATOMIC_RELEASE);
+		}
+		applied_assignment_seq = local_assignment_seq;
+	}
+
 	u32 local_configuration_seq = READ_ONCE(configuration_seq);
 	if (local_configuration_seq == READ_ONCE(applied_configuration_seq))
 		return;
@@ -660,35 +992,50 @@ void BPF_STRUCT_OPS(mitosis_tick, struct task_struct *p_run)
 	}
 	bpf_cpumask_copy(root_bpf_cpumask, (const struct cpumask *)all_cpumask);
 
-	// Iterate through the rest of the cells and (if in_use), clear their cpus
-	// from the root cell and assign them to the correct core
-	// TODO: Handle freed cells by giving their cores back to the root cell
-	int cell_idx;
-	bpf_for(cell_idx, 1, MAX_CELLS)
+	// Clear the cpus of the other cells in use from the root cell. This is
+	// one cpumask operation per cell rather than one test per cell and cpu,
+	// so it stays cheap with many cells. Cpus of freed cells go back to the
+	// root cell.
+	const struct cpumask *cpumask;
+	struct cpu_ctx *cctx;
+	int word_idx, bit, cpu_idx;
+	u64 word;
+	bpf_for(word_idx, 0, CELL_WORDS)
 	{
-		struct cell *cell;
-		if (!(cell = lookup_cell(cell_idx)))
-			goto out;
+		if (word_idx >= CELL_WORDS)
+			break;
 
-		if (!cell->in_use)
+		word = READ_ONCE(cells_in_use[word_idx]);
+		if (!word_idx)
+			word &= ~1LLU;
+		if (!word)
 			continue;
 
-		int cpu_idx;
-		const struct cpumask *cpumask;
-		struct cpu_ctx *cctx;
-		bpf_for(cpu_idx, 0, nr_possible_cpus)
+		bpf_for(bit, 0, 64)
 		{
-			if (!(cpumask = lookup_cell_cpumask(cell_idx)))
+			if (!(word & (1LLU << bit)))
+				continue;
+
+			if (!(cpumask = lookup_cell_cpumask(word_idx * 64 + bit)))
 				goto out;
-			if (bpf_cpumask_test_cpu(cpu_idx, cpumask)) {
-				bpf_cpumask_clear_cpu(cpu_idx,
-						      root_bpf_cpumask);
-				if (!(cctx = lookup_cpu_ctx(cpu_idx)))
-					goto out;
-				WRITE_ONCE(cctx->cell, cell_idx);
-			}
+
+			bpf_cpumask_andnot(root_bpf_cpumask,
+					   (const struct cpumask *)root_bpf_cpumask,
+					   cpumask);
 		}
 	}
+
+	// Cpus owned by a cell had their cpu_ctx pointed at it when the cell
+	// was set up, hand the remaining ones to the root cell.
+	bpf_for(cpu_idx, 0, nr_possible_cpus)
+	{
+		if (!bpf_cpumask_test_cpu(cpu_idx,
+					  (const struct cpumask *)root_bpf_cpumask))
+			continue;
+		if (!(cctx = lookup_cpu_ctx(cpu_idx)))
+			goto out;
+		WRITE_ONCE(cctx->cell, 0);
+	}
 	root_bpf_cpumask =
 		bpf_kptr_xchg(&root_cell_cpumaskw->cpumask, root_bpf_cpumask);
 	if (!root_bpf_cpumask) {
@@ -713,7 +1060,7 @@ out:
 void BPF_STRUCT_OPS(mitosis_running, struct task_struct *p)
 {
 	struct task_ctx *tctx;
-	struct cell *cell;
+	struct cell __arena *cell;
 
 	if (!(tctx = lookup_task_ctx(p)) || !(cell = lookup_cell(tctx->cell)))
 		return;
@@ -728,7 +1075,7 @@ void BPF_STRUCT_OPS(mitosis_stopping, struct task_struct *p, bool runnable)
 {
 	struct cpu_ctx *cctx;
 	struct task_ctx *tctx;
-	struct cell *cell;
+	struct cell __arena *cell;
 	u64 now, used;
 	u32 cidx;
 
@@ -746,12 +1093,11 @@ void BPF_STRUCT_OPS(mitosis_stopping, struct task_struct *p, bool runnable)
 	p->scx.dsq_vtime += used * 100 / p->scx.weight;
 
 	if (cidx != 0 || tctx->all_cpus_allowed) {
-		u64 *cell_cycles = MEMBER_VPTR(cctx->cell_cycles, [cidx]);
-		if (!cell_cycles) {
-			scx_bpf_error("Cell index is too large: %d", cidx);
+		struct cpu_cell_stats *slot;
+
+		if (!(slot = lookup_cell_stats(cctx, cidx)))
 			return;
-		}
-		*cell_cycles += used;
+		slot->cycles += used;
 	}
 }
 
@@ -879,22 +1225,31 @@ static inline int cgroup_init_with_cpuset(struct cgrp_ctx *cgc,
 	if (bpf_cpumask_empty((const struct cpumask *)&entry->cpumask))
 		goto free_entry;
 
+	/*
+	 * cgroup_init is sleepable, so the all_cpumask kptr can only be
+	 * dereferenced inside an RCU read-side critical section.
+	 */
+	bpf_rcu_read_lock();
 	if (!all_cpumask) {
+		bpf_rcu_read_unlock();
 		scx_bpf_error("all_cpumask should not be NULL");
 		return -EINVAL;
 	}
 
-	if (bpf_cpumask_subset((const struct cpumask *)all_cpumask,
-			       (const struct cpumask *)&entry->cpumask))
+	bool covers_all = bpf_cpumask_subset((const struct cpumask *)all_cpumask,
+					     (const struct cpumask *)&entry->cpumask);
+	bpf_rcu_read_unlock();
+	if (covers_all)
 		goto free_entry;
 
 	int cell_idx = allocate_cell();
 	if (cell_idx < 0)
 		return -EBUSY;
 
-	struct cell *cell = lookup_cell(cell_idx);
-	if (!cell)
-		return -ENOENT;
+	if ((err = setup_cell(cell_idx))) {
+		free_cell(cell_idx);
+		return err;
+	}
 
 	struct cell_cpumask_wrapper *cell_cpumaskw;
 	if (!(cell_cpumaskw = bpf_map_lookup_elem(&cell_cpumasks, &cell_idx))) {
@@ -902,6 +1257,10 @@ static inline int cgroup_init_with_cpuset(struct cgrp_ctx *cgc,
 		return -ENOENT;
 	}
 
+	struct cell __arena *cell;
+	if (!(cell = lookup_cell(cell_idx)))
+		return -ENOENT;
+
 	struct bpf_cpumask *bpf_cpumask;
 	bpf_cpumask = bpf_kptr_xchg(&cell_cpumaskw->tmp_cpumask, NULL);
 	if (!bpf_cpumask) {
@@ -912,6 +1271,8 @@ static inline int cgroup_init_with_cpuset(struct cgrp_ctx *cgc,
 	int cpu_idx;
 	bpf_for(cpu_idx, 0, nr_possible_cpus)
 	{
+		if (cpu_idx >= MAX_CPUS)
+			break;
 		if (bpf_cpumask_test_cpu(
 			    cpu_idx, (const struct cpumask *)&entry->cpumask)) {
 			struct cpu_ctx *cpu_ctx;
@@ -920,6 +1281,7 @@ static inline int cgroup_init_with_cpuset(struct cgrp_ctx *cgc,
 				return -ENOENT;
 			}
 			cpu_ctx->cell = cell_idx;
+			cell->home_cpus[cpu_idx / 64] |= 1LLU << (cpu_idx % 64);
 		}
 	}
 	bpf_cpumask = bpf_kptr_xchg(&cell_cpumaskw->cpumask, bpf_cpumask);
@@ -946,7 +1308,7 @@ free_entry:
 	return 0;
 }
 
-s32 BPF_STRUCT_OPS(mitosis_cgroup_init, struct cgroup *cgrp,
+s32 BPF_STRUCT_OPS_SLEEPABLE(mitosis_cgroup_init, struct cgroup *cgrp,
 		   struct scx_cgroup_init_args *args)
 {
 	struct cgrp_ctx *cgc;
@@ -1105,47 +1467,45 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(mitosis_init)
 	if (cpumask)
 		bpf_cpumask_release(cpumask);
 
-	bpf_for(i, 0, MAX_CELLS)
-	{
-		struct cell_cpumask_wrapper *cpumaskw;
+	/* The root cell always exists */
+	if ((ret = setup_cell(0)))
+		return ret;
 
-		ret = scx_bpf_create_dsq(i, -1);
-		if (ret < 0)
-			return ret;
+	cells_in_use[0] |= 1;
 
-		if (!(cpumaskw = bpf_map_lookup_elem(&cell_cpumasks, &i)))
-			return -ENOENT;
+	return 0;
+}
 
-		cpumask = bpf_cpumask_create();
-		if (!cpumask)
-			return -ENOMEM;
+/*
+ * Run by userspace to sample the queue depth of the cells in use.
+ */
+SEC("syscall")
+int sample_cells(void *ctx)
+{
+	struct cell __arena *cell;
+	int word_idx, bit;
+	u32 cell_idx;
+	u64 word;
 
-		/*
-		 * Start with all full cpumask for all cells. They'll get setup in
-		 * cgroup_init
-		 */
-		bpf_cpumask_setall(cpumask);
+	bpf_for(word_idx, 0, CELL_WORDS)
+	{
+		if (word_idx >= CELL_WORDS)
+			break;
 
-		cpumask = bpf_kptr_xchg(&cpumaskw->cpumask, cpumask);
-		if (cpumask) {
-			/* Should be impossible, we just initialized the cell cpumask */
-			bpf_cpumask_release(cpumask);
-			return -EINVAL;
-		}
+		word = READ_ONCE(cells_in_use[word_idx]);
+		bpf_for(bit, 0, 64)
+		{
+			if (!(word & (1LLU << bit)))
+				continue;
 
-		cpumask = bpf_cpumask_create();
-		if (!cpumask)
-			return -ENOMEM;
-		cpumask = bpf_kptr_xchg(&cpumaskw->tmp_cpumask, cpumask);
-		if (cpumask) {
-			/* Should be impossible, we just initialized the cell tmp_cpumask */
-			bpf_cpumask_release(cpumask);
-			return -EINVAL;
+			cell_idx = word_idx * 64 + bit;
+			if (!(cell = lookup_cell(cell_idx)))
+				return -ENOENT;
+
+			cell->nr_queued = scx_bpf_dsq_nr_queued(cell_idx);
 		}
 	}
 
-	cells[0].in_use = true;
-
 	return 0;
 }
 
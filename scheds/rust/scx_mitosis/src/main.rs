@@ -5,14 +5,18 @@
 mod bpf_skel;
 pub use bpf_skel::*;
 pub mod bpf_intf;
+mod resize;
 
 use std::cmp::max;
+use std::collections::BTreeMap;
 use std::collections::HashMap;
 use std::mem::MaybeUninit;
+use std::sync::atomic::fence;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::time::Duration;
+use std::time::Instant;
 
 use anyhow::bail;
 use anyhow::Context;
@@ -20,9 +24,12 @@ use anyhow::Result;
 use clap::Parser;
 use libbpf_rs::MapCore as _;
 use libbpf_rs::OpenObject;
+use libbpf_rs::ProgramInput;
 use log::debug;
 use log::info;
 use log::trace;
+use resize::CellLoad;
+use resize::CellResizer;
 use scx_utils::init_libbpf_logging;
 use scx_utils::scx_enums;
 use scx_utils::scx_ops_attach;
@@ -36,8 +43,12 @@ use scx_utils::UserExitInfo;
 use scx_utils::NR_CPUS_POSSIBLE;
 
 const MAX_CELLS: usize = bpf_intf::consts_MAX_CELLS as usize;
+const CELL_CHUNK_SHIFT: u32 = bpf_intf::consts_CELL_CHUNK_SHIFT as u32;
+const CELLS_PER_CHUNK: usize = bpf_intf::consts_CELLS_PER_CHUNK as usize;
 const NR_CSTATS: usize = bpf_intf::cell_stat_idx_NR_CSTATS as usize;
 
+type CellStats = [u64; NR_CSTATS];
+
 /// scx_mitosis: A dynamic affinity scheduler
 ///
 /// Cgroups are assigned to a dynamic number of Cells which are assigned to a
@@ -64,6 +75,26 @@ struct Opts {
     #[clap(long, default_value = "5")]
     rebalance_cpus_interval_s: u64,
 
+    /// Resize the cells according to their utilization. Mostly idle cells
+    /// lend whole cores of their cpuset to the root cell and take them back
+    /// once they get busy again.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    dynamic_cells: bool,
+
+    /// With --dynamic-cells, move whole LLCs instead of cores.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    resize_by_llc: bool,
+
+    /// With --dynamic-cells, a cell busier than this fraction of its cpus
+    /// takes back cpus it lent.
+    #[clap(long, default_value = "0.8")]
+    resize_high_util: f64,
+
+    /// With --dynamic-cells, a cell idler than this fraction of its cpus
+    /// lends cpus to the root cell.
+    #[clap(long, default_value = "0.4")]
+    resize_low_util: f64,
+
     /// Interval to report monitoring information
     #[clap(long, default_value = "1")]
     monitor_interval_s: u64,
@@ -89,16 +120,29 @@ struct Cell {
 struct Scheduler<'a> {
     skel: BpfSkel<'a>,
     monitor_interval: Duration,
+    rebalance_interval: Duration,
+    last_rebalance: Instant,
+    resizer: Option<CellResizer>,
+    // Running time of each cell as of the last rebalance.
+    prev_cell_cycles: HashMap<u32, u64>,
     cells: HashMap<u32, Cell>,
     // These are the per-cell cstats.
     // Note these are accumulated across all CPUs.
-    prev_cell_stats: [[u64; NR_CSTATS]; MAX_CELLS],
+    prev_cell_stats: HashMap<u32, CellStats>,
 }
 
 impl<'a> Scheduler<'a> {
     fn init(opts: &Opts, open_object: &'a mut MaybeUninit<OpenObject>) -> Result<Self> {
         let topology = Topology::new()?;
 
+        if opts.dynamic_cells
+            && !(0.0 < opts.resize_low_util
+                && opts.resize_low_util < opts.resize_high_util
+                && opts.resize_high_util <= 1.0)
+        {
+            bail!("--resize-low-util and --resize-high-util must satisfy 0 < low < high <= 1");
+        }
+
         let mut skel_builder = BpfSkelBuilder::default();
         skel_builder.obj_builder.debug(opts.verbose > 1);
         init_libbpf_logging(None);
@@ -112,14 +156,26 @@ impl<'a> Scheduler<'a> {
         for cpu in topology.all_cpus.keys() {
             skel.maps.rodata_data.all_cpus[cpu / 8] |= 1 << (cpu % 8);
         }
+        skel.maps.rodata_data.dynamic_cells = opts.dynamic_cells;
 
         let skel = scx_ops_load!(skel, mitosis, uei)?;
 
         Ok(Self {
             skel,
             monitor_interval: Duration::from_secs(opts.monitor_interval_s),
+            rebalance_interval: Duration::from_secs(opts.rebalance_cpus_interval_s),
+            last_rebalance: Instant::now(),
+            resizer: opts.dynamic_cells.then(|| {
+                CellResizer::new(
+                    &topology,
+                    opts.resize_by_llc,
+                    opts.resize_high_util,
+                    opts.resize_low_util,
+                )
+            }),
+            prev_cell_cycles: HashMap::new(),
             cells: HashMap::new(),
-            prev_cell_stats: [[0; NR_CSTATS]; MAX_CELLS],
+            prev_cell_stats: HashMap::new(),
         })
     }
 
@@ -129,6 +185,9 @@ impl<'a> Scheduler<'a> {
         while !shutdown.load(Ordering::Relaxed) && !uei_exited!(&self.skel, uei) {
             std::thread::sleep(self.monitor_interval);
             self.refresh_bpf_cells()?;
+            if self.resizer.is_some() && self.last_rebalance.elapsed() >= self.rebalance_interval {
+                self.resize_cells()?;
+            }
             self.debug()?;
         }
         drop(struct_ops);
@@ -203,13 +262,13 @@ impl<'a> Scheduler<'a> {
     fn log_global_queue_stats(
         &self,
         global_queue_decisions: u64,
-        cell_stats_delta: &[[u64; NR_CSTATS]; MAX_CELLS],
+        cell_stats_delta: &BTreeMap<u32, CellStats>,
     ) -> Result<()> {
         // Get total of each queue summed over all cells
         let mut queue_counts = [0; QUEUE_STATS_IDX.len()];
-        for cells in 0..MAX_CELLS {
+        for cell_stats in cell_stats_delta.values() {
             for (i, stat) in QUEUE_STATS_IDX.iter().enumerate() {
-                queue_counts[i] += cell_stats_delta[cells][*stat as usize];
+                queue_counts[i] += cell_stats[*stat as usize];
             }
         }
 
@@ -217,8 +276,8 @@ impl<'a> Scheduler<'a> {
 
         // Here we want to sum the affinity violations over all cells.
         let scope_affn_viols: u64 = cell_stats_delta
-            .iter()
-            .map(|&cell| cell[bpf_intf::cell_stat_idx_CSTAT_AFFN_VIOL as usize])
+            .values()
+            .map(|cell| cell[bpf_intf::cell_stat_idx_CSTAT_AFFN_VIOL as usize])
             .sum::<u64>();
 
         // Special case where the number of scope decisions == number global decisions
@@ -237,12 +296,12 @@ impl<'a> Scheduler<'a> {
     fn log_cell_queue_stats(
         &self,
         global_queue_decisions: u64,
-        cell_stats_delta: &[[u64; NR_CSTATS]; MAX_CELLS],
+        cell_stats_delta: &BTreeMap<u32, CellStats>,
     ) -> Result<()> {
-        for cell in 0..MAX_CELLS {
+        for (cell, cell_stats) in cell_stats_delta.iter() {
             let cell_queue_decisions = QUEUE_STATS_IDX
                 .iter()
-                .map(|&stat| cell_stats_delta[cell][stat as usize])
+                .map(|&stat| cell_stats[stat as usize])
                 .sum::<u64>();
 
             // FIXME: This should really query if the cell is enabled or not.
@@ -252,7 +311,7 @@ impl<'a> Scheduler<'a> {
 
             let mut queue_counts = [0; QUEUE_STATS_IDX.len()];
             for (i, &stat) in QUEUE_STATS_IDX.iter().enumerate() {
-                queue_counts[i] = cell_stats_delta[cell][stat as usize];
+                queue_counts[i] = cell_stats[stat as usize];
             }
 
             const MIN_CELL_WIDTH: usize = 2;
@@ -262,7 +321,7 @@ impl<'a> Scheduler<'a> {
 
             // Sum affinity violations for this cell
             let scope_affn_viols: u64 =
-                cell_stats_delta[cell][bpf_intf::cell_stat_idx_CSTAT_AFFN_VIOL as usize];
+                cell_stats[bpf_intf::cell_stat_idx_CSTAT_AFFN_VIOL as usize];
 
             self.calculate_distribution_and_log(
                 &queue_counts,
@@ -275,10 +334,10 @@ impl<'a> Scheduler<'a> {
         Ok(())
     }
 
-    fn log_all_queue_stats(&self, cell_stats_delta: &[[u64; NR_CSTATS]; MAX_CELLS]) -> Result<()> {
+    fn log_all_queue_stats(&self, cell_stats_delta: &BTreeMap<u32, CellStats>) -> Result<()> {
         // Get total decisions
         let global_queue_decisions: u64 = cell_stats_delta
-            .iter()
+            .values()
             .flat_map(|cell| QUEUE_STATS_IDX.iter().map(|&idx| cell[idx as usize]))
             .sum();
 
@@ -294,28 +353,38 @@ impl<'a> Scheduler<'a> {
         Ok(())
     }
 
-    fn calculate_cell_stat_delta(&mut self) -> Result<[[u64; NR_CSTATS]; MAX_CELLS]> {
-        let mut cell_stats_delta = [[0 as u64; NR_CSTATS]; MAX_CELLS];
+    fn calculate_cell_stat_delta(&mut self) -> Result<BTreeMap<u32, CellStats>> {
+        // Start from the totals BPF has flushed into the cells...
+        let mut cell_stats: BTreeMap<u32, CellStats> = BTreeMap::new();
+        for cell in cells_in_use(&self.skel) {
+            let totals = read_cell(&self.skel, cell).map_or([0; NR_CSTATS], |c| c.cstats);
+            cell_stats.insert(cell, totals);
+        }
 
-        // Read CPU contexts
+        // ...and add what the CPUs still hold in their per-cell slots.
         let cpu_ctxs = read_cpu_ctxs(&self.skel)?;
-
-        // Loop over cells and stats first, then CPU contexts
-        // TODO: We should loop over the in_use cells only.
-        for cell in 0..MAX_CELLS {
-            for stat in 0..NR_CSTATS {
-                let mut cur_cell_stat = 0;
-
-                // Accumulate stats from all CPUs
-                for cpu_ctx in cpu_ctxs.iter() {
-                    cur_cell_stat += cpu_ctx.cstats[cell][stat];
+        for cpu_ctx in cpu_ctxs.iter() {
+            for slot in cpu_ctx.cell_stats.iter().filter(|slot| slot.key != 0) {
+                let cell = slot.key - 1;
+                let stats = cell_stats.entry(cell).or_insert_with(|| {
+                    read_cell(&self.skel, cell).map_or([0; NR_CSTATS], |c| c.cstats)
+                });
+                for (stat, val) in slot.cstats.iter().enumerate() {
+                    stats[stat] += val;
                 }
-
-                // Calculate delta and update previous stat
-                cell_stats_delta[cell][stat] = cur_cell_stat - self.prev_cell_stats[cell][stat];
-                self.prev_cell_stats[cell][stat] = cur_cell_stat;
             }
         }
+
+        // A slot being flushed may briefly be counted twice, so saturate.
+        let mut cell_stats_delta = BTreeMap::new();
+        for (cell, stats) in cell_stats.into_iter() {
+            let prev = self.prev_cell_stats.insert(cell, stats);
+            let prev = prev.unwrap_or([0; NR_CSTATS]);
+            cell_stats_delta.insert(
+                cell,
+                core::array::from_fn(|stat| stats[stat].saturating_sub(prev[stat])),
+            );
+        }
         Ok(cell_stats_delta)
     }
 
@@ -347,26 +416,150 @@ impl<'a> Scheduler<'a> {
         }
 
         // create cells we don't have yet, drop cells that are no longer in use.
-        let cells = &self.skel.maps.bss_data.cells;
-        for i in 0..MAX_CELLS {
-            let cell_idx = i as u32;
-            let bpf_cell = cells[i];
-            if bpf_cell.in_use > 0 {
-                self.cells.entry(cell_idx).or_insert(Cell {
-                    cpus: cell_to_cpus
-                        .get(&cell_idx)
-                        .expect("missing cell in cpu map")
-                        .clone(),
-                });
-            } else {
-                self.cells.remove(&cell_idx);
+        let in_use = cells_in_use(&self.skel);
+        self.cells.retain(|cell_idx, _| in_use.contains(cell_idx));
+        for cell_idx in in_use {
+            self.cells.entry(cell_idx).or_insert(Cell {
+                cpus: cell_to_cpus
+                    .get(&cell_idx)
+                    .cloned()
+                    .unwrap_or_else(Cpumask::new),
+            });
+        }
+
+        Ok(())
+    }
+
+    /// Grow and shrink the cells according to how busy they were since the
+    /// last call and hand the new assignment to BPF, which applies it on the
+    /// next tick through the usual configuration_seq handoff.
+    fn resize_cells(&mut self) -> Result<()> {
+        let Some(resizer) = self.resizer.as_ref() else {
+            return Ok(());
+        };
+        let interval = self.last_rebalance.elapsed();
+        self.last_rebalance = Instant::now();
+
+        // There is nothing to resize with a single cell, don't bother
+        // sampling it. The baselines would be stale by the time a second
+        // cell shows up.
+        if cells_in_use(&self.skel).len() < 2 {
+            self.prev_cell_cycles.clear();
+            return Ok(());
+        }
+
+        // Snapshot configuration_seq before reading the cells. If a cell
+        // gets created in the meantime, BPF drops the assignment and we
+        // retry on the next interval.
+        let base_seq = self.skel.maps.bss_data.configuration_seq;
+        fence(Ordering::Acquire);
+
+        let output = self.skel.progs.sample_cells.test_run(ProgramInput {
+            ..Default::default()
+        })?;
+        if output.return_value != 0 {
+            bail!(
+                "Could not sample the cells, sample_cells returned {}",
+                output.return_value as i32
+            );
+        }
+
+        let cpu_ctxs = read_cpu_ctxs(&self.skel)?;
+        let assignment: Vec<u32> = cpu_ctxs.iter().map(|cpu_ctx| cpu_ctx.cell).collect();
+
+        let mut homes = BTreeMap::new();
+        let mut cycles = BTreeMap::new();
+        let mut nr_queued = BTreeMap::new();
+        for cell_idx in cells_in_use(&self.skel) {
+            let Some(cell) = read_cell(&self.skel, cell_idx) else {
+                continue;
+            };
+            cycles.insert(cell_idx, cell.cycles);
+            nr_queued.insert(cell_idx, cell.nr_queued);
+            if cell_idx == 0 {
+                continue;
+            }
+            let mut home = Cpumask::new();
+            for (word_idx, word) in cell.home_cpus.iter().enumerate() {
+                let mut word = *word;
+                while word != 0 {
+                    home.set_cpu(word_idx * 64 + word.trailing_zeros() as usize)?;
+                    word &= word - 1;
+                }
+            }
+            homes.insert(cell_idx, home);
+        }
+        for cpu_ctx in cpu_ctxs.iter() {
+            for slot in cpu_ctx.cell_stats.iter().filter(|slot| slot.key != 0) {
+                if let Some(c) = cycles.get_mut(&(slot.key - 1)) {
+                    *c += slot.cycles;
+                }
             }
         }
 
+        // Cells seen for the first time have no baseline yet.
+        let mut loads = BTreeMap::new();
+        for (cell_idx, cell_cycles) in cycles.iter() {
+            if let Some(prev) = self.prev_cell_cycles.get(cell_idx) {
+                loads.insert(
+                    *cell_idx,
+                    CellLoad {
+                        busy_ns: cell_cycles.saturating_sub(*prev),
+                        nr_queued: nr_queued[cell_idx],
+                    },
+                );
+            }
+        }
+        self.prev_cell_cycles = cycles.into_iter().collect();
+
+        let Some(next) = resizer.resize(&assignment, &homes, &loads, interval.as_nanos() as u64)
+        else {
+            return Ok(());
+        };
+
+        let bss_data = &mut self.skel.maps.bss_data;
+        let nr_cpus = next.len().min(bss_data.cpu_cell_assignment.len());
+        bss_data.cpu_cell_assignment[..nr_cpus].copy_from_slice(&next[..nr_cpus]);
+        bss_data.assignment_base_seq = base_seq;
+        fence(Ordering::Release);
+        bss_data.assignment_seq = bss_data.assignment_seq.wrapping_add(1);
+        debug!(
+            "Published cell assignment {} ({} stale so far)",
+            bss_data.assignment_seq, bss_data.nr_stale_assignments
+        );
+
         Ok(())
     }
 }
 
+/// Ids of the cells BPF currently has in use.
+fn cells_in_use(skel: &BpfSkel) -> Vec<u32> {
+    let mut cells = vec![];
+    for (word_idx, word) in skel.maps.bss_data.cells_in_use.iter().enumerate() {
+        let mut word = *word;
+        while word != 0 {
+            cells.push((word_idx * 64) as u32 + word.trailing_zeros());
+            word &= word - 1;
+        }
+    }
+    cells
+}
+
+/// Read the arena-resident book-keeping of a cell. Returns None if the cell's
+/// chunk hasn't been allocated yet.
+fn read_cell(skel: &BpfSkel, cell: u32) -> Option<bpf_intf::cell> {
+    if cell as usize >= MAX_CELLS {
+        return None;
+    }
+    let chunk = skel.maps.bss_data.cell_chunks[(cell >> CELL_CHUNK_SHIFT) as usize];
+    if chunk == 0 {
+        return None;
+    }
+    // The arena is mapped at the same address in userspace and BPF.
+    let cells = chunk as *const bpf_intf::cell;
+    Some(unsafe { std::ptr::read_volatile(cells.add(cell as usize & (CELLS_PER_CHUNK - 1))) })
+}
+
 fn read_cpu_ctxs(skel: &BpfSkel) -> Result<Vec<bpf_intf::cpu_ctx>> {
     let mut cpu_ctxs = vec![];
     let cpu_ctxs_vec = skel
@@ -0,0 +1,271 @@
+// Copyright (c) Meta Platforms, Inc. and affiliates.
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+//! Utilization-driven resizing of the cells.
+//!
+//! A cell owns the cpus of the cpuset it was created from, its home. While a
+//! cell is mostly idle, whole cores (or LLCs) of its home are lent to the
+//! root cell, and they are taken back as soon as the cell gets busy again.
+//! Cells never grow beyond their home, so tenants stay isolated from each
+//! other and only the root cell soaks up the idle cpus.
+//!
+//! Growing and shrinking use separate thresholds, and a cell only shrinks if
+//! its utilization after the shrink stays below the midpoint of the two, so a
+//! steady load doesn't make a cell oscillate.
+
+use std::collections::BTreeMap;
+use std::collections::BTreeSet;
+
+use log::debug;
+use scx_utils::Cpumask;
+use scx_utils::Topology;
+
+/// A set of cpus that is always moved between cells as a whole.
+#[derive(Debug)]
+struct Unit {
+    cpus: Vec<usize>,
+    llc: usize,
+}
+
+/// Demand of a cell over the last resize interval.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct CellLoad {
+    /// Time the cell's tasks spent running.
+    pub busy_ns: u64,
+    /// Depth of the cell's DSQ when sampled.
+    pub nr_queued: u32,
+}
+
+#[derive(Debug)]
+pub struct CellResizer {
+    units: Vec<Unit>,
+    high_util: f64,
+    low_util: f64,
+}
+
+impl CellResizer {
+    pub fn new(topo: &Topology, by_llc: bool, high_util: f64, low_util: f64) -> Self {
+        let units = if by_llc {
+            topo.all_llcs
+                .values()
+                .map(|llc| Unit {
+                    cpus: llc.all_cpus.keys().copied().collect(),
+                    llc: llc.id,
+                })
+                .collect()
+        } else {
+            topo.all_cores
+                .values()
+                .map(|core| Unit {
+                    cpus: core.cpus.keys().copied().collect(),
+                    llc: core.llc_id,
+                })
+                .collect()
+        };
+
+        Self {
+            units,
+            high_util,
+            low_util,
+        }
+    }
+
+    /// Compute a new cpu to cell assignment from the current one. @homes
+    /// holds the home of every cell but the root one, @loads the demand of
+    /// the cells over the last @interval_ns. Cells without a load entry are
+    /// left alone. Returns None if nothing needs to move.
+    pub fn resize(
+        &self,
+        assignment: &[u32],
+        homes: &BTreeMap<u32, Cpumask>,
+        loads: &BTreeMap<u32, CellLoad>,
+        interval_ns: u64,
+    ) -> Option<Vec<u32>> {
+        let owner = |unit: &Unit| -> Option<u32> {
+            let cell = *assignment.get(unit.cpus[0])?;
+            unit.cpus
+                .iter()
+                .all(|cpu| assignment.get(*cpu) == Some(&cell))
+                .then_some(cell)
+        };
+        let util = |busy_ns: u64, nr_cpus: usize| -> f64 {
+            if nr_cpus == 0 {
+                return if busy_ns > 0 { f64::INFINITY } else { 0.0 };
+            }
+            busy_ns as f64 / (nr_cpus as f64 * interval_ns.max(1) as f64)
+        };
+
+        let mut next = assignment.to_vec();
+        let mut changed = false;
+
+        for (&cell, home) in homes.iter() {
+            let Some(load) = loads.get(&cell) else {
+                continue;
+            };
+            let nr_cpus = assignment.iter().filter(|c| **c == cell).count();
+            let cur_util = util(load.busy_ns, nr_cpus);
+
+            // Only units entirely inside the home can move, a core shared
+            // with another cpuset always stays where it is.
+            let (mut owned, mut lent) = (vec![], vec![]);
+            for unit in self.units.iter().filter(|u| !u.cpus.is_empty()) {
+                if !unit.cpus.iter().all(|cpu| home.test_cpu(*cpu)) {
+                    continue;
+                }
+                match owner(unit) {
+                    Some(c) if c == cell => owned.push(unit),
+                    Some(0) => lent.push(unit),
+                    _ => (),
+                }
+            }
+
+            if (cur_util > self.high_util || load.nr_queued as usize > nr_cpus) && !lent.is_empty()
+            {
+                // Take back a unit close to what the cell already runs on.
+                let llcs: BTreeSet<usize> = owned.iter().map(|u| u.llc).collect();
+                let unit = lent
+                    .iter()
+                    .find(|u| llcs.contains(&u.llc))
+                    .unwrap_or(&lent[0]);
+                debug!(
+                    "CELL[{}]: util={:.2} queued={} cpus={}, growing by {:?}",
+                    cell, cur_util, load.nr_queued, nr_cpus, unit.cpus
+                );
+                for cpu in unit.cpus.iter() {
+                    next[*cpu] = cell;
+                }
+                changed = true;
+            } else if cur_util < self.low_util && load.nr_queued == 0 && owned.len() > 1 {
+                // Lend from the LLC the cell has the least presence in so
+                // that what remains stays compact.
+                let mut per_llc: BTreeMap<usize, usize> = BTreeMap::new();
+                for unit in owned.iter() {
+                    *per_llc.entry(unit.llc).or_default() += 1;
+                }
+                owned.sort_by_key(|u| per_llc[&u.llc]);
+                let unit = owned[0];
+
+                let new_util = util(load.busy_ns, nr_cpus - unit.cpus.len());
+                if new_util >= (self.high_util + self.low_util) / 2.0 {
+                    continue;
+                }
+                debug!(
+                    "CELL[{}]: util={:.2} cpus={}, lending {:?}",
+                    cell, cur_util, nr_cpus, unit.cpus
+                );
+                for cpu in unit.cpus.iter() {
+                    next[*cpu] = 0;
+                }
+                changed = true;
+            }
+        }
+
+        changed.then_some(next)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const INTERVAL_NS: u64 = 1_000_000;
+
+    // 8 cpus, 4 cores of 2 cpus, cores 0-1 in LLC 0 and cores 2-3 in LLC 1.
+    fn resizer() -> CellResizer {
+        CellResizer {
+            units: (0..4)
+                .map(|core| Unit {
+                    cpus: vec![core * 2, core * 2 + 1],
+                    llc: core / 2,
+                })
+                .collect(),
+            high_util: 0.8,
+            low_util: 0.3,
+        }
+    }
+
+    // Cell 1 is homed on @home and has the demand of @util busy cpus.
+    fn resize(assignment: &[u32], home: u64, util: f64, nr_queued: u32) -> Option<Vec<u32>> {
+        let homes = BTreeMap::from([(1, Cpumask::from_vec(vec![home]))]);
+        let loads = BTreeMap::from([(
+            1,
+            CellLoad {
+                busy_ns: (util * INTERVAL_NS as f64) as u64,
+                nr_queued,
+            },
+        )]);
+        resizer().resize(assignment, &homes, &loads, INTERVAL_NS)
+    }
+
+    #[test]
+    fn test_grow() {
+        // 2 cpus at 90% utilization: take back the lent core of the same LLC.
+        let assignment = [1, 1, 0, 0, 0, 0, 0, 0];
+        let next = resize(&assignment, 0xf, 1.8, 0).unwrap();
+        assert_eq!(next, vec![1, 1, 1, 1, 0, 0, 0, 0]);
+
+        // Low utilization, but more tasks queued than cpus.
+        let next = resize(&assignment, 0xf, 0.5, 3).unwrap();
+        assert_eq!(next, vec![1, 1, 1, 1, 0, 0, 0, 0]);
+    }
+
+    #[test]
+    fn test_grow_prefers_same_llc() {
+        // The cell runs on LLC 1 and its home spans both LLCs.
+        let assignment = [0, 0, 0, 0, 0, 0, 1, 1];
+        let next = resize(&assignment, 0xff, 1.8, 0).unwrap();
+        assert_eq!(next, vec![0, 0, 0, 0, 1, 1, 1, 1]);
+    }
+
+    #[test]
+    fn test_shrink() {
+        // 4 cpus at 20% utilization: lend one core, 40% on the remaining ones.
+        let assignment = [1, 1, 1, 1, 0, 0, 0, 0];
+        let next = resize(&assignment, 0xf, 0.8, 0).unwrap();
+        assert_eq!(next.iter().filter(|c| **c == 1).count(), 2);
+        assert_eq!(&next[4..], &[0, 0, 0, 0]);
+
+        // Queued tasks prevent shrinking.
+        assert_eq!(resize(&assignment, 0xf, 0.8, 1), None);
+    }
+
+    #[test]
+    fn test_hysteresis() {
+        let assignment = [1, 1, 1, 1, 0, 0, 0, 0];
+
+        // Between the thresholds: nothing to do.
+        assert_eq!(resize(&assignment, 0xff, 2.0, 0), None);
+
+        // Below the low threshold (28%), but shrinking would push the
+        // utilization (56%) above the midpoint of the thresholds.
+        assert_eq!(resize(&assignment, 0xf, 1.12, 0), None);
+    }
+
+    #[test]
+    fn test_clamps() {
+        // The cell already owns its whole home: it can't grow beyond it.
+        let assignment = [1, 1, 1, 1, 0, 0, 0, 0];
+        assert_eq!(resize(&assignment, 0xf, 4.0, 8), None);
+
+        // The cell owns a single core: it never shrinks below it.
+        let assignment = [1, 1, 0, 0, 0, 0, 0, 0];
+        assert_eq!(resize(&assignment, 0x3, 0.0, 0), None);
+
+        // Cores only partially inside the home never move.
+        let assignment = [1, 0, 0, 0, 0, 0, 0, 0];
+        assert_eq!(resize(&assignment, 0x7, 1.0, 0), None);
+    }
+
+    #[test]
+    fn test_no_load() {
+        // Cells without a load entry are left alone.
+        let homes = BTreeMap::from([(1, Cpumask::from_vec(vec![0xf]))]);
+        let assignment = [1, 1, 0, 0, 0, 0, 0, 0];
+        assert_eq!(
+            resizer().resize(&assignment, &homes, &BTreeMap::new(), INTERVAL_NS),
+            None
+        );
+    }
+}
@@ -27,6 +27,7 @@ enum consts {
 	MAX_DSQS_PER_LLC	= 8,
 	MAX_TASK_PRIO		= 39,
 	MAX_TOPO_NODES		= 1024,
+	CACHELINE_SIZE		= 64,
 
 	NSEC_PER_USEC		= 1000ULL,
 	NSEC_PER_MSEC		= (1000ULL * NSEC_PER_USEC),
@@ -38,6 +39,9 @@ enum consts {
 
 	LOAD_BALANCE_SLACK	= 20ULL,
 
+	RUNTIME_HIST_BUCKETS	= 16,
+	AUTOSLICE_MIN_SAMPLES	= 16,
+
 	P2DQ_MIG_DSQ		= 1LLU << 60,
 	P2DQ_INTR_DSQ		= 1LLU << 32,
 
@@ -67,9 +71,14 @@ enum stat_idx {
 	P2DQ_STAT_ENQ_MIG,
 	P2DQ_STAT_SELECT_PICK2,
 	P2DQ_STAT_DISPATCH_PICK2,
+	P2DQ_STAT_PICK2_ATTEMPT,
+	P2DQ_STAT_PICK2_STALE,
 	P2DQ_STAT_WAKE_PREV,
 	P2DQ_STAT_WAKE_LLC,
 	P2DQ_STAT_WAKE_MIG,
+	P2DQ_STAT_SLICE_EXPIRED,
+	P2DQ_STAT_AUTOSLICE_GROW,
+	P2DQ_STAT_AUTOSLICE_SHRINK,
 	P2DQ_NR_STATS,
 };
 
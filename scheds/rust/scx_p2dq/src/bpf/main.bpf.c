@@ -53,7 +53,8 @@ const volatile u64 dsq_shift = 2;
 const volatile int init_dsq_index = 0;
 const volatile u64 min_slice_us = 100;
 const volatile u64 min_llc_runs_pick2 = 5;
-const volatile u32 interactive_ratio = 10;
+const volatile u32 autoslice_pct = 90;
+const volatile u32 autoslice_intr_pct = 50;
 const volatile u32 min_nr_queued_pick2 = 10;
 
 const volatile bool autoslice = true;
@@ -93,6 +94,8 @@ u64 cpu_llc_ids[MAX_CPUS];
 u64 cpu_node_ids[MAX_CPUS];
 u64 big_core_ids[MAX_CPUS];
 u64 dsq_time_slices[MAX_DSQS_PER_LLC];
+u64 llc_dsq_time_slices[MAX_LLCS][MAX_DSQS_PER_LLC];
+struct llc_snap llc_snaps[MAX_LLCS];
 
 u64 min_slice_ns = 500;
 u32 sched_mode = MODE_PERFORMANCE;
@@ -139,11 +142,85 @@ static __always_inline u64 task_slice_ns(struct task_struct *p, u64 slice_ns)
 	return clamp_slice(scale_by_task_weight(p, slice_ns));
 }
 
-static __always_inline u64 task_dsq_slice_ns(struct task_struct *p, int dsq_index)
+static __always_inline u64 task_dsq_slice_ns(struct task_struct *p,
+					     struct llc_ctx *llcx,
+					     int dsq_index)
 {
+	u64 *slice_ns;
+
+	if (autoslice &&
+	    (slice_ns = MEMBER_VPTR(llcx->dsq_slice_ns, [dsq_index])) &&
+	    *slice_ns > 0)
+		return task_slice_ns(p, *slice_ns);
+
 	return task_slice_ns(p, dsq_time_slice(dsq_index));
 }
 
+/*
+ * Returns the runtime histogram bucket, buckets are log2 of the runtime in
+ * microseconds.
+ */
+static __always_inline u32 runtime_bucket(u64 used_ns)
+{
+	u64 us = used_ns / NSEC_PER_USEC;
+	u32 bucket = 0;
+
+	if (us >= 1 << 8) { bucket += 8; us >>= 8; }
+	if (us >= 1 << 4) { bucket += 4; us >>= 4; }
+	if (us >= 1 << 2) { bucket += 2; us >>= 2; }
+	if (us >= 1 << 1) { bucket += 1; }
+
+	return min(bucket, RUNTIME_HIST_BUCKETS - 1);
+}
+
+static struct llc_ctx *lookup_llc_ctx(u32 llc_id);
+
+/*
+ * Record the length of the current burst of @taskc in the runtime histogram.
+ * The burst of a task that is still runnable keeps growing: each burst counts
+ * as a single sample, that is moved to the bucket of the new length if the
+ * burst has already been recorded since the histogram was last aged.
+ */
+static __always_inline void record_runtime(task_ctx *taskc,
+					   struct llc_ctx *llcx, int dsq_index,
+					   u64 used_ns)
+{
+	u32 bucket = runtime_bucket(used_ns);
+	struct llc_ctx *prev_llcx;
+	u32 *cnt;
+
+	if (dsq_index < 0 || dsq_index >= MAX_DSQS_PER_LLC ||
+	    bucket >= RUNTIME_HIST_BUCKETS)
+		return;
+
+	if (taskc->rt_recorded) {
+		if (taskc->rt_llc_id == llcx->id &&
+		    taskc->rt_dsq_index == dsq_index &&
+		    taskc->rt_bucket == bucket &&
+		    taskc->rt_gen == llcx->rt_gen)
+			return;
+
+		prev_llcx = taskc->rt_llc_id == llcx->id ? llcx :
+			    lookup_llc_ctx(taskc->rt_llc_id);
+		if (prev_llcx && taskc->rt_gen == prev_llcx->rt_gen &&
+		    taskc->rt_dsq_index < MAX_DSQS_PER_LLC &&
+		    taskc->rt_bucket < RUNTIME_HIST_BUCKETS) {
+			cnt = &prev_llcx->rt_hist[taskc->rt_dsq_index][taskc->rt_bucket];
+			if (*cnt)
+				__sync_fetch_and_sub(cnt, 1);
+		}
+	}
+
+	cnt = &llcx->rt_hist[dsq_index][bucket];
+	__sync_fetch_and_add(cnt, 1);
+
+	taskc->rt_recorded = true;
+	taskc->rt_llc_id = llcx->id;
+	taskc->rt_dsq_index = dsq_index;
+	taskc->rt_bucket = bucket;
+	taskc->rt_gen = llcx->rt_gen;
+}
+
 static u64 llc_nr_queued(struct llc_ctx *llcx)
 {
 	u64 nr_queued = scx_bpf_dsq_nr_queued(llcx->dsq);
@@ -991,8 +1068,24 @@ void BPF_STRUCT_OPS(p2dq_stopping, struct task_struct *p, bool runnable)
 	trace("STOPPING %s weight %d slice %llu used %llu scaled %llu",
 	      p->comm, p->scx.weight, last_dsq_slice_ns, used, scaled_used);
 
+	/*
+	 * A task that is still runnable after using up its slice was
+	 * preempted involuntarily, its burst is at least twice as long as
+	 * what it has run for so far as far as autoslice is concerned.
+	 */
+	if (runnable && used >= last_dsq_slice_ns) {
+		stat_inc(P2DQ_STAT_SLICE_EXPIRED);
+		if (autoslice)
+			record_runtime(taskc, llcx, dsq_index,
+				       2 * (now - taskc->last_run_started));
+	}
+
 	if (!runnable) {
 		used = now - taskc->last_run_started;
+		if (autoslice) {
+			record_runtime(taskc, llcx, dsq_index, used);
+			taskc->rt_recorded = false;
+		}
 		// On stopping determine if the task can move to a longer DSQ by
 		// comparing the used time to the scaled DSQ slice.
 		if (used >= ((9 * last_dsq_slice_ns) / 10)) {
@@ -1023,18 +1116,35 @@ void BPF_STRUCT_OPS(p2dq_stopping, struct task_struct *p, bool runnable)
 		if (p->scx.weight < 100 && taskc->dsq_index > 1)
 			taskc->dsq_index = 1;
 
-		taskc->slice_ns = task_dsq_slice_ns(p, taskc->dsq_index);
+		taskc->slice_ns = task_dsq_slice_ns(p, llcx, taskc->dsq_index);
 		taskc->last_run_started = 0;
 		taskc->interactive = is_interactive(taskc);
 	}
 }
 
-static __always_inline bool consume_llc(struct llc_ctx *llcx)
+static __always_inline bool consume_llc(struct llc_snap *snap)
 {
-	if (!llcx)
+	if (!snap)
+		return false;
+
+	stat_inc(P2DQ_STAT_PICK2_ATTEMPT);
+
+	/*
+	 * The snapshot is only a hint, the live queue depth is only checked
+	 * for the chosen victim. If the snapshot claimed there was work to
+	 * steal but there isn't, or the load balancer timer fell behind, the
+	 * decision was made on stale data.
+	 */
+	if (scx_bpf_dsq_nr_queued(snap->mig_dsq) == 0) {
+		if (snap->nr_queued > 0)
+			stat_inc(P2DQ_STAT_PICK2_STALE);
 		return false;
+	}
+
+	if (scx_bpf_now() - snap->snap_at > 2 * lb_timer_intvl_ns)
+		stat_inc(P2DQ_STAT_PICK2_STALE);
 
-	if (scx_bpf_dsq_move_to_local(llcx->mig_dsq)) {
+	if (scx_bpf_dsq_move_to_local(snap->mig_dsq)) {
 		stat_inc(P2DQ_STAT_DISPATCH_PICK2);
 		return true;
 	}
@@ -1042,9 +1152,19 @@ static __always_inline bool consume_llc(struct llc_ctx *llcx)
 	return false;
 }
 
+/*
+ * Returns a random LLC snapshot.
+ */
+static struct llc_snap *rand_llc_snap(void)
+{
+	u32 llc_id = bpf_get_prandom_u32() % nr_llcs;
+
+	return MEMBER_VPTR(llc_snaps, [llc_id]);
+}
+
 static __always_inline int dispatch_pick_two(s32 cpu, struct llc_ctx *cur_llcx, struct cpu_ctx *cpuc)
 {
-	struct llc_ctx *first, *second, *left, *right;
+	struct llc_snap *first, *second, *left, *right, *cur;
 	int i;
 	u64 cur_load;
 
@@ -1077,12 +1197,14 @@ static __always_inline int dispatch_pick_two(s32 cpu, struct llc_ctx *cur_llcx,
 	 * first try to consume from the LLC with the largest load. If we are
 	 * unable to consume from the first LLC then the second LLC is consumed
 	 * from. This yields better work conservation on machines with a large
-	 * number of LLCs.
+	 * number of LLCs. Loads are compared using the snapshots from the last
+	 * load balancing interval.
 	 */
-	left = nr_llcs == 2 ? lookup_llc_ctx(llc_ids[0]) : rand_llc_ctx();
-	right = nr_llcs == 2 ? lookup_llc_ctx(llc_ids[1]) : rand_llc_ctx();
+	left = nr_llcs == 2 ? MEMBER_VPTR(llc_snaps, [llc_ids[0]]) : rand_llc_snap();
+	right = nr_llcs == 2 ? MEMBER_VPTR(llc_snaps, [llc_ids[1]]) : rand_llc_snap();
+	cur = MEMBER_VPTR(llc_snaps, [cur_llcx->id]);
 
-	if (!left || !right)
+	if (!left || !right || !cur)
 		return -EINVAL;
 
 	if (right->load > left->load) {
@@ -1095,15 +1217,15 @@ static __always_inline int dispatch_pick_two(s32 cpu, struct llc_ctx *cur_llcx,
 
 	// Handle the edge case where there are two LLCs and the current has
 	// more load. Since it's already been checked start with the other LLC.
-	if (nr_llcs == 2 && first->id == cur_llcx->id) {
+	if (nr_llcs == 2 && first == cur) {
 		first = second;
-		second = cur_llcx;
+		second = cur;
 	}
 
-	trace("PICK2 cpu[%d] first[%d] %llu second[%d] %llu",
-	      cpu, first->id, first->load, second->id, second->load);
+	trace("PICK2 cpu[%d] first %llu/%llu second %llu/%llu",
+	      cpu, first->load, first->nr_queued, second->load, second->nr_queued);
 
-	cur_load = cur_llcx->load + (cur_llcx->load * lb_slack_factor);
+	cur_load = cur->load + (cur->load * lb_slack_factor);
 
 	if (first->load > cur_load &&
 	    consume_llc(first))
@@ -1276,6 +1398,7 @@ static __always_inline s32 p2dq_init_task_impl(struct task_struct *p,
 	}
 	taskc->last_dsq_index = taskc->dsq_index;
 	taskc->slice_ns = scale_by_task_weight(p, dsq_time_slice(init_dsq_index));
+	taskc->rt_recorded = false;
 	taskc->all_cpus = p->cpus_ptr == &p->cpus_mask && p->nr_cpus_allowed == nr_cpus;
 	taskc->interactive = is_interactive(taskc);
 	p->scx.dsq_vtime = llcx->vtime;
@@ -1300,7 +1423,7 @@ static int init_llc(u32 llc_index)
 	struct bpf_cpumask *cpumask, *big_cpumask, *little_cpumask, *node_cpumask;
 	struct llc_ctx *llcx;
 	u32 llc_id = llc_ids[llc_index];
-	int ret;
+	int i, ret;
 
 	llcx = bpf_map_lookup_elem(&llc_ctxs, &llc_id);
 	if (!llcx) {
@@ -1311,6 +1434,12 @@ static int init_llc(u32 llc_index)
 	llcx->vtime = 0;
 	llcx->id = *MEMBER_VPTR(llc_ids, [llc_index]);
 	llcx->index = llc_index;
+
+	bpf_for(i, 0, nr_dsqs_per_llc) {
+		if (i >= MAX_DSQS_PER_LLC)
+			break;
+		llcx->dsq_slice_ns[i] = dsq_time_slices[i];
+	}
 	llcx->nr_cpus = 0;
 	llcx->vtime = 0;
 
@@ -1335,6 +1464,13 @@ static int init_llc(u32 llc_index)
 		return -EINVAL;
 	}
 
+	struct llc_snap *snap = MEMBER_VPTR(llc_snaps, [llc_id]);
+	if (!snap) {
+		scx_bpf_error("invalid llc %u", llc_id);
+		return -EINVAL;
+	}
+	snap->mig_dsq = llcx->mig_dsq;
+
 	cpumask = bpf_cpumask_create();
 	if (!cpumask) {
 		scx_bpf_error("failed to create cpumask");
@@ -1497,11 +1633,87 @@ static s32 init_cpu(int cpu)
 	return 0;
 }
 
+/*
+ * Sets the slice of each DSQ tier of the LLC independently to the target
+ * percentile of the runtime distribution observed in the tier. The slices of
+ * each LLC are exported in llc_dsq_time_slices and the global dsq_time_slices
+ * are the max slices of all LLCs.
+ */
+static void autoslice_llc(struct llc_ctx *llcx, bool first)
+{
+	u64 slice_ns, target_ns, prev_ns = min_slice_ns;
+	u32 total, cum, pct, *hist;
+	int j, b;
+
+	bpf_for(j, 0, nr_dsqs_per_llc) {
+		if (j >= MAX_DSQS_PER_LLC)
+			break;
+
+		hist = llcx->rt_hist[j];
+		slice_ns = llcx->dsq_slice_ns[j];
+		total = 0;
+		bpf_for(b, 0, RUNTIME_HIST_BUCKETS) {
+			if (b >= RUNTIME_HIST_BUCKETS)
+				break;
+			total += hist[b];
+		}
+
+		if (total >= AUTOSLICE_MIN_SAMPLES) {
+			pct = (nr_dsqs_per_llc > 1 && j == 0) ?
+				autoslice_intr_pct : autoslice_pct;
+			target_ns = slice_ns;
+			cum = 0;
+			bpf_for(b, 0, RUNTIME_HIST_BUCKETS) {
+				if (b >= RUNTIME_HIST_BUCKETS)
+					break;
+				cum += hist[b];
+				if ((u64)cum * 100 >= (u64)total * pct) {
+					// upper bound of the bucket
+					target_ns = (2ULL << b) * NSEC_PER_USEC;
+					break;
+				}
+			}
+
+			// Move halfway to the target to smooth out noise.
+			target_ns = (slice_ns + target_ns) / 2;
+			if (target_ns > slice_ns)
+				stat_inc(P2DQ_STAT_AUTOSLICE_GROW);
+			else if (target_ns < slice_ns)
+				stat_inc(P2DQ_STAT_AUTOSLICE_SHRINK);
+			slice_ns = target_ns;
+		}
+
+		// Longer running tiers never get a shorter slice.
+		slice_ns = min(max(slice_ns, prev_ns), max_exec_ns);
+		llcx->dsq_slice_ns[j] = slice_ns;
+		prev_ns = slice_ns;
+
+		if (llcx->index < MAX_LLCS)
+			llc_dsq_time_slices[llcx->index][j] = slice_ns;
+
+		if (first || slice_ns > dsq_time_slices[j])
+			dsq_time_slices[j] = slice_ns;
+
+		dbg("LB autoslice llc[%u] dsq[%d] samples %u slice %llu",
+		    llcx->id, j, total, slice_ns);
+
+		// Age the histogram so it tracks the current workload.
+		bpf_for(b, 0, RUNTIME_HIST_BUCKETS) {
+			if (b >= RUNTIME_HIST_BUCKETS)
+				break;
+			hist[b] >>= 1;
+		}
+	}
+
+	// Samples recorded before the aging can't be moved anymore.
+	llcx->rt_gen++;
+}
+
 static bool load_balance_timer(void)
 {
 	struct llc_ctx *llcx, *lb_llcx;
-	int j;
-	u64 ideal_sum, load_sum = 0, interactive_sum = 0;
+	struct llc_snap *snap;
+	u64 load_sum = 0, interactive_sum = 0;
 	u32 llc_id, llc_index, lb_llc_index, lb_llc_id;
 
 	bpf_for(llc_index, 0, nr_llcs) {
@@ -1530,6 +1742,14 @@ static bool load_balance_timer(void)
 		load_sum += llcx->load;
 		interactive_sum += llcx->intr_load;
 
+		snap = MEMBER_VPTR(llc_snaps, [llc_id]);
+		if (snap) {
+			snap->load = llcx->load;
+			snap->nr_queued = scx_bpf_dsq_nr_queued(llcx->mig_dsq);
+			snap->mig_dsq = llcx->mig_dsq;
+			snap->snap_at = scx_bpf_now();
+		}
+
 		s64 load_imbalance = 0;
 		if(llcx->load > lb_llcx->load)
 			load_imbalance = (100 * (llcx->load - lb_llcx->load)) / llcx->load;
@@ -1550,51 +1770,18 @@ static bool load_balance_timer(void)
 
 	llc_lb_offset = (llc_lb_offset % (nr_llcs - 1)) + 1;
 
-	if (!autoslice || load_sum == 0 || load_sum < interactive_sum)
-		goto reset_load;
-
-	if (interactive_sum == 0) {
-		dsq_time_slices[0] = (11 * dsq_time_slices[0]) / 10;
-		bpf_for(j, 1, nr_dsqs_per_llc) {
-			dsq_time_slices[j] = dsq_time_slices[0] << j << dsq_shift;
-		}
-	} else {
-		ideal_sum = (load_sum * interactive_ratio) / 100;
-		dbg("LB autoslice ideal/sum %llu/%llu", ideal_sum, interactive_sum);
-		if (interactive_sum < ideal_sum) {
-			dsq_time_slices[0] = (11 * dsq_time_slices[0]) / 10;
-
-			bpf_for(j, 1, nr_dsqs_per_llc) {
-				dsq_time_slices[j] = dsq_time_slices[0] << j << dsq_shift;
-			}
-		} else {
-			dsq_time_slices[0] = max((10 * dsq_time_slices[0]) / 11, min_slice_ns);
-			bpf_for(j, 1, nr_dsqs_per_llc) {
-				dsq_time_slices[j] = dsq_time_slices[0] << j << dsq_shift;
-			}
-		}
-	}
-
-
-reset_load:
-
 	bpf_for(llc_index, 0, nr_llcs) {
 		llc_id = *MEMBER_VPTR(llc_ids, [llc_index]);
 		if (!(llcx = lookup_llc_ctx(llc_id)))
 			return false;
 
+		if (autoslice)
+			autoslice_llc(llcx, llc_index == 0);
+
 		llcx->load = 0;
 		llcx->intr_load = 0;
 		llcx->affn_load = 0;
 		llcx->last_period_ns = scx_bpf_now();
-		bpf_for(j, 0, nr_dsqs_per_llc) {
-			if (llc_id == 0 && autoslice) {
-				if (j > 0 && dsq_time_slices[j] < dsq_time_slices[j-1]) {
-					dsq_time_slices[j] = dsq_time_slices[j-1] << dsq_shift;
-				}
-				dbg("LB autoslice interactive slice %llu", dsq_time_slices[j]);
-			}
-		}
 	}
 
 	return true;
@@ -40,12 +40,30 @@ struct llc_ctx {
 	u64				affn_load;
 	u64				intr_load;
 	bool				all_big;
+
+	/* autoslice: per DSQ tier slices and log2(usec) runtime histograms */
+	u64				dsq_slice_ns[MAX_DSQS_PER_LLC];
+	u32				rt_hist[MAX_DSQS_PER_LLC][RUNTIME_HIST_BUCKETS];
+	u32				rt_gen; /* bumped when the histograms are aged */
+
 	struct bpf_cpumask __kptr	*cpumask;
 	struct bpf_cpumask __kptr	*big_cpumask;
 	struct bpf_cpumask __kptr	*little_cpumask;
 	struct bpf_cpumask __kptr	*node_cpumask;
 };
 
+/*
+ * Per interval snapshot of the LLC load published by the load balancer timer.
+ * Pick two load balancing compares snapshots so that dispatch does not have to
+ * touch remote llc_ctx cachelines.
+ */
+struct llc_snap {
+	u64				load;
+	u64				nr_queued;
+	u64				mig_dsq;
+	u64				snap_at;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
 struct node_ctx {
 	u32				id;
 	bool				all_big;
@@ -63,6 +81,14 @@ struct task_p2dq {
 	u64			last_dsq_id;
 	u64 			last_run_started;
 	u64 			last_run_at;
+
+	/* autoslice: histogram slot of the current burst, if recorded */
+	bool			rt_recorded;
+	u32			rt_llc_id;
+	u32			rt_dsq_index;
+	u32			rt_bucket;
+	u32			rt_gen;
+
 	u64			llc_runs; /* how many runs on the current LLC */
 	int			last_dsq_index;
 	bool			interactive;
@@ -32,14 +32,23 @@ pub struct SchedulerOpts {
     #[clap(short = 'k', long, action = clap::ArgAction::SetTrue)]
     pub disable_kthreads_local: bool,
 
-    /// Enables autoslice tuning
+    /// Enables autoslice tuning, each DSQ tier slice is set per LLC from the runtime
+    /// distribution of the tasks in the tier.
     #[clap(short = 'a', long, action = clap::ArgAction::SetTrue)]
     pub autoslice: bool,
 
-    /// Ratio of interactive tasks for autoslice tuning, percent value from 1-99.
-    #[clap(short = 'r', long, default_value = "10")]
+    /// *DEPRECATED* Ratio of interactive tasks for autoslice tuning, percent value from 1-99.
+    #[clap(short = 'r', long, default_value = "10", help = "DEPRECATED")]
     pub interactive_ratio: usize,
 
+    /// Target runtime percentile for autoslice tuning of the non interactive DSQ tiers.
+    #[clap(long, default_value = "90", value_parser = clap::value_parser!(u32).range(1..100))]
+    pub autoslice_pct: u32,
+
+    /// Target runtime percentile for autoslice tuning of the interactive DSQ tier.
+    #[clap(long, default_value = "50", value_parser = clap::value_parser!(u32).range(1..100))]
+    pub autoslice_intr_pct: u32,
+
     /// Enables deadline scheduling
     #[clap(long, action = clap::ArgAction::SetTrue)]
     pub deadline: bool,
@@ -191,16 +200,8 @@ macro_rules! init_open_skel {
                     $skel.maps.bss_data.dsq_time_slices[i] = slice_ns;
                 }
             }
-            if opts.autoslice {
-                if opts.interactive_ratio == 0 || opts.interactive_ratio > 99 {
-                    break 'block ::anyhow::Result::Err(::anyhow::anyhow!(
-                        "Invalid interactive_ratio {}, must be between 1-99",
-                        opts.interactive_ratio
-                    ));
-                }
-            }
-
-            $skel.maps.rodata_data.interactive_ratio = opts.interactive_ratio as u32;
+            $skel.maps.rodata_data.autoslice_pct = opts.autoslice_pct;
+            $skel.maps.rodata_data.autoslice_intr_pct = opts.autoslice_intr_pct;
             $skel.maps.rodata_data.min_slice_us = opts.min_slice_us;
             $skel.maps.rodata_data.min_nr_queued_pick2 = opts.min_nr_queued_pick2;
             $skel.maps.rodata_data.min_llc_runs_pick2 = opts.min_llc_runs_pick2;
@@ -3,6 +3,7 @@
 // This software may be used and distributed according to the terms of the
 // GNU General Public License version 2.
 pub mod stats;
+use stats::LlcStats;
 use stats::Metrics;
 
 use std::mem::MaybeUninit;
@@ -38,6 +39,8 @@ use scx_utils::{Core, Llc};
 use std::ffi::c_ulong;
 
 use bpf_intf::stat_idx_P2DQ_NR_STATS;
+use bpf_intf::stat_idx_P2DQ_STAT_AUTOSLICE_GROW;
+use bpf_intf::stat_idx_P2DQ_STAT_AUTOSLICE_SHRINK;
 use bpf_intf::stat_idx_P2DQ_STAT_DIRECT;
 use bpf_intf::stat_idx_P2DQ_STAT_DISPATCH_PICK2;
 use bpf_intf::stat_idx_P2DQ_STAT_DSQ_CHANGE;
@@ -49,7 +52,10 @@ use bpf_intf::stat_idx_P2DQ_STAT_IDLE;
 use bpf_intf::stat_idx_P2DQ_STAT_KEEP;
 use bpf_intf::stat_idx_P2DQ_STAT_LLC_MIGRATION;
 use bpf_intf::stat_idx_P2DQ_STAT_NODE_MIGRATION;
+use bpf_intf::stat_idx_P2DQ_STAT_PICK2_ATTEMPT;
+use bpf_intf::stat_idx_P2DQ_STAT_PICK2_STALE;
 use bpf_intf::stat_idx_P2DQ_STAT_SELECT_PICK2;
+use bpf_intf::stat_idx_P2DQ_STAT_SLICE_EXPIRED;
 use bpf_intf::stat_idx_P2DQ_STAT_WAKE_LLC;
 use bpf_intf::stat_idx_P2DQ_STAT_WAKE_MIG;
 use bpf_intf::stat_idx_P2DQ_STAT_WAKE_PREV;
@@ -145,6 +151,17 @@ impl<'a> Scheduler<'a> {
                 .sum();
             stats[stat as usize] = sum;
         }
+        let bss_data = &self.skel.maps.bss_data;
+        let nr_dsqs = self.skel.maps.rodata_data.nr_dsqs_per_llc as usize;
+        let llcs = (0..self.skel.maps.rodata_data.nr_llcs as usize)
+            .map(|index| {
+                let slices_us = bss_data.llc_dsq_time_slices[index][..nr_dsqs]
+                    .iter()
+                    .map(|slice_ns| slice_ns / 1000)
+                    .collect();
+                (bss_data.llc_ids[index] as u32, LlcStats { slices_us })
+            })
+            .collect();
         Metrics {
             direct: stats[stat_idx_P2DQ_STAT_DIRECT as usize],
             idle: stats[stat_idx_P2DQ_STAT_IDLE as usize],
@@ -157,11 +174,22 @@ impl<'a> Scheduler<'a> {
             enq_mig: stats[stat_idx_P2DQ_STAT_ENQ_MIG as usize],
             select_pick2: stats[stat_idx_P2DQ_STAT_SELECT_PICK2 as usize],
             dispatch_pick2: stats[stat_idx_P2DQ_STAT_DISPATCH_PICK2 as usize],
+            pick2_attempts: stats[stat_idx_P2DQ_STAT_PICK2_ATTEMPT as usize],
+            pick2_stale: stats[stat_idx_P2DQ_STAT_PICK2_STALE as usize],
             llc_migrations: stats[stat_idx_P2DQ_STAT_LLC_MIGRATION as usize],
             node_migrations: stats[stat_idx_P2DQ_STAT_NODE_MIGRATION as usize],
             wake_prev: stats[stat_idx_P2DQ_STAT_WAKE_PREV as usize],
             wake_llc: stats[stat_idx_P2DQ_STAT_WAKE_LLC as usize],
             wake_mig: stats[stat_idx_P2DQ_STAT_WAKE_MIG as usize],
+            slice_expired: stats[stat_idx_P2DQ_STAT_SLICE_EXPIRED as usize],
+            autoslice_grow: stats[stat_idx_P2DQ_STAT_AUTOSLICE_GROW as usize],
+            autoslice_shrink: stats[stat_idx_P2DQ_STAT_AUTOSLICE_SHRINK as usize],
+            dsq_slices_us: self.skel.maps.bss_data.dsq_time_slices
+                [..self.skel.maps.rodata_data.nr_dsqs_per_llc as usize]
+                .iter()
+                .map(|slice_ns| slice_ns / 1000)
+                .collect(),
+            llcs,
         }
     }
 
@@ -1,3 +1,4 @@
+use std::collections::BTreeMap;
 use std::io::Write;
 use std::sync::atomic::AtomicBool;
 use std::sync::atomic::Ordering;
@@ -11,6 +12,14 @@ use scx_stats_derive::Stats;
 use serde::Deserialize;
 use serde::Serialize;
 
+#[stat_doc]
+#[derive(Clone, Debug, Default, Serialize, Deserialize, Stats)]
+#[stat(_om_prefix = "l_", _om_label = "llc")]
+pub struct LlcStats {
+    #[stat(desc = "DSQ tier slices of the LLC in microseconds")]
+    pub slices_us: Vec<u64>,
+}
+
 #[stat_doc]
 #[derive(Clone, Debug, Default, Serialize, Deserialize, Stats)]
 #[stat(top)]
@@ -33,6 +42,10 @@ pub struct Metrics {
     pub select_pick2: u64,
     #[stat(desc = "Number of times a dispatch pick 2 load balancing occured")]
     pub dispatch_pick2: u64,
+    #[stat(desc = "Number of times a dispatch pick 2 tried to steal from a LLC")]
+    pub pick2_attempts: u64,
+    #[stat(desc = "Number of dispatch pick 2 decisions made on stale LLC snapshots")]
+    pub pick2_stale: u64,
     #[stat(desc = "Number of times a task migrated LLCs")]
     pub llc_migrations: u64,
     #[stat(desc = "Number of times a task migrated NUMA nodes")]
@@ -47,9 +60,26 @@ pub struct Metrics {
     pub wake_llc: u64,
     #[stat(desc = "Number of times tasks have been woken and migrated llc")]
     pub wake_mig: u64,
+    #[stat(desc = "Number of times tasks were preempted after using up their slice")]
+    pub slice_expired: u64,
+    #[stat(desc = "Number of times autoslice grew a DSQ tier slice")]
+    pub autoslice_grow: u64,
+    #[stat(desc = "Number of times autoslice shrank a DSQ tier slice")]
+    pub autoslice_shrink: u64,
+    #[stat(desc = "Max DSQ tier slices across LLCs in microseconds")]
+    pub dsq_slices_us: Vec<u64>,
+    #[stat(desc = "Per-LLC stats")]
+    pub llcs: BTreeMap<u32, LlcStats>,
 }
 
 impl Metrics {
+    fn steal_pct(&self) -> f64 {
+        if self.pick2_attempts == 0 {
+            return 0.0;
+        }
+        100.0 * self.dispatch_pick2 as f64 / self.pick2_attempts as f64
+    }
+
     fn format<W: Write>(&self, w: &mut W) -> Result<()> {
         writeln!(
             w,
@@ -65,15 +95,25 @@ impl Metrics {
         )?;
         writeln!(
             w,
-            "\twake prev/llc/mig {}/{}/{}\n\tpick2 select/dispatch {}/{}\n\tmigrations llc/node: {}/{}",
+            "\twake prev/llc/mig {}/{}/{}\n\tpick2 select/dispatch {}/{}\n\tpick2 steal/stale {:.2}%/{}\n\tmigrations llc/node: {}/{}",
             self.wake_prev,
             self.wake_llc,
             self.wake_mig,
             self.select_pick2,
             self.dispatch_pick2,
+            self.steal_pct(),
+            self.pick2_stale,
             self.llc_migrations,
             self.node_migrations,
         )?;
+        writeln!(
+            w,
+            "\tslice expired {}\n\tautoslice grow/shrink {}/{} slices_us {:?}",
+            self.slice_expired, self.autoslice_grow, self.autoslice_shrink, self.dsq_slices_us,
+        )?;
+        for (id, llc) in self.llcs.iter() {
+            writeln!(w, "\tLLC[{:02}] slices_us {:?}", id, llc.slices_us)?;
+        }
         Ok(())
     }
 
@@ -89,11 +129,16 @@ impl Metrics {
             enq_mig: self.enq_mig - rhs.enq_mig,
             select_pick2: self.select_pick2 - rhs.select_pick2,
             dispatch_pick2: self.dispatch_pick2 - rhs.dispatch_pick2,
+            pick2_attempts: self.pick2_attempts - rhs.pick2_attempts,
+            pick2_stale: self.pick2_stale - rhs.pick2_stale,
             llc_migrations: self.llc_migrations - rhs.llc_migrations,
             node_migrations: self.node_migrations - rhs.node_migrations,
             wake_prev: self.wake_prev - rhs.wake_prev,
             wake_llc: self.wake_llc - rhs.wake_llc,
             wake_mig: self.wake_mig - rhs.wake_mig,
+            slice_expired: self.slice_expired - rhs.slice_expired,
+            autoslice_grow: self.autoslice_grow - rhs.autoslice_grow,
+            autoslice_shrink: self.autoslice_shrink - rhs.autoslice_shrink,
             ..self.clone()
         }
     }
@@ -115,6 +160,7 @@ pub fn server_data() -> StatsServerData<(), Metrics> {
     });
 
     StatsServerData::new()
+        .add_meta(LlcStats::meta())
         .add_meta(Metrics::meta())
         .add_ops("top", StatsOps { open, close: None })
 }
@@ -32,11 +32,20 @@
 //!
 //! - **Initialization**:
 //!   - `BpfScheduler::init()` registers the scheduler and initializes the BPF component.
+//!   - `spawn_shards(new_policy)`: Run the other scheduler shards (one per LLC by default), each
+//!      one in a dedicated thread calling the policy returned by `new_policy` with its own
+//!      `BpfShard`, that provides the same task management methods of `BpfScheduler`
 //!
 //! - **Task Management**:
 //!   - `dequeue_task()`: Consume a task that wants to run, returns a QueuedTask object
+//!   - `dequeue_tasks(tasks: &mut Vec<QueuedTask>, max: usize)`: Consume up to `max` tasks that
+//!      want to run at once, appending them to `tasks`
 //!   - `select_cpu(pid: i32, prev_cpu: i32, flags: u64)`: Select an idle CPU for a task
+//!   - `select_cpu_fast(pid: i32, prev_cpu: i32, flags: u64)`: Same as `select_cpu()`, but the
+//!      idle CPU is picked from the idle state shared by the BPF component, without any syscall
 //!   - `dispatch_task(task: &DispatchedTask)`: Dispatch a task
+//!   - `dispatch_tasks(tasks: &[DispatchedTask])`: Dispatch multiple tasks at once, returns the
+//!      amount of tasks dispatched (less than `tasks.len()` if the dispatch ring buffer is full)
 //!
 //! - **Completion Notification**:
 //!   - `notify_complete(nr_pending: u64)` Give control to the BPF component and report the number
@@ -82,6 +91,8 @@
 //!  let n: u64 = *self.bpf.nr_bounce_dispatches_mut(); // amount of bounced dispatches
 //!  let n: u64 = *self.bpf.nr_failed_dispatches_mut(); // amount of failed dispatches
 //!  let n: u64 = *self.bpf.nr_sched_congested_mut();   // amount of scheduler congestion events
+//!  let n: u64 = self.bpf.nr_dispatched_tasks();        // amount of tasks sent to the dispatcher
+//!  let n: u64 = self.bpf.sched_cpu_time_ns();          // CPU time used by the scheduler threads
 
 mod bpf_skel;
 pub use bpf_skel::*;
@@ -100,53 +111,118 @@ use scx_utils::UserExitInfo;
 // Maximum time slice (in nanoseconds) that a task can use before it is re-enqueued.
 const SLICE_NS: u64 = 5_000_000;
 
+// Maximum amount of tasks consumed and dispatched in a single batch.
+const BATCH_SIZE: usize = 256;
+
+// FIFO policy of a single scheduler shard.
+//
+// Each shard only sees the tasks queued on the CPUs of its own LLCs, so the FIFO order is
+// per-LLC.
+struct FifoShard {
+    queued: Vec<QueuedTask>, // Batch of tasks received from the BPF backend
+    dispatched: Vec<DispatchedTask>, // Batch of tasks to be sent to the BPF backend
+}
+
+impl FifoShard {
+    fn new() -> Self {
+        Self {
+            queued: Vec::with_capacity(BATCH_SIZE),
+            dispatched: Vec::with_capacity(BATCH_SIZE),
+        }
+    }
+
+    // Send the batch of tasks to the BPF backend.
+    //
+    // If the dispatch ring buffer is full, only part of the batch is dispatched: keep the other
+    // tasks to retry them in the next round and return false.
+    fn flush_dispatched(&mut self, bpf: &mut BpfShard) -> bool {
+        if !self.dispatched.is_empty() {
+            let nr_dispatched = bpf.dispatch_tasks(&self.dispatched).unwrap_or(0);
+            self.dispatched.drain(..nr_dispatched);
+        }
+        self.dispatched.is_empty()
+    }
+
+    fn dispatch_tasks(&mut self, bpf: &mut BpfShard) {
+        // Get the amount of tasks that are waiting to be scheduled.
+        let nr_waiting = bpf.nr_queued();
+
+        // Start consuming and dispatching tasks in batches, until all the CPUs are busy or there
+        // are no more tasks to be dispatched. Tasks that couldn't be dispatched in the previous
+        // round go first.
+        self.queued.clear();
+        while self.flush_dispatched(bpf) {
+            match bpf.dequeue_tasks(&mut self.queued, BATCH_SIZE) {
+                Ok(n) if n > 0 => {}
+                _ => break,
+            }
+
+            for task in self.queued.drain(..) {
+                // Create a new task to be dispatched from the received enqueued task.
+                let mut dispatched_task = DispatchedTask::new(&task);
+
+                // Decide where the task needs to run (pick a target CPU).
+                //
+                // A call to select_cpu_fast() will return the most suitable idle CPU for the
+                // task, prioritizing its previously used CPU (task.cpu), without leaving
+                // user-space (the BPF dispatcher takes care of the CPUs that stopped being idle
+                // in the meantime).
+                //
+                // If we can't find any idle CPU, run on the first CPU available.
+                let cpu = bpf.select_cpu_fast(task.pid, task.cpu, task.flags);
+                dispatched_task.cpu = if cpu >= 0 { cpu } else { RL_CPU_ANY };
+
+                // Determine the task's time slice: assign value inversely proportional to the
+                // number of tasks waiting to be scheduled.
+                dispatched_task.slice_ns = SLICE_NS / (nr_waiting + 1);
+
+                self.dispatched.push(dispatched_task);
+            }
+        }
+
+        // Notify the BPF component that tasks have been dispatched, reporting the tasks that are
+        // still pending.
+        //
+        // This function will put the scheduler to sleep, until another task needs to run.
+        bpf.notify_complete(self.dispatched.len() as u64);
+    }
+}
+
 struct Scheduler<'a> {
-    bpf: BpfScheduler<'a>, // Connector to the sched_ext BPF backend
+    bpf: BpfScheduler<'a>,   // Connector to the sched_ext BPF backend
+    fifo: FifoShard,         // Policy of the first scheduler shard
+    prev_nr_dispatched: u64, // Dispatched tasks at the previous stats report
+    prev_cpu_time_ns: u64,   // Scheduler CPU time at the previous stats report
 }
 
 impl<'a> Scheduler<'a> {
     fn init(open_object: &'a mut MaybeUninit<OpenObject>) -> Result<Self> {
-        let bpf = BpfScheduler::init(
+        let mut bpf = BpfScheduler::init(
             open_object,
             0,     // exit_dump_len (buffer size of exit info, 0 = default)
             false, // partial (false = include all tasks)
             false, // debug (false = debug mode off)
             true,  // builtin_idle (true = allow BPF to use idle CPUs if available)
+            0,     // nr_shards (0 = one scheduler shard per LLC)
         )?;
-        Ok(Self { bpf })
+
+        // The first shard is run by the main thread (see run()), start the others, each one with
+        // its own FifoShard created by the shard thread.
+        bpf.spawn_shards(|| {
+            let mut fifo = FifoShard::new();
+            move |shard: &mut BpfShard| fifo.dispatch_tasks(shard)
+        })?;
+
+        Ok(Self {
+            bpf,
+            fifo: FifoShard::new(),
+            prev_nr_dispatched: 0,
+            prev_cpu_time_ns: 0,
+        })
     }
 
     fn dispatch_tasks(&mut self) {
-        // Get the amount of tasks that are waiting to be scheduled.
-        let nr_waiting = *self.bpf.nr_queued_mut();
-
-        // Start consuming and dispatching tasks, until all the CPUs are busy or there are no more
-        // tasks to be dispatched.
-        while let Ok(Some(task)) = self.bpf.dequeue_task() {
-            // Create a new task to be dispatched from the received enqueued task.
-            let mut dispatched_task = DispatchedTask::new(&task);
-
-            // Decide where the task needs to run (pick a target CPU).
-            //
-            // A call to select_cpu() will return the most suitable idle CPU for the task,
-            // prioritizing its previously used CPU (task.cpu).
-            //
-            // If we can't find any idle CPU, run on the first CPU available.
-            let cpu = self.bpf.select_cpu(task.pid, task.cpu, task.flags);
-            dispatched_task.cpu = if cpu >= 0 { cpu } else { RL_CPU_ANY };
-
-            // Determine the task's time slice: assign value inversely proportional to the number
-            // of tasks waiting to be scheduled.
-            dispatched_task.slice_ns = SLICE_NS / (nr_waiting + 1);
-
-            // Dispatch the task.
-            self.bpf.dispatch_task(&dispatched_task).unwrap();
-        }
-
-        // Notify the BPF component that tasks have been dispatched.
-        //
-        // This function will put the scheduler to sleep, until another task needs to run.
-        self.bpf.notify_complete(0);
+        self.fifo.dispatch_tasks(self.bpf.shard_mut());
     }
 
     fn print_stats(&mut self) {
@@ -158,14 +234,24 @@ impl<'a> Scheduler<'a> {
         let nr_failed_dispatches = *self.bpf.nr_failed_dispatches_mut();
         let nr_sched_congested = *self.bpf.nr_sched_congested_mut();
 
+        // Scheduling throughput: tasks dispatched per second of CPU time used by the scheduler.
+        let nr_dispatched = self.bpf.nr_dispatched_tasks();
+        let cpu_time_ns = self.bpf.sched_cpu_time_ns();
+        let sched_rate = ((nr_dispatched - self.prev_nr_dispatched) * 1_000_000_000)
+            .checked_div(cpu_time_ns.saturating_sub(self.prev_cpu_time_ns))
+            .unwrap_or(0);
+        self.prev_nr_dispatched = nr_dispatched;
+        self.prev_cpu_time_ns = cpu_time_ns;
+
         println!(
-            "user={} kernel={} cancel={} bounce={} fail={} cong={}",
+            "user={} kernel={} cancel={} bounce={} fail={} cong={} sched/s/core={}",
             nr_user_dispatches,
             nr_kernel_dispatches,
             nr_cancel_dispatches,
             nr_bounce_dispatches,
             nr_failed_dispatches,
             nr_sched_congested,
+            sched_rate,
         );
     }
 
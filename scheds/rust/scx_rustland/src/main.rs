@@ -11,7 +11,7 @@ mod bpf;
 use bpf::*;
 
 mod stats;
-use std::collections::BTreeSet;
+mod task_heap;
 use std::io::{self};
 use std::mem::MaybeUninit;
 use std::time::Duration;
@@ -27,6 +27,7 @@ use scx_stats::prelude::*;
 use scx_utils::build_id;
 use scx_utils::UserExitInfo;
 use stats::Metrics;
+use task_heap::TaskHeap;
 
 const SCHEDULER_NAME: &'static str = "RustLand";
 
@@ -55,7 +56,8 @@ const SCHEDULER_NAME: &'static str = "RustLand";
 /// exec_runtime, resulting in earlier deadlines. In contrast, CPU-intensive tasks that don’t sleep
 /// accumulate a larger exec_runtime and thus get scheduled later.
 ///
-/// All the tasks are stored in a BTreeSet (TaskTree), using the deadline as the ordering key.
+/// All the tasks are stored in a preallocated pid-indexed heap (TaskHeap), using the deadline as
+/// the ordering key, so that the scheduling loop doesn't need to allocate any memory.
 /// Once the order of execution is determined all tasks are sent back to the BPF counterpart
 /// (scx_rustland_core) to be dispatched.
 ///
@@ -88,6 +90,12 @@ struct Opts {
     #[clap(short = 'p', long, action = clap::ArgAction::SetTrue)]
     partial: bool,
 
+    /// If specified, the user-space scheduler keeps running on the given CPU, polling for new
+    /// tasks instead of waiting for a CPU to become idle. This reduces the scheduling latency, at
+    /// the cost of dedicating a CPU to the scheduler.
+    #[clap(long)]
+    busy_poll_cpu: Option<usize>,
+
     /// Exit debug dump buffer length. 0 indicates default.
     #[clap(long, default_value = "0")]
     exit_dump_len: u32,
@@ -118,6 +126,12 @@ struct Opts {
 // Time constants.
 const NSEC_PER_USEC: u64 = 1_000;
 
+// Maximum amount of tasks received from the BPF backend in a single batch.
+const DEQUEUE_BATCH: usize = 256;
+
+// Amount of tasks that can be waiting in the scheduler without allocating memory.
+const MAX_SCHED_TASKS: usize = 16384;
+
 #[derive(Debug, PartialEq, Eq, PartialOrd, Clone)]
 struct Task {
     qtask: QueuedTask, // queued task
@@ -142,7 +156,8 @@ struct Scheduler<'a> {
     bpf: BpfScheduler<'a>,                  // BPF connector
     opts: &'a Opts,                         // scheduler options
     stats_server: StatsServer<(), Metrics>, // statistics
-    tasks: BTreeSet<Task>,                  // tasks ordered by deadline
+    tasks: TaskHeap<Task>,                  // tasks ordered by deadline
+    queued: Vec<QueuedTask>,                // batch of tasks received from the BPF backend
     min_vruntime: u64,                      // Keep track of the minimum vruntime across all tasks
     init_page_faults: u64,                  // Initial page faults counter
     slice_ns: u64,                          // Default time slice (in ns)
@@ -154,13 +169,17 @@ impl<'a> Scheduler<'a> {
         let stats_server = StatsServer::new(stats::server_data()).launch()?;
 
         // Low-level BPF connector.
-        let bpf = BpfScheduler::init(
+        let mut bpf = BpfScheduler::init(
             open_object,
             opts.exit_dump_len,
             opts.partial,
             opts.verbose,
             true, // Enable built-in idle CPU selection policy
+            1,    // Single shard: tasks are ordered by a global deadline
         )?;
+        if let Some(cpu) = opts.busy_poll_cpu {
+            bpf.enable_busy_poll(cpu)?;
+        }
 
         info!(
             "{} version {} - scx_rustland_core {}",
@@ -174,7 +193,8 @@ impl<'a> Scheduler<'a> {
             bpf,
             opts,
             stats_server,
-            tasks: BTreeSet::new(),
+            tasks: TaskHeap::with_capacity(MAX_SCHED_TASKS),
+            queued: Vec::with_capacity(DEQUEUE_BATCH),
             min_vruntime: 0,
             init_page_faults: 0,
             slice_ns: opts.slice_us * NSEC_PER_USEC,
@@ -204,6 +224,12 @@ impl<'a> Scheduler<'a> {
             nr_bounce_dispatches: *self.bpf.nr_bounce_dispatches_mut(),
             nr_failed_dispatches: *self.bpf.nr_failed_dispatches_mut(),
             nr_sched_congested: *self.bpf.nr_sched_congested_mut(),
+            nr_sched_tasks: self.bpf.nr_dispatched_tasks(),
+            sched_cpu_ns: self.bpf.sched_cpu_time_ns(),
+            nr_poll_spins: *self.bpf.nr_poll_spins_mut(),
+            nr_poll_yields: *self.bpf.nr_poll_yields_mut(),
+            nr_poll_sleeps: *self.bpf.nr_poll_sleeps_mut(),
+            poll_idle_ns: *self.bpf.poll_idle_ns_mut(),
         }
     }
 
@@ -267,7 +293,7 @@ impl<'a> Scheduler<'a> {
     fn dispatch_task(&mut self) -> bool {
         let nr_waiting = self.nr_tasks_waiting() + 1;
 
-        if let Some(task) = self.tasks.pop_first() {
+        if let Some(task) = self.tasks.pop() {
             // Scale time slice based on the amount of tasks that are waiting in the
             // scheduler's queue and the previously unused time slice budget, but make sure
             // to assign at least slice_us_min.
@@ -300,7 +326,7 @@ impl<'a> Scheduler<'a> {
             // Send task to the BPF dispatcher.
             if self.bpf.dispatch_task(&dispatched_task).is_err() {
                 // If dispatching fails, re-add the task to the pool and skip further dispatching.
-                self.tasks.insert(task);
+                self.tasks.push(task.qtask.pid, task);
 
                 return false;
             }
@@ -312,29 +338,39 @@ impl<'a> Scheduler<'a> {
     // Drain all the tasks from the queued list, update their vruntime (Self::update_enqueued()),
     // then push them all to the task pool (doing so will sort them by their vruntime).
     fn drain_queued_tasks(&mut self) {
+        let mut queued = std::mem::take(&mut self.queued);
+
         loop {
-            match self.bpf.dequeue_task() {
-                Ok(Some(mut task)) => {
-                    // Update task information and determine vruntime.
-                    let deadline = self.update_enqueued(&mut task);
-                    let timestamp = Self::now();
-
-                    // Insert task in the task pool (ordered by vruntime).
-                    self.tasks.insert(Task {
-                        qtask: task,
-                        deadline,
-                        timestamp,
-                    });
-                }
-                Ok(None) => {
+            match self.bpf.dequeue_tasks(&mut queued, DEQUEUE_BATCH) {
+                Ok(0) => {
                     break;
                 }
+                Ok(_) => {
+                    for mut task in queued.drain(..) {
+                        // Update task information and determine vruntime.
+                        let deadline = self.update_enqueued(&mut task);
+                        let timestamp = Self::now();
+
+                        // Insert task in the task pool (ordered by vruntime), replacing any stale
+                        // entry of the same task.
+                        let pid = task.pid;
+                        self.tasks.push(
+                            pid,
+                            Task {
+                                qtask: task,
+                                deadline,
+                                timestamp,
+                            },
+                        );
+                    }
+                }
                 Err(err) => {
                     warn!("Error: {}", err);
                     break;
                 }
             }
         }
+        self.queued = queued;
 
         // Dispatch the first task from the task pool.
         self.dispatch_task();
@@ -34,13 +34,25 @@ pub struct Metrics {
     pub nr_failed_dispatches: u64,
     #[stat(desc = "Number of scheduler congestion events")]
     pub nr_sched_congested: u64,
+    #[stat(desc = "Number of tasks sent to the BPF dispatcher by the user-space scheduler")]
+    pub nr_sched_tasks: u64,
+    #[stat(desc = "CPU time used by the user-space scheduler (ns)")]
+    pub sched_cpu_ns: u64,
+    #[stat(desc = "Number of idle busy-polling rounds spent spinning")]
+    pub nr_poll_spins: u64,
+    #[stat(desc = "Number of idle busy-polling rounds that yielded the CPU")]
+    pub nr_poll_yields: u64,
+    #[stat(desc = "Number of times the busy-polling scheduler blocked waiting for tasks")]
+    pub nr_poll_sleeps: u64,
+    #[stat(desc = "Time spent busy-polling without any task to schedule (ns)")]
+    pub poll_idle_ns: u64,
 }
 
 impl Metrics {
     fn format<W: Write>(&self, w: &mut W) -> Result<()> {
         writeln!(
             w,
-            "[{}] tasks -> r: {:>2}/{:<2} w: {:<2}/{:<2} | pf: {:<5} | dispatch -> u: {:<5} k: {:<5} c: {:<5} b: {:<5} f: {:<5} | cg: {:<5}",
+            "[{}] tasks -> r: {:>2}/{:<2} w: {:<2}/{:<2} | pf: {:<5} | dispatch -> u: {:<5} k: {:<5} c: {:<5} b: {:<5} f: {:<5} | cg: {:<5} | sched/s/core: {} | poll -> sp: {:<5} y: {:<5} s: {:<5} idle: {}ms",
             crate::SCHEDULER_NAME,
             self.nr_running,
             self.nr_cpus,
@@ -53,6 +65,13 @@ impl Metrics {
             self.nr_bounce_dispatches,
             self.nr_failed_dispatches,
             self.nr_sched_congested,
+            (self.nr_sched_tasks * 1_000_000_000)
+                .checked_div(self.sched_cpu_ns)
+                .unwrap_or(0),
+            self.nr_poll_spins,
+            self.nr_poll_yields,
+            self.nr_poll_sleeps,
+            self.poll_idle_ns / 1_000_000,
         )?;
         Ok(())
     }
@@ -65,6 +84,12 @@ impl Metrics {
             nr_bounce_dispatches: self.nr_bounce_dispatches - rhs.nr_bounce_dispatches,
             nr_failed_dispatches: self.nr_failed_dispatches - rhs.nr_failed_dispatches,
             nr_sched_congested: self.nr_sched_congested - rhs.nr_sched_congested,
+            nr_sched_tasks: self.nr_sched_tasks - rhs.nr_sched_tasks,
+            sched_cpu_ns: self.sched_cpu_ns.saturating_sub(rhs.sched_cpu_ns),
+            nr_poll_spins: self.nr_poll_spins - rhs.nr_poll_spins,
+            nr_poll_yields: self.nr_poll_yields - rhs.nr_poll_yields,
+            nr_poll_sleeps: self.nr_poll_sleeps - rhs.nr_poll_sleeps,
+            poll_idle_ns: self.poll_idle_ns - rhs.poll_idle_ns,
             ..self.clone()
         }
     }
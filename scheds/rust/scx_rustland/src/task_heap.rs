@@ -0,0 +1,300 @@
+// Copyright (c) Andrea Righi <andrea.righi@linux.dev>
+
+// This software may be used and distributed according to the terms of the
+// GNU General Public License version 2.
+
+// Pid-indexed binary min-heap.
+//
+// Items are stored in a binary heap backed by a preallocated vector, and each item is indexed by
+// the pid of its task in an open-addressing hash table (linear probing, backward-shift deletion),
+// so that the item of a task can be replaced or removed in O(log n) without scanning the heap.
+//
+// Heap entries and hash table slots point to each other, so moving an entry in the heap updates
+// its slot in O(1), without re-hashing the pid.
+//
+// All the memory is allocated up-front: as long as the amount of items doesn't exceed the initial
+// capacity, push(), pop() and remove() never allocate. If the capacity is exceeded the heap and
+// the hash table double their size.
+
+use std::cmp::Ordering;
+
+const EMPTY: i32 = -1;
+
+// Heap entry.
+struct Entry<T> {
+    item: T,
+    pid: i32,    // Task pid
+    slot: usize, // Hash table slot of the entry
+}
+
+// Hash table slot.
+#[derive(Clone, Copy)]
+struct Slot {
+    pid: i32,   // Task pid (EMPTY = free slot)
+    pos: usize, // Position of the task in the heap
+}
+
+const FREE_SLOT: Slot = Slot { pid: EMPTY, pos: 0 };
+
+pub struct TaskHeap<T: Ord> {
+    heap: Vec<Entry<T>>, // Binary min-heap
+    slots: Vec<Slot>,    // Hash table of the pids (size is a power of 2)
+}
+
+impl<T: Ord> TaskHeap<T> {
+    // Create an empty heap that can hold up to @capacity items without allocating memory.
+    pub fn with_capacity(capacity: usize) -> Self {
+        let capacity = capacity.max(1);
+        TaskHeap {
+            heap: Vec::with_capacity(capacity),
+            slots: vec![FREE_SLOT; Self::nr_slots(capacity)],
+        }
+    }
+
+    // Size of the hash table for @capacity items (load factor <= 50%).
+    fn nr_slots(capacity: usize) -> usize {
+        (capacity * 2).next_power_of_two()
+    }
+
+    // Amount of items in the heap.
+    pub fn len(&self) -> usize {
+        self.heap.len()
+    }
+
+    // Return true if the heap is empty.
+    #[allow(dead_code)]
+    pub fn is_empty(&self) -> bool {
+        self.heap.is_empty()
+    }
+
+    // Amount of items that can be stored without allocating memory.
+    #[allow(dead_code)]
+    pub fn capacity(&self) -> usize {
+        self.heap.capacity().min(self.slots.len() / 2)
+    }
+
+    // Add the item of task @pid to the heap. If the task is already in the heap its item is
+    // replaced and the previous one is returned.
+    pub fn push(&mut self, pid: i32, item: T) -> Option<T> {
+        debug_assert!(pid != EMPTY);
+
+        if let Some(slot) = self.lookup(pid) {
+            let pos = self.slots[slot].pos;
+            let old = std::mem::replace(&mut self.heap[pos].item, item);
+            self.sift_up(pos);
+            self.sift_down(self.slots[slot].pos);
+            return Some(old);
+        }
+
+        if self.heap.len() == self.capacity() {
+            self.grow();
+        }
+        let pos = self.heap.len();
+        let slot = self.insert_slot(pid, pos);
+        self.heap.push(Entry { item, pid, slot });
+        self.sift_up(pos);
+
+        None
+    }
+
+    // Remove and return the minimum item.
+    pub fn pop(&mut self) -> Option<T> {
+        if self.heap.is_empty() {
+            return None;
+        }
+        Some(self.remove_at(0))
+    }
+
+    // Return the minimum item, without removing it.
+    #[allow(dead_code)]
+    pub fn peek(&self) -> Option<&T> {
+        self.heap.first().map(|entry| &entry.item)
+    }
+
+    // Remove and return the item of task @pid.
+    #[allow(dead_code)]
+    pub fn remove(&mut self, pid: i32) -> Option<T> {
+        let slot = self.lookup(pid)?;
+        Some(self.remove_at(self.slots[slot].pos))
+    }
+
+    // Remove the item at position @pos of the heap.
+    fn remove_at(&mut self, pos: usize) -> T {
+        let last = self.heap.len() - 1;
+        self.swap(pos, last);
+        let entry = self.heap.pop().unwrap();
+        self.delete_slot(entry.slot);
+        if pos < self.heap.len() {
+            self.sift_up(pos);
+            self.sift_down(self.slots[self.heap[pos].slot].pos);
+        }
+        entry.item
+    }
+
+    // Swap the heap entries at positions @a and @b, updating their hash table slots.
+    fn swap(&mut self, a: usize, b: usize) {
+        self.heap.swap(a, b);
+        self.slots[self.heap[a].slot].pos = a;
+        self.slots[self.heap[b].slot].pos = b;
+    }
+
+    fn sift_up(&mut self, mut pos: usize) {
+        while pos > 0 {
+            let parent = (pos - 1) / 2;
+            if self.heap[pos].item.cmp(&self.heap[parent].item) != Ordering::Less {
+                break;
+            }
+            self.swap(pos, parent);
+            pos = parent;
+        }
+    }
+
+    fn sift_down(&mut self, mut pos: usize) {
+        let len = self.heap.len();
+        loop {
+            let left = 2 * pos + 1;
+            if left >= len {
+                break;
+            }
+            let right = left + 1;
+            let child = if right < len
+                && self.heap[right].item.cmp(&self.heap[left].item) == Ordering::Less
+            {
+                right
+            } else {
+                left
+            };
+            if self.heap[pos].item.cmp(&self.heap[child].item) != Ordering::Greater {
+                break;
+            }
+            self.swap(pos, child);
+            pos = child;
+        }
+    }
+
+    // Return the preferred hash table slot of @pid.
+    fn hash(&self, pid: i32) -> usize {
+        let mask = self.slots.len() - 1;
+        ((pid as u32).wrapping_mul(0x9e37_79b9) as usize) & mask
+    }
+
+    // Return the hash table slot of @pid, if present.
+    fn lookup(&self, pid: i32) -> Option<usize> {
+        let mask = self.slots.len() - 1;
+        let mut slot = self.hash(pid);
+        loop {
+            match self.slots[slot].pid {
+                EMPTY => return None,
+                p if p == pid => return Some(slot),
+                _ => slot = (slot + 1) & mask,
+            }
+        }
+    }
+
+    // Store @pid in a free hash table slot, pointing to heap position @pos.
+    fn insert_slot(&mut self, pid: i32, pos: usize) -> usize {
+        let mask = self.slots.len() - 1;
+        let mut slot = self.hash(pid);
+        while self.slots[slot].pid != EMPTY {
+            slot = (slot + 1) & mask;
+        }
+        self.slots[slot] = Slot { pid, pos };
+        slot
+    }
+
+    // Free hash table @slot, shifting back the following entries of the probe sequence, so that
+    // lookups never need tombstones.
+    fn delete_slot(&mut self, mut slot: usize) {
+        let mask = self.slots.len() - 1;
+        let mut next = (slot + 1) & mask;
+        while self.slots[next].pid != EMPTY {
+            // Move the entry back only if its preferred slot is not between the freed slot and
+            // its current slot (cyclically).
+            let home = self.hash(self.slots[next].pid);
+            if (next.wrapping_sub(home) & mask) >= (next.wrapping_sub(slot) & mask) {
+                self.slots[slot] = self.slots[next];
+                self.heap[self.slots[slot].pos].slot = slot;
+                slot = next;
+            }
+            next = (next + 1) & mask;
+        }
+        self.slots[slot] = FREE_SLOT;
+    }
+
+    // Double the capacity of the heap, re-hashing all the pids.
+    fn grow(&mut self) {
+        let capacity = self.capacity() * 2;
+        self.heap.reserve_exact(capacity - self.heap.len());
+        self.slots = vec![FREE_SLOT; Self::nr_slots(capacity)];
+        for pos in 0..self.heap.len() {
+            let pid = self.heap[pos].pid;
+            self.heap[pos].slot = self.insert_slot(pid, pos);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use scx_rustland_core::ALLOCATOR;
+
+    // Simple pseudo-random generator (xorshift).
+    fn rand(state: &mut u64) -> u64 {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        *state
+    }
+
+    #[test]
+    fn test_task_heap_order() {
+        let mut heap = TaskHeap::with_capacity(4);
+        let mut state = 42;
+        for pid in 0..1000 {
+            heap.push(pid, (rand(&mut state) % 100, pid));
+        }
+        // Replace and remove some tasks.
+        for pid in (0..1000).step_by(3) {
+            assert!(heap.push(pid, (rand(&mut state) % 100, pid)).is_some());
+        }
+        for pid in (0..1000).step_by(5) {
+            assert_eq!(heap.remove(pid).map(|(_, p)| p), Some(pid));
+            assert!(heap.remove(pid).is_none());
+        }
+        assert_eq!(heap.len(), 800);
+
+        let mut prev = (0, -1);
+        while let Some(item) = heap.pop() {
+            assert!(item > prev);
+            assert!(item.1 % 5 != 0);
+            prev = item;
+        }
+        assert!(heap.is_empty());
+    }
+
+    #[test]
+    fn test_task_heap_no_alloc() {
+        const NR_TASKS: i32 = 4096;
+
+        let mut heap = TaskHeap::with_capacity(NR_TASKS as usize);
+        let mut state = 42;
+        for pid in 0..NR_TASKS / 2 {
+            heap.push(pid, (rand(&mut state), pid));
+        }
+
+        // Steady state: dispatch, requeue and enqueue new tasks, without allocating memory.
+        let nr_allocs = ALLOCATOR.thread_allocs();
+        for i in 0..100_000 {
+            let (_, pid) = heap.pop().unwrap();
+            heap.push(pid, (rand(&mut state), pid));
+            let pid = (rand(&mut state) % NR_TASKS as u64) as i32;
+            if i % 2 == 0 {
+                heap.push(pid, (rand(&mut state), pid));
+            } else {
+                heap.remove(pid);
+            }
+        }
+        assert_eq!(ALLOCATOR.thread_allocs(), nr_allocs);
+        assert!(heap.len() <= heap.capacity());
+    }
+}
@@ -57,15 +57,21 @@ enum consts {
 
 	/*
 	 * When userspace load balancer is trying to determine the tasks to push
-	 * out from an overloaded domain, it looks at the the following number
-	 * of recently active tasks of the domain. While this may lead to
-	 * spurious migration victim selection failures in pathological cases,
-	 * this isn't a practical problem as the LB rounds are best-effort
-	 * anyway and will be retried until loads are balanced.
+	 * out from an overloaded domain, it looks at the recently active tasks
+	 * of the domain indexed by log2 of their load. Each load bucket keeps
+	 * up to the following number of tasks, so the many light tasks of a
+	 * busy domain can't push out the few heavy ones. While this may lead
+	 * to spurious migration victim selection failures in pathological
+	 * cases, this isn't a practical problem as the LB rounds are
+	 * best-effort anyway and will be retried until loads are balanced.
 	 */
-	MAX_DOM_ACTIVE_TPTRS	= 1024,
+	LB_TASK_LOAD_BUCKETS	= 16,	/* log2 of LB_MAX_WEIGHT, rounded up */
+	LB_TASK_BUCKET_SLOTS	= 64,
 
 	STATIC_ALLOC_PAGES_GRANULARITY = 1,
+
+	/* kernel definitions */
+	CLOCK_BOOTTIME		= 7,
 };
 
 /* Statistics */
@@ -87,6 +93,7 @@ enum stat_idx {
 	RUSTY_STAT_REPATRIATE,
 	RUSTY_STAT_KICK_GREEDY,
 	RUSTY_STAT_LOAD_BALANCE,
+	RUSTY_STAT_BPF_LB_XFER,
 
 	/* Errors */
 	RUSTY_STAT_TASK_GET_ERR,
@@ -34,6 +34,8 @@
  * Load balancing is almost entirely handled by userspace. BPF populates the
  * task weight, dom mask and current dom in the task map and executes the
  * load balance based on userspace's setting of the target_dom field.
+ * Optionally, balancing between the domains of a NUMA node can be performed
+ * from a BPF timer, see bpf_lb_timerfn().
  */
 
 #ifdef LSP
@@ -86,10 +88,26 @@ const volatile u32 greedy_threshold;
 const volatile u32 greedy_threshold_x_numa;
 const volatile u32 rusty_perf_mode;
 const volatile u32 debug;
+const volatile bool bpf_lb;
+const volatile bool bpf_lb_skip_kworkers;
 
 /* base slice duration */
 volatile u64 slice_ns;
 
+/*
+ * Scale the task loads by their weight, set by the tuner when the system is
+ * fully utilized. Otherwise all tasks count as LB_DEFAULT_WEIGHT, as in the
+ * userspace load balancer.
+ */
+volatile bool lb_apply_weight;
+
+/* in-BPF load balancer parameters, see bpf_lb_timerfn() */
+volatile u64 bpf_lb_interval_ns = 5 * NSEC_PER_MSEC;
+volatile u32 bpf_lb_imbal_pct = 5;
+volatile u32 bpf_lb_xfer_pct = 50;
+volatile u32 bpf_lb_max_xfers = 4;
+volatile u64 bpf_lb_index_period_ns = 4 * NSEC_PER_SEC;
+
 struct bpfmask_wrapper {
 	struct bpf_cpumask __kptr *instance;
 };
@@ -297,6 +315,30 @@ static inline u32 weight_to_bucket_idx(u32 weight)
 	return weight * LB_LOAD_BUCKETS / LB_MAX_WEIGHT;
 }
 
+static u64 task_lb_load(struct task_ctx *taskc, u64 now)
+{
+	u64 dcycle = ravg_read(&taskc->dcyc_rd, now, load_half_life);
+	u64 weight = lb_apply_weight ? taskc->weight : LB_DEFAULT_WEIGHT;
+
+	return (dcycle * weight) >> RAVG_FRAC_BITS;
+}
+
+/*
+ * Returns the index of the task load bucket, buckets are log2 of the load,
+ * i.e. the duty cycle scaled by weight.
+ */
+static u32 load_to_task_bucket_idx(u64 load)
+{
+	u32 idx = 0;
+
+	if (load >= 1 << 8) { idx += 8; load >>= 8; }
+	if (load >= 1 << 4) { idx += 4; load >>= 4; }
+	if (load >= 1 << 2) { idx += 2; load >>= 2; }
+	if (load >= 1 << 1) { idx += 1; }
+
+	return idx < LB_TASK_LOAD_BUCKETS ? idx : LB_TASK_LOAD_BUCKETS - 1;
+}
+
 static void task_load_adj(struct task_ctx *taskc,
 			  u64 now, bool runnable)
 {
@@ -1466,8 +1508,9 @@ void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 {
 	task_ptr usrptr = (task_ptr)sdt_task_data(p);
 	struct task_ctx *taskc;
+	struct dom_task_bucket *bucket;
 	dom_ptr domc;
-	u32 dap_gen;
+	u32 dap_gen, bucket_idx;
 
 	if (!(taskc = lookup_task_ctx(p)))
 		return;
@@ -1479,25 +1522,34 @@ void BPF_STRUCT_OPS(rusty_running, struct task_struct *p)
 	}
 
 	/*
-	 * Record that @p has been active in @domc. Load balancer will only
-	 * consider recently active tasks. Access synchronization rules aren't
+	 * Record that @p has been active in @domc in the bucket matching its
+	 * load. Load balancer will only consider recently active tasks and
+	 * starts from the heaviest bucket. Access synchronization rules aren't
 	 * strict. We just need to be right most of the time.
 	 */
-	dap_gen = domc->active_tasks.genn;
+	dap_gen = domc->task_index.genn;
 	if (taskc->dom_active_tasks_gen != dap_gen) {
-		u64 idx = __sync_fetch_and_add(&domc->active_tasks.write_idx, 1) %
-			MAX_DOM_ACTIVE_TPTRS;
+		bucket_idx = load_to_task_bucket_idx(task_lb_load(taskc, scx_bpf_now()));
+		if (bucket_idx >= LB_TASK_LOAD_BUCKETS) {
+			scx_bpf_error("dom_task_index[%u] bucket %u out of bounds",
+				      domc->id, bucket_idx);
+			return;
+		}
+		bucket = (struct dom_task_bucket *)&domc->task_index.buckets[bucket_idx];
 
-		if (idx >= MAX_DOM_ACTIVE_TPTRS) {
-			scx_bpf_error("dom_active_tasks[%u][%llu] out of bounds indexing",
-				      domc->id, idx);
+		u64 idx = __sync_fetch_and_add(&bucket->write_idx, 1) %
+			LB_TASK_BUCKET_SLOTS;
+
+		if (idx >= LB_TASK_BUCKET_SLOTS) {
+			scx_bpf_error("dom_task_index[%u][%u][%llu] out of bounds indexing",
+				      domc->id, bucket_idx, idx);
 			return;
 		}
 
 		usrptr = (task_ptr)sdt_task_data(p);
 		cast_user(usrptr);
 
-		domc->active_tasks.tasks[idx] = usrptr;
+		bucket->tasks[idx] = usrptr;
 		taskc->dom_active_tasks_gen = dap_gen;
 	}
 
@@ -1918,6 +1970,301 @@ static s32 initialize_cpu(s32 cpu)
 	return -ENOENT;
 }
 
+/*
+ * In-BPF load balancer
+ *
+ * Optionally, the intra-node domain load balancing can be performed from a BPF
+ * timer instead of userspace so that bursty load can be reacted to within a
+ * few slices. The algorithm is the same as userspace's: domains whose load is
+ * more than bpf_lb_imbal_pct above the average push tasks to the least loaded
+ * domain of the same NUMA node which is below the average by the same margin.
+ * Victims are picked from the per-domain load-indexed task buckets starting
+ * with the bucket matching the load to transfer. The migration itself happens
+ * on the next enqueue of the task through target_dom as with userspace load
+ * balancing. Balancing across NUMA nodes is still left to userspace.
+ */
+struct bpf_lb_timer {
+	struct bpf_timer timer;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct bpf_lb_timer);
+} bpf_lb_timer SEC(".maps");
+
+/* Domain loads as of the last in-BPF load balancing round */
+u64 bpf_lb_dom_loads[MAX_DOMS];
+
+/* Task index generation of each domain and when it started */
+u64 bpf_lb_index_genn[MAX_DOMS];
+u64 bpf_lb_index_at[MAX_DOMS];
+
+static u64 bucket_weight(u32 bucket_idx)
+{
+	/* Same as LoadBalancer::bucket_weight(), the mid-point of the bucket */
+	return 1 + (LB_MAX_WEIGHT * bucket_idx) / LB_LOAD_BUCKETS +
+		(LB_WEIGHT_PER_BUCKET + 1) / 2;
+}
+
+static u64 dom_load(dom_ptr domc, u64 now)
+{
+	struct bucket_ctx *bucket;
+	u64 load = 0, dcycle;
+	u32 idx;
+
+	bpf_for(idx, 0, LB_LOAD_BUCKETS) {
+		if (idx >= LB_LOAD_BUCKETS)
+			break;
+
+		bucket = (struct bucket_ctx *)&domc->buckets[idx];
+		if (!bucket->dcycle && !bucket->rd.val &&
+		    !bucket->rd.old && !bucket->rd.cur)
+			continue;
+
+		dcycle = ravg_read(&bucket->rd, now, load_half_life);
+		load += (dcycle * (lb_apply_weight ? bucket_weight(idx) :
+				   LB_DEFAULT_WEIGHT)) >> RAVG_FRAC_BITS;
+	}
+
+	return load;
+}
+
+/*
+ * Pick the task of @push_domc which can run in @pull_dom_id and whose load is
+ * the closest to @to_xfer, below twice @to_xfer, IOW moving it reduces the
+ * imbalance the most, and retarget it. Returns the load of the task
+ * transferred, 0 if none was found.
+ */
+static u64 bpf_lb_xfer_task(dom_ptr push_domc, u32 pull_dom_id, u64 to_xfer,
+			    u64 now)
+{
+	u64 load, diff, best_load = 0, best_diff = -1;
+	struct task_ctx *taskc, *best = NULL;
+	struct dom_task_bucket *bucket;
+	u32 top, i, slot, nr;
+	task_ptr taskp;
+	s32 idx;
+
+	top = load_to_task_bucket_idx(to_xfer);
+
+	/*
+	 * Loads below twice @to_xfer can also be in the bucket above @to_xfer's
+	 * one. Start from there and move to the lighter buckets, until the
+	 * loads they can hold are all farther from @to_xfer than the best
+	 * candidate found.
+	 */
+	bpf_for(i, 0, LB_TASK_LOAD_BUCKETS + 1) {
+		idx = top + 1 - i;
+		if (idx < 0)
+			break;
+		if (idx >= LB_TASK_LOAD_BUCKETS)
+			continue;
+		if (best && idx < top && to_xfer - (2LLU << idx) >= best_diff)
+			break;
+
+		bucket = (struct dom_task_bucket *)&push_domc->task_index.buckets[idx];
+		nr = min(bucket->write_idx, LB_TASK_BUCKET_SLOTS);
+
+		bpf_for(slot, 0, nr) {
+			if (slot >= LB_TASK_BUCKET_SLOTS)
+				break;
+
+			taskp = bucket->tasks[slot];
+			if (!taskp)
+				continue;
+			cast_kern(taskp);
+			taskc = (struct task_ctx *)taskp;
+
+			if (taskc->target_dom != push_domc->id ||
+			    !(taskc->dom_mask & (1LLU << pull_dom_id)) ||
+			    (bpf_lb_skip_kworkers && taskc->is_kworker))
+				continue;
+
+			load = task_lb_load(taskc, now);
+			if (!load || load >= 2 * to_xfer)
+				continue;
+
+			diff = load > to_xfer ? load - to_xfer : to_xfer - load;
+			if (diff < best_diff) {
+				best = taskc;
+				best_load = load;
+				best_diff = diff;
+			}
+		}
+	}
+
+	if (!best)
+		return 0;
+
+	if (debug >= 2)
+		bpf_printk("BPF LB XFER pid=%u dom=%u->%u load=%llu",
+			   best->pid, push_domc->id, pull_dom_id, best_load);
+
+	/*
+	 * Leave the slot alone, the task won't be picked again as its
+	 * target_dom no longer matches @push_domc and userspace may be
+	 * reading the bucket concurrently.
+	 */
+	best->target_dom = pull_dom_id;
+	stat_add(RUSTY_STAT_BPF_LB_XFER, 1);
+	return best_load;
+}
+
+static s32 bpf_lb_find_pull_dom(u32 push_dom_id, u64 pull_below)
+{
+	u32 node_id = dom_node_id(push_dom_id), dom_id;
+	u64 min_load = pull_below;
+	s32 pull_dom_id = -1;
+	u64 *loadp;
+
+	bpf_for(dom_id, 0, nr_doms) {
+		if (dom_id == push_dom_id || dom_node_id(dom_id) != node_id)
+			continue;
+
+		loadp = MEMBER_VPTR(bpf_lb_dom_loads, [dom_id]);
+		if (loadp && *loadp < min_load) {
+			min_load = *loadp;
+			pull_dom_id = dom_id;
+		}
+	}
+
+	return pull_dom_id;
+}
+
+static void bpf_lb_balance(void)
+{
+	u64 now = scx_bpf_now(), load_sum = 0, load_avg, margin, xferred;
+	u64 *push_loadp, *pull_loadp, to_push, to_pull;
+	u32 dom_id, nr_xfers;
+	s32 pull_dom_id;
+	dom_ptr domc;
+
+	bpf_for(dom_id, 0, nr_doms) {
+		if (!(domc = lookup_dom_ctx(dom_id)) ||
+		    !(push_loadp = MEMBER_VPTR(bpf_lb_dom_loads, [dom_id])))
+			return;
+
+		*push_loadp = dom_load(domc, now);
+		load_sum += *push_loadp;
+	}
+
+	load_avg = load_sum / nr_doms;
+	margin = load_avg * bpf_lb_imbal_pct / 100;
+	if (!load_avg)
+		return;
+
+	bpf_for(dom_id, 0, nr_doms) {
+		if (!(domc = lookup_dom_ctx(dom_id)) ||
+		    !(push_loadp = MEMBER_VPTR(bpf_lb_dom_loads, [dom_id])))
+			return;
+
+		if (*push_loadp <= load_avg + margin)
+			continue;
+
+		bpf_for(nr_xfers, 0, bpf_lb_max_xfers) {
+			pull_dom_id = bpf_lb_find_pull_dom(dom_id, load_avg - margin);
+			if (pull_dom_id < 0 ||
+			    !(pull_loadp = MEMBER_VPTR(bpf_lb_dom_loads, [pull_dom_id])))
+				break;
+
+			to_push = *push_loadp - load_avg;
+			to_pull = load_avg - *pull_loadp;
+			xferred = bpf_lb_xfer_task(domc, pull_dom_id,
+						   min(to_push, to_pull) * bpf_lb_xfer_pct / 100,
+						   now);
+			if (!xferred)
+				break;
+
+			*push_loadp -= min(xferred, *push_loadp);
+			*pull_loadp += xferred;
+			if (*push_loadp <= load_avg + margin)
+				break;
+		}
+	}
+}
+
+/*
+ * The task buckets are reset, and genn is bumped so that running tasks get
+ * filed again with their current load, by userspace when it picks the tasks
+ * to push out of a domain. Userspace doesn't run intra-node balancing when the
+ * in-BPF load balancer is enabled, so start a new indexing period for the
+ * domains whose index hasn't been reset by userspace for
+ * bpf_lb_index_period_ns, before their buckets fill up with stale tasks. This
+ * never wipes out the index of a domain before userspace reads it.
+ */
+static void bpf_lb_expire_task_index(u64 now)
+{
+	struct dom_task_bucket *bucket;
+	u64 *genp, *atp;
+	u32 dom_id, idx;
+	dom_ptr domc;
+
+	bpf_for(dom_id, 0, nr_doms) {
+		if (!(domc = lookup_dom_ctx(dom_id)) ||
+		    !(genp = MEMBER_VPTR(bpf_lb_index_genn, [dom_id])) ||
+		    !(atp = MEMBER_VPTR(bpf_lb_index_at, [dom_id])))
+			return;
+
+		if (*genp != domc->task_index.genn) {
+			*genp = domc->task_index.genn;
+			*atp = now;
+			continue;
+		}
+
+		if (now - *atp < bpf_lb_index_period_ns)
+			continue;
+
+		bpf_for(idx, 0, LB_TASK_LOAD_BUCKETS) {
+			if (idx >= LB_TASK_LOAD_BUCKETS)
+				break;
+
+			bucket = (struct dom_task_bucket *)&domc->task_index.buckets[idx];
+			bucket->write_idx = 0;
+		}
+		*genp = ++domc->task_index.genn;
+		*atp = now;
+	}
+}
+
+static int bpf_lb_timerfn(void *map, int *key, struct bpf_timer *timer)
+{
+	int err;
+
+	bpf_lb_balance();
+	bpf_lb_expire_task_index(scx_bpf_now());
+
+	err = bpf_timer_start(timer, bpf_lb_interval_ns, 0);
+	if (err)
+		scx_bpf_error("Failed to re-arm load balancer timer");
+
+	return 0;
+}
+
+static s32 bpf_lb_init(void)
+{
+	struct bpf_timer *timer;
+	u32 key = 0;
+	int err;
+
+	timer = bpf_map_lookup_elem(&bpf_lb_timer, &key);
+	if (!timer) {
+		scx_bpf_error("Failed to lookup load balancer timer");
+		return -ESRCH;
+	}
+
+	bpf_timer_init(timer, &bpf_lb_timer, CLOCK_BOOTTIME);
+	bpf_timer_set_callback(timer, bpf_lb_timerfn);
+	err = bpf_timer_start(timer, bpf_lb_interval_ns, 0);
+	if (err) {
+		scx_bpf_error("Failed to start load balancer timer");
+		return err;
+	}
+
+	return 0;
+}
+
 s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init)
 {
 	s32 i, ret;
@@ -1970,6 +2317,9 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(rusty_init)
 			return ret;
 	}
 
+	if (bpf_lb && nr_doms > 1)
+		return bpf_lb_init();
+
 	return 0;
 }
 
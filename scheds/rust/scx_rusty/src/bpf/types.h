@@ -78,11 +78,19 @@ struct bucket_ctx {
 	struct ravg_data rd;
 };
 
-struct dom_active_tasks {
-	u64 genn;
-	u64 read_idx;
+struct dom_task_bucket {
 	u64 write_idx;
-	task_ptr tasks[MAX_DOM_ACTIVE_TPTRS];
+	task_ptr tasks[LB_TASK_BUCKET_SLOTS];
+};
+
+/*
+ * Recently active tasks of a domain indexed by load. The buckets are reset and
+ * genn is bumped by userspace when it reads them, or by the in-BPF load
+ * balancer timer if userspace hasn't done it for a while.
+ */
+struct dom_task_index {
+	u64 genn;
+	struct dom_task_bucket buckets[LB_TASK_LOAD_BUCKETS];
 };
 
 struct dom_ctx {
@@ -91,7 +99,7 @@ struct dom_ctx {
 
 	u64 dbg_dcycle_printed_at;
 	struct bucket_ctx buckets[LB_LOAD_BUCKETS];
-	struct dom_active_tasks active_tasks;
+	struct dom_task_index task_index;
 };
 
 struct node_ctx {
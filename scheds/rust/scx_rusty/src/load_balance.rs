@@ -87,7 +87,9 @@
 //!
 //! The load hierarchy is always created when load_balance() is called on a
 //! LoadBalancer object, but actual load balancing is only performed if the
-//! balance_load option is specified.
+//! balance_load option is specified. If load balancing between the domains of
+//! each NUMA node is delegated to the in-BPF load balancer (intra_node_in_bpf),
+//! step 4 is skipped.
 //!
 //! Statistics
 //! ----------
@@ -335,6 +337,8 @@ struct Domain {
     id: usize,
     queried_tasks: bool,
     load: LoadEntity,
+    task_buckets: Vec<Vec<*mut types::task_ctx>>,
+    read_buckets: u64,
     tasks: SortedVec<TaskInfo>,
 }
 
@@ -354,6 +358,8 @@ impl Domain {
                 load_sum,
                 load_avg,
             ),
+            task_buckets: vec![],
+            read_buckets: 0,
             tasks: SortedVec::new(),
         }
     }
@@ -460,6 +466,7 @@ pub struct LoadBalancer<'a, 'b> {
 
     lb_apply_weight: bool,
     balance_load: bool,
+    intra_node_in_bpf: bool,
 }
 
 // Verify that the number of buckets is a factor of the maximum weight to
@@ -476,6 +483,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         skip_kworkers: bool,
         lb_apply_weight: bool,
         balance_load: bool,
+        intra_node_in_bpf: bool,
     ) -> Self {
         Self {
             skel,
@@ -487,6 +495,7 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
 
             lb_apply_weight,
             balance_load,
+            intra_node_in_bpf,
 
             dom_group,
         }
@@ -619,33 +628,65 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         (min_weight + (WEIGHT_PER_BUCKET / 2.0f64)).ceil() as usize
     }
 
-    /// @dom needs to push out tasks to balance loads. Make sure its
-    /// tasks_by_load is populated so that the victim tasks can be picked.
+    /// @dom needs to push out tasks to balance loads. Make sure the
+    /// load-indexed task buckets of @dom have been collected, so that the
+    /// victim tasks can be picked (see read_task_bucket()).
     fn populate_tasks_by_load(&mut self, dom: &mut Domain) -> Result<()> {
         if dom.queried_tasks {
             return Ok(());
         }
         dom.queried_tasks = true;
 
-        // Read active_tasks and update read_idx and gen.
-        const MAX_TPTRS: u64 = bpf_intf::consts_MAX_DOM_ACTIVE_TPTRS as u64;
+        // Collect the load-indexed task buckets, reset them and bump gen
+        // so that BPF starts recording the tasks active in the next period.
+        // Only the task pointers are copied: the tasks of a bucket are read
+        // only if the bucket is picked for a transfer.
+        const NUM_BUCKETS: usize = bpf_intf::consts_LB_TASK_LOAD_BUCKETS as usize;
+        const SLOTS: u64 = bpf_intf::consts_LB_TASK_BUCKET_SLOTS as u64;
         let dom_ctx = unsafe { &mut *self.skel.maps.bss_data.dom_ctxs[dom.id] };
-        let active_tasks = &mut dom_ctx.active_tasks;
+        let task_index = &mut dom_ctx.task_index;
+
+        dom.task_buckets = task_index.buckets[..NUM_BUCKETS]
+            .iter_mut()
+            .map(|bucket| {
+                let widx = bucket.write_idx;
+                bucket.write_idx = 0;
+                bucket.tasks[..widx.min(SLOTS) as usize].to_vec()
+            })
+            .collect();
+        task_index.genn += 1;
 
-        let (mut ridx, widx) = (active_tasks.read_idx, active_tasks.write_idx);
-        active_tasks.read_idx = active_tasks.write_idx;
-        active_tasks.genn += 1;
+        Ok(())
+    }
+
+    /// Return the load-indexed task bucket of @load: buckets are log2 of
+    /// the load, as in load_to_task_bucket_idx() of the BPF scheduler.
+    /// BPF weighs the loads by the same rule as read_task_bucket(), as the
+    /// tuner publishes lb_apply_weight along with fully_utilized.
+    fn task_bucket_idx(load: f64) -> usize {
+        const NUM_BUCKETS: usize = bpf_intf::consts_LB_TASK_LOAD_BUCKETS as usize;
+
+        if load < 2.0 {
+            return 0;
+        }
+        (load.log2() as usize).min(NUM_BUCKETS - 1)
+    }
 
-        if widx - ridx > MAX_TPTRS {
-            ridx = widx - MAX_TPTRS;
+    /// Read the load of the tasks in the load-indexed task bucket @idx of
+    /// @dom and add them to its tasks_by_load, if not done already.
+    fn read_task_bucket(&self, dom: &mut Domain, idx: usize) {
+        if dom.read_buckets & (1 << idx) != 0 {
+            return;
         }
+        dom.read_buckets |= 1 << idx;
 
-        // Read task_ctx and load.
         let load_half_life = self.skel.maps.rodata_data.load_half_life;
         let now_mono = now_monotonic();
 
-        for idx in ridx..widx {
-            let taskc_p = active_tasks.tasks[(idx % MAX_TPTRS) as usize];
+        for &taskc_p in dom.task_buckets[idx].iter() {
+            if taskc_p.is_null() {
+                continue;
+            }
             let taskc = unsafe { &mut *taskc_p };
 
             if taskc.target_dom as usize != dom.id {
@@ -679,8 +720,52 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
                 is_kworker: unsafe { taskc.is_kworker.assume_init() },
             });
         }
+    }
 
-        Ok(())
+    /// Read the task buckets of @dom needed to find the candidates
+    /// (according to @is_candidate) to transfer @to_xfer load: start from
+    /// the bucket of @to_xfer, then move to the lighter buckets until a
+    /// candidate with a smaller load is found, and to the heavier ones until
+    /// a candidate with a larger load is found.
+    ///
+    /// The weights above the infeasible threshold are clamped only here, so
+    /// the loads of such tasks can be lower than their bucket: in this case
+    /// all the heavier buckets are read.
+    fn read_task_buckets(
+        &self,
+        dom: &mut Domain,
+        is_candidate: impl Fn(&TaskInfo) -> bool,
+        to_xfer: f64,
+    ) {
+        let top = Self::task_bucket_idx(to_xfer);
+        let nr_buckets = dom.task_buckets.len();
+        let clamped =
+            self.lb_apply_weight && self.infeas_threshold < bpf_intf::consts_LB_MAX_WEIGHT as f64;
+        if top >= nr_buckets {
+            return;
+        }
+
+        for idx in (0..=top).rev() {
+            self.read_task_bucket(dom, idx);
+            if dom
+                .tasks
+                .iter()
+                .any(|task| task.load <= OrderedFloat(to_xfer) && is_candidate(task))
+            {
+                break;
+            }
+        }
+        for idx in top..nr_buckets {
+            self.read_task_bucket(dom, idx);
+            if !clamped
+                && dom
+                    .tasks
+                    .iter()
+                    .any(|task| task.load >= OrderedFloat(to_xfer) && is_candidate(task))
+            {
+                break;
+            }
+        }
     }
 
     // Find the first candidate task which hasn't already been migrated and
@@ -707,6 +792,15 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
 
         self.populate_tasks_by_load(push_dom)?;
 
+        let pull_dom_id: u32 = pull_dom.id.try_into().unwrap();
+        let is_candidate = |task: &TaskInfo| {
+            task.dom_mask & (1 << pull_dom_id) != 0
+                && !(self.skip_kworkers && task.is_kworker)
+                && !task.migrated.get()
+                && task_filter(task, pull_dom_id)
+        };
+        self.read_task_buckets(push_dom, is_candidate, to_xfer);
+
         // We want to pick a task to transfer from push_dom to pull_dom to
         // reduce the load imbalance between the two closest to $to_xfer.
         // IOW, pick a task which has the closest load value to $to_xfer
@@ -714,7 +808,6 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         // migratable task while scanning left from $to_xfer and the
         // counterpart while scanning right and picking the better of the
         // two.
-        let pull_dom_id: u32 = pull_dom.id.try_into().unwrap();
         let tasks: Vec<TaskInfo> = std::mem::take(&mut push_dom.tasks)
             .into_vec()
             .into_iter()
@@ -1060,7 +1153,11 @@ impl<'a, 'b> LoadBalancer<'a, 'b> {
         }
 
         // Now that the NUMA nodes have been balanced, do another balance round
-        // amongst the domains in each node.
+        // amongst the domains in each node, unless the BPF timer is taking
+        // care of it.
+        if self.intra_node_in_bpf {
+            return Ok(());
+        }
 
         debug!("Intra node LBs started");
 
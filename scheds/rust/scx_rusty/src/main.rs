@@ -152,6 +152,32 @@ struct Opts {
     #[clap(long, action = clap::ArgAction::SetTrue)]
     no_load_balance: bool,
 
+    /// Balance load between the domains of each NUMA node from a BPF timer
+    /// instead of userspace, so that bursty load is reacted to within a few
+    /// slices. Userspace keeps balancing load between NUMA nodes at the
+    /// regular load balance interval.
+    #[clap(long, action = clap::ArgAction::SetTrue, conflicts_with = "no_load_balance")]
+    bpf_load_balance: bool,
+
+    /// In-BPF load balance interval in microseconds.
+    #[clap(long, default_value = "5000")]
+    bpf_lb_interval_us: u64,
+
+    /// In-BPF load balancing is performed when a domain's load is more than
+    /// this percentage above the average.
+    #[clap(long, default_value = "5", value_parser = clap::value_parser!(u32).range(1..100))]
+    bpf_lb_imbal_pct: u32,
+
+    /// Percentage of the load imbalance between two domains that the in-BPF
+    /// load balancer tries to transfer with each task migration.
+    #[clap(long, default_value = "50", value_parser = clap::value_parser!(u32).range(1..=100))]
+    bpf_lb_xfer_pct: u32,
+
+    /// Maximum number of tasks the in-BPF load balancer migrates out of a
+    /// domain in each round.
+    #[clap(long, default_value = "4", value_parser = clap::value_parser!(u32).range(1..))]
+    bpf_lb_max_xfers: u32,
+
     /// Put per-cpu kthreads directly into local dsq's.
     #[clap(short = 'k', long, action = clap::ArgAction::SetTrue)]
     kthreads_local: bool,
@@ -336,6 +362,7 @@ struct Scheduler<'a> {
     sched_interval: Duration,
     tune_interval: Duration,
     balance_load: bool,
+    bpf_load_balance: bool,
     balanced_kworkers: bool,
 
     dom_group: Arc<DomainGroup>,
@@ -441,6 +468,14 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.mempolicy_affinity = opts.mempolicy_affinity;
         skel.maps.rodata_data.debug = opts.verbose as u32;
         skel.maps.rodata_data.rusty_perf_mode = opts.perf;
+        skel.maps.rodata_data.bpf_lb = opts.bpf_load_balance;
+        skel.maps.rodata_data.bpf_lb_skip_kworkers = opts.balanced_kworkers;
+        skel.maps.bss_data.bpf_lb_interval_ns = opts.bpf_lb_interval_us * 1000;
+        skel.maps.bss_data.bpf_lb_imbal_pct = opts.bpf_lb_imbal_pct;
+        skel.maps.bss_data.bpf_lb_xfer_pct = opts.bpf_lb_xfer_pct;
+        skel.maps.bss_data.bpf_lb_max_xfers = opts.bpf_lb_max_xfers;
+        // Let userspace reset the task index of the domains it balances.
+        skel.maps.bss_data.bpf_lb_index_period_ns = (opts.interval * 2.0 * 1e9) as u64;
 
         // Attach.
         let mut skel = scx_ops_load!(skel, rusty, uei)?;
@@ -465,6 +500,7 @@ impl<'a> Scheduler<'a> {
             sched_interval: Duration::from_secs_f64(opts.interval),
             tune_interval: Duration::from_secs_f64(opts.tune_interval),
             balance_load: !opts.no_load_balance,
+            bpf_load_balance: opts.bpf_load_balance,
             balanced_kworkers: opts.balanced_kworkers,
 
             dom_group: domains.clone(),
@@ -526,6 +562,7 @@ impl<'a> Scheduler<'a> {
             cpu_busy,
             load: node_stats.iter().map(|(_k, v)| v.load).sum::<f64>(),
             nr_migrations: sc.bpf_stats[bpf_intf::stat_idx_RUSTY_STAT_LOAD_BALANCE as usize],
+            bpf_lb_xfers: sc.bpf_stats[bpf_intf::stat_idx_RUSTY_STAT_BPF_LB_XFER as usize],
 
             task_get_err: sc.bpf_stats[bpf_intf::stat_idx_RUSTY_STAT_TASK_GET_ERR as usize],
             time_used: sc.time_used.as_secs_f64(),
@@ -560,6 +597,7 @@ impl<'a> Scheduler<'a> {
             self.balanced_kworkers,
             self.tuner.fully_utilized,
             self.balance_load,
+            self.bpf_load_balance,
         );
 
         lb.load_balance()?;
@@ -117,6 +117,8 @@ pub struct ClusterStats {
     pub load: f64,
     #[stat(desc = "# of migrations from load balancing")]
     pub nr_migrations: u64,
+    #[stat(desc = "# of tasks retargeted by the in-BPF load balancer")]
+    pub bpf_lb_xfers: u64,
 
     #[stat(desc = "# of BPF task get errors")]
     pub task_get_err: u64,
@@ -167,10 +169,11 @@ impl ClusterStats {
     pub fn format<W: Write>(&self, w: &mut W) -> Result<()> {
         writeln!(
             w,
-            "cpu={:7.2} load={:8.2} mig={} task_err={} time_used={:4.1}ms",
+            "cpu={:7.2} load={:8.2} mig={} bpf_lb={} task_err={} time_used={:4.1}ms",
             self.cpu_busy,
             self.load,
             self.nr_migrations,
+            self.bpf_lb_xfers,
             self.task_get_err,
             self.time_used * 1000.0,
         )?;
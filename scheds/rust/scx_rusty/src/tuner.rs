@@ -176,6 +176,7 @@ impl Tuner {
             self.slice_ns = self.underutil_slice_ns;
         }
         ti.slice_ns = self.slice_ns;
+        skel.maps.bss_data.lb_apply_weight = self.fully_utilized;
 
         ti.genn += 1;
 
@@ -22,8 +22,13 @@ typedef signed long s64;
 typedef int pid_t;
 #endif /* __VMLINUX_H__ */
 
+enum consts {
+	MAX_GROUPS = 64,
+};
+
 struct cpu_arg {
 	s32 cpu_id;
+	s32 group_id;
 };
 
 #endif /* __INTF_H */
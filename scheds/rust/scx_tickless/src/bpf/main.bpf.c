@@ -10,6 +10,9 @@
 extern unsigned CONFIG_HZ __kconfig;
 
 enum {
+	/*
+	 * Each primary group has its own shared DSQ, SHARED_DSQ + group id.
+	 */
 	SHARED_DSQ		= 0,
 	MSEC_PER_SEC		= 1000LLU,
 	USEC_PER_MSEC		= 1000LLU,
@@ -32,16 +35,20 @@ const volatile bool smt_enabled;
 const volatile bool prefer_same_cpu;
 const volatile u64 slice_ns;
 const volatile u64 tick_freq;
+const volatile u32 nr_groups = 1;
+const volatile bool work_conserving = true;
 
 /*
  * Scheduling statistics.
  */
 volatile u64 nr_ticks, nr_preemptions;
 volatile u64 nr_direct_dispatches, nr_timer_dispatches, nr_primary_dispatches;
+volatile u64 nr_remote_dispatches;
 
 struct cpu_ctx {
 	struct bpf_timer timer;
 	u64 started_at;
+	u32 group;
 };
 
 struct {
@@ -56,6 +63,49 @@ struct cpu_ctx *try_lookup_cpu_ctx(s32 cpu)
 	return bpf_map_lookup_elem(&cpu_ctx_stor, &cpu);
 }
 
+/*
+ * Primary groups: the CPUs are partitioned in groups (typically one per
+ * NUMA node or LLC), each with its own primary CPUs, shared DSQ and timer,
+ * so that tasks are queued and dispatched close to where they ran.
+ */
+struct group_ctx {
+	/*
+	 * All the CPUs of the group.
+	 */
+	struct bpf_cpumask __kptr *span;
+
+	/*
+	 * Primary CPUs of the group.
+	 */
+	struct bpf_cpumask __kptr *primary;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct group_ctx);
+	__uint(max_entries, MAX_GROUPS);
+} group_ctx_stor SEC(".maps");
+
+struct group_ctx *try_lookup_group_ctx(u32 group)
+{
+	return bpf_map_lookup_elem(&group_ctx_stor, &group);
+}
+
+/*
+ * Return the primary group of @cpu.
+ */
+static u32 cpu_group(s32 cpu)
+{
+	struct cpu_ctx *cctx;
+
+	cctx = try_lookup_cpu_ctx(cpu);
+	if (!cctx)
+		return 0;
+
+	return cctx->group;
+}
+
 /*
  * CPUs assigned to handle scheduling events.
  */
@@ -85,11 +135,19 @@ static bool is_primary_cpu(s32 cpu)
 
 /*
  * Return a random CPU from the pool of CPUs dedicated to process
- * scheduling events.
+ * scheduling events, preferring the primary CPUs of @prev_cpu's group.
  */
-static s32 pick_primary_cpu(void)
+static s32 pick_primary_cpu(s32 prev_cpu)
 {
 	const struct cpumask *primary;
+	struct group_ctx *gctx;
+
+	gctx = try_lookup_group_ctx(cpu_group(prev_cpu));
+	if (gctx) {
+		primary = cast_mask(gctx->primary);
+		if (primary && !bpf_cpumask_empty(primary))
+			return bpf_cpumask_any_distribute(primary);
+	}
 
 	primary = cast_mask(primary_cpumask);
 	if (!primary) {
@@ -223,13 +281,13 @@ s32 BPF_STRUCT_OPS(tickless_select_cpu, struct task_struct *p, s32 prev_cpu, u64
 		return bpf_get_smp_processor_id();
 
 	/*
-	 * Always route wakeups to a CPU from the primary group to minimize
-	 * noise on the other CPUs.
+	 * Always route wakeups to a primary CPU of the task's group to
+	 * minimize noise on the other CPUs.
 	 *
 	 * Also make sure to lock the selected CPU, so that it's not picked
 	 * when distributing tasks in dispatch_all_cpus().
 	 */
-	cpu = pick_primary_cpu();
+	cpu = pick_primary_cpu(prev_cpu);
 	scx_bpf_test_and_clear_cpu_idle(cpu);
 
 	return cpu;
@@ -241,30 +299,32 @@ void BPF_STRUCT_OPS(tickless_enqueue, struct task_struct *p, u64 enq_flags)
 	u64 deadline;
 
 	/*
-	 * Insert the task to the shared queue.
+	 * Insert the task to the shared queue of the group it was routed
+	 * to.
 	 */
 	tctx = try_lookup_task_ctx(p);
 	if (!tctx)
 		return;
 
 	deadline = task_deadline(p, tctx);
-	scx_bpf_dsq_insert_vtime(p, SHARED_DSQ, SCX_SLICE_INF, deadline, enq_flags);
+	scx_bpf_dsq_insert_vtime(p, SHARED_DSQ + cpu_group(scx_bpf_task_cpu(p)),
+				 SCX_SLICE_INF, deadline, enq_flags);
 }
 
 /*
- * Try to consume a task from the shared queue and dispatch on a target
- * @cpu. If @same_cpu is true, try to consume a task that was previously
- * running on @cpu.
+ * Try to consume a task from the shared queue @dsq_id and dispatch on a
+ * target @cpu. If @same_cpu is true, try to consume a task that was
+ * previously running on @cpu.
  *
  * Return true if a task was dispatched, false otherwise.
  */
-static bool dispatch_cpu(s32 cpu, bool same_cpu, bool from_dispatch)
+static bool dispatch_cpu(s32 cpu, u64 dsq_id, bool same_cpu, bool from_dispatch)
 {
 	struct task_struct *p;
 	bool dispatched = false;
 
 	bpf_rcu_read_lock();
-	bpf_for_each(scx_dsq, p, SHARED_DSQ, 0) {
+	bpf_for_each(scx_dsq, p, dsq_id, 0) {
 		 /*
 		  * This is a workaround for the BPF verifier's pointer
 		  * validation limitations. Once the verifier gets smarter
@@ -304,31 +364,44 @@ static bool dispatch_cpu(s32 cpu, bool same_cpu, bool from_dispatch)
 }
 
 /*
- * Consume tasks from the shared queue and distribute them evenly across
- * the available CPUs.
+ * Consume tasks from the shared queue of @group and distribute them evenly
+ * across the available CPUs of @target.
  *
  * If @do_idle_smt is true, consider only full-idle SMT cores.
  *
  * If @from_dispatch is true, the function is called from ops.dispatch()
  * (used to check if we have enough dispatch slots available).
  */
-static bool dispatch_all_cpus(bool do_idle_smt, bool from_dispatch)
+static bool dispatch_group_cpus(u32 group, u32 target, bool do_idle_smt, bool from_dispatch)
 {
-	const struct cpumask *idle_mask;
+	const struct cpumask *idle_mask, *span;
+	struct group_ctx *gctx;
+	u64 dsq_id = SHARED_DSQ + group;
 	s32 i, cpu;
-	bool is_done = false;
+	bool is_done = false, dispatched;
 
-	if (!scx_bpf_dsq_nr_queued(SHARED_DSQ))
+	if (!scx_bpf_dsq_nr_queued(dsq_id))
 		return true;
 
+	gctx = try_lookup_group_ctx(target);
+	if (!gctx)
+		return false;
+
+	bpf_rcu_read_lock();
+	span = cast_mask(gctx->span);
+	if (!span) {
+		bpf_rcu_read_unlock();
+		return false;
+	}
+
 	idle_mask = do_idle_smt ? scx_bpf_get_idle_smtmask() : scx_bpf_get_idle_cpumask();
 
 	bpf_for(i, 0, bpf_cpumask_weight(idle_mask)) {
 		/*
-		 * Lock the first idle CPU available and attempt to dispatch a
-		 * task.
+		 * Lock the first idle CPU available in the target group and
+		 * attempt to dispatch a task.
 		 */
-		cpu = bpf_cpumask_first(idle_mask);
+		cpu = bpf_cpumask_first_and(idle_mask, span);
 		if (cpu >= nr_cpu_ids)
 			break;
 		if (!scx_bpf_test_and_clear_cpu_idle(cpu))
@@ -351,42 +424,104 @@ static bool dispatch_all_cpus(bool do_idle_smt, bool from_dispatch)
 		 * Try to dispatch a task that was using this CPU first, if
 		 * @prefer_same_cpu is enabled.
 		 */
-		if (!prefer_same_cpu || !dispatch_cpu(cpu, true, from_dispatch))
-			dispatch_cpu(cpu, false, from_dispatch);
+		dispatched = prefer_same_cpu && dispatch_cpu(cpu, dsq_id, true, from_dispatch);
+		if (!dispatched)
+			dispatched = dispatch_cpu(cpu, dsq_id, false, from_dispatch);
+		if (dispatched && group != target)
+			__sync_fetch_and_add(&nr_remote_dispatches, 1);
 
 		/*
 		 * Stop dispatching if all the pending tasks have been
 		 * distributed.
 		 */
-		if (!scx_bpf_dsq_nr_queued(SHARED_DSQ)) {
+		if (!scx_bpf_dsq_nr_queued(dsq_id)) {
 			is_done = true;
 			break;
 		}
 	}
 
 	scx_bpf_put_cpumask(idle_mask);
+	bpf_rcu_read_unlock();
 
 	return is_done;
 }
 
+/*
+ * Distribute the tasks queued in @group to the group's own CPUs.
+ */
+static bool dispatch_all_cpus(u32 group, bool do_idle_smt, bool from_dispatch)
+{
+	return dispatch_group_cpus(group, group, do_idle_smt, from_dispatch);
+}
+
+/*
+ * Work-conserving fallback: if the CPUs of @group are all busy and tasks
+ * are still waiting, hand them to the idle CPUs of the other groups rather
+ * than letting them wait for a local CPU to free up.
+ */
+static void dispatch_remote_cpus(u32 group)
+{
+	u32 i;
+
+	if (!work_conserving)
+		return;
+
+	bpf_for(i, 1, nr_groups) {
+		if (dispatch_group_cpus(group, (group + i) % nr_groups, false, false))
+			break;
+	}
+}
+
+/*
+ * Work-conserving fallback for a CPU that found nothing to run in its own
+ * group: consume a task from the busiest among the other groups.
+ */
+static bool consume_remote_dsq(u32 group)
+{
+	u32 i, victim = group, nr, max_nr = 0;
+
+	if (!work_conserving)
+		return false;
+
+	bpf_for(i, 1, nr_groups) {
+		nr = scx_bpf_dsq_nr_queued(SHARED_DSQ + (group + i) % nr_groups);
+		if (nr > max_nr) {
+			max_nr = nr;
+			victim = (group + i) % nr_groups;
+		}
+	}
+	if (victim == group || !scx_bpf_dsq_move_to_local(SHARED_DSQ + victim))
+		return false;
+
+	__sync_fetch_and_add(&nr_remote_dispatches, 1);
+
+	return true;
+}
+
 static int sched_timerfn(void *map, int *key, struct bpf_timer *timer)
 {
 	struct cpu_ctx *cctx;
 	u64 now = scx_bpf_now();
+	u32 group = cpu_group(*key);
+	bool is_done;
 	s32 cpu;
 
 	/*
-	 * Dispatch tasks on the available CPUs.
+	 * Dispatch tasks on the available CPUs of the group, falling back
+	 * to the other groups if the group is saturated.
 	 */
-	if (!smt_enabled || !dispatch_all_cpus(true, false))
-		dispatch_all_cpus(false, false);
+	is_done = smt_enabled && dispatch_all_cpus(group, true, false);
+	if (!is_done)
+		is_done = dispatch_all_cpus(group, false, false);
+	if (!is_done)
+		dispatch_remote_cpus(group);
 
 	/*
-	 * Check if we need to preempt the running tasks.
+	 * Check if we need to preempt the running tasks of the group.
 	 */
 	bpf_for(cpu, 0, nr_cpu_ids) {
 		cctx = try_lookup_cpu_ctx(cpu);
-		if (!cctx)
+		if (!cctx || cctx->group != group)
 			continue;
 
 		if (!cctx->started_at ||
@@ -394,7 +529,7 @@ static int sched_timerfn(void *map, int *key, struct bpf_timer *timer)
 			continue;
 
 		if (!scx_bpf_dsq_nr_queued(SCX_DSQ_LOCAL_ON | cpu) &&
-		    !scx_bpf_dsq_nr_queued(SHARED_DSQ))
+		    !scx_bpf_dsq_nr_queued(SHARED_DSQ + group))
 			continue;
 
 		scx_bpf_kick_cpu(cpu, SCX_KICK_PREEMPT);
@@ -431,27 +566,35 @@ static void init_timer(s32 cpu)
 
 void BPF_STRUCT_OPS(tickless_dispatch, s32 cpu, struct task_struct *prev)
 {
+	u32 group = cpu_group(cpu);
+
 	if (is_primary_cpu(cpu)) {
 		/*
 		 * Try to bounce all the queued tasks to the available
 		 * tickless CPUs first.
 		 */
-		if (!smt_enabled || !dispatch_all_cpus(true, true))
-			dispatch_all_cpus(false, true);
+		if (!smt_enabled || !dispatch_all_cpus(group, true, true))
+			dispatch_all_cpus(group, false, true);
 	}
 
 	/*
-	 * Consume a task from the shared DSQ.
+	 * Consume a task from the group's shared DSQ.
 	 *
 	 * This applies also to primary CPUs: if there are still tasks in
 	 * the shared DSQ after distributing them to the tickless CPUs,
 	 * primary CPUs will also start consuming them.
 	 */
-	if (scx_bpf_dsq_move_to_local(SHARED_DSQ)) {
+	if (scx_bpf_dsq_move_to_local(SHARED_DSQ + group)) {
 		__sync_fetch_and_add(&nr_direct_dispatches, 1);
 		return;
 	}
 
+	/*
+	 * Nothing to do in our group, help the other groups.
+	 */
+	if (consume_remote_dsq(group))
+		return;
+
 	/*
 	 * Keep running the previous task if it still wants to run.
 	 */
@@ -640,7 +783,9 @@ SEC("syscall")
 int enable_primary_cpu(struct cpu_arg *input)
 {
 	struct bpf_cpumask *mask;
+	struct group_ctx *gctx;
 	s32 cpu = input->cpu_id;
+	u32 group;
 	int ret;
 
 	ret = init_cpumask(&primary_cpumask);
@@ -657,19 +802,97 @@ int enable_primary_cpu(struct cpu_arg *input)
 			bpf_cpumask_set_cpu(cpu, mask);
 	}
 
+	/*
+	 * Keep the primary CPUs of the groups in sync.
+	 */
+	bpf_for(group, 0, MAX_GROUPS) {
+		if (cpu >= 0 && group != cpu_group(cpu))
+			continue;
+		gctx = try_lookup_group_ctx(group);
+		if (!gctx)
+			continue;
+		mask = gctx->primary;
+		if (!mask)
+			continue;
+		if (cpu < 0)
+			bpf_cpumask_clear(mask);
+		else
+			bpf_cpumask_set_cpu(cpu, mask);
+	}
+
 	bpf_rcu_read_unlock();
 
 	return ret;
 }
 
-s32 BPF_STRUCT_OPS_SLEEPABLE(tickless_init)
+/*
+ * Assign a CPU to a primary group.
+ *
+ * This must be done for all the CPUs before enabling the primary CPUs.
+ */
+SEC("syscall")
+int set_cpu_group(struct cpu_arg *input)
 {
+	struct bpf_cpumask *mask;
+	struct group_ctx *gctx;
+	struct cpu_ctx *cctx;
+	s32 cpu = input->cpu_id;
 	int ret;
 
-	ret = scx_bpf_create_dsq(SHARED_DSQ, -1);
-	if (ret < 0)
+	cctx = try_lookup_cpu_ctx(cpu);
+	gctx = try_lookup_group_ctx(input->group_id);
+	if (!cctx || !gctx)
+		return -EINVAL;
+
+	ret = init_cpumask(&gctx->span);
+	if (ret)
+		return ret;
+	ret = init_cpumask(&gctx->primary);
+	if (ret)
 		return ret;
 
+	bpf_rcu_read_lock();
+	mask = gctx->span;
+	if (mask)
+		bpf_cpumask_set_cpu(cpu, mask);
+	bpf_rcu_read_unlock();
+
+	cctx->group = input->group_id;
+
+	return 0;
+}
+
+/*
+ * Start the timer of a primary group on the current CPU, which must be a
+ * primary CPU (the timer keeps firing on the CPU it was started on).
+ */
+SEC("syscall")
+int start_group_timer(struct cpu_arg *input)
+{
+	s32 cpu = bpf_get_smp_processor_id();
+
+	if (cpu != input->cpu_id)
+		return -EINVAL;
+
+	init_timer(cpu);
+
+	return 0;
+}
+
+s32 BPF_STRUCT_OPS_SLEEPABLE(tickless_init)
+{
+	int ret, group;
+
+	bpf_for(group, 0, nr_groups) {
+		ret = scx_bpf_create_dsq(SHARED_DSQ + group, -1);
+		if (ret < 0)
+			return ret;
+	}
+
+	/*
+	 * Start the timer of the first group, the other groups' timers are
+	 * started by userspace once the scheduler is attached.
+	 */
 	init_timer(bpf_get_smp_processor_id());
 
 	return 0;
@@ -24,6 +24,7 @@ use anyhow::bail;
 use anyhow::Context;
 use anyhow::Result;
 use clap::Parser;
+use clap::ValueEnum;
 use crossbeam::channel::RecvTimeoutError;
 use libbpf_rs::OpenObject;
 use libbpf_rs::ProgramInput;
@@ -45,6 +46,17 @@ use stats::Metrics;
 
 const SCHEDULER_NAME: &'static str = "scx_tickless";
 
+/// How CPUs are partitioned in primary groups.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, ValueEnum)]
+enum PrimaryGroups {
+    /// A single group spanning all the CPUs.
+    None,
+    /// One group per NUMA node.
+    Node,
+    /// One group per LLC.
+    Llc,
+}
+
 #[derive(Debug, Parser)]
 struct Opts {
     /// Exit debug dump buffer length. 0 indicates default.
@@ -56,6 +68,21 @@ struct Opts {
     #[clap(short = 'm', long, default_value = "0x1")]
     primary_domain: String,
 
+    /// Partition the CPUs in primary groups, each one with its own primary CPUs, shared queue and
+    /// scheduling timer, so that tasks are queued and dispatched close to where they were running.
+    ///
+    /// Groups that don't include any CPU of the primary domain get their first CPU added as a
+    /// primary CPU, widening --primary-domain (a warning is printed for each added CPU).
+    #[clap(long, value_enum, default_value = "none")]
+    primary_groups: PrimaryGroups,
+
+    /// Never move tasks across primary groups.
+    ///
+    /// By default, tasks are handed to idle CPUs of the other groups when all the CPUs of their
+    /// group are busy, this option keeps them waiting in their group instead.
+    #[clap(long, action = clap::ArgAction::SetTrue)]
+    strict_groups: bool,
+
     /// Maximum scheduling slice duration in microseconds (applied only when multiple tasks are
     /// contending the same CPU).
     #[clap(short = 's', long, default_value = "20000")]
@@ -136,8 +163,35 @@ impl<'a> Scheduler<'a> {
         }
 
         // Process the domain of primary CPUs.
-        let domain = Cpumask::from_str(&opts.primary_domain)?;
-        info!("primary CPU domain = 0x{:x}", domain);
+        let mut domain = Cpumask::from_str(&opts.primary_domain)?;
+
+        // Partition the CPUs in primary groups and make sure each group has at least one primary
+        // CPU to route its scheduling events.
+        let groups = Self::primary_groups(&topo, opts.primary_groups);
+        if groups.len() > consts_MAX_GROUPS as usize {
+            bail!(
+                "too many primary groups ({}), the maximum is {}",
+                groups.len(),
+                consts_MAX_GROUPS
+            );
+        }
+        for (id, group) in groups.iter().enumerate() {
+            if group.iter().any(|cpu| domain.test_cpu(*cpu)) {
+                continue;
+            }
+            if let Some(&cpu) = group.first() {
+                warn!(
+                    "primary group {} has no primary CPU: adding CPU {} to the primary domain {}",
+                    id, cpu, opts.primary_domain
+                );
+                domain.set_cpu(cpu)?;
+            }
+        }
+        info!(
+            "primary CPU domain = 0x{:x}, {} primary group(s)",
+            domain,
+            groups.len()
+        );
 
         // Initialize BPF connector.
         let mut skel_builder = BpfSkelBuilder::default();
@@ -153,17 +207,39 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.slice_ns = opts.slice_us * 1000;
         skel.maps.rodata_data.tick_freq = opts.frequency;
         skel.maps.rodata_data.prefer_same_cpu = opts.prefer_same_cpu;
+        skel.maps.rodata_data.nr_groups = groups.len() as u32;
+        skel.maps.rodata_data.work_conserving = !opts.strict_groups;
 
         // Load the BPF program for validation.
         let mut skel = scx_ops_load!(skel, tickless_ops, uei)?;
 
+        // Assign the CPUs to their primary group.
+        for (id, group) in groups.iter().enumerate() {
+            for &cpu in group.iter() {
+                if let Err(err) = Self::set_cpu_group(&mut skel, cpu as i32, id as i32) {
+                    bail!(
+                        "failed to add CPU {} to primary group {}: error {}",
+                        cpu,
+                        id,
+                        err
+                    );
+                }
+            }
+        }
+
+        // Each group runs its scheduling timer on its first primary CPU.
+        let timer_cpus: Vec<usize> = groups
+            .iter()
+            .filter_map(|group| group.iter().copied().find(|cpu| domain.test_cpu(*cpu)))
+            .collect();
+
         // Set task affinity to the first primary CPU: this is required to start the scheduler's
         // timer on a primary CPU.
-        let timer_cpu = domain.iter().next();
+        let timer_cpu = timer_cpus.first();
         if timer_cpu.is_none() {
             bail!("primary cpumask is empty");
         }
-        if let Err(e) = set_thread_affinity(&[timer_cpu.unwrap() as usize]) {
+        if let Err(e) = set_thread_affinity(&[*timer_cpu.unwrap()]) {
             bail!("cannot set central CPU affinity: {}", e);
         }
 
@@ -176,6 +252,16 @@ impl<'a> Scheduler<'a> {
         let struct_ops = Some(scx_ops_attach!(skel, tickless_ops)?);
         let stats_server = StatsServer::new(stats::server_data()).launch()?;
 
+        // Start the timers of the other groups, each one from its own primary CPU.
+        for &cpu in timer_cpus.iter().skip(1) {
+            if let Err(e) = set_thread_affinity(&[cpu]) {
+                bail!("cannot set CPU {} affinity: {}", cpu, e);
+            }
+            if let Err(err) = Self::start_group_timer(&mut skel, cpu as i32) {
+                bail!("failed to start timer on CPU {}: error {}", cpu, err);
+            }
+        }
+
         // Reset task affinity.
         if let Err(e) = set_thread_affinity((0..*NR_CPU_IDS).collect::<Vec<usize>>()) {
             bail!("cannot reset CPU affinity: {}", e);
@@ -188,10 +274,31 @@ impl<'a> Scheduler<'a> {
         })
     }
 
-    fn enable_primary_cpu(skel: &mut BpfSkel<'_>, cpu: i32) -> Result<(), u32> {
-        let prog = &mut skel.progs.enable_primary_cpu;
+    fn primary_groups(topo: &Topology, kind: PrimaryGroups) -> Vec<Vec<usize>> {
+        let groups: Vec<Vec<usize>> = match kind {
+            PrimaryGroups::None => vec![topo.all_cpus.keys().copied().collect()],
+            PrimaryGroups::Node => topo
+                .nodes
+                .values()
+                .map(|node| node.all_cpus.keys().copied().collect())
+                .collect(),
+            PrimaryGroups::Llc => topo
+                .all_llcs
+                .values()
+                .map(|llc| llc.all_cpus.keys().copied().collect())
+                .collect(),
+        };
+
+        groups
+            .into_iter()
+            .filter(|group| !group.is_empty())
+            .collect()
+    }
+
+    fn run_cpu_prog(prog: &mut libbpf_rs::ProgramMut<'_>, cpu: i32, group: i32) -> Result<(), u32> {
         let mut args = cpu_arg {
             cpu_id: cpu as c_int,
+            group_id: group as c_int,
         };
         let input = ProgramInput {
             context_in: Some(unsafe {
@@ -210,6 +317,18 @@ impl<'a> Scheduler<'a> {
         Ok(())
     }
 
+    fn enable_primary_cpu(skel: &mut BpfSkel<'_>, cpu: i32) -> Result<(), u32> {
+        Self::run_cpu_prog(&mut skel.progs.enable_primary_cpu, cpu, 0)
+    }
+
+    fn set_cpu_group(skel: &mut BpfSkel<'_>, cpu: i32, group: i32) -> Result<(), u32> {
+        Self::run_cpu_prog(&mut skel.progs.set_cpu_group, cpu, group)
+    }
+
+    fn start_group_timer(skel: &mut BpfSkel<'_>, cpu: i32) -> Result<(), u32> {
+        Self::run_cpu_prog(&mut skel.progs.start_group_timer, cpu, 0)
+    }
+
     fn init_primary_domain(skel: &mut BpfSkel<'_>, domain: &Cpumask) -> Result<()> {
         // Clear the primary domain by passing a negative CPU id.
         if let Err(err) = Self::enable_primary_cpu(skel, -1) {
@@ -234,6 +353,7 @@ impl<'a> Scheduler<'a> {
             nr_direct_dispatches: self.skel.maps.bss_data.nr_direct_dispatches,
             nr_primary_dispatches: self.skel.maps.bss_data.nr_primary_dispatches,
             nr_timer_dispatches: self.skel.maps.bss_data.nr_timer_dispatches,
+            nr_remote_dispatches: self.skel.maps.bss_data.nr_remote_dispatches,
         }
     }
 
@@ -32,19 +32,22 @@ pub struct Metrics {
     pub nr_primary_dispatches: u64,
     #[stat(desc = "Number of dispatches routed by the primary CPU timers")]
     pub nr_timer_dispatches: u64,
+    #[stat(desc = "Number of dispatches moved across primary groups")]
+    pub nr_remote_dispatches: u64,
 }
 
 impl Metrics {
     fn format<W: Write>(&self, w: &mut W) -> Result<()> {
         writeln!(
             w,
-            "[{}] ticks -> {:<5} preempts -> {:<5} dispatch -> d: {:<5} p: {:<5} t: {:<5}",
+            "[{}] ticks -> {:<5} preempts -> {:<5} dispatch -> d: {:<5} p: {:<5} t: {:<5} r: {:<5}",
             crate::SCHEDULER_NAME,
             self.nr_ticks,
             self.nr_preemptions,
             self.nr_direct_dispatches,
             self.nr_primary_dispatches,
-            self.nr_timer_dispatches
+            self.nr_timer_dispatches,
+            self.nr_remote_dispatches
         )?;
         Ok(())
     }
@@ -56,6 +59,7 @@ impl Metrics {
             nr_direct_dispatches: self.nr_direct_dispatches - rhs.nr_direct_dispatches,
             nr_primary_dispatches: self.nr_primary_dispatches - rhs.nr_primary_dispatches,
             nr_timer_dispatches: self.nr_timer_dispatches - rhs.nr_timer_dispatches,
+            nr_remote_dispatches: self.nr_remote_dispatches - rhs.nr_remote_dispatches,
             ..self.clone()
         }
     }
@@ -38,6 +38,7 @@ enum consts {
 	LB_MAX_WEIGHT		= 10000,
 	LB_LOAD_BUCKETS		= 100,	/* Must be a factor of LB_MAX_WEIGHT */
 	LB_WEIGHT_PER_BUCKET	= LB_MAX_WEIGHT / LB_LOAD_BUCKETS,
+	LB_DCYCLE_DIRTY_WORDS	= (LB_LOAD_BUCKETS + 63) / 64,
 
 	/* Time constants */
 	MSEC_PER_SEC		= 1000LLU,
@@ -47,6 +48,16 @@ enum consts {
 	USEC_PER_SEC            = USEC_PER_MSEC * MSEC_PER_SEC,
 	NSEC_PER_SEC            = NSEC_PER_USEC * USEC_PER_SEC,
 
+	/*
+	 * Per-CPU duty cycle deltas are folded into the domains
+	 * LB_DCYCLE_FOLDS_PER_HALF_LIFE times per load half-life, but not more
+	 * often than every LB_DCYCLE_FOLD_MIN_NS.
+	 */
+	LB_DCYCLE_FOLDS_PER_HALF_LIFE	= 100,
+	LB_DCYCLE_FOLD_MIN_NS		= NSEC_PER_MSEC,
+
+	CLOCK_BOOTTIME		= 7,
+
 	/* Constants used for determining a task's deadline */
 	DL_RUNTIME_SCALE	= 2, /* roughly scales average runtime to */
 				     /* same order of magnitude as waker  */
@@ -65,6 +76,13 @@ enum consts {
 	 */
 	MAX_DOM_ACTIVE_TPTRS	= 1024,
 
+	/*
+	 * Cross-node stealing is rate limited per node: at most
+	 * xnuma_steal_budget remote DSQs are probed per period, and a single
+	 * dispatch only probes the victim domain cached for its node.
+	 */
+	XNUMA_STEAL_PERIOD_NS	= NSEC_PER_MSEC,
+
 	STATIC_ALLOC_PAGES_GRANULARITY = 1,
 };
 
@@ -87,6 +105,9 @@ enum stat_idx {
 	RUSTY_STAT_REPATRIATE,
 	RUSTY_STAT_KICK_GREEDY,
 	RUSTY_STAT_LOAD_BALANCE,
+	RUSTY_STAT_GREEDY_PROBE,
+	RUSTY_STAT_XNUMA_PROBE,
+	RUSTY_STAT_XNUMA_BUDGET,
 
 	/* Errors */
 	RUSTY_STAT_TASK_GET_ERR,
@@ -24,6 +24,11 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 
+/*
+ * Serializes folds of a domain's buckets against load balancing transfers.
+ * Task runnable/quiescent transitions don't take it, they only record a delta
+ * (see dom_dcycle_adj()).
+ */
 struct lock_wrapper {
 	struct bpf_spin_lock lock;
 };
@@ -32,10 +37,21 @@ struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
 	__type(key, u32);
 	__type(value, struct lock_wrapper);
-	__uint(max_entries, MAX_DOMS * LB_LOAD_BUCKETS);
+	__uint(max_entries, MAX_DOMS);
 	__uint(map_flags, 0);
 } dom_dcycle_locks SEC(".maps");
 
+struct dcycle_fold_timer {
+	struct bpf_timer timer;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, struct dcycle_fold_timer);
+} dcycle_fold_timer SEC(".maps");
+
 volatile scx_bitmap_t node_data[MAX_NUMA_NODES];
 
 struct scx_stk lb_domain_allocator;
@@ -133,31 +149,19 @@ dom_ptr lookup_dom_ctx(u32 dom_id)
 
 static inline u32 weight_to_bucket_idx(u32 weight)
 {
-	/* Weight is calculated linearly, and is within range of [1, 10000] */
-	return weight * LB_LOAD_BUCKETS / LB_MAX_WEIGHT;
-}
+	u32 idx;
 
-static struct bucket_ctx *lookup_dom_bucket(dom_ptr dom_ctx,
-					    u32 weight, u32 *bucket_id)
-{
-	u32 idx = weight_to_bucket_idx(weight);
-	struct bucket_ctx *bucket;
-
-	*bucket_id = idx;
-	bucket = (struct bucket_ctx *)&dom_ctx->buckets[idx];
-	if (bucket)
-		return bucket;
+	/* Weight is calculated linearly, and is within range of [1, 10000] */
+	idx = weight * LB_LOAD_BUCKETS / LB_MAX_WEIGHT;
 
-	scx_bpf_error("Failed to lookup dom bucket");
-	return NULL;
+	return idx < LB_LOAD_BUCKETS ? idx : LB_LOAD_BUCKETS - 1;
 }
 
-static struct lock_wrapper *lookup_dom_bkt_lock(u32 dom_id, u32 weight)
+static struct lock_wrapper *lookup_dom_lock(u32 dom_id)
 {
-	u32 idx = dom_id * LB_LOAD_BUCKETS + weight_to_bucket_idx(weight);
 	struct lock_wrapper *lockw;
 
-	lockw = bpf_map_lookup_elem(&dom_dcycle_locks, &idx);
+	lockw = bpf_map_lookup_elem(&dom_dcycle_locks, &dom_id);
 	if (lockw)
 		return lockw;
 
@@ -165,63 +169,230 @@ static struct lock_wrapper *lookup_dom_bkt_lock(u32 dom_id, u32 weight)
 	return NULL;
 }
 
+static inline u64 dcycle_val(struct bucket_ctx __arena *bucket)
+{
+	return bucket->dcycle > 0 ? bucket->dcycle : 0;
+}
+
+/*
+ * Record a change of @adj runnable tasks in bucket @idx of @domc. If @domc is
+ * this CPU's domain, which is the common case, only CPU-local memory is
+ * touched. Otherwise the change is queued on the bucket itself. Either way it
+ * reaches the bucket's ravg at the next fold.
+ */
+static void dom_dcycle_delta(dom_ptr domc, u32 idx, s32 adj)
+{
+	struct pcpu_ctx *pcpuc;
+	u32 word = idx / 64;
+	u64 bit = 1LLU << (idx % 64);
+	s32 cpu;
+
+	if (idx >= LB_LOAD_BUCKETS || word >= LB_DCYCLE_DIRTY_WORDS)
+		return;
+
+	cpu = bpf_get_smp_processor_id();
+	pcpuc = MEMBER_VPTR(pcpu_ctx, [cpu]);
+	if (pcpuc && pcpuc->domc == domc) {
+		__sync_fetch_and_add(&pcpuc->dcycle_delta[idx], adj);
+		if (!(READ_ONCE(pcpuc->dcycle_dirty[word]) & bit))
+			__sync_fetch_and_or(&pcpuc->dcycle_dirty[word], bit);
+		return;
+	}
+
+	__sync_fetch_and_add(&domc->buckets[idx].pending, adj);
+	if (!(READ_ONCE(domc->dcycle_dirty[word]) & bit))
+		__sync_fetch_and_or(&domc->dcycle_dirty[word], bit);
+}
+
 __hidden
 void dom_dcycle_adj(dom_ptr domc, u32 weight, u64 now, bool runnable)
 {
-	struct bucket_ctx *bucket;
-	struct lock_wrapper *lockw;
-	s64 adj = runnable ? 1 : -1;
-	u32 bucket_idx = 0;
-	u32 dom_id;
+	if (!domc)
+		return;
 
-	dom_id = domc->id;
+	dom_dcycle_delta(domc, weight_to_bucket_idx(weight), runnable ? 1 : -1);
+}
 
-	bucket = lookup_dom_bucket(domc, weight, &bucket_idx);
-	lockw = lookup_dom_bkt_lock(dom_id, weight);
+/*
+ * Move the deltas @pcpuc accumulated for its domain onto the domain's buckets.
+ * The owning CPU may keep adding to them concurrently, so each slot is drained
+ * with an exchange and no update is lost.
+ */
+static void dom_dcycle_fold_pcpu(struct pcpu_ctx *pcpuc)
+{
+	dom_ptr domc = pcpuc->domc;
+	u64 dirty;
+	u32 idx;
+	s32 delta;
+	int w, b;
 
-	if (!bucket || !lockw)
+	if (!domc)
 		return;
 
-	bpf_spin_lock(&lockw->lock);
-	bucket->dcycle += adj;
-	ravg_accumulate(&bucket->rd, bucket->dcycle, now, load_half_life);
-	bpf_spin_unlock(&lockw->lock);
-
-	if (adj < 0 && (s64)bucket->dcycle < 0)
-		scx_bpf_error("cpu%d dom%u bucket%u load underflow (dcycle=%lld adj=%lld)",
-			      bpf_get_smp_processor_id(), dom_id, bucket_idx,
-			      bucket->dcycle, adj);
-
-	if (debug >=2 &&
-	    (!domc->dbg_dcycle_printed_at || now - domc->dbg_dcycle_printed_at >= 1000000000)) {
-		bpf_printk("DCYCLE ADJ dom=%u bucket=%u adj=%lld dcycle=%u avg_dcycle=%llu",
-			   dom_id, bucket_idx, adj, bucket->dcycle,
-			   ravg_read(&bucket->rd, now, load_half_life) >> RAVG_FRAC_BITS);
-		domc->dbg_dcycle_printed_at = now;
+	bpf_for(w, 0, LB_DCYCLE_DIRTY_WORDS) {
+		if (w >= LB_DCYCLE_DIRTY_WORDS)
+			break;
+
+		if (!READ_ONCE(pcpuc->dcycle_dirty[w]))
+			continue;
+
+		dirty = __sync_lock_test_and_set(&pcpuc->dcycle_dirty[w], 0);
+
+		bpf_for(b, 0, 64) {
+			if (!(dirty & (1LLU << b)))
+				continue;
+
+			idx = w * 64 + b;
+			if (idx >= LB_LOAD_BUCKETS)
+				break;
+
+			delta = __sync_lock_test_and_set(&pcpuc->dcycle_delta[idx], 0);
+			if (!delta)
+				continue;
+
+			__sync_fetch_and_add(&domc->buckets[idx].pending, delta);
+			__sync_fetch_and_or(&domc->dcycle_dirty[w], 1LLU << b);
+		}
 	}
 }
 
+/*
+ * Apply the pending runnable count changes of @domc's buckets and accumulate
+ * them into the buckets' ravg.
+ */
+static void dom_dcycle_fold_dom(dom_ptr domc, u64 now)
+{
+	struct bucket_ctx __arena *bucket;
+	struct lock_wrapper *lockw;
+	u64 dirty;
+	s64 delta;
+	u32 idx;
+	int w, b;
 
+	lockw = lookup_dom_lock(domc->id);
+	if (!lockw)
+		return;
+
+	bpf_for(w, 0, LB_DCYCLE_DIRTY_WORDS) {
+		if (w >= LB_DCYCLE_DIRTY_WORDS)
+			break;
+
+		if (!READ_ONCE(domc->dcycle_dirty[w]))
+			continue;
+
+		dirty = __sync_lock_test_and_set(&domc->dcycle_dirty[w], 0);
+
+		bpf_for(b, 0, 64) {
+			if (!(dirty & (1LLU << b)))
+				continue;
+
+			idx = w * 64 + b;
+			if (idx >= LB_LOAD_BUCKETS)
+				break;
+
+			bucket = &domc->buckets[idx];
+			delta = __sync_lock_test_and_set(&bucket->pending, 0);
+			if (!delta)
+				continue;
+
+			bpf_spin_lock(&lockw->lock);
+			bucket->dcycle += delta;
+			ravg_accumulate(&bucket->rd, dcycle_val(bucket), now, load_half_life);
+			bpf_spin_unlock(&lockw->lock);
+
+			if (debug >= 2 &&
+			    (!domc->dbg_dcycle_printed_at ||
+			     now - domc->dbg_dcycle_printed_at >= 1000000000)) {
+				bpf_printk("DCYCLE FOLD dom=%u bucket=%u delta=%lld dcycle=%lld avg_dcycle=%llu",
+					   domc->id, idx, delta, bucket->dcycle,
+					   ravg_read(&bucket->rd, now, load_half_life) >> RAVG_FRAC_BITS);
+				domc->dbg_dcycle_printed_at = now;
+			}
+		}
+	}
+}
+
+/*
+ * The buckets' ravg only sees the net runnable count of each fold period: a
+ * task that becomes runnable and quiescent again within the same period is not
+ * accounted at all, and the others are accounted from the fold rather than
+ * from their transition. Fold a fixed number of times per load half-life, so
+ * that the error stays a small fraction of the window the load is averaged
+ * over, whatever load_half_life is.
+ */
+static u64 dom_dcycle_fold_ns(void)
+{
+	u64 fold_ns = load_half_life / LB_DCYCLE_FOLDS_PER_HALF_LIFE;
+
+	return fold_ns > LB_DCYCLE_FOLD_MIN_NS ? fold_ns : LB_DCYCLE_FOLD_MIN_NS;
+}
+
+static int dom_dcycle_fold_timerfn(void *map, int *key, struct bpf_timer *timer)
+{
+	u64 now = scx_bpf_now();
+	dom_ptr domc;
+	int cpu, dom;
+
+	scx_arena_subprog_init();
+
+	bpf_for(cpu, 0, nr_cpu_ids) {
+		if (cpu >= MAX_CPUS)
+			break;
+
+		dom_dcycle_fold_pcpu(&pcpu_ctx[cpu]);
+	}
+
+	bpf_for(dom, 0, nr_doms) {
+		domc = try_lookup_dom_ctx(dom);
+		if (domc)
+			dom_dcycle_fold_dom(domc, now);
+	}
+
+	xnuma_victims_refresh();
+
+	bpf_timer_start(timer, dom_dcycle_fold_ns(), 0);
+	return 0;
+}
+
+__hidden
+int dom_dcycle_fold_init(void)
+{
+	struct bpf_timer *timer;
+	u32 key = 0;
+	int ret;
+
+	timer = bpf_map_lookup_elem(&dcycle_fold_timer, &key);
+	if (!timer) {
+		scx_bpf_error("Failed to lookup dcycle fold timer");
+		return -ESRCH;
+	}
+
+	bpf_timer_init(timer, &dcycle_fold_timer, CLOCK_BOOTTIME);
+	bpf_timer_set_callback(timer, dom_dcycle_fold_timerfn);
+	ret = bpf_timer_start(timer, dom_dcycle_fold_ns(), 0);
+	if (ret)
+		scx_bpf_error("Failed to start dcycle fold timer (%d)", ret);
+
+	return ret;
+}
 
 static int dom_dcycle_xfer_task(struct task_struct *p __arg_trusted, task_ptr taskc,
 			         dom_ptr from_domc,
 				 dom_ptr to_domc, u64 now)
 {
-	struct bucket_ctx *from_bucket, *to_bucket;
-	u32 idx = 0, weight = taskc->weight;
+	struct bucket_ctx __arena *from_bucket, *to_bucket;
+	u32 idx = weight_to_bucket_idx(taskc->weight);
 	struct lock_wrapper *from_lockw, *to_lockw;
 	struct ravg_data task_dcyc_rd;
 	u64 from_dcycle[2], to_dcycle[2], task_dcycle;
 
-	from_lockw = lookup_dom_bkt_lock(from_domc->id, weight);
-	to_lockw = lookup_dom_bkt_lock(to_domc->id, weight);
+	from_lockw = lookup_dom_lock(from_domc->id);
+	to_lockw = lookup_dom_lock(to_domc->id);
 	if (!from_lockw || !to_lockw)
 		return 0;
 
-	from_bucket = lookup_dom_bucket(from_domc, weight, &idx);
-	to_bucket = lookup_dom_bucket(to_domc, weight, &idx);
-	if (!from_bucket || !to_bucket)
-		return 0;
+	from_bucket = &from_domc->buckets[idx];
+	to_bucket = &to_domc->buckets[idx];
 
 	/*
 	 * @p is moving from @from_domc to @to_domc. Its duty cycle
@@ -230,20 +401,24 @@ static int dom_dcycle_xfer_task(struct task_struct *p __arg_trusted, task_ptr ta
 	 * duty cycle from BPF. Load is computed in user space when performing
 	 * load balancing.
 	 */
-	ravg_accumulate(&task_dcyc_rd,  taskc->runnable, now, load_half_life);
-	taskc->dcyc_rd = taskc->dcyc_rd;
+	task_dcyc_rd = taskc->dcyc_rd;
+	ravg_accumulate(&task_dcyc_rd, taskc->runnable, now, load_half_life);
+	taskc->dcyc_rd = task_dcyc_rd;
 	if (debug >= 2)
 		task_dcycle = ravg_read(&task_dcyc_rd, now, load_half_life);
 
+	/* the runnable count follows the regular delta path */
+	if (taskc->runnable) {
+		dom_dcycle_delta(from_domc, idx, -1);
+		dom_dcycle_delta(to_domc, idx, 1);
+	}
+
 	/* transfer out of @from_domc */
 	bpf_spin_lock(&from_lockw->lock);
-	if (taskc->runnable)
-		from_bucket->dcycle--;
-
 	if (debug >= 2)
 		from_dcycle[0] = ravg_read(&from_bucket->rd, now, load_half_life);
 
-	ravg_transfer(&from_bucket->rd, from_bucket->dcycle,
+	ravg_transfer(&from_bucket->rd, dcycle_val(from_bucket),
 		      &task_dcyc_rd, taskc->runnable, load_half_life, false);
 
 	if (debug >= 2)
@@ -253,13 +428,10 @@ static int dom_dcycle_xfer_task(struct task_struct *p __arg_trusted, task_ptr ta
 
 	/* transfer into @to_domc */
 	bpf_spin_lock(&to_lockw->lock);
-	if (taskc->runnable)
-		to_bucket->dcycle++;
-
 	if (debug >= 2)
 		to_dcycle[0] = ravg_read(&to_bucket->rd, now, load_half_life);
 
-	ravg_transfer(&to_bucket->rd, to_bucket->dcycle,
+	ravg_transfer(&to_bucket->rd, dcycle_val(to_bucket),
 		      &task_dcyc_rd, taskc->runnable, load_half_life, true);
 
 	if (debug >= 2)
@@ -290,6 +462,8 @@ int dom_xfer_task(struct task_struct *p __arg_trusted, u32 new_dom_id, u64 now)
 
 	from_domc = taskc->domc;
 	to_domc = lookup_dom_ctx(new_dom_id);
+	if (!from_domc || !to_domc)
+		return 0;
 
 	dom_dcycle_xfer_task(p, taskc, from_domc, to_domc, now);
 	return 0;
@@ -22,6 +22,8 @@ extern const volatile u32 nr_nodes;
 #define lookup_task_ctx(p) ((task_ptr) scx_task_data(p))
 u32 dom_node_id(u32 dom_id);
 void dom_dcycle_adj(dom_ptr domc, u32 weight, u64 now, bool runnable);
+int dom_dcycle_fold_init(void);
+void xnuma_victims_refresh(void);
 
 static inline u64 min(u64 a, u64 b)
 {
@@ -52,6 +54,13 @@ bool task_set_domain(struct task_struct *p __arg_trusted,
 struct pcpu_ctx {
 	u32 dom_rr_cur; /* used when scanning other doms */
 	dom_ptr domc;
+
+	/*
+	 * Runnable count changes for @domc's buckets made on this CPU that
+	 * haven't been folded into the domain yet.
+	 */
+	u64 dcycle_dirty[LB_DCYCLE_DIRTY_WORDS];
+	s32 dcycle_delta[LB_LOAD_BUCKETS];
 } __attribute__((aligned(CACHELINE_SIZE)));
 
 extern struct pcpu_ctx pcpu_ctx[MAX_CPUS];
@@ -81,6 +81,7 @@ const volatile bool fifo_sched = false;
 const volatile bool direct_greedy_numa;
 const volatile u32 greedy_threshold;
 const volatile u32 greedy_threshold_x_numa;
+const volatile u32 xnuma_steal_budget = 8;
 
 struct pcpu_ctx pcpu_ctx[MAX_CPUS];
 
@@ -430,6 +431,75 @@ enoent:
 	return -ENOENT;
 }
 
+node_steal_ptr node_steal[MAX_NUMA_NODES];
+
+static node_steal_ptr lookup_node_steal(u32 node_id)
+{
+	node_steal_ptr ns;
+
+	if (node_id >= MAX_NUMA_NODES) {
+		scx_bpf_error("invalid node id %u", node_id);
+		return NULL;
+	}
+
+	ns = node_steal[node_id];
+	if (!ns)
+		scx_bpf_error("no steal summary for node %u", node_id);
+
+	return ns;
+}
+
+/*
+ * Record that @dom has queued work. Only the empty -> non-empty transition
+ * writes to the summary so that enqueues on a busy domain don't keep pulling
+ * the node's summary cacheline around.
+ */
+static void steal_summary_mark(u32 dom, u64 now)
+{
+	node_steal_ptr ns;
+	u64 bit;
+
+	if (dom >= MAX_DOMS)
+		return;
+
+	ns = lookup_node_steal(dom_node_id(dom));
+	if (!ns)
+		return;
+
+	bit = 1LLU << dom;
+	if (READ_ONCE(ns->nonempty_doms) & bit)
+		return;
+
+	WRITE_ONCE(ns->oldest_enq_at[dom], now);
+	__sync_fetch_and_or(&ns->nonempty_doms, bit);
+}
+
+/*
+ * Clear @dom from the summary if its DSQ is empty. An enqueue may race with
+ * us and observe the bit still set right before we clear it, so look at the
+ * DSQ again afterwards and restore the bit if it has been refilled.
+ */
+static void steal_summary_sync(u32 dom)
+{
+	node_steal_ptr ns;
+	u64 bit;
+
+	if (dom >= MAX_DOMS)
+		return;
+
+	ns = lookup_node_steal(dom_node_id(dom));
+	if (!ns)
+		return;
+
+	bit = 1LLU << dom;
+	if (!(READ_ONCE(ns->nonempty_doms) & bit) || scx_bpf_dsq_nr_queued(dom))
+		return;
+
+	__sync_fetch_and_and(&ns->nonempty_doms, ~bit);
+	if (scx_bpf_dsq_nr_queued(dom))
+		__sync_fetch_and_or(&ns->nonempty_doms, bit);
+}
+
 void BPF_STRUCT_OPS(wd40_enqueue, struct task_struct *p __arg_trusted, u64 enq_flags)
 {
 	task_ptr taskc;
@@ -487,6 +557,8 @@ dom_queue:
 	else
 		place_task_dl(p, taskc, enq_flags);
 
+	steal_summary_mark(taskc->target_dom, bpf_ktime_get_ns());
+
 	/*
 	 * If there are CPUs which are idle and not saturated, wake them up to
 	 * see whether they'd be able to steal the just queued task. This path
@@ -523,50 +595,168 @@ dom_queue:
 
 static bool dispatch_steal_local_numa(u32 curr_dom, struct pcpu_ctx *pcpuc)
 {
-	u32 my_node;
-	u32 dom;
+	node_steal_ptr ns;
+	u32 start, dom;
+	u64 cands;
+	int i;
 
-	/* XXX Check if the addresses of the nodes are the same, the dom
-	 * we traverse to should be in the array. */
+	ns = lookup_node_steal(dom_node_id(curr_dom));
+	if (!ns)
+		return false;
 
-	my_node = dom_node_id(curr_dom);
+	cands = READ_ONCE(ns->nonempty_doms) & ~(1LLU << curr_dom);
+	if (!cands)
+		return false;
 
-	/* try to steal a task from domains on the current NUMA node */
-	bpf_repeat(nr_doms - 1) {
-		dom = pcpuc->dom_rr_cur++ % nr_doms;
-		if (dom == curr_dom || dom_node_id(dom) != my_node)
+	/*
+	 * Only probe the domains the summary says have queued work, rotating
+	 * the starting point so that stealers spread out over the candidates.
+	 */
+	start = pcpuc->dom_rr_cur;
+	bpf_for(i, 0, nr_doms) {
+		dom = (start + i) % nr_doms;
+		if (dom >= MAX_DOMS || !(cands & (1LLU << dom)))
 			continue;
 
+		stat_add(RUSTY_STAT_GREEDY_PROBE, 1);
 		if (scx_bpf_dsq_move_to_local(dom)) {
+			pcpuc->dom_rr_cur = dom + 1;
 			stat_add(RUSTY_STAT_GREEDY_LOCAL, 1);
 			return true;
 		}
+
+		steal_summary_sync(dom);
 	}
 
 	return false;
 }
 
-static bool dispatch_steal_x_numa(u32 curr_dom, struct pcpu_ctx *pcpuc)
+/*
+ * Charge one cross-node probe against @ns's budget, refilling it if the
+ * current period has elapsed. Returns false once the budget is exhausted.
+ */
+static bool xnuma_budget_take(node_steal_ptr ns, u64 now)
 {
-	u32 my_node;
-	u32 dom;
+	u64 budget_at;
+
+	if (!xnuma_steal_budget)
+		return true;
+
+	budget_at = READ_ONCE(ns->xnuma_budget_at);
+	if (now - budget_at >= XNUMA_STEAL_PERIOD_NS &&
+	    __sync_bool_compare_and_swap(&ns->xnuma_budget_at, budget_at, now))
+		WRITE_ONCE(ns->xnuma_budget, xnuma_steal_budget);
+
+	if (__sync_fetch_and_sub(&ns->xnuma_budget, 1) > 0)
+		return true;
+
+	stat_add(RUSTY_STAT_XNUMA_BUDGET, 1);
+	return false;
+}
 
-	my_node = dom_node_id(curr_dom);
+/*
+ * Cache in each node's steal summary the remote domain whose queued work has
+ * been waiting the longest, so that dispatch doesn't need to scan all the
+ * domains. Called from the dcycle fold timer.
+ */
+__hidden
+void xnuma_victims_refresh(void)
+{
+	u64 eligible = 0, oldest, enq_at;
+	u32 dom, node, dnode, victim;
+	node_steal_ptr ns;
+
+	scx_arena_subprog_init();
+
+	if (!greedy_threshold || !greedy_threshold_x_numa || nr_nodes == 1)
+		return;
 
-	/* try to steal a task from domains on other NUMA nodes */
-	bpf_repeat(nr_doms - 1) {
-		dom = pcpuc->dom_rr_cur++ % nr_doms;
+	/* Look at the DSQ of each domain only once. */
+	bpf_for(dom, 0, nr_doms) {
+		if (dom >= MAX_DOMS)
+			break;
 
-		if (dom_node_id(dom) == my_node || dom == curr_dom ||
-		    scx_bpf_dsq_nr_queued(dom) >= greedy_threshold_x_numa)
+		dnode = dom_node_id(dom);
+		if (dnode >= MAX_NUMA_NODES)
 			continue;
 
-		if (scx_bpf_dsq_move_to_local(dom)) {
-			stat_add(RUSTY_STAT_GREEDY_XNUMA, 1);
-			return true;
+		ns = node_steal[dnode];
+		if (!ns || !(READ_ONCE(ns->nonempty_doms) & (1LLU << dom)))
+			continue;
+
+		if (scx_bpf_dsq_nr_queued(dom) >= greedy_threshold_x_numa)
+			continue;
+
+		eligible |= 1LLU << dom;
+	}
+
+	bpf_for(node, 0, nr_nodes) {
+		if (node >= MAX_NUMA_NODES)
+			break;
+
+		oldest = (u64)-1;
+		victim = MAX_DOMS;
+
+		bpf_for(dom, 0, nr_doms) {
+			if (dom >= MAX_DOMS)
+				break;
+
+			if (!(eligible & (1LLU << dom)))
+				continue;
+
+			dnode = dom_node_id(dom);
+			if (dnode == node || dnode >= MAX_NUMA_NODES)
+				continue;
+
+			ns = node_steal[dnode];
+			if (!ns)
+				continue;
+
+			enq_at = READ_ONCE(ns->oldest_enq_at[dom]);
+			if (enq_at < oldest) {
+				oldest = enq_at;
+				victim = dom;
+			}
 		}
+
+		ns = node_steal[node];
+		if (ns)
+			WRITE_ONCE(ns->xnuma_victim, victim);
+	}
+}
+
+static bool dispatch_steal_x_numa(u32 curr_dom, struct pcpu_ctx *pcpuc)
+{
+	u64 now = bpf_ktime_get_ns();
+	node_steal_ptr my_ns;
+	u32 dom;
+
+	my_ns = lookup_node_steal(dom_node_id(curr_dom));
+	if (!my_ns)
+		return false;
+
+	/* try to steal a task from the victim domain cached for this node */
+	dom = READ_ONCE(my_ns->xnuma_victim);
+	if (dom >= MAX_DOMS)
+		return false;
+
+	if (!xnuma_budget_take(my_ns, now))
+		return false;
+
+	stat_add(RUSTY_STAT_XNUMA_PROBE, 1);
+	if (scx_bpf_dsq_move_to_local(dom)) {
+		stat_add(RUSTY_STAT_GREEDY_XNUMA, 1);
+		return true;
 	}
 
+	/*
+	 * The victim has been drained, stop probing it until the next
+	 * refresh.
+	 */
+	steal_summary_sync(dom);
+	if (READ_ONCE(my_ns->xnuma_victim) == dom)
+		WRITE_ONCE(my_ns->xnuma_victim, MAX_DOMS);
+
 	return false;
 }
 
@@ -587,11 +777,17 @@ void BPF_STRUCT_OPS(wd40_dispatch, s32 cpu, struct task_struct *prev)
 	if (unlikely(is_offline_cpu(cpu)))
 		return;
 
+	if (curr_dom >= MAX_DOMS)
+		return;
+
 	if (scx_bpf_dsq_move_to_local(curr_dom)) {
 		stat_add(RUSTY_STAT_DSQ_DISPATCH, 1);
+		steal_summary_sync(curr_dom);
 		return;
 	}
 
+	steal_summary_sync(curr_dom);
+
 	if (!greedy_threshold)
 		return;
 
@@ -722,6 +918,14 @@ void BPF_STRUCT_OPS(wd40_set_weight, struct task_struct *p, u32 weight)
 		bpf_printk("%s[%p]: SET_WEIGHT %u -> %u", p->comm, p,
 			   taskc->weight, weight);
 
+	/* Keep the runnable count of the domain's weight buckets accurate. */
+	if (taskc->runnable && taskc->domc) {
+		u64 now = scx_bpf_now();
+
+		dom_dcycle_adj(taskc->domc, taskc->weight, now, false);
+		dom_dcycle_adj(taskc->domc, weight, now, true);
+	}
+
 	taskc->weight = weight;
 }
 
@@ -851,6 +1055,18 @@ int wd40_setup(void)
 			return ret;
 	}
 
+	bpf_for(i, 0, nr_nodes) {
+		if (i >= MAX_NUMA_NODES)
+			break;
+
+		node_steal[i] = scx_static_alloc(sizeof(struct node_steal), 1);
+		if (!node_steal[i]) {
+			scx_bpf_error("failed to allocate steal summary for node %d", i);
+			return -ENOMEM;
+		}
+		node_steal[i]->xnuma_victim = MAX_DOMS;
+	}
+
 	bpf_for(i, 0, nr_doms) {
 		ret = alloc_dom(i);
 		if (ret)
@@ -888,7 +1104,7 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(wd40_init)
 			return ret;
 	}
 
-	return 0;
+	return dom_dcycle_fold_init();
 }
 
 void BPF_STRUCT_OPS(wd40_exit, struct scx_exit_info *ei)
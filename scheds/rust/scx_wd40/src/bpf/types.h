@@ -52,7 +52,14 @@ struct task_ctx {
 typedef struct task_ctx __arena *task_ptr;
 
 struct bucket_ctx {
-	u64 dcycle;
+	/*
+	 * Number of runnable tasks as of the last fold. May briefly go
+	 * negative when a task's runnable and quiescent transitions land in
+	 * different folds.
+	 */
+	s64 dcycle;
+	/* Changes from CPUs outside the domain, folded into dcycle */
+	s64 pending;
 	struct ravg_data rd;
 };
 
@@ -69,6 +76,8 @@ struct dom_ctx {
 
 	u64 dbg_dcycle_printed_at;
 	struct bucket_ctx buckets[LB_LOAD_BUCKETS];
+	/* Buckets with pending duty cycle changes */
+	u64 dcycle_dirty[LB_DCYCLE_DIRTY_WORDS];
 	struct dom_active_tasks active_tasks;
 
 	scx_bitmap_t cpumask;
@@ -78,4 +87,32 @@ struct dom_ctx {
 	arena_lock_t vtime_lock;
 };
 
+/*
+ * Per-node summary of stealable work. Idle CPUs consult it before probing
+ * any foreign DSQ so that the cost of stealing scales with the number of
+ * domains that actually have queued tasks rather than with nr_doms.
+ */
+struct node_steal {
+	/* Domains of this node whose DSQ is believed to be non-empty. */
+	u64 nonempty_doms;
+
+	/*
+	 * When each domain's DSQ last went from empty to non-empty. This is a
+	 * lower bound on the enqueue time of its oldest queued task.
+	 */
+	u64 oldest_enq_at[MAX_DOMS];
+
+	/* Cross-node probes this node may still issue in the current period. */
+	s64 xnuma_budget;
+	u64 xnuma_budget_at;
+
+	/*
+	 * Remote domain the CPUs of this node steal from, refreshed by the
+	 * dcycle fold timer (MAX_DOMS if there is none).
+	 */
+	u32 xnuma_victim;
+};
+
+typedef struct node_steal __arena *node_steal_ptr;
+
 #endif /* __TYPES_H */
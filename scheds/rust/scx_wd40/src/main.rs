@@ -149,6 +149,12 @@ struct Opts {
     #[clap(long, default_value = "0")]
     greedy_threshold_x_numa: u32,
 
+    /// Maximum number of remote DSQs each NUMA node may probe per
+    /// millisecond when stealing tasks across NUMA nodes. Probes beyond the
+    /// budget are skipped until the next period. 0 disables the limit.
+    #[clap(long, default_value = "8")]
+    xnuma_steal_budget: u32,
+
     /// Disable load balancing. Unless disabled, userspace will periodically calculate
     /// the load factor of each domain and instruct BPF which processes to move.
     #[clap(long, action = clap::ArgAction::SetTrue)]
@@ -570,6 +576,7 @@ impl<'a> Scheduler<'a> {
         skel.maps.rodata_data.fifo_sched = opts.fifo_sched;
         skel.maps.rodata_data.greedy_threshold = opts.greedy_threshold;
         skel.maps.rodata_data.greedy_threshold_x_numa = opts.greedy_threshold_x_numa;
+        skel.maps.rodata_data.xnuma_steal_budget = opts.xnuma_steal_budget;
         skel.maps.rodata_data.direct_greedy_numa = opts.direct_greedy_numa;
         skel.maps.rodata_data.mempolicy_affinity = opts.mempolicy_affinity;
         skel.maps.rodata_data.debug = opts.verbose as u32;
@@ -674,6 +681,13 @@ impl<'a> Scheduler<'a> {
             + stat(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_LOCAL)
             + stat(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_XNUMA);
         let stat_pct = |idx| stat(idx) as f64 / total as f64 * 100.0;
+        let stat_ratio = |num, den| {
+            if stat(den) != 0 {
+                stat(num) as f64 / stat(den) as f64
+            } else {
+                0.0
+            }
+        };
 
         let cpu_busy = if sc.cpu_total != 0 {
             (sc.cpu_busy as f64 / sc.cpu_total as f64) * 100.0
@@ -716,6 +730,15 @@ impl<'a> Scheduler<'a> {
             dsq_dispatch: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_DSQ_DISPATCH),
             greedy_local: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_LOCAL),
             greedy_xnuma: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_GREEDY_XNUMA),
+            greedy_local_probes: stat_ratio(
+                bpf_intf::stat_idx_RUSTY_STAT_GREEDY_PROBE,
+                bpf_intf::stat_idx_RUSTY_STAT_GREEDY_LOCAL,
+            ),
+            greedy_xnuma_probes: stat_ratio(
+                bpf_intf::stat_idx_RUSTY_STAT_XNUMA_PROBE,
+                bpf_intf::stat_idx_RUSTY_STAT_GREEDY_XNUMA,
+            ),
+            xnuma_budget_denied: stat(bpf_intf::stat_idx_RUSTY_STAT_XNUMA_BUDGET),
             kick_greedy: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_KICK_GREEDY),
             repatriate: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_REPATRIATE),
             dl_clamp: stat_pct(bpf_intf::stat_idx_RUSTY_STAT_DL_CLAMP),
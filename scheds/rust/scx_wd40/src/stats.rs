@@ -145,6 +145,12 @@ pub struct ClusterStats {
     pub greedy_local: f64,
     #[stat(desc = "% scheduled from foreign node")]
     pub greedy_xnuma: f64,
+    #[stat(desc = "foreign domain DSQ probes per successful steal")]
+    pub greedy_local_probes: f64,
+    #[stat(desc = "foreign node DSQ probes per successful steal")]
+    pub greedy_xnuma_probes: f64,
+    #[stat(desc = "# of foreign node probes skipped due to the per-node budget")]
+    pub xnuma_budget_denied: u64,
     #[stat(desc = "% foreign domain CPU kicked on enqueue")]
     pub kick_greedy: f64,
     #[stat(desc = "% repatriated to local domain on enqueue")]
@@ -197,6 +203,12 @@ impl ClusterStats {
             self.dsq_dispatch, self.greedy_local, self.greedy_xnuma,
         )?;
 
+        writeln!(
+            w,
+            "probes/steal local={:5.2} xnuma={:5.2} xnuma_denied={}",
+            self.greedy_local_probes, self.greedy_xnuma_probes, self.xnuma_budget_denied,
+        )?;
+
         writeln!(
             w,
             "kick_greedy={:5.2} rep={:5.2}",